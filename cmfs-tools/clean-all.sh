@@ -5,9 +5,14 @@ who="$who Makefile Makefile.in aclocal.m4 autom4te.cache/ config.log config.stat
 who="$who include/stamp-h1 install-sh"
 who="$who libcmfs/.deps/ libcmfs/Makefile libcmfs/Makefile.in libcmfs/*.o libcmfs/libcmfs.a libcmfs/cmfs_err.c libcmfs/cmfs_err.h"
 who="$who mkfs.cmfs/.deps/ mkfs.cmfs/Makefile mkfs.cmfs/Makefile.in mkfs.cmfs/*.o mkfs.cmfs/mkfs.cmfs"
-who="$who misc/.deps misc/Makefile misc/Makefile.in misc/member_offset misc/member_offset.o"
+who="$who misc/.deps misc/Makefile misc/Makefile.in misc/member_offset misc/member_offset.o misc/cmfs_probe misc/cmfs_mtbench misc/cmfs_allocbench misc/cmfs_mmapbench misc/cmfs_cachebench misc/cmfs_replay misc/cmfs_genvol misc/cmfs_bench misc/bench.img misc/bench.img.layout misc/bench-results.json misc/*.o"
 who="$who dumpcmfs/*.o dumpcmfs/Makefile dumpcmfs/Makefile.in dumpcmfs/.deps/"
 who="$who libtools-internal/libtools-internal.a libtools-internal/*.o libtools-internal/Makefile libtools-internal/Makefile.in libtools-internal/.deps"
+who="$who fsck.cmfs/*.o fsck.cmfs/Makefile fsck.cmfs/Makefile.in fsck.cmfs/.deps/ fsck.cmfs/fsck.cmfs"
+who="$who scrub.cmfs/*.o scrub.cmfs/Makefile scrub.cmfs/Makefile.in scrub.cmfs/.deps/ scrub.cmfs/scrub.cmfs"
+who="$who cmfs-import/*.o cmfs-import/Makefile cmfs-import/Makefile.in cmfs-import/.deps/ cmfs-import/cmfs-import"
+who="$who cmfs-image/*.o cmfs-image/Makefile cmfs-image/Makefile.in cmfs-image/.deps/ cmfs-image/cmfs-image"
+who="$who defrag.cmfs/*.o defrag.cmfs/Makefile defrag.cmfs/Makefile.in defrag.cmfs/.deps/ defrag.cmfs/defrag.cmfs"
 who="$who debugfs.cmfs/*.o debugfs.cmfs/Makefile debugfs.cmfs/Makefile.in debugfs.cmfs/.deps/ debugfs.cmfs/debugfs.cmfs"
 
 rm -rf $who
@@ -0,0 +1,605 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * image.c
+ *
+ * Take a metadata image of an unmounted CMFS volume.
+ *
+ * Copyright (C) 2012, Coly Li <i@coly.li>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * The image holds the blocks up to the superblock, every group
+ * descriptor, every block the inode and extent suballocators hand
+ * out, and the data of directories, symlinks and system files; file
+ * data is left out.  The format is in <cmfs/image.h>, and libcmfs
+ * opens the image in place of the device.
+ *
+ * Nothing is copied until it is all found.  The first pass only marks
+ * blocks in a bitmap of the volume: the allocator chains, then an
+ * inode scan, which is itself large sequential reads.  Inodes whose
+ * extent trees live in extent blocks are put aside and read in sorted
+ * batches after the scan, their leaves a window at a time along the
+ * leaf chain (cmfs_extent_iterate_leaves()).  The second pass walks
+ * the bitmap lowest block first and reads the runs it finds
+ * IMAGE_BATCH_BLOCKS at a time with io_vec_read_blocks(), so the
+ * device sees one sweep.
+ */
+
+#define _XOPEN_SOURCE 600
+#define _LARGEFILE64_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <cmfs/cmfs.h>
+#include <cmfs/bitops.h>
+#include <cmfs/image.h>
+#include "../libcmfs/cmfs_err.h"
+
+#define IMAGE_CACHE_MB		64
+#define IMAGE_RUN_BLOCKS	256	/* longest single read */
+#define IMAGE_BATCH_BLOCKS	2048	/* read per io_vec_read_blocks() */
+#define IMAGE_INODE_BATCH	64	/* deep inodes read together */
+
+struct image_ctxt {
+	cmfs_filesys *im_fs;
+	const char *im_devname;
+	const char *im_outname;
+	int im_fd;
+	int im_verbose;
+	int im_journal;
+	int im_flags;
+
+	uint8_t *im_map;		/* a bit per block of the volume */
+	uint64_t im_marked;
+	uint64_t im_outside;		/* pointers off the volume */
+
+	uint64_t *im_deep;		/* inodes with extent blocks */
+	unsigned long im_nr_deep;
+	unsigned long im_deep_alloced;
+
+	unsigned long im_inodes;	/* whose data is taken */
+	struct timeval im_start;
+};
+
+struct mark_ctxt {
+	struct image_ctxt *mc_im;
+	struct cmfs_dinode *mc_di;
+};
+
+static char *progname = "cmfs-image";
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-zjv] [-c cache_mb] device imagefile\n"
+		"  -z  compress the image\n"
+		"  -j  take the journal too\n"
+		"  -c  block cache for the scan in MB (default %d)\n"
+		"  -v  verbose\n",
+		progname, IMAGE_CACHE_MB);
+	exit(1);
+}
+
+static double elapsed(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) +
+	       (now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+/* cmfs_set_bit() takes an int, volumes have more blocks than that */
+static inline void mark_block(struct image_ctxt *im, uint64_t blkno)
+{
+	uint8_t bit = 1 << (blkno & 7);
+
+	if (!(im->im_map[blkno >> 3] & bit)) {
+		im->im_map[blkno >> 3] |= bit;
+		im->im_marked++;
+	}
+}
+
+static inline int block_marked(struct image_ctxt *im, uint64_t blkno)
+{
+	return im->im_map[blkno >> 3] & (1 << (blkno & 7));
+}
+
+/*
+ * A broken volume is what images are taken of, so a pointer past the
+ * end is counted and left out rather than given up on.
+ */
+static void mark_range(struct image_ctxt *im, uint64_t blkno,
+		       uint64_t count)
+{
+	if ((blkno >= im->im_fs->fs_blocks) ||
+	    (count > im->im_fs->fs_blocks - blkno)) {
+		im->im_outside++;
+		return;
+	}
+
+	while (count--)
+		mark_block(im, blkno++);
+}
+
+/*
+ * The group descriptors of a chain allocator, and for a suballocator
+ * the blocks it has handed out, which are inodes or extent blocks.
+ */
+static errcode_t mark_allocator(struct image_ctxt *im, int type)
+{
+	cmfs_filesys *fs = im->im_fs;
+	struct cmfs_dinode *di;
+	struct cmfs_chain_list *cl;
+	struct cmfs_group_desc *gd;
+	char name[CMFS_MAX_FILENAME_LEN];
+	char *di_buf = NULL, *gd_buf = NULL;
+	uint64_t blkno, gd_blkno, nr_groups;
+	int i, bit;
+	errcode_t ret;
+
+	cmfs_sprintf_system_inode_name(name, sizeof(name), type);
+	ret = cmfs_lookup(fs, fs->fs_sysdir_blkno, name, strlen(name), NULL,
+			  &blkno);
+	if (ret == CMFS_ET_FILE_NOT_FOUND)
+		return 0;
+	if (ret)
+		return ret;
+
+	ret = cmfs_malloc_block(fs->fs_io, &di_buf);
+	if (ret)
+		return ret;
+	ret = cmfs_malloc_block(fs->fs_io, &gd_buf);
+	if (ret)
+		goto out;
+
+	ret = cmfs_read_inode(fs, blkno, di_buf);
+	if (ret)
+		goto out;
+	di = (struct cmfs_dinode *)di_buf;
+	cl = &di->id2.i_chain;
+	gd = (struct cmfs_group_desc *)gd_buf;
+	ret = CMFS_ET_INODE_CANNOT_BE_ITERATED;
+	if (!(di->i_flags & CMFS_CHAIN_FL) ||
+	    (cl->cl_next_free_rec > cl->cl_count) ||
+	    (cl->cl_count > cmfs_chain_recs_per_inode(fs->fs_blocksize)))
+		goto out;
+
+	for (i = 0; i < cl->cl_next_free_rec; i++) {
+		nr_groups = 0;
+		for (gd_blkno = cl->cl_recs[i].c_blkno; gd_blkno;
+		     gd_blkno = gd->bg_next_group) {
+			ret = CMFS_ET_BAD_GROUP_DESC_MAGIC;
+			if (++nr_groups > fs->fs_clusters)
+				goto out;
+
+			ret = cmfs_read_group_desc(fs, gd_blkno, gd_buf);
+			if (ret)
+				goto out;
+			ret = CMFS_ET_BAD_GROUP_DESC_MAGIC;
+			if ((gd->bg_blkno != gd_blkno) ||
+			    (gd->bg_bits > gd->bg_size * 8))
+				goto out;
+
+			mark_range(im, gd_blkno, 1);
+
+			/* The cluster bitmap's bits are clusters of data */
+			if (type == GLOBAL_BITMAP_SYSTEM_INODE)
+				continue;
+
+			for (bit = cmfs_find_next_bit_set(gd->bg_bitmap,
+							  gd->bg_bits, 1);
+			     bit < gd->bg_bits;
+			     bit = cmfs_find_next_bit_set(gd->bg_bitmap,
+							  gd->bg_bits,
+							  bit + 1))
+				mark_range(im, gd_blkno + bit, 1);
+		}
+	}
+	ret = 0;
+
+out:
+	if (gd_buf)
+		cmfs_free(&gd_buf);
+	cmfs_free(&di_buf);
+	return ret;
+}
+
+/* Directories, symlinks and the system files that keep their data */
+static int wants_data(struct image_ctxt *im, struct cmfs_dinode *di)
+{
+	if (di->i_dyn_features & CMFS_INLINE_DATA_FL)
+		return 0;
+	/* The truncate log keeps its records in the inode */
+	if (di->i_flags & (CMFS_SUPER_BLOCK_FL | CMFS_LOCAL_ALLOC_FL |
+			   CMFS_BITMAP_FL | CMFS_CHAIN_FL | CMFS_DEALLOC_FL))
+		return 0;
+	if (di->i_flags & CMFS_JOURNAL_FL)
+		return im->im_journal;
+	if (di->i_flags & CMFS_SYSTEM_FL)
+		return 1;
+	if (S_ISDIR(di->i_mode))
+		return 1;
+	/* A fast symlink is all in the inode */
+	if (S_ISLNK(di->i_mode))
+		return !!di->i_clusters;
+	return 0;
+}
+
+static int mark_extent(cmfs_filesys *fs, struct cmfs_extent_rec *rec,
+		       int tree_depth, uint32_t ccount, uint64_t ref_blkno,
+		       int ref_recno, void *priv_data)
+{
+	struct mark_ctxt *mc = priv_data;
+	struct cmfs_dinode *di = mc->mc_di;
+	uint64_t v_blkno, count, end;
+
+	if (rec->e_flags & CMFS_EXT_UNWRITTEN)
+		return 0;
+
+	/* A directory's blocks past i_size were never written */
+	count = rec->e_leaf_blocks;
+	if (S_ISDIR(di->i_mode)) {
+		v_blkno = cmfs_clusters_to_blocks(fs, rec->e_cpos);
+		end = (di->i_size + fs->fs_blocksize - 1) / fs->fs_blocksize;
+		if (v_blkno >= end)
+			return 0;
+		if (count > end - v_blkno)
+			count = end - v_blkno;
+	}
+
+	mark_range(mc->mc_im, rec->e_blkno, count);
+	return 0;
+}
+
+static errcode_t mark_data(struct image_ctxt *im, struct cmfs_dinode *di)
+{
+	struct mark_ctxt mc = {
+		.mc_im = im,
+		.mc_di = di,
+	};
+	errcode_t ret;
+
+	ret = cmfs_extent_iterate_leaves(im->im_fs, di,
+					 CMFS_EXTENT_FLAG_DATA_ONLY, 0,
+					 mark_extent, &mc);
+	if (!ret)
+		im->im_inodes++;
+	return ret;
+}
+
+static errcode_t put_aside(struct image_ctxt *im, uint64_t blkno)
+{
+	unsigned long want;
+	uint64_t *deep;
+
+	if (im->im_nr_deep == im->im_deep_alloced) {
+		want = im->im_deep_alloced ? im->im_deep_alloced * 2 : 1024;
+		deep = realloc(im->im_deep, want * sizeof(uint64_t));
+		if (!deep)
+			return CMFS_ET_NO_MEMORY;
+		im->im_deep = deep;
+		im->im_deep_alloced = want;
+	}
+	im->im_deep[im->im_nr_deep++] = blkno;
+	return 0;
+}
+
+static errcode_t mark_deep(struct image_ctxt *im)
+{
+	cmfs_filesys *fs = im->im_fs;
+	char *bufs[IMAGE_INODE_BATCH];
+	unsigned long i;
+	int j, n;
+	errcode_t ret;
+
+	memset(bufs, 0, sizeof(bufs));
+	for (j = 0; j < IMAGE_INODE_BATCH; j++) {
+		ret = cmfs_malloc_block(fs->fs_io, &bufs[j]);
+		if (ret)
+			goto out;
+	}
+
+	/* The scan found them in chain order, cmfs_read_inodes() sorts */
+	for (i = 0; i < im->im_nr_deep; i += n) {
+		n = IMAGE_INODE_BATCH;
+		if (n > im->im_nr_deep - i)
+			n = im->im_nr_deep - i;
+		ret = cmfs_read_inodes(fs, im->im_deep + i, n, bufs);
+		if (ret)
+			goto out;
+		for (j = 0; j < n; j++) {
+			ret = mark_data(im, (struct cmfs_dinode *)bufs[j]);
+			if (ret)
+				goto out;
+		}
+	}
+
+out:
+	for (j = 0; j < IMAGE_INODE_BATCH; j++)
+		if (bufs[j])
+			cmfs_free(&bufs[j]);
+	return ret;
+}
+
+static errcode_t mark_metadata(struct image_ctxt *im)
+{
+	static const int types[] = {
+		GLOBAL_BITMAP_SYSTEM_INODE,
+		GLOBAL_INODE_ALLOC_SYSTEM_INODE,
+		INODE_ALLOC_SYSTEM_INODE,
+		EXTENT_ALLOC_SYSTEM_INODE,
+	};
+	cmfs_filesys *fs = im->im_fs;
+	cmfs_inode_scan *scan = NULL;
+	struct cmfs_dinode *di;
+	char *buf = NULL;
+	uint64_t blkno;
+	int i;
+	errcode_t ret;
+
+	mark_range(im, 0, CMFS_SUPER_BLOCK_BLKNO + 1);
+
+	for (i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+		ret = mark_allocator(im, types[i]);
+		if (ret)
+			return ret;
+	}
+
+	ret = cmfs_malloc_block(fs->fs_io, &buf);
+	if (ret)
+		return ret;
+	di = (struct cmfs_dinode *)buf;
+
+	ret = cmfs_open_inode_scan(fs, &scan);
+	if (ret)
+		goto out;
+	for (;;) {
+		ret = cmfs_get_next_inode(scan, &blkno, buf);
+		if (ret || !blkno)
+			break;
+		if (!wants_data(im, di))
+			continue;
+		if (di->id2.i_list.l_tree_depth)
+			ret = put_aside(im, blkno);
+		else
+			ret = mark_data(im, di);
+		if (ret)
+			break;
+	}
+	cmfs_close_inode_scan(scan);
+	if (ret)
+		goto out;
+
+	if (im->im_verbose)
+		fprintf(stdout, "scanned the inodes, %lu with extent blocks, "
+			"in %.1f seconds\n", im->im_nr_deep,
+			elapsed(&im->im_start));
+
+	ret = mark_deep(im);
+
+out:
+	cmfs_free(&buf);
+	return ret;
+}
+
+/* Read the marked blocks in one pass and hand them to the writer */
+static errcode_t copy_blocks(struct image_ctxt *im, cmfs_image_writer *iw)
+{
+	cmfs_filesys *fs = im->im_fs;
+	struct io_vec_unit ivus[IMAGE_BATCH_BLOCKS];
+	uint64_t blkno = 0, start;
+	int nr_ivus, used, count;
+	char *buf = NULL;
+	errcode_t ret;
+
+	ret = cmfs_malloc_blocks(fs->fs_io, IMAGE_BATCH_BLOCKS, &buf);
+	if (ret)
+		return ret;
+
+	/* Each block is read once, don't push the cache around */
+	io_set_nocache(fs->fs_io, 1);
+
+	while (blkno < fs->fs_blocks) {
+		nr_ivus = 0;
+		used = 0;
+		while ((used < IMAGE_BATCH_BLOCKS) && (blkno < fs->fs_blocks)) {
+			/* Skip a whole empty byte at a time */
+			if (!(blkno & 7) && !im->im_map[blkno >> 3]) {
+				blkno += 8;
+				continue;
+			}
+			if (!block_marked(im, blkno)) {
+				blkno++;
+				continue;
+			}
+
+			start = blkno;
+			count = 0;
+			while ((blkno < fs->fs_blocks) &&
+			       block_marked(im, blkno) &&
+			       (count < IMAGE_RUN_BLOCKS) &&
+			       (used + count < IMAGE_BATCH_BLOCKS)) {
+				blkno++;
+				count++;
+			}
+
+			ivus[nr_ivus].ivu_blkno = start;
+			ivus[nr_ivus].ivu_buf = buf + used * fs->fs_blocksize;
+			ivus[nr_ivus].ivu_buflen = count * fs->fs_blocksize;
+			nr_ivus++;
+			used += count;
+		}
+		if (!nr_ivus)
+			break;
+
+		ret = io_vec_read_blocks(fs->fs_io, ivus, nr_ivus);
+		if (ret)
+			break;
+
+		/* The runs are back to back in buf, in block order */
+		ret = cmfs_image_write_blocks(iw, used, buf);
+		if (ret)
+			break;
+	}
+
+	io_set_nocache(fs->fs_io, 0);
+	cmfs_free(&buf);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct image_ctxt im;
+	struct stat st;
+	cmfs_image_writer *iw = NULL;
+	unsigned long cache_mb = IMAGE_CACHE_MB;
+	uint64_t size = 0;
+	double secs;
+	int c, rc = 1;
+	errcode_t ret;
+
+	initialize_cmfs_error_table();
+
+	if (argc && *argv)
+		progname = basename(argv[0]);
+
+	memset(&im, 0, sizeof(im));
+	im.im_fd = -1;
+
+	while ((c = getopt(argc, argv, "zjvc:")) != EOF) {
+		switch (c) {
+		case 'z':
+			im.im_flags |= CMFS_IMAGE_FL_COMPRESSED;
+			break;
+		case 'j':
+			im.im_journal = 1;
+			break;
+		case 'v':
+			im.im_verbose = 1;
+			break;
+		case 'c':
+			cache_mb = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if ((optind != argc - 2) || !cache_mb)
+		usage();
+	im.im_devname = argv[optind];
+	im.im_outname = argv[optind + 1];
+
+	ret = cmfs_open(im.im_devname, CMFS_FLAG_RO, 0, CMFS_MAX_BLOCKSIZE,
+			&im.im_fs);
+	if (ret) {
+		com_err(progname, ret, "while opening \"%s\"", im.im_devname);
+		return 1;
+	}
+
+	ret = io_init_cache_size(im.im_fs->fs_io, cache_mb * 1024 * 1024);
+	if (ret) {
+		com_err(progname, ret, "while creating a %luMB cache",
+			cache_mb);
+		goto out;
+	}
+
+	ret = cmfs_malloc0((im.im_fs->fs_blocks + 7) / 8, &im.im_map);
+	if (ret) {
+		com_err(progname, ret, "while allocating the block map");
+		goto out;
+	}
+
+	/* Never write an image over a device, least of all this one */
+	if (!stat(im.im_outname, &st) && !S_ISREG(st.st_mode)) {
+		fprintf(stderr, "%s: \"%s\" is not a regular file\n",
+			progname, im.im_outname);
+		goto out;
+	}
+	im.im_fd = open64(im.im_outname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (im.im_fd < 0) {
+		com_err(progname, errno, "while creating \"%s\"",
+			im.im_outname);
+		goto out;
+	}
+
+	gettimeofday(&im.im_start, NULL);
+	ret = mark_metadata(&im);
+	if (ret) {
+		com_err(progname, ret, "while finding the metadata");
+		goto out;
+	}
+	if (im.im_verbose)
+		fprintf(stdout, "%"PRIu64" blocks of metadata, the data of %lu "
+			"inodes, found in %.1f seconds\n", im.im_marked,
+			im.im_inodes, elapsed(&im.im_start));
+
+	ret = cmfs_open_image_writer(im.im_fd, im.im_fs->fs_blocksize,
+				     im.im_fs->fs_blocks, im.im_map,
+				     im.im_flags, &iw);
+	if (!ret)
+		ret = copy_blocks(&im, iw);
+	if (!ret)
+		ret = cmfs_image_writer_finish(iw,
+				CMFS_RAW_SB(im.im_fs->fs_super)->s_uuid,
+				&size);
+	if (ret) {
+		com_err(progname, ret, "while writing \"%s\"", im.im_outname);
+		goto out;
+	}
+	secs = elapsed(&im.im_start);
+
+	if (im.im_outside)
+		fprintf(stderr, "%s: %"PRIu64" block pointers past the end of "
+			"the volume were left out\n", progname,
+			im.im_outside);
+
+	fprintf(stdout, "%"PRIu64" blocks (%"PRIu64" MB) of %"PRIu64" in a "
+		"%"PRIu64" MB image, %.1f seconds (%.1f MB/s)\n",
+		im.im_marked, (im.im_marked * im.im_fs->fs_blocksize) >> 20,
+		im.im_fs->fs_blocks, size >> 20, secs,
+		secs > 0 ? im.im_marked * im.im_fs->fs_blocksize / secs /
+			   (1024 * 1024) : 0.0);
+	rc = 0;
+
+out:
+	cmfs_close_image_writer(iw);
+	if (im.im_fd >= 0) {
+		close(im.im_fd);
+		/* Half an image has no header, but don't leave it around */
+		if (rc)
+			unlink(im.im_outname);
+	}
+	if (im.im_deep)
+		cmfs_free(&im.im_deep);
+	if (im.im_map)
+		cmfs_free(&im.im_map);
+	cmfs_close(im.im_fs);
+	return rc;
+}
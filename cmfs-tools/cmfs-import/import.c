@@ -0,0 +1,813 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * import.c
+ *
+ * Copy files and directory trees from the host into an unmounted
+ * CMFS volume.
+ *
+ * Copyright (C) 2012, Coly Li <i@coly.li>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Each file gets all of its clusters up front, as one extent next to
+ * the previous file when there is room, else from the largest free
+ * extents, so its data lands in a few long runs.  The data is then
+ * streamed with large O_DIRECT writes on a descriptor of our own, -q
+ * of them in flight through libaio; the source is read while earlier
+ * writes are still going.  The allocators keep their group descriptors
+ * in memory and write them back once at the end, so the metadata cost
+ * per file is its inode, its directory block and rarely an extent
+ * block; when a file does need them, cmfs_build_extent_tree() writes
+ * its whole tree at once.
+ *
+ * Only regular files and directories are imported.
+ */
+
+#define _XOPEN_SOURCE 600
+#define _LARGEFILE64_SOURCE
+#define _GNU_SOURCE /* O_DIRECT */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <dirent.h>
+#include <libaio.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <cmfs/cmfs.h>
+#include "../libcmfs/cmfs_err.h"
+
+#define IMPORT_IO_KB		4096
+#define IMPORT_DEPTH		8
+
+struct import_extent {
+	uint32_t ie_cpos;	/* physical cluster */
+	uint32_t ie_len;
+};
+
+struct import_io {
+	struct iocb ii_iocb;
+	char *ii_buf;
+	size_t ii_len;
+};
+
+struct import_ctxt {
+	cmfs_filesys *ic_fs;
+	const char *ic_devname;
+	int ic_fd;
+	int ic_verbose;
+	int ic_save_summary;
+
+	cmfs_allocator *ic_cluster_ca;
+	cmfs_allocator *ic_inode_ca;
+	cmfs_allocator *ic_eb_ca;
+	uint32_t ic_goal;	/* next cluster after the last file */
+
+	uint32_t ic_io_blocks;
+	int ic_depth;
+	io_context_t ic_ctx;
+	struct import_io *ic_ios;
+	struct import_io **ic_idle;
+	struct io_event *ic_events;
+	int ic_nr_idle;
+	int ic_inflight;
+	errcode_t ic_io_err;
+
+	struct import_extent *ic_extents;
+	size_t ic_nr_extents;
+	size_t ic_alloc_extents;
+
+	struct timeval ic_start;
+	uint64_t ic_bytes;
+	unsigned long ic_files;
+	unsigned long ic_dirs;
+	unsigned long ic_skipped;
+};
+
+static char *progname = "cmfs-import";
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-v] [-S] [-b io_kb] [-q depth] [-d dir] device "
+		"source...\n"
+		"  -b  size of one write in KB (default %d)\n"
+		"  -q  writes in flight (default %d)\n"
+		"  -d  directory on the volume to import into (default /)\n"
+		"  -S  save the group summary of the global bitmap\n"
+		"  -v  verbose\n",
+		progname, IMPORT_IO_KB, IMPORT_DEPTH);
+	exit(1);
+}
+
+static double elapsed(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) +
+	       (now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+/* Wait for at least min writes, the buffers go back to the idle list */
+static errcode_t reap_writes(struct import_ctxt *ic, int min)
+{
+	struct import_io *ii;
+	int i, n;
+
+	while (min > 0) {
+		n = io_getevents(ic->ic_ctx, min, ic->ic_inflight,
+				 ic->ic_events, NULL);
+		if (n == -EINTR)
+			continue;
+		if (n < 0)
+			return CMFS_ET_IO;
+
+		for (i = 0; i < n; i++) {
+			ii = ic->ic_events[i].data;
+			if ((long)ic->ic_events[i].res != (long)ii->ii_len)
+				ic->ic_io_err = CMFS_ET_SHORT_WRITE;
+			ic->ic_idle[ic->ic_nr_idle++] = ii;
+			ic->ic_inflight--;
+		}
+		min -= n;
+	}
+
+	return ic->ic_io_err;
+}
+
+static errcode_t get_idle_io(struct import_ctxt *ic, struct import_io **ret)
+{
+	errcode_t ret2;
+
+	if (!ic->ic_nr_idle) {
+		ret2 = reap_writes(ic, 1);
+		if (ret2)
+			return ret2;
+	}
+
+	*ret = ic->ic_idle[--ic->ic_nr_idle];
+	return 0;
+}
+
+static errcode_t setup_writes(struct import_ctxt *ic)
+{
+	int i;
+	errcode_t ret;
+
+	ret = cmfs_malloc0(ic->ic_depth * sizeof(struct import_io),
+			   &ic->ic_ios);
+	if (ret)
+		return ret;
+	ret = cmfs_malloc0(ic->ic_depth * sizeof(struct import_io *),
+			   &ic->ic_idle);
+	if (ret)
+		return ret;
+	ret = cmfs_malloc0(ic->ic_depth * sizeof(struct io_event),
+			   &ic->ic_events);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < ic->ic_depth; i++) {
+		ret = cmfs_malloc_blocks(ic->ic_fs->fs_io, ic->ic_io_blocks,
+					 &ic->ic_ios[i].ii_buf);
+		if (ret)
+			return ret;
+		ic->ic_idle[ic->ic_nr_idle++] = &ic->ic_ios[i];
+	}
+
+	if (io_queue_init(ic->ic_depth, &ic->ic_ctx))
+		return CMFS_ET_IO;
+
+	return 0;
+}
+
+static void teardown_writes(struct import_ctxt *ic)
+{
+	int i;
+
+	if (ic->ic_ctx) {
+		if (ic->ic_inflight)
+			reap_writes(ic, ic->ic_inflight);
+		io_queue_release(ic->ic_ctx);
+	}
+	if (ic->ic_ios) {
+		for (i = 0; i < ic->ic_depth; i++)
+			if (ic->ic_ios[i].ii_buf)
+				cmfs_free(&ic->ic_ios[i].ii_buf);
+		cmfs_free(&ic->ic_ios);
+	}
+	if (ic->ic_idle)
+		cmfs_free(&ic->ic_idle);
+	if (ic->ic_events)
+		cmfs_free(&ic->ic_events);
+}
+
+/* Fill len bytes of buf from the source, zeroes past its end */
+static errcode_t read_source(int fd, char *buf, size_t len, off64_t off)
+{
+	ssize_t got;
+	size_t done = 0;
+
+	while (done < len) {
+		got = pread64(fd, buf + done, len - done, off + done);
+		if (got < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		if (!got)
+			break;
+		done += got;
+	}
+	if (done < len)
+		memset(buf + done, 0, len - done);
+
+	return 0;
+}
+
+/* Write the first bytes of the file to the extent, block aligned */
+static errcode_t write_extent(struct import_ctxt *ic, int src_fd,
+			      struct import_extent *ie, uint64_t offset,
+			      uint64_t bytes)
+{
+	cmfs_filesys *fs = ic->ic_fs;
+	struct import_io *ii;
+	struct iocb *iocb;
+	uint64_t blkno, done = 0;
+	size_t len, max = (size_t)ic->ic_io_blocks * fs->fs_blocksize;
+	errcode_t ret;
+
+	blkno = cmfs_clusters_to_blocks(fs, ie->ie_cpos);
+	while (done < bytes) {
+		ret = get_idle_io(ic, &ii);
+		if (ret)
+			return ret;
+
+		len = bytes - done > max ? max : bytes - done;
+		ret = read_source(src_fd, ii->ii_buf, len, offset + done);
+		if (ret) {
+			ic->ic_idle[ic->ic_nr_idle++] = ii;
+			return ret;
+		}
+
+		ii->ii_len = (len + fs->fs_blocksize - 1) &
+			     ~((size_t)fs->fs_blocksize - 1);
+		memset(ii->ii_buf + len, 0, ii->ii_len - len);
+		io_prep_pwrite(&ii->ii_iocb, ic->ic_fd, ii->ii_buf, ii->ii_len,
+			       (blkno * fs->fs_blocksize) + done);
+		ii->ii_iocb.data = ii;
+		iocb = &ii->ii_iocb;
+		if (io_submit(ic->ic_ctx, 1, &iocb) != 1) {
+			ic->ic_idle[ic->ic_nr_idle++] = ii;
+			return CMFS_ET_IO;
+		}
+		ic->ic_inflight++;
+		ic->ic_bytes += ii->ii_len;
+		done += len;
+	}
+
+	return 0;
+}
+
+static errcode_t add_extent(struct import_ctxt *ic, uint32_t cpos,
+			    uint32_t len)
+{
+	struct import_extent *ie;
+	size_t alloc;
+
+	if (ic->ic_nr_extents == ic->ic_alloc_extents) {
+		alloc = ic->ic_alloc_extents ? ic->ic_alloc_extents * 2 : 16;
+		ie = realloc(ic->ic_extents,
+			     alloc * sizeof(struct import_extent));
+		if (!ie)
+			return CMFS_ET_NO_MEMORY;
+		ic->ic_extents = ie;
+		ic->ic_alloc_extents = alloc;
+	}
+
+	ie = &ic->ic_extents[ic->ic_nr_extents++];
+	ie->ie_cpos = cpos;
+	ie->ie_len = len;
+	return 0;
+}
+
+static void free_extents(struct import_ctxt *ic)
+{
+	size_t i;
+
+	for (i = 0; i < ic->ic_nr_extents; i++)
+		cmfs_free_clusters(ic->ic_cluster_ca,
+				   ic->ic_extents[i].ie_cpos,
+				   ic->ic_extents[i].ie_len);
+	ic->ic_nr_extents = 0;
+}
+
+/*
+ * Get clusters for a whole file: one extent at ic_goal or as close to
+ * it as possible, else the largest free extents until it fits.  An
+ * extent never holds more blocks than a leaf record can describe.
+ */
+static errcode_t alloc_file(struct import_ctxt *ic, uint32_t clusters)
+{
+	uint32_t max_len, len, cpos, want;
+	errcode_t ret;
+
+	max_len = UINT32_MAX / cmfs_clusters_to_blocks(ic->ic_fs, 1);
+	ic->ic_nr_extents = 0;
+
+	while (clusters) {
+		want = clusters > max_len ? max_len : clusters;
+		ret = cmfs_alloc_clusters(ic->ic_cluster_ca, ic->ic_goal,
+					  want, want, &cpos, &len);
+		if (ret == CMFS_ET_NO_SPACE) {
+			ret = cmfs_largest_free_clusters(ic->ic_cluster_ca,
+							 &cpos, &len);
+			if (ret)
+				goto out;
+			if (want > len)
+				want = len;
+			ret = cmfs_alloc_clusters(ic->ic_cluster_ca, cpos,
+						  want, want, &cpos, &len);
+		}
+		if (ret)
+			goto out;
+
+		ret = add_extent(ic, cpos, len);
+		if (ret) {
+			cmfs_free_clusters(ic->ic_cluster_ca, cpos, len);
+			goto out;
+		}
+		ic->ic_goal = cpos + len;
+		clusters -= len;
+	}
+
+out:
+	if (ret)
+		free_extents(ic);
+	return ret;
+}
+
+static void set_inode_attrs(struct cmfs_dinode *di, struct stat64 *st)
+{
+	di->i_uid = st->st_uid;
+	di->i_gid = st->st_gid;
+	di->i_atime = st->st_atime;
+	di->i_mtime = st->st_mtime;
+	di->i_ctime = st->st_ctime;
+}
+
+static errcode_t import_file(struct import_ctxt *ic, uint64_t parent,
+			     const char *name, const char *path,
+			     struct stat64 *st)
+{
+	cmfs_filesys *fs = ic->ic_fs;
+	struct cmfs_dinode *di;
+	struct import_extent *ie;
+	struct cmfs_extent_run *runs = NULL;
+	uint64_t ino, offset = 0, bytes, v_blkno = 0;
+	uint32_t clusters;
+	char *buf = NULL;
+	size_t i;
+	int fd;
+	errcode_t ret;
+
+	fd = open64(path, O_RDONLY);
+	if (fd < 0) {
+		com_err(progname, errno, "while opening \"%s\"", path);
+		ic->ic_skipped++;
+		return 0;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	ret = cmfs_malloc_block(fs->fs_io, &buf);
+	if (ret)
+		goto out;
+
+	clusters = (st->st_size + fs->fs_clustersize - 1) /
+		   fs->fs_clustersize;
+	ret = alloc_file(ic, clusters);
+	if (ret) {
+		com_err(progname, ret, "while allocating %"PRIu32" clusters "
+			"for \"%s\"", clusters, path);
+		goto out;
+	}
+
+	ret = cmfs_new_inode(ic->ic_inode_ca, ic->ic_cluster_ca,
+			     S_IFREG | (st->st_mode & 07777), buf, &ino);
+	if (ret) {
+		free_extents(ic);
+		goto out;
+	}
+
+	di = (struct cmfs_dinode *)buf;
+	set_inode_attrs(di, st);
+	di->i_size = st->st_size;
+
+	if (ic->ic_nr_extents) {
+		ret = cmfs_malloc(sizeof(struct cmfs_extent_run) *
+				  ic->ic_nr_extents, &runs);
+		if (ret)
+			goto out;
+	}
+
+	for (i = 0; i < ic->ic_nr_extents; i++) {
+		ie = &ic->ic_extents[i];
+		bytes = (uint64_t)ie->ie_len * fs->fs_clustersize;
+		if (bytes > (uint64_t)st->st_size - offset)
+			bytes = (uint64_t)st->st_size - offset;
+
+		ret = write_extent(ic, fd, ie, offset, bytes);
+		if (ret) {
+			com_err(progname, ret, "while copying \"%s\"", path);
+			goto out;
+		}
+		offset += bytes;
+
+		runs[i].er_v_blkno = v_blkno;
+		runs[i].er_blkno = cmfs_clusters_to_blocks(fs, ie->ie_cpos);
+		runs[i].er_blocks = cmfs_clusters_to_blocks(fs, ie->ie_len);
+		runs[i].er_flags = 0;
+		v_blkno += runs[i].er_blocks;
+	}
+
+	/* The whole tree at once, every extent is known by now */
+	ret = cmfs_build_extent_tree(fs, buf, runs, ic->ic_nr_extents,
+				     ic->ic_eb_ca, ic->ic_cluster_ca);
+	if (ret)
+		goto out;
+
+	ret = cmfs_write_inode(fs, ino, buf);
+	if (ret)
+		goto out;
+	ret = cmfs_link(fs, parent, name, ino, CMFS_FT_REG_FILE,
+			ic->ic_eb_ca, ic->ic_cluster_ca);
+	if (ret)
+		goto out;
+
+	ic->ic_files++;
+	if (ic->ic_verbose)
+		fprintf(stdout, "%s: inode %"PRIu64", %"PRIu64" bytes in "
+			"%zu extents\n", path, ino, (uint64_t)st->st_size,
+			ic->ic_nr_extents);
+
+out:
+	if (runs)
+		cmfs_free(&runs);
+	if (buf)
+		cmfs_free(&buf);
+	close(fd);
+	return ret;
+}
+
+static errcode_t import_path(struct import_ctxt *ic, uint64_t parent,
+			     const char *name, const char *path);
+
+static errcode_t import_dir(struct import_ctxt *ic, uint64_t parent,
+			    const char *name, const char *path,
+			    struct stat64 *st)
+{
+	cmfs_filesys *fs = ic->ic_fs;
+	struct dirent *de;
+	char *buf = NULL, *child = NULL;
+	uint64_t ino;
+	DIR *dir;
+	errcode_t ret;
+
+	dir = opendir(path);
+	if (!dir) {
+		com_err(progname, errno, "while opening \"%s\"", path);
+		ic->ic_skipped++;
+		return 0;
+	}
+
+	ret = cmfs_malloc_block(fs->fs_io, &buf);
+	if (ret)
+		goto out;
+	ret = cmfs_malloc(PATH_MAX, &child);
+	if (ret)
+		goto out;
+
+	ret = cmfs_lookup(fs, parent, name, strlen(name), NULL, &ino);
+	if (ret == CMFS_ET_FILE_NOT_FOUND) {
+		ret = cmfs_mkdir(fs, parent, name, st->st_mode, ic->ic_inode_ca,
+				 ic->ic_eb_ca, ic->ic_cluster_ca, &ino);
+		if (ret)
+			goto out;
+		ret = cmfs_read_inode(fs, ino, buf);
+		if (ret)
+			goto out;
+		set_inode_attrs((struct cmfs_dinode *)buf, st);
+		ret = cmfs_write_inode(fs, ino, buf);
+		if (ret)
+			goto out;
+		ic->ic_dirs++;
+	} else if (!ret) {
+		/* Merge into the directory that is already there */
+		ret = cmfs_check_directory(fs, ino);
+	}
+	if (ret) {
+		com_err(progname, ret, "while creating directory \"%s\"",
+			path);
+		goto out;
+	}
+
+	while ((de = readdir(dir)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		if (snprintf(child, PATH_MAX, "%s/%s", path, de->d_name) >=
+		    PATH_MAX) {
+			fprintf(stderr, "%s: path too long, skipping "
+				"\"%s/%s\"\n", progname, path, de->d_name);
+			ic->ic_skipped++;
+			continue;
+		}
+		ret = import_path(ic, ino, de->d_name, child);
+		if (ret)
+			break;
+	}
+
+out:
+	if (child)
+		cmfs_free(&child);
+	if (buf)
+		cmfs_free(&buf);
+	closedir(dir);
+	return ret;
+}
+
+static errcode_t import_path(struct import_ctxt *ic, uint64_t parent,
+			     const char *name, const char *path)
+{
+	struct stat64 st;
+	uint64_t ino;
+
+	if (lstat64(path, &st)) {
+		com_err(progname, errno, "while reading \"%s\"", path);
+		ic->ic_skipped++;
+		return 0;
+	}
+
+	if (strlen(name) > CMFS_MAX_FILENAME_LEN) {
+		fprintf(stderr, "%s: name too long, skipping \"%s\"\n",
+			progname, path);
+		ic->ic_skipped++;
+		return 0;
+	}
+
+	if (S_ISDIR(st.st_mode))
+		return import_dir(ic, parent, name, path, &st);
+
+	if (!S_ISREG(st.st_mode)) {
+		fprintf(stderr, "%s: \"%s\" is not a regular file or a "
+			"directory, skipped\n", progname, path);
+		ic->ic_skipped++;
+		return 0;
+	}
+
+	if (!cmfs_lookup(ic->ic_fs, parent, name, strlen(name), NULL,
+			 &ino)) {
+		fprintf(stderr, "%s: \"%s\" already exists, skipped\n",
+			progname, path);
+		ic->ic_skipped++;
+		return 0;
+	}
+
+	return import_file(ic, parent, name, path, &st);
+}
+
+static errcode_t open_allocators(struct import_ctxt *ic)
+{
+	errcode_t ret;
+
+	ret = cmfs_open_allocator(ic->ic_fs, GLOBAL_BITMAP_SYSTEM_INODE,
+				  &ic->ic_cluster_ca);
+	if (ret)
+		return ret;
+	ret = cmfs_open_allocator(ic->ic_fs, INODE_ALLOC_SYSTEM_INODE,
+				  &ic->ic_inode_ca);
+	if (ret)
+		return ret;
+	return cmfs_open_allocator(ic->ic_fs, EXTENT_ALLOC_SYSTEM_INODE,
+				   &ic->ic_eb_ca);
+}
+
+static errcode_t flush_allocators(struct import_ctxt *ic)
+{
+	errcode_t ret;
+
+	ret = cmfs_allocator_flush(ic->ic_eb_ca);
+	if (ret)
+		return ret;
+	ret = cmfs_allocator_flush(ic->ic_inode_ca);
+	if (ret)
+		return ret;
+	return cmfs_allocator_flush(ic->ic_cluster_ca);
+}
+
+int main(int argc, char **argv)
+{
+	struct import_ctxt *ic;
+	cmfs_group_summary *sm;
+	const char *dest = "/";
+	char *src, *name;
+	uint64_t dest_ino;
+	int c, i, io_kb = IMPORT_IO_KB, rc = 0;
+	double secs;
+	errcode_t ret, ret2;
+
+	initialize_cmfs_error_table();
+
+	if (argc && *argv)
+		progname = basename(argv[0]);
+
+	ic = calloc(1, sizeof(struct import_ctxt));
+	if (!ic) {
+		com_err(progname, CMFS_ET_NO_MEMORY,
+			"while allocating import state");
+		return 1;
+	}
+	ic->ic_depth = IMPORT_DEPTH;
+	ic->ic_fd = -1;
+
+	while ((c = getopt(argc, argv, "vSb:q:d:")) != EOF) {
+		switch (c) {
+		case 'v':
+			ic->ic_verbose = 1;
+			break;
+		case 'S':
+			ic->ic_save_summary = 1;
+			break;
+		case 'b':
+			io_kb = atoi(optarg);
+			break;
+		case 'q':
+			ic->ic_depth = atoi(optarg);
+			break;
+		case 'd':
+			dest = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if ((optind > argc - 2) || (io_kb <= 0) || (ic->ic_depth <= 0))
+		usage();
+	ic->ic_devname = argv[optind++];
+
+	ret = cmfs_open(ic->ic_devname, CMFS_FLAG_RW, 0, CMFS_MAX_BLOCKSIZE,
+			&ic->ic_fs);
+	if (ret) {
+		com_err(progname, ret, "while opening \"%s\"",
+			ic->ic_devname);
+		free(ic);
+		return 1;
+	}
+
+	ic->ic_io_blocks = (io_kb * 1024) / ic->ic_fs->fs_blocksize;
+	if (!ic->ic_io_blocks)
+		ic->ic_io_blocks = 1;
+
+	ret = cmfs_namei(ic->ic_fs, ic->ic_fs->fs_root_blkno,
+			 ic->ic_fs->fs_root_blkno, dest, &dest_ino);
+	if (!ret)
+		ret = cmfs_check_directory(ic->ic_fs, dest_ino);
+	if (ret) {
+		com_err(progname, ret, "while looking up \"%s\"", dest);
+		rc = 1;
+		goto out;
+	}
+
+	ret = open_allocators(ic);
+	if (ret) {
+		com_err(progname, ret, "while loading the allocators");
+		rc = 1;
+		goto out;
+	}
+
+	/* Loaded before allocating, the allocator keeps it current */
+	if (ic->ic_save_summary) {
+		ret = cmfs_get_group_summary(ic->ic_fs,
+					     GLOBAL_BITMAP_SYSTEM_INODE, &sm);
+		if (ret) {
+			com_err(progname, ret, "while loading the group "
+				"summary");
+			rc = 1;
+			goto out;
+		}
+	}
+
+	ic->ic_fd = open64(ic->ic_devname, O_WRONLY | O_DIRECT);
+	if ((ic->ic_fd < 0) && (errno == EINVAL)) {
+		fprintf(stderr, "%s: O_DIRECT not supported on %s, writing "
+			"through the page cache\n", progname, ic->ic_devname);
+		ic->ic_fd = open64(ic->ic_devname, O_WRONLY);
+	}
+	if (ic->ic_fd < 0) {
+		com_err(progname, errno, "while opening \"%s\"",
+			ic->ic_devname);
+		rc = 1;
+		goto out;
+	}
+
+	ret = setup_writes(ic);
+	if (ret) {
+		com_err(progname, ret, "while setting up the writes");
+		rc = 1;
+		goto out;
+	}
+
+	gettimeofday(&ic->ic_start, NULL);
+	for (i = optind; i < argc; i++) {
+		src = strdup(argv[i]);
+		if (!src) {
+			ret = CMFS_ET_NO_MEMORY;
+			break;
+		}
+		name = basename(src);
+		if (!strcmp(name, "/") || !strcmp(name, ".") ||
+		    !strcmp(name, "..")) {
+			fprintf(stderr, "%s: can't import \"%s\" by that name\n",
+				progname, argv[i]);
+			ic->ic_skipped++;
+		} else
+			ret = import_path(ic, dest_ino, name, argv[i]);
+		free(src);
+		if (ret)
+			break;
+	}
+
+	/* Data first, then the allocators that point at it */
+	ret2 = ic->ic_inflight ? reap_writes(ic, ic->ic_inflight) :
+				 ic->ic_io_err;
+	if (!ret)
+		ret = ret2;
+	if (!ret && fsync(ic->ic_fd))
+		ret = errno;
+	ret2 = flush_allocators(ic);
+	if (!ret)
+		ret = ret2;
+	if (!ret && ic->ic_save_summary)
+		ret = cmfs_save_group_summary(ic->ic_fs,
+					      GLOBAL_BITMAP_SYSTEM_INODE,
+					      ic->ic_inode_ca, ic->ic_eb_ca,
+					      ic->ic_cluster_ca);
+	secs = elapsed(&ic->ic_start);
+
+	if (ret) {
+		com_err(progname, ret, "while importing");
+		rc = 1;
+	}
+
+	fprintf(stdout, "%lu files, %lu directories, %"PRIu64" MB in %.1f "
+		"seconds (%.1f MB/s)", ic->ic_files, ic->ic_dirs,
+		ic->ic_bytes >> 20, secs,
+		secs > 0 ? ic->ic_bytes / secs / (1024 * 1024) : 0.0);
+	if (ic->ic_skipped)
+		fprintf(stdout, ", %lu skipped", ic->ic_skipped);
+	fprintf(stdout, "\n");
+	if (ic->ic_skipped && !rc)
+		rc = 2;
+
+out:
+	teardown_writes(ic);
+	if (ic->ic_fd >= 0)
+		close(ic->ic_fd);
+	cmfs_close_allocator(ic->ic_eb_ca);
+	cmfs_close_allocator(ic->ic_inode_ca);
+	cmfs_close_allocator(ic->ic_cluster_ca);
+	if (ic->ic_extents)
+		free(ic->ic_extents);
+	ret = cmfs_close(ic->ic_fs);
+	if (ret) {
+		com_err(progname, ret, "while closing \"%s\"",
+			ic->ic_devname);
+		rc = 1;
+	}
+	free(ic);
+	return rc;
+}
@@ -59,6 +59,7 @@ static void do_chroot(char **args);
 static void do_close(char **args);
 static void do_curdev(char **args);
 static void do_dirblocks(char **args);
+static void do_dump(char **args);
 static void do_extent(char **args);
 static void do_frag(char **args);
 static void do_group(char **args);
@@ -69,9 +70,12 @@ static void do_locate(char **args);
 static void do_ls(char **args);
 static void do_open(char **args);
 static void do_quit(char **args);
+static void do_rdump(char **args);
 static void do_stat(char **args);
 static void do_stat_sysdir(char **args);
 static void do_stats(char **args);
+static void do_summary(char **args);
+static void do_iostats(char **args);
 
 static struct command commands[] = {
 	{ "bmap",
@@ -109,6 +113,11 @@ static struct command commands[] = {
 		"dirblocks <filespec>",
 		"Dump directory blocks",
 	},
+	{ "dump",
+		do_dump,
+		"dump [-p] <filespec> <outfile>",
+		"Dumps file to outfile on a mounted fs",
+	},
 	{ "extent",
 		do_extent,
 		"extent <block#>",
@@ -144,6 +153,11 @@ static struct command commands[] = {
 		"icheck block# ...",
 		"List inode# that is using the block#",
 	},
+	{ "iostats",
+		do_iostats,
+		"iostats [-r]",
+		"Show I/O statistics, -r resets them",
+	},
 	{ "lcd",
 		do_lcd,
 		"lcd <directory>",
@@ -179,6 +193,11 @@ static struct command commands[] = {
 		NULL,
 		NULL,
 	},
+	{ "rdump",
+		do_rdump,
+		"rdump [-v] [-j threads] <filespec> <outdir>",
+		"Recursively dumps from src to a dir on a mounted filesystem",
+	},
 	{ "stat",
 		do_stat,
 		"stat [-t|-T] <filespec>",
@@ -194,6 +213,11 @@ static struct command commands[] = {
 		"stats [-h]",
 		"Show superblock",
 	},
+	{ "summary",
+		do_summary,
+		"summary [-a] [allocator]",
+		"Show the free space of an allocator, -a by group",
+	},
 };
 
 void handle_signal(int sig)
@@ -438,6 +462,7 @@ static void do_open(char **args)
 	errcode_t ret = 0;
 	char sysfile[SYSTEM_FILE_NAME_MAX];
 	struct cmfs_super_block *sb;
+	struct cmfs_open_params params;
 	uint64_t superblock = CMFS_SUPER_BLOCK_BLKNO;
 	uint64_t block_size = CMFS_MIN_BLOCKSIZE;
 
@@ -450,7 +475,17 @@ static void do_open(char **args)
 	}
 
 	flags = gbls.allow_write ? CMFS_FLAG_RW : CMFS_FLAG_RO;
-	ret = cmfs_open(dev, flags, superblock, block_size, &gbls.fs);
+
+	memset(&params, 0, sizeof(params));
+	params.op_cache_bytes = gbls.cache_mb * 1024 * 1024;
+	params.op_cache_max_bytes = params.op_cache_bytes * DBGFS_CACHE_GROWTH;
+	if (gbls.mlock_cache)
+		params.op_flags |= CMFS_OPEN_MLOCK_CACHE;
+	if (gbls.prewarm)
+		params.op_flags |= CMFS_OPEN_PREWARM;
+
+	ret = cmfs_open_with_params(dev, flags, superblock, block_size,
+				    &params, &gbls.fs);
 	if (ret) {
 		gbls.fs = NULL;
 		com_err(args[0], ret, "while opening context for device %s",
@@ -553,7 +588,7 @@ static void do_ls(char **args)
 {
 	uint64_t blkno;
 	errcode_t ret = 0;
-	struct list_dir_opts ls_opts = { gbls.fs, NULL, 0, NULL };
+	struct list_dir_opts ls_opts = { gbls.fs, NULL, 0, NULL, NULL, 0 };
 
 	if (process_ls_args(args, &blkno, &ls_opts.long_opt))
 		return ;
@@ -566,11 +601,19 @@ static void do_ls(char **args)
 	}
 
 	if (ls_opts.long_opt) {
-		ret = cmfs_malloc_block(gbls.fs->fs_io, &ls_opts.buf);
+		ret = cmfs_malloc_blocks(gbls.fs->fs_io, LS_BATCH_INODES,
+					 &ls_opts.buf);
 		if (ret) {
-			com_err(args[0], ret, "while allocating a block");
+			com_err(args[0], ret, "while allocating %u blocks",
+				LS_BATCH_INODES);
 			return ;
 		}
+		ret = cmfs_malloc(sizeof(struct ls_dirent) * LS_BATCH_INODES,
+				  &ls_opts.dirents);
+		if (ret) {
+			com_err(args[0], ret, "while allocating dirents");
+			goto bail;
+		}
 	}
 
 	ls_opts.out = open_pager(gbls.interactive);
@@ -580,8 +623,14 @@ static void do_ls(char **args)
 		com_err(args[0], ret, "while iterating directory at "
 			"block %"PRIu64"", blkno);
 
+	if (ls_opts.long_opt)
+		dump_dir_entries_long(&ls_opts);
+
 	close_pager(ls_opts.out);
 
+bail:
+	if (ls_opts.dirents)
+		cmfs_free(&ls_opts.dirents);
 	if (ls_opts.buf)
 		cmfs_free(&ls_opts.buf);
 
@@ -615,6 +664,93 @@ static void do_quit(char **args)
 	exit(0);
 }
 
+/*
+ * The copy threads read through a handle of their own, opened
+ * threaded and buffered so the readahead they ask for is kept.
+ */
+static void do_rdump(char **args)
+{
+	cmfs_filesys *fs = NULL;
+	uint64_t blkno;
+	struct stat st;
+	char *p, *in_fn, *out_dn;
+	int c, argc, verbose = 0;
+	long threads = 0;
+	errcode_t ret;
+
+	if (check_device_open())
+		return ;
+
+	for (argc = 0; (args[argc]); ++argc);
+	optind = 0;
+
+	while ((c = getopt(argc, args, "vj:")) != -1) {
+		switch (c) {
+		case 'v':
+			verbose = 1;
+			break;
+		case 'j':
+			threads = strtol(optarg, &p, 0);
+			if (*p || (threads <= 0) || (threads > 256)) {
+				fprintf(stderr, "%s: Invalid thread count "
+					"'%s'\n", args[0], optarg);
+				return ;
+			}
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-v] [-j threads] "
+				"<filespec> <outdir>\n", args[0]);
+			return ;
+		}
+	}
+
+	if (optind != argc - 2) {
+		fprintf(stderr, "usage: %s [-v] [-j threads] "
+			"<filespec> <outdir>\n", args[0]);
+		return ;
+	}
+	in_fn = args[optind];
+	out_dn = args[optind + 1];
+
+	if (!threads)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads <= 0)
+		threads = 1;
+
+	/* source */
+	ret = string_to_inode(gbls.fs, gbls.root_blkno, gbls.cwd_blkno,
+			      in_fn, &blkno);
+	if (ret) {
+		com_err(args[0], ret, "'%s'", in_fn);
+		return ;
+	}
+
+	/* destination... has to be a dir on a mounted fs */
+	if (stat(out_dn, &st) == -1) {
+		com_err(args[0], errno, "'%s'", out_dn);
+		return ;
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		com_err(args[0], CMFS_ET_NO_DIRECTORY, "'%s'", out_dn);
+		return ;
+	}
+
+	ret = cmfs_open(gbls.device, CMFS_FLAG_RO | CMFS_FLAG_BUFFERED |
+			CMFS_FLAG_THREADED, 0, gbls.fs->fs_blocksize, &fs);
+	if (ret) {
+		com_err(args[0], ret, "while opening device %s", gbls.device);
+		return ;
+	}
+
+	ret = rdump_inode(fs, blkno, in_fn, out_dn, threads, verbose);
+	if (ret)
+		com_err(args[0], ret, "while recursively dumping inode %"PRIu64,
+			blkno);
+
+	cmfs_close(fs);
+	return ;
+}
+
 static void do_lcd(char **args)
 {
 	char buf[PATH_MAX];
@@ -680,6 +816,91 @@ bail:
 	return ;
 }
 
+static void do_iostats(char **args)
+{
+	struct cmfs_io_stats st;
+	FILE *out;
+	int c, argc;
+	int reset = 0;
+
+	if (check_device_open())
+		return;
+
+	for (argc = 0; (args[argc]); ++argc);
+	optind = 0;
+
+	while ((c = getopt(argc, args, "r")) != -1) {
+		switch (c) {
+		case 'r':
+			reset = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-r]\n", args[0]);
+			return;
+		}
+	}
+
+	cmfs_get_stats(gbls.fs, &st);
+	out = open_pager(gbls.interactive);
+	dump_io_stats(out, &st, io_get_cache_size(gbls.fs->fs_io));
+	close_pager(out);
+
+	if (reset)
+		cmfs_reset_stats(gbls.fs);
+}
+
+static void do_summary(char **args)
+{
+	cmfs_group_summary *sm;
+	char name[CMFS_MAX_FILENAME_LEN];
+	FILE *out;
+	errcode_t ret;
+	int c, argc, type, all = 0;
+
+	if (check_device_open())
+		return;
+
+	for (argc = 0; (args[argc]); ++argc);
+	optind = 0;
+
+	while ((c = getopt(argc, args, "a")) != -1) {
+		switch (c) {
+		case 'a':
+			all = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-a] [allocator]\n", args[0]);
+			return;
+		}
+	}
+
+	type = GLOBAL_BITMAP_SYSTEM_INODE;
+	if (optind < argc) {
+		for (type = 0; type < NUM_SYSTEM_INODES; type++) {
+			cmfs_sprintf_system_inode_name(name, sizeof(name),
+						       type);
+			if (!strcmp(name, args[optind]))
+				break;
+		}
+		if (type == NUM_SYSTEM_INODES) {
+			fprintf(stderr, "%s: no allocator \"%s\"\n", args[0],
+				args[optind]);
+			return;
+		}
+	}
+	cmfs_sprintf_system_inode_name(name, sizeof(name), type);
+
+	ret = cmfs_get_group_summary(gbls.fs, type, &sm);
+	if (ret) {
+		com_err(args[0], ret, "while summarizing \"%s\"", name);
+		return;
+	}
+
+	out = open_pager(gbls.interactive);
+	dump_group_summary(out, name, sm, all);
+	close_pager(out);
+}
+
 static void do_stat(char **args)
 {
 	struct cmfs_dinode *inode;
@@ -777,6 +998,63 @@ static void do_cat(char **args)
 	return ;
 }
 
+static void do_dump(char **args)
+{
+	uint64_t blkno;
+	char *in_fn, *out_fn;
+	int fd, ind = 1, preserve = 0;
+	errcode_t ret;
+	struct cmfs_dinode *di;
+
+	if (check_device_open())
+		return ;
+
+	if (args[ind] && !strcmp(args[ind], "-p")) {
+		preserve = 1;
+		ind++;
+	}
+
+	in_fn = args[ind];
+	out_fn = in_fn ? args[ind + 1] : NULL;
+	if (!in_fn || !out_fn) {
+		fprintf(stderr, "usage: %s [-p] <filespec> <outfile>\n",
+			args[0]);
+		return ;
+	}
+
+	ret = string_to_inode(gbls.fs, gbls.root_blkno, gbls.cwd_blkno,
+			      in_fn, &blkno);
+	if (ret) {
+		com_err(args[0], ret, "'%s'", in_fn);
+		return ;
+	}
+
+	ret = cmfs_read_inode(gbls.fs, blkno, gbls.blockbuf);
+	if (ret) {
+		com_err(args[0], ret, "while reading inode %"PRIu64"", blkno);
+		return ;
+	}
+
+	di = (struct cmfs_dinode *)gbls.blockbuf;
+	if (!S_ISREG(di->i_mode) && !S_ISLNK(di->i_mode)) {
+		fprintf(stderr, "%s: Not a regular file\n", args[0]);
+		return ;
+	}
+
+	fd = open64(out_fn, O_CREAT | O_WRONLY | O_TRUNC, 0666);
+	if (fd < 0) {
+		com_err(args[0], errno, "'%s'", out_fn);
+		return ;
+	}
+
+	ret = dump_file(gbls.fs, blkno, fd, out_fn, preserve);
+	if (ret)
+		com_err(args[0], ret, "while dumping file for inode %"PRIu64"",
+			blkno);
+
+	return ;
+}
+
 static void do_group(char **args)
 {
 	struct cmfs_group_desc *grp;
@@ -789,6 +1067,13 @@ static void do_group(char **args)
 	if (process_inodestr_args(args, 1, &blkno) != 1)
 		return ;
 
+	ret = cmfs_prefetch_group_chain(gbls.fs, blkno);
+	if (ret) {
+		com_err(args[0], ret, "while prefetching block group "
+			"descriptors");
+		return ;
+	}
+
 	buf = gbls.blockbuf;
 	out = open_pager(gbls.interactive);
 	while (blkno) {
@@ -1036,59 +1321,19 @@ static void do_icheck(char **args)
 	return;
 }
 
-static errcode_t calc_num_extents(cmfs_filesys *fs,
-				  struct cmfs_extent_list *el,
-				  uint32_t *ne)
+static int count_extent(cmfs_filesys *fs, struct cmfs_extent_rec *rec,
+			int tree_depth, uint32_t ccount, uint64_t ref_blkno,
+			int ref_recno, void *priv_data)
 {
-	struct cmfs_extent_block *eb;
-	struct cmfs_extent_rec *rec;
-	errcode_t ret = 0;
-	char *buf = NULL;
-	int i;
-	uint32_t clusters;
-	uint32_t extents = 0;
-
-	*ne = 0;
-
-	for (i = 0; i < el->l_next_free_rec; ++i) {
-		rec = &(el->l_recs[i]);
-		clusters = cmfs_rec_clusters(fs, el->l_tree_depth, rec);
-
-		/*
-		 * In a unsuccessful insertion, we may shift a tree
-		 * add a new branch for it and do no insertion. So we
-		 * may meet a extent block which have
-		 * clusters == 0, this should only be happen
-		 * in the last extent rec. */
-		if (!clusters && i == el->l_next_free_rec - 1)
-			break;
-
-		extents = 1;
-
-		if (el->l_tree_depth) {
-			ret = cmfs_malloc_block(gbls.fs->fs_io, &buf);
-			if (ret)
-				goto bail;
-
-			ret = cmfs_read_extent_block(fs, rec->e_blkno, buf);
-			if (ret)
-				goto bail;
-
-			eb = (struct cmfs_extent_block *)buf;
-
-			ret = calc_num_extents(fs, &(eb->h_list), &extents);
-			if (ret)
-				goto bail;
-
-		}		
-
-		*ne = *ne + extents;
-	}
-
-bail:
-	if (buf)
-		cmfs_free(&buf);
-	return ret;
+	uint32_t *extents = priv_data;
+
+	/*
+	 * In a unsuccessful insertion, we may shift a tree add a new
+	 * branch for it and do no insertion, leaving an empty record.
+	 */
+	if (cmfs_rec_clusters(fs, tree_depth, rec))
+		(*extents)++;
+	return 0;
 }
 
 static void do_frag(char **args)
@@ -1117,7 +1362,9 @@ static void do_frag(char **args)
 
 	clusters = inode->i_clusters;
 	if (!(inode->i_dyn_features & CMFS_INLINE_DATA_FL))
-		ret = calc_num_extents(gbls.fs, &(inode->id2.i_list), &extents);
+		ret = cmfs_extent_iterate_leaves(gbls.fs, inode,
+						 CMFS_EXTENT_FLAG_DATA_ONLY, 0,
+						 count_extent, &extents);
 
 	if (ret)
 		com_err(args[0], ret, "while traversing inode at block "
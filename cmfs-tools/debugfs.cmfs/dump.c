@@ -89,6 +89,10 @@ void dump_super_block(FILE *out, struct cmfs_super_block *sb)
 	return ;
 }
 
+/*
+ * For a long listing the entries are queued in ls->dirents and printed
+ * by dump_dir_entries_long(), so that their inodes are read in batches.
+ */
 int dump_dir_entry(struct cmfs_dir_entry *rec,
 		   uint64_t blocknr,
 		   int offset,
@@ -98,9 +102,7 @@ int dump_dir_entry(struct cmfs_dir_entry *rec,
 {
 	struct list_dir_opts *ls = (struct list_dir_opts *)priv_data;
 	char tmp = rec->name[rec->name_len];
-	struct cmfs_dinode *di;
-	char perms[20];
-	char timestr[40];
+	struct ls_dirent *ent;
 
 	rec->name[rec->name_len] = '\0';
 
@@ -110,23 +112,58 @@ int dump_dir_entry(struct cmfs_dir_entry *rec,
 			rec->rec_len, rec->name_len,
 			rec->file_type, rec->name);
 	} else {
-		memset(ls->buf, 0, ls->fs->fs_blocksize);
-		cmfs_read_inode(ls->fs, rec->inode, ls->buf);
-		di = (struct cmfs_dinode *)ls->buf;
+		ent = &ls->dirents[ls->nr_dirents++];
+		ent->inode = rec->inode;
+		memcpy(ent->name, rec->name, rec->name_len + 1);
+
+		if (ls->nr_dirents == LS_BATCH_INODES)
+			dump_dir_entries_long(ls);
+	}
+
+	rec->name[rec->name_len] = tmp;
+
+	return 0;
+}
+
+void dump_dir_entries_long(struct list_dir_opts *ls)
+{
+	int i;
+	errcode_t ret;
+	struct cmfs_dinode *di;
+	struct ls_dirent *ent;
+	uint64_t blknos[LS_BATCH_INODES];
+	char *bufs[LS_BATCH_INODES];
+	char perms[20];
+	char timestr[40];
+
+	if (!ls->nr_dirents)
+		return;
+
+	for (i = 0; i < ls->nr_dirents; i++) {
+		blknos[i] = ls->dirents[i].inode;
+		bufs[i] = ls->buf + (i * ls->fs->fs_blocksize);
+	}
+
+	ret = cmfs_read_inodes(ls->fs, blknos, ls->nr_dirents, bufs);
+	if (ret && (ret != CMFS_ET_BAD_BLKNO) &&
+	    (ret != CMFS_ET_BAD_INODE_MAGIC))
+		com_err(gbls.cmd, ret, "while reading inodes");
+
+	for (i = 0; i < ls->nr_dirents; i++) {
+		ent = &ls->dirents[i];
+		di = (struct cmfs_dinode *)bufs[i];
 
 		inode_perms_to_str(di->i_mode, perms, sizeof(perms));
 		inode_time_to_str(di->i_mtime, timestr, sizeof(timestr));
 
 		fprintf(ls->out,
 			"\t%-15"PRIu64" %10s %3u %5u %5u %15"PRIu64" %s %s\n",
-			(uint64_t)rec->inode, perms, di->i_links_count,
+			ent->inode, perms, di->i_links_count,
 			di->i_uid, di->i_gid,
-			(uint64_t)di->i_size, timestr, rec->name);
+			(uint64_t)di->i_size, timestr, ent->name);
 	}
 
-	rec->name[rec->name_len] = tmp;
-
-	return 0;
+	ls->nr_dirents = 0;
 }
 
 void dump_dir_block(FILE *out, char *buf)
@@ -440,54 +477,155 @@ void dump_logical_blkno(FILE *out, uint64_t blkno)
 	return;
 }
 
+static const char *block_type_names[CMFS_NR_BLOCK_TYPES] = {
+	[CMFS_BLOCK_UNKNOW]		= "Unknown",
+	[CMFS_BLOCK_INODE]		= "Inode",
+	[CMFS_BLOCK_SUPERBLOCK]		= "Superblock",
+	[CMFS_BLOCK_EXTENT_BLOCK]	= "Extent Block",
+	[CMFS_BLOCK_GROUP_DESCRIPTOR]	= "Group Desc",
+	[CMFS_BLOCK_DIR_BLOCK]		= "Dir Block",
+	[CMFS_BLOCK_DATA]		= "Data",
+};
+
+static void sprint_ns(char *buf, int len, uint64_t ns)
+{
+	if (ns < 1000)
+		snprintf(buf, len, "%"PRIu64"ns", ns);
+	else if (ns < 1000000)
+		snprintf(buf, len, "%.1fus", ns / 1000.0);
+	else if (ns < 1000000000)
+		snprintf(buf, len, "%.1fms", ns / 1000000.0);
+	else
+		snprintf(buf, len, "%.1fs", ns / 1000000000.0);
+}
 
+enum io_hist_kind {
+	IO_HIST_LAT,
+	IO_HIST_SIZE,
+	IO_HIST_SEEK,
+};
 
+/* The buckets are as cmfs.h describes them, empty ones are skipped */
+static void dump_io_hist(FILE *out, const char *title, uint64_t *hist,
+			 int nr, enum io_hist_kind kind)
+{
+	char lo[32], hi[32], range[80];
+	uint64_t total = 0;
+	int i, shift;
+
+	for (i = 0; i < nr; i++)
+		total += hist[i];
+	if (!total)
+		return;
+
+	fprintf(out, "\t%s:\n", title);
+	for (i = 0; i < nr; i++) {
+		if (!hist[i])
+			continue;
+
+		if (kind == IO_HIST_SEEK && !i) {
+			snprintf(range, sizeof(range), "sequential");
+		} else {
+			shift = (kind == IO_HIST_SEEK) ? i - 1 : i;
+			if (kind == IO_HIST_LAT) {
+				sprint_ns(lo, sizeof(lo), 1ULL << shift);
+				sprint_ns(hi, sizeof(hi), 2ULL << shift);
+			} else {
+				/* Whole blocks, so the ranges are inclusive */
+				snprintf(lo, sizeof(lo), "%llu", 1ULL << shift);
+				snprintf(hi, sizeof(hi), "%llu",
+					 (2ULL << shift) - 1);
+			}
+			if (i == nr - 1)
+				snprintf(range, sizeof(range), ">= %s", lo);
+			else if (kind != IO_HIST_LAT && !shift)
+				snprintf(range, sizeof(range), "%s", lo);
+			else
+				snprintf(range, sizeof(range), "%s - %s", lo,
+					 hi);
+		}
 
+		fprintf(out, "\t\t%-20s %12"PRIu64"  %5.1f%%\n", range,
+			hist[i], 100.0 * hist[i] / total);
+	}
+}
 
+void dump_io_stats(FILE *out, struct cmfs_io_stats *st, size_t cache_bytes)
+{
+	int i;
 
+	fprintf(out, "\tBytes Read: %"PRIu64"   Written: %"PRIu64"\n",
+		st->is_bytes_read, st->is_bytes_written);
+	fprintf(out, "\tDevice Reads: %"PRIu64"   Mean: %.1fus   "
+		"Writes: %"PRIu64"   Mean: %.1fus\n",
+		st->is_reads,
+		st->is_reads ? st->is_read_ns / 1000.0 / st->is_reads : 0,
+		st->is_writes,
+		st->is_writes ? st->is_write_ns / 1000.0 / st->is_writes : 0);
+	if (cache_bytes)
+		fprintf(out, "\tCache Size: %zuMB   Hits: %u   Misses: %u   "
+			"Evictions: %u\n", cache_bytes >> 20,
+			st->is_cache_hits, st->is_cache_misses,
+			st->is_cache_evictions);
+	else
+		fprintf(out, "\tCache: none\n");
+	fprintf(out, "\tInode Cache Hits: %u   Misses: %u\n",
+		st->is_icache_hits, st->is_icache_misses);
+
+	fprintf(out, "\t%-20s %12s %12s %12s\n", "Block Type", "Read",
+		"From Disk", "Written");
+	for (i = 0; i < CMFS_NR_BLOCK_TYPES; i++) {
+		if (!st->is_type_read[i] && !st->is_type_disk[i] &&
+		    !st->is_type_written[i])
+			continue;
+		fprintf(out, "\t%-20s %12"PRIu64" %12"PRIu64" %12"PRIu64"\n",
+			block_type_names[i], st->is_type_read[i],
+			st->is_type_disk[i], st->is_type_written[i]);
+	}
 
+	dump_io_hist(out, "Read Latency", st->is_read_lat,
+		     CMFS_IO_LAT_BUCKETS, IO_HIST_LAT);
+	dump_io_hist(out, "Write Latency", st->is_write_lat,
+		     CMFS_IO_LAT_BUCKETS, IO_HIST_LAT);
+	dump_io_hist(out, "Read Size (blocks)", st->is_read_size,
+		     CMFS_IO_SIZE_BUCKETS, IO_HIST_SIZE);
+	dump_io_hist(out, "Write Size (blocks)", st->is_write_size,
+		     CMFS_IO_SIZE_BUCKETS, IO_HIST_SIZE);
+	dump_io_hist(out, "Seek Distance (blocks)", st->is_seek,
+		     CMFS_IO_SEEK_BUCKETS, IO_HIST_SEEK);
+}
 
+void dump_group_summary(FILE *out, const char *name, cmfs_group_summary *sm,
+			int all)
+{
+	struct cmfs_group_sum *gs, *largest = NULL;
+	uint32_t i, full = 0;
+
+	for (i = 0, gs = sm->sm_groups; i < sm->sm_nr_groups; i++, gs++) {
+		if (!gs->gs_free)
+			full++;
+		if (!largest || (gs->gs_max_run > largest->gs_max_run))
+			largest = gs;
+	}
 
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
+	fprintf(out, "	Allocator: %s   Inode: %"PRIu64"   Groups: %u   "
+		"Full: %u\n", name, sm->sm_blkno, sm->sm_nr_groups, full);
+	fprintf(out, "	Bits: %"PRIu64"   Used: %"PRIu64"   Free: %"PRIu64
+		"\n", sm->sm_total_bits, sm->sm_total_bits - sm->sm_free_bits,
+		sm->sm_free_bits);
+	if (largest && largest->gs_max_run)
+		fprintf(out, "	Largest Free Run: %u at bit %u of group %"
+			PRIu64"\n", largest->gs_max_run,
+			largest->gs_max_run_start, largest->gs_blkno);
+
+	if (!all)
+		return;
+
+	fprintf(out, "	%-15s   %-5s   %-6s   %-6s   %-6s   %-6s   %-6s\n",
+		"Block#", "Chain", "Total", "Free", "First", "Contig", "At");
+	for (i = 0, gs = sm->sm_groups; i < sm->sm_nr_groups; i++, gs++)
+		fprintf(out, "\t%-15"PRIu64"   %-5u   %-6u   %-6u   %-6u   "
+			"%-6u   %-6u\n", gs->gs_blkno, gs->gs_chain, gs->gs_bits,
+			gs->gs_free, gs->gs_first_free, gs->gs_max_run,
+			gs->gs_max_run_start);
+}
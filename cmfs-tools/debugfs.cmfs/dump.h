@@ -20,11 +20,21 @@
 #ifndef __DUMP_H__
 #define __DUMP_H__
 
+/* ls -l reads the inodes of this many entries in one batch */
+#define LS_BATCH_INODES		256
+
+struct ls_dirent {
+	uint64_t inode;
+	char name[CMFS_MAX_FILENAME_LEN + 1];
+};
+
 struct list_dir_opts {
 	cmfs_filesys *fs;
 	FILE *out;
 	int long_opt;
-	char *buf;
+	char *buf;		/* LS_BATCH_INODES blocks for -l */
+	struct ls_dirent *dirents;
+	int nr_dirents;
 };
 
 struct dirblocks_walk {
@@ -44,6 +54,7 @@ void dump_extent_block (FILE *out, struct cmfs_extent_block *blk);
 void dump_group_descriptor (FILE *out, struct cmfs_group_desc *grp, int index);
 int  dump_dir_entry (struct cmfs_dir_entry *rec, uint64_t blocknr, int offset, int blocksize,
 		     char *buf, void *priv_data);
+void dump_dir_entries_long(struct list_dir_opts *ls);
 void dump_dir_block(FILE *out, char *buf);
 void dump_jbd_header (FILE *out, journal_header_t *header);
 void dump_jbd_superblock (FILE *out, journal_superblock_t *jsb);
@@ -60,4 +71,7 @@ void dump_icheck(FILE *out, int hdr, uint64_t blkno, uint64_t inode,
 void dump_block_check(FILE *out, struct cmfs_block_check *bc, void *block);
 void dump_frag(FILE *out, uint64_t ino, uint32_t clusters,
 	       uint32_t extents);
+void dump_io_stats(FILE *out, struct cmfs_io_stats *st, size_t cache_bytes);
+void dump_group_summary(FILE *out, const char *name, cmfs_group_summary *sm,
+			int all);
 #endif		/* __DUMP_H__ */
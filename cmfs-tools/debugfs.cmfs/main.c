@@ -43,11 +43,14 @@ struct log_entry {
 
 static void usage(char *progname)
 {
-	g_print("usage: %s [-f cmdfile] [-R request] [-i] [-s backup#] [-V] [-w] [-n] [-?] [device]\n", progname);
+	g_print("usage: %s [-f cmdfile] [-R request] [-i] [-s backup#] [-c cache_mb] [-L] [-p] [-V] [-w] [-n] [-?] [device]\n", progname);
 	g_print("\t-f, --file <cmdfile>\t\tExecute commands in cmdfile\n");
 	g_print("\t-R, --request <command>\t\tExecute a single command\n");
 	g_print("\t-s, --superblock <backup#>\tOpen the device using a backup superblock\n");
 	g_print("\t-w, --write\t\t\tOpen in read-write mode instead of the default of read-only\n");
+	g_print("\t-c, --cache <mb>\t\tCache %d MB of the device to start with, 0 for none\n", DBGFS_DEFAULT_CACHE_MB);
+	g_print("\t-L, --lock-cache\t\tLock the cache in memory\n");
+	g_print("\t-p, --prewarm\t\t\tRead the system files into the cache on open\n");
 	g_print("\t-V, --version\t\t\tShow version\n");
 	g_print("\t-n, --noprompt\t\t\tHide prompt\n");
 	g_print("\t-?, --help\t\t\tShow this help\n");
@@ -72,11 +75,14 @@ static void get_options(int argc, char **argv, struct dbgfs_opts *opts)
 		{ "log", 0, 0, 'l' },
 		{ "noprompt", 0, 0, 'n' },
 		{ "superblock", 0, 0, 's' },
+		{ "cache", 1, 0, 'c' },
+		{ "lock-cache", 0, 0, 'L' },
+		{ "prewarm", 0, 0, 'p' },
 		{ 0, 0, 0, 0}
 	};
 
 	while (1) {
-		c = getopt_long(argc, argv, "f:R:V?wns:",
+		c = getopt_long(argc, argv, "f:R:V?wns:c:Lp",
 				long_options, NULL);
 		if (c == -1)
 			break;
@@ -121,6 +127,22 @@ static void get_options(int argc, char **argv, struct dbgfs_opts *opts)
 			opts->sb_num = strtoul(optarg, &ptr, 0);
 			break;
 
+		case 'c':
+			opts->cache_mb = strtoul(optarg, &ptr, 0);
+			if (*ptr) {
+				usage(gbls.progname);
+				exit(1);
+			}
+			break;
+
+		case 'L':
+			opts->mlock_cache = 1;
+			break;
+
+		case 'p':
+			opts->prewarm = 1;
+			break;
+
 		default:
 			usage(gbls.progname);
 			break;
@@ -191,12 +213,16 @@ int main(int argc, char **argv)
 
 	memset(&opts, 0, sizeof(opts));
 	memset(&gbls, 0, sizeof(gbls));
+	opts.cache_mb = DBGFS_DEFAULT_CACHE_MB;
 
 	gbls.progname = basename(argv[0]);
 
 	get_options(argc, argv, &opts);
 
 	gbls.allow_write = opts.allow_write;
+	gbls.cache_mb = opts.cache_mb;
+	gbls.mlock_cache = opts.mlock_cache;
+	gbls.prewarm = opts.prewarm;
 	if (!opts.cmd_file)
 		gbls.interactive++;
 
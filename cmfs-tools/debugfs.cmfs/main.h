@@ -75,11 +75,26 @@ struct dbgfs_gbls {
 	uint64_t sysdir_blkno;
 	uint64_t slotmap_blkno;
 	uint64_t jrnl_blkno;
+	unsigned long cache_mb;		/* io_cache, 0 for none */
+	int mlock_cache;
+	int prewarm;
 };
 
+/*
+ * An interactive session keeps going back to the same directories and
+ * system files, so the device gets a cache by default.  It starts at
+ * DBGFS_DEFAULT_CACHE_MB and may grow to DBGFS_CACHE_GROWTH times that
+ * while a command reads a lot.
+ */
+#define DBGFS_DEFAULT_CACHE_MB		64
+#define DBGFS_CACHE_GROWTH		8
+
 struct dbgfs_opts {
 	int allow_write;
 	int no_prompt;
+	unsigned long cache_mb;
+	int mlock_cache;
+	int prewarm;
 	uint32_t sb_num;
 	char *cmd_file;
 	char *one_cmd;
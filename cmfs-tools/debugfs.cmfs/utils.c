@@ -26,7 +26,13 @@
  *
  */
 
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
 
 #include <cmfs/cmfs.h>
 #include <cmfs/bitops.h>
@@ -241,78 +247,876 @@ bail:
 	return ret;
 }
 
-errcode_t dump_file(cmfs_filesys *fs,
-		    uint64_t ino,
-		    int fd,
-		    char *out_file,
-		    int preserve)
+/*
+ * Holes are only skipped when fd is a regular file we can seek in;
+ * a pipe or an O_APPEND file gets the zeros written out.
+ */
+static int can_punch_holes(int fd)
+{
+	struct stat st;
+	int flags;
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode))
+		return 0;
+	flags = fcntl(fd, F_GETFL);
+	if ((flags == -1) || (flags & O_APPEND))
+		return 0;
+	return lseek64(fd, 0, SEEK_CUR) != -1;
+}
+
+/*
+ * Written extents are copied from the device to the output file by
+ * the kernel, with copy_file_range() where both ends support it (an
+ * image file to a file), else with splice() (a block device, or a
+ * pipe on either end).  Both go down to the buffered copy on errors
+ * which only mean "not supported here", for the rest of the file.
+ * Holes, unwritten extents and a partial last block always take the
+ * buffered copy.
+ */
+enum {
+	DUMP_COPY_BUFFERED = 0,
+	DUMP_COPY_SPLICE,
+	DUMP_COPY_FILE_RANGE,
+};
+
+#define DUMP_SPLICE_CHUNK	(1 << 20)
+
+struct dump_context {
+	cmfs_cached_inode	*ci;
+	int			fd;
+	int			dev_fd;
+	int			fd_is_pipe;
+	int			sparse;
+	int			method;
+	int			pipe_fds[2];
+	char			*buf;
+	uint32_t		buflen;
+	uint32_t		readahead;
+	uint64_t		base;
+	uint64_t		size;
+	errcode_t		errcode;
+};
+
+static int copy_unsupported(int err)
+{
+	return (err == EINVAL) || (err == EXDEV) || (err == ENOSYS) ||
+	       (err == EOPNOTSUPP) || (err == EBADF);
+}
+
+static ssize_t dump_copy_file_range(int fd_in, loff_t *off_in, int fd_out,
+				    size_t len)
+{
+#ifdef __NR_copy_file_range
+	return syscall(__NR_copy_file_range, fd_in, off_in, fd_out, NULL,
+		       len, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/* Move len bytes from the device at *off_in to fd through a pipe */
+static ssize_t dump_splice(struct dump_context *ctxt, loff_t *off_in,
+			   size_t len)
+{
+	ssize_t n, out;
+	size_t left;
+
+	if (len > DUMP_SPLICE_CHUNK)
+		len = DUMP_SPLICE_CHUNK;
+
+	if (ctxt->fd_is_pipe)
+		return splice(ctxt->dev_fd, off_in, ctxt->fd, NULL, len,
+			      SPLICE_F_MOVE);
+
+	if (ctxt->pipe_fds[0] < 0) {
+		if (pipe(ctxt->pipe_fds))
+			return -1;
+		fcntl(ctxt->pipe_fds[1], F_SETPIPE_SZ, DUMP_SPLICE_CHUNK);
+	}
+
+	n = splice(ctxt->dev_fd, off_in, ctxt->pipe_fds[1], NULL, len,
+		   SPLICE_F_MOVE);
+	if (n <= 0)
+		return n;
+
+	/* The data is in our pipe now, it must all go out */
+	for (left = n; left; left -= out) {
+		out = splice(ctxt->pipe_fds[0], NULL, ctxt->fd, NULL, left,
+			     SPLICE_F_MOVE);
+		if (out <= 0) {
+			if (!out)
+				errno = EIO;
+			ctxt->method = DUMP_COPY_BUFFERED;
+			return -2;
+		}
+	}
+
+	return n;
+}
+
+/*
+ * Copy len bytes of the device at p_off to fd.  *copied says how much
+ * went out before the method fell back, or the whole len.  With a
+ * readahead window the copy goes a window at a time, and the device
+ * is asked for the next window before each one is copied.  That keeps
+ * each stream's reads going on its own, where the kernel readahead of
+ * the device file is shared by everyone copying from it.
+ */
+static errcode_t copy_direct(struct dump_context *ctxt, uint64_t p_off,
+			     uint64_t len, uint64_t *copied)
 {
+	loff_t off_in = p_off;
+	uint64_t chunk, ahead, ra_end = p_off, end = p_off + len;
+	ssize_t n;
+
+	*copied = 0;
+	while (len && ctxt->method) {
+		chunk = len;
+		if (ctxt->readahead) {
+			if (chunk > ctxt->readahead)
+				chunk = ctxt->readahead;
+			/* Keep up to one window queued past this chunk */
+			if ((ra_end <= off_in + chunk) &&
+			    (off_in + chunk < end)) {
+				ra_end = off_in + chunk;
+				ahead = end - ra_end;
+				if (ahead > ctxt->readahead)
+					ahead = ctxt->readahead;
+				posix_fadvise(ctxt->dev_fd, ra_end, ahead,
+					      POSIX_FADV_WILLNEED);
+				ra_end += ahead;
+			}
+		}
+
+		if (ctxt->method == DUMP_COPY_FILE_RANGE)
+			n = dump_copy_file_range(ctxt->dev_fd, &off_in,
+						 ctxt->fd, chunk);
+		else
+			n = dump_splice(ctxt, &off_in, chunk);
+
+		if (n == -2)
+			return errno;
+		if (n < 0) {
+			if (!copy_unsupported(errno))
+				return errno;
+			ctxt->method--;
+			continue;
+		}
+		if (!n)
+			return CMFS_ET_SHORT_READ;
+
+		*copied += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Copy [offset, end) of the file to fd, at its current position */
+static errcode_t copy_range(cmfs_cached_inode *ci, int fd, char *buf,
+			    uint32_t buflen, uint64_t offset, uint64_t end)
+{
+	cmfs_filesys *fs = ci->ci_fs;
+	uint32_t want, got;
+	ssize_t wrote;
 	errcode_t ret;
-	char *buf = NULL;
-	int buflen;
-	uint32_t got;
-	uint32_t wrote;
-	cmfs_cached_inode *ci = NULL;
-	uint64_t offset = 0;
 
-	ret = cmfs_read_cached_inode(fs, ino, &ci);
-	if (!ret) {
+	while (offset < end) {
+		want = buflen;
+		if (end - offset < want)
+			want = (end - offset + fs->fs_blocksize - 1) &
+				~((uint64_t)fs->fs_blocksize - 1);
+
+		ret = cmfs_file_read(ci, buf, want, offset, &got);
+		if (ret) {
+			com_err(gbls.cmd, ret, "while reading file %"PRIu64
+				" at offset %"PRIu64, ci->ci_blkno, offset);
+			return ret;
+		}
+		if (!got)
+			break;
+		if (got > end - offset)
+			got = end - offset;
+
+		wrote = write(fd, buf, got);
+		if (wrote != got) {
+			ret = (wrote < 0) ? errno : CMFS_ET_SHORT_WRITE;
+			com_err(gbls.cmd, ret, "while writing file");
+			return ret;
+		}
+
+		offset += got;
+	}
+
+	return 0;
+}
+
+static int dump_proc(cmfs_cached_inode *ci, uint64_t offset, uint64_t len,
+		     uint64_t p_blkno, uint16_t ext_flags, void *priv_data)
+{
+	struct dump_context *ctxt = priv_data;
+	cmfs_filesys *fs = ci->ci_fs;
+	uint64_t whole, done = 0;
+	errcode_t ret;
+
+	if (!p_blkno || (ext_flags & CMFS_EXT_UNWRITTEN)) {
+		if (ctxt->sparse)
+			return 0;
+		ret = copy_range(ci, ctxt->fd, ctxt->buf, ctxt->buflen,
+				 offset, offset + len);
+		goto out;
+	}
+
+	if (ctxt->sparse &&
+	    (lseek64(ctxt->fd, ctxt->base + offset, SEEK_SET) == -1)) {
+		ret = errno;
+		com_err(gbls.cmd, ret, "while seeking in file");
+		goto out;
+	}
+
+	whole = len & ~((uint64_t)fs->fs_blocksize - 1);
+	if (whole && ctxt->method) {
+		ret = copy_direct(ctxt, p_blkno * fs->fs_blocksize, whole,
+				  &done);
+		if (ret) {
+			com_err(gbls.cmd, ret, "while copying file %"PRIu64
+				" at offset %"PRIu64, ci->ci_blkno,
+				offset + done);
+			goto out;
+		}
+	}
+
+	ret = copy_range(ci, ctxt->fd, ctxt->buf, ctxt->buflen,
+			 offset + done, offset + len);
+
+out:
+	ctxt->errcode = ret;
+	return ret ? CMFS_EXTENT_ABORT : 0;
+}
+
+static errcode_t dump_context_init(cmfs_filesys *fs,
+				   struct dump_context *ctxt,
+				   uint32_t readahead)
+{
+	errcode_t ret;
+
+	memset(ctxt, 0, sizeof(*ctxt));
+	ctxt->pipe_fds[0] = ctxt->pipe_fds[1] = -1;
+	ctxt->readahead = readahead;
+	ctxt->buflen = 1 << 20;
+	ret = cmfs_malloc_blocks(fs->fs_io,
+				 (ctxt->buflen >>
+				  CMFS_RAW_SB(fs->fs_super)->s_blocksize_bits),
+				 &ctxt->buf);
+	if (ret)
+		com_err(gbls.cmd, ret, "while allocating %u bytes",
+			ctxt->buflen);
+	return ret;
+}
+
+static void dump_context_free(struct dump_context *ctxt)
+{
+	if (ctxt->pipe_fds[0] >= 0) {
+		close(ctxt->pipe_fds[0]);
+		close(ctxt->pipe_fds[1]);
+	}
+	if (ctxt->buf)
+		cmfs_free(&ctxt->buf);
+}
+
+/*
+ * The body of dump_file(), with the buffer and the pipe of a context
+ * set up by dump_context_init() so they can be used for many files.
+ * fd is always closed.  The size of the file is left in ctxt->size.
+ */
+static errcode_t dump_file_ctxt(struct dump_context *ctxt,
+				cmfs_filesys *fs,
+				uint64_t ino,
+				int fd,
+				char *out_file,
+				int preserve)
+{
+	errcode_t ret;
+	struct stat st;
+	uint64_t size;
+
+	ctxt->ci = NULL;
+	ctxt->errcode = 0;
+	ctxt->size = 0;
+
+	ret = cmfs_read_cached_inode(fs, ino, &ctxt->ci);
+	if (ret) {
 		com_err(gbls.cmd, ret, "while reading inode %"PRIu64, ino);
 		goto bail;
 	}
 
-	if (S_ISLNK(ci->ci_inode->i_mode)) {
+	if (S_ISLNK(ctxt->ci->ci_inode->i_mode)) {
 		ret = unlink(out_file);
 		if (ret)
 			goto bail;
 
-		ret = dump_symlink(fs, ino, out_file, ci->ci_inode);
+		ret = dump_symlink(fs, ino, out_file, ctxt->ci->ci_inode);
 		goto bail;
 	}
 
-	buflen = 1 << 20;
-	ret = cmfs_malloc_blocks(fs->fs_io,
-				 (buflen >>
-				  CMFS_RAW_SB(fs->fs_super)->s_blocksize_bits),
-				  &buf);
+	ctxt->fd = fd;
+	ctxt->dev_fd = io_get_fd(fs->fs_io);
+	ctxt->fd_is_pipe = !fstat(fd, &st) && S_ISFIFO(st.st_mode);
+	ctxt->method = DUMP_COPY_FILE_RANGE;
+	ctxt->sparse = can_punch_holes(fd);
+	ctxt->base = 0;
+	if (ctxt->sparse)
+		ctxt->base = lseek64(fd, 0, SEEK_CUR);
+
+	size = ctxt->ci->ci_inode->i_size;
+	ret = cmfs_file_map_iterate(ctxt->ci, 0, dump_proc, ctxt);
+	if (!ret)
+		ret = ctxt->errcode;
 	if (ret) {
-		com_err(gbls.cmd, ret, "while allocating %u bytes", buflen);
+		if (!ctxt->errcode)
+			com_err(gbls.cmd, ret, "while mapping file %"PRIu64,
+				ctxt->ci->ci_blkno);
 		goto bail;
 	}
 
-	while (1) {
-		ret = cmfs_file_read(ci, buf, buflen, offset, &got);
+	/* A hole at the end does not show up in the file size otherwise */
+	if (ctxt->sparse && (ftruncate64(fd, ctxt->base + size) == -1)) {
+		ret = errno;
+		com_err(gbls.cmd, ret, "while setting the size of the file");
+		goto bail;
+	}
+	ctxt->size = size;
+
+	if (preserve)
+		ret = fix_perms(ctxt->ci->ci_inode, &fd, out_file);
+bail:
+	if (fd > 0 && fd != fileno(stdout))
+		close(fd);
+	if (ctxt->ci) {
+		cmfs_free_cached_inode(fs, ctxt->ci);
+		ctxt->ci = NULL;
+	}
+	return ret;
+}
+
+/*
+ * Write the contents of inode ino to fd.  Holes and unwritten extents
+ * become holes in the output file if it can have them, otherwise they
+ * are written as zeros.
+ */
+errcode_t dump_file(cmfs_filesys *fs,
+		    uint64_t ino,
+		    int fd,
+		    char *out_file,
+		    int preserve)
+{
+	errcode_t ret;
+	struct dump_context ctxt;
+
+	ret = dump_context_init(fs, &ctxt, 0);
+	if (ret) {
+		if (fd > 0 && fd != fileno(stdout))
+			close(fd);
+		goto bail;
+	}
+
+	ret = dump_file_ctxt(&ctxt, fs, ino, fd, out_file, preserve);
+bail:
+	dump_context_free(&ctxt);
+	return ret;
+}
+
+/*
+ * rdump copies a directory tree off the volume.  The calling thread
+ * walks the directories, making them and the symlinks as it goes, and
+ * queues the regular files for a pool of copy threads.  The queue is
+ * bounded, so the walk can't run far ahead of the copies.  Every copy
+ * thread has its own buffer, pipe and readahead window, so enough of
+ * them keep the device busy.  The permissions of a directory are set
+ * once everything under it has been written, deepest first.
+ *
+ * fs must have been opened with CMFS_FLAG_THREADED when threads > 1.
+ * The first error stops the whole dump.
+ */
+#define RDUMP_QUEUE_PER_THREAD	16
+#define RDUMP_READAHEAD		(8 << 20)
+
+struct rdump_item {
+	struct list_head	ri_list;
+	uint64_t		ri_ino;
+	char			*ri_path;
+};
+
+struct rdump_opts {
+	cmfs_filesys		*ro_fs;
+	int			ro_verbose;
+	pthread_mutex_t		ro_lock;
+	pthread_cond_t		ro_work_cond;	/* queued, or walk done */
+	pthread_cond_t		ro_room_cond;	/* room in the queue */
+	struct list_head	ro_queue;
+	int			ro_queued;
+	int			ro_max_queued;
+	int			ro_walk_done;
+	struct list_head	ro_dirs;
+	uint64_t		ro_files;
+	uint64_t		ro_ndirs;
+	uint64_t		ro_links;
+	uint64_t		ro_bytes;
+	errcode_t		ro_errcode;
+};
+
+struct rdump_walk {
+	struct rdump_opts	*rw_opts;
+	const char		*rw_path;
+	errcode_t		rw_errcode;
+};
+
+static errcode_t rdump_entry(struct rdump_opts *opts, uint64_t ino,
+			     int type, char *path);
+
+static void rdump_fail(struct rdump_opts *opts, errcode_t ret)
+{
+	pthread_mutex_lock(&opts->ro_lock);
+	if (!opts->ro_errcode)
+		opts->ro_errcode = ret;
+	pthread_cond_broadcast(&opts->ro_work_cond);
+	pthread_cond_broadcast(&opts->ro_room_cond);
+	pthread_mutex_unlock(&opts->ro_lock);
+}
+
+static errcode_t rdump_new_item(uint64_t ino, char *path,
+				struct rdump_item **ret_item)
+{
+	struct rdump_item *ri;
+	errcode_t ret;
+
+	ret = cmfs_malloc0(sizeof(struct rdump_item), &ri);
+	if (ret) {
+		cmfs_free(&path);
+		return ret;
+	}
+
+	INIT_LIST_HEAD(&ri->ri_list);
+	ri->ri_ino = ino;
+	ri->ri_path = path;
+	*ret_item = ri;
+	return 0;
+}
+
+static void rdump_free_items(struct list_head *head)
+{
+	struct rdump_item *ri;
+	struct list_head *pos, *next;
+
+	list_for_each_safe(pos, next, head) {
+		ri = list_entry(pos, struct rdump_item, ri_list);
+		list_del(&ri->ri_list);
+		cmfs_free(&ri->ri_path);
+		cmfs_free(&ri);
+	}
+}
+
+/* Hand a regular file to the copy threads, waiting for room if need be */
+static errcode_t rdump_queue(struct rdump_opts *opts, uint64_t ino,
+			     char *path)
+{
+	struct rdump_item *ri;
+	errcode_t ret;
+
+	ret = rdump_new_item(ino, path, &ri);
+	if (ret)
+		return ret;
+
+	pthread_mutex_lock(&opts->ro_lock);
+	while ((opts->ro_queued >= opts->ro_max_queued) && !opts->ro_errcode)
+		pthread_cond_wait(&opts->ro_room_cond, &opts->ro_lock);
+	ret = opts->ro_errcode;
+	if (!ret) {
+		list_add_tail(&ri->ri_list, &opts->ro_queue);
+		opts->ro_queued++;
+		pthread_cond_signal(&opts->ro_work_cond);
+	}
+	pthread_mutex_unlock(&opts->ro_lock);
+
+	if (ret) {
+		cmfs_free(&ri->ri_path);
+		cmfs_free(&ri);
+	}
+	return ret;
+}
+
+/* NULL once the walk is over and the queue is empty, or on an error */
+static struct rdump_item *rdump_dequeue(struct rdump_opts *opts)
+{
+	struct rdump_item *ri = NULL;
+
+	pthread_mutex_lock(&opts->ro_lock);
+	while (list_empty(&opts->ro_queue) && !opts->ro_walk_done &&
+	       !opts->ro_errcode)
+		pthread_cond_wait(&opts->ro_work_cond, &opts->ro_lock);
+	if (!opts->ro_errcode && !list_empty(&opts->ro_queue)) {
+		ri = list_entry(opts->ro_queue.next, struct rdump_item,
+				ri_list);
+		list_del(&ri->ri_list);
+		opts->ro_queued--;
+		pthread_cond_signal(&opts->ro_room_cond);
+	}
+	pthread_mutex_unlock(&opts->ro_lock);
+
+	return ri;
+}
+
+static errcode_t rdump_copy(struct rdump_opts *opts,
+			    struct dump_context *ctxt,
+			    struct rdump_item *ri)
+{
+	errcode_t ret;
+	int fd;
+
+	if (opts->ro_verbose)
+		fprintf(stdout, "%s\n", ri->ri_path);
+
+	fd = open64(ri->ri_path, O_CREAT | O_WRONLY | O_TRUNC, 0600);
+	if (fd < 0) {
+		ret = errno;
+		com_err(gbls.cmd, ret, "'%s'", ri->ri_path);
+		return ret;
+	}
+
+	ret = dump_file_ctxt(ctxt, opts->ro_fs, ri->ri_ino, fd, ri->ri_path,
+			     1);
+	if (ret) {
+		com_err(gbls.cmd, ret, "while dumping inode %"PRIu64" to '%s'",
+			ri->ri_ino, ri->ri_path);
+		return ret;
+	}
+
+	pthread_mutex_lock(&opts->ro_lock);
+	opts->ro_files++;
+	opts->ro_bytes += ctxt->size;
+	pthread_mutex_unlock(&opts->ro_lock);
+
+	return 0;
+}
+
+static void *rdump_worker(void *arg)
+{
+	struct rdump_opts *opts = arg;
+	struct dump_context ctxt;
+	struct rdump_item *ri;
+	errcode_t ret;
+
+	ret = dump_context_init(opts->ro_fs, &ctxt, RDUMP_READAHEAD);
+	if (ret)
+		goto out;
+
+	while ((ri = rdump_dequeue(opts)) != NULL) {
+		ret = rdump_copy(opts, &ctxt, ri);
+		cmfs_free(&ri->ri_path);
+		cmfs_free(&ri);
+		if (ret)
+			break;
+	}
+
+out:
+	if (ret)
+		rdump_fail(opts, ret);
+	dump_context_free(&ctxt);
+	return NULL;
+}
+
+static int rdump_dirent(struct cmfs_dir_entry *dirent,
+			uint64_t blocknr,
+			int offset,
+			int blocksize,
+			char *buf,
+			void *priv_data)
+{
+	struct rdump_walk *rw = priv_data;
+	size_t len = strlen(rw->rw_path);
+	char *path;
+	errcode_t ret;
+
+	ret = cmfs_malloc(len + dirent->name_len + 2, &path);
+	if (ret)
+		goto out;
+	memcpy(path, rw->rw_path, len);
+	path[len] = '/';
+	memcpy(path + len + 1, dirent->name, dirent->name_len);
+	path[len + 1 + dirent->name_len] = '\0';
+
+	ret = rdump_entry(rw->rw_opts, dirent->inode, dirent->file_type,
+			  path);
+out:
+	rw->rw_errcode = ret;
+	return ret ? CMFS_DIRENT_ABORT : 0;
+}
+
+static errcode_t rdump_dir(struct rdump_opts *opts, uint64_t ino,
+			   char *path)
+{
+	struct rdump_item *ri;
+	struct rdump_walk rw;
+	errcode_t ret;
+
+	if (opts->ro_verbose)
+		fprintf(stdout, "%s\n", path);
+
+	/* Writable until fix_perms() at the end */
+	if ((mkdir(path, 0700) == -1) && (errno != EEXIST)) {
+		ret = errno;
+		com_err(gbls.cmd, ret, "while creating directory '%s'", path);
+		cmfs_free(&path);
+		return ret;
+	}
+
+	ret = rdump_new_item(ino, path, &ri);
+	if (ret)
+		return ret;
+	/* Added at the head, so a directory comes before its parent */
+	list_add(&ri->ri_list, &opts->ro_dirs);
+	opts->ro_ndirs++;
+
+	rw.rw_opts = opts;
+	rw.rw_path = path;
+	rw.rw_errcode = 0;
+	ret = cmfs_dir_iterate(opts->ro_fs, ino, CMFS_DIRENT_FLAG_EXCLUDE_DOTS,
+			       NULL, rdump_dirent, &rw);
+	if (!ret)
+		ret = rw.rw_errcode;
+	if (ret && !rw.rw_errcode)
+		com_err(gbls.cmd, ret, "while iterating directory '%s'", path);
+	return ret;
+}
+
+static errcode_t rdump_link(struct rdump_opts *opts, uint64_t ino,
+			    char *path)
+{
+	char *buf = NULL;
+	errcode_t ret;
+
+	if (opts->ro_verbose)
+		fprintf(stdout, "%s\n", path);
+
+	ret = cmfs_malloc_block(opts->ro_fs->fs_io, &buf);
+	if (ret)
+		goto out;
+
+	ret = cmfs_read_inode(opts->ro_fs, ino, buf);
+	if (ret)
+		goto out;
+
+	ret = dump_symlink(opts->ro_fs, ino, path, (struct cmfs_dinode *)buf);
+	if (!ret)
+		opts->ro_links++;
+out:
+	if (ret)
+		com_err(gbls.cmd, ret, "while dumping symlink '%s'", path);
+	if (buf)
+		cmfs_free(&buf);
+	cmfs_free(&path);
+	return ret;
+}
+
+static int rdump_mode_to_type(uint16_t mode)
+{
+	if (S_ISDIR(mode))
+		return CMFS_FT_DIR;
+	if (S_ISREG(mode))
+		return CMFS_FT_REG_FILE;
+	if (S_ISLNK(mode))
+		return CMFS_FT_SYMLINK;
+	return CMFS_FT_UNKNOWN;
+}
+
+/* Dump one inode to path, which is freed when done with */
+static errcode_t rdump_entry(struct rdump_opts *opts, uint64_t ino,
+			     int type, char *path)
+{
+	char *buf = NULL;
+	errcode_t ret;
+
+	if (type == CMFS_FT_UNKNOWN) {
+		ret = cmfs_malloc_block(opts->ro_fs->fs_io, &buf);
+		if (!ret)
+			ret = cmfs_read_inode(opts->ro_fs, ino, buf);
 		if (ret) {
-			com_err(gbls.cmd, ret, "while reading file %"PRIu64
-				" at offset %"PRIu64, ci->ci_blkno, offset);
-			goto bail;
+			com_err(gbls.cmd, ret, "while reading inode %"PRIu64,
+				ino);
+			cmfs_free(&path);
+			goto out;
 		}
+		type = rdump_mode_to_type(((struct cmfs_dinode *)buf)->i_mode);
+	}
 
-		if (!got)
-			break;
+	switch (type) {
+	case CMFS_FT_DIR:
+		ret = rdump_dir(opts, ino, path);
+		break;
+	case CMFS_FT_REG_FILE:
+		ret = rdump_queue(opts, ino, path);
+		break;
+	case CMFS_FT_SYMLINK:
+		ret = rdump_link(opts, ino, path);
+		break;
+	default:
+		if (opts->ro_verbose)
+			fprintf(stdout, "%s: skipped\n", path);
+		cmfs_free(&path);
+		ret = 0;
+		break;
+	}
 
-		wrote = write(fd, buf, got);
-		if (wrote != got) {
-			com_err(gbls.cmd, errno, "while writing file");
-			ret = errno;
-			goto bail;
+out:
+	if (buf)
+		cmfs_free(&buf);
+	return ret;
+}
+
+static errcode_t rdump_fix_dirs(struct rdump_opts *opts)
+{
+	struct rdump_item *ri;
+	struct list_head *pos;
+	char *buf = NULL;
+	errcode_t ret;
+	int fd = -1;
+
+	ret = cmfs_malloc_block(opts->ro_fs->fs_io, &buf);
+	if (ret)
+		return ret;
+
+	list_for_each(pos, &opts->ro_dirs) {
+		ri = list_entry(pos, struct rdump_item, ri_list);
+		ret = cmfs_read_inode(opts->ro_fs, ri->ri_ino, buf);
+		if (!ret)
+			ret = fix_perms((struct cmfs_dinode *)buf, &fd,
+					ri->ri_path);
+		if (ret) {
+			com_err(gbls.cmd, ret, "while setting permissions "
+				"of '%s'", ri->ri_path);
+			break;
 		}
+	}
 
-		if (got < buflen)
+	cmfs_free(&buf);
+	return ret;
+}
+
+/*
+ * Dump inode blkno, called name on the volume, and everything under
+ * it into directory dumproot, with up to threads files being copied
+ * at once.  name "/" dumps the contents of the root into dumproot.
+ */
+errcode_t rdump_inode(cmfs_filesys *fs, uint64_t blkno, const char *name,
+		      const char *dumproot, int threads, int verbose)
+{
+	struct rdump_opts opts;
+	struct timeval start, end;
+	pthread_t *workers = NULL;
+	const char *base, *p;
+	char *buf = NULL, *path = NULL;
+	size_t len, baselen;
+	double secs, mb;
+	int i, started = 0, type;
+	errcode_t ret;
+
+	memset(&opts, 0, sizeof(opts));
+	opts.ro_fs = fs;
+	opts.ro_verbose = verbose;
+	opts.ro_max_queued = threads * RDUMP_QUEUE_PER_THREAD;
+	INIT_LIST_HEAD(&opts.ro_queue);
+	INIT_LIST_HEAD(&opts.ro_dirs);
+	pthread_mutex_init(&opts.ro_lock, NULL);
+	pthread_cond_init(&opts.ro_work_cond, NULL);
+	pthread_cond_init(&opts.ro_room_cond, NULL);
+
+	ret = cmfs_malloc_block(fs->fs_io, &buf);
+	if (ret)
+		goto out;
+	ret = cmfs_read_inode(fs, blkno, buf);
+	if (ret) {
+		com_err(gbls.cmd, ret, "while reading inode %"PRIu64, blkno);
+		goto out;
+	}
+	type = rdump_mode_to_type(((struct cmfs_dinode *)buf)->i_mode);
+
+	/* The last component of name, without trailing slashes */
+	for (len = strlen(name); len && (name[len - 1] == '/'); len--)
+		;
+	for (base = name, p = name; p < name + len; p++)
+		if (*p == '/')
+			base = p + 1;
+	baselen = name + len - base;
+
+	len = strlen(dumproot);
+	ret = cmfs_malloc(len + baselen + 2, &path);
+	if (ret)
+		goto out;
+	memcpy(path, dumproot, len);
+	if (baselen) {
+		path[len++] = '/';
+		memcpy(path + len, base, baselen);
+		len += baselen;
+	}
+	path[len] = '\0';
+
+	ret = cmfs_malloc0(sizeof(pthread_t) * threads, &workers);
+	if (ret)
+		goto out;
+
+	gettimeofday(&start, NULL);
+	for (started = 0; started < threads; started++) {
+		i = pthread_create(&workers[started], NULL, rdump_worker,
+				   &opts);
+		if (i) {
+			ret = i;
+			com_err(gbls.cmd, ret, "while starting copy threads");
 			break;
-		else
-			offset += got;
+		}
 	}
 
-	if (preserve)
-		ret = fix_perms(ci->ci_inode, &fd, out_file);
-bail:
-	if (fd > 0 && fd != fileno(stdout))
-		close(fd);
+	if (!ret) {
+		ret = rdump_entry(&opts, blkno, type, path);
+		path = NULL;
+	}
+	if (ret)
+		rdump_fail(&opts, ret);
+
+	pthread_mutex_lock(&opts.ro_lock);
+	opts.ro_walk_done = 1;
+	pthread_cond_broadcast(&opts.ro_work_cond);
+	pthread_mutex_unlock(&opts.ro_lock);
+
+	for (i = 0; i < started; i++)
+		pthread_join(workers[i], NULL);
+	gettimeofday(&end, NULL);
+
+	if (!ret)
+		ret = opts.ro_errcode;
+	if (!ret)
+		ret = rdump_fix_dirs(&opts);
+
+	secs = (end.tv_sec - start.tv_sec) +
+	       (end.tv_usec - start.tv_usec) / 1000000.0;
+	mb = opts.ro_bytes / (1024.0 * 1024.0);
+	fprintf(stdout, "%"PRIu64" files, %"PRIu64" directories, %"PRIu64
+		" symlinks, %.1f MB in %.2f seconds (%.1f MB/s, %d threads)\n",
+		opts.ro_files, opts.ro_ndirs, opts.ro_links, mb, secs,
+		secs > 0 ? mb / secs : 0.0, started);
+
+out:
+	rdump_free_items(&opts.ro_queue);
+	rdump_free_items(&opts.ro_dirs);
+	pthread_cond_destroy(&opts.ro_room_cond);
+	pthread_cond_destroy(&opts.ro_work_cond);
+	pthread_mutex_destroy(&opts.ro_lock);
+	if (workers)
+		cmfs_free(&workers);
+	if (path)
+		cmfs_free(&path);
 	if (buf)
 		cmfs_free(&buf);
-	if (ci)
-		cmfs_free_cached_inode(fs, ci);
 	return ret;
 }
 
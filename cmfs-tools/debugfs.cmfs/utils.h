@@ -25,13 +25,6 @@
 #ifndef __UTILS_H__
 #define __UTILS_H__
 
-struct rdump_opts {
-	cmfs_filesys *fs;
-	char *fullname;
-	char *buf;
-	int verbose;
-};
-
 struct strings {
 	char *s_str;
 	struct list_head s_list;
@@ -61,7 +54,7 @@ errcode_t read_whole_file(cmfs_filesys *fs, uint64_t ino, char **buf,
 void inode_perms_to_str(uint16_t mode, char *str, int len);
 void inode_time_to_str(uint64_t mtime, char *str, int len);
 errcode_t rdump_inode(cmfs_filesys *fs, uint64_t blkno, const char *name,
-		      const char *dumproot, int verbose);
+		      const char *dumproot, int threads, int verbose);
 void crunch_strsplit(char **args);
 void find_max_contig_free_bits(struct cmfs_group_desc *gd, int *max_contig_free_bits);
 
@@ -0,0 +1,1057 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * defrag.c
+ *
+ * Move the fragmented files of an unmounted CMFS volume into
+ * contiguous free space.
+ *
+ * Copyright (C) 2012, Coly Li <i@coly.li>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Every regular file is scored by its fragments per GB, a fragment
+ * being a physically contiguous run of its data, and those scoring at
+ * least -e are moved, the worst first.  A file gets one free extent of
+ * the global bitmap that holds it all (cmfs_alloc_clusters_fit()), or
+ * failing that the largest free extents, as long as they are fewer
+ * than its fragments.  Its data is copied with large O_DIRECT reads
+ * and writes on a descriptor of our own, -q buffers in flight through
+ * libaio, and a new tree is built with cmfs_build_extent_tree().
+ *
+ * A file is switched over in this order, with the volume synced after
+ * each step:
+ *
+ *   1. the data is copied to the new clusters, still free on disk
+ *   2. the new extent blocks are written, then the allocators are
+ *      flushed with the new clusters and blocks marked in use
+ *   3. the inode is written pointing at the new tree
+ *   4. the old clusters and extent blocks are freed and the
+ *      allocators flushed again
+ *
+ * The inode write is the switch, a crash on either side of it leaves
+ * the file whole and at worst leaks the clusters of the other copy,
+ * which fsck.cmfs reports.  Nothing else points at the data of a file,
+ * so nothing else changes.
+ *
+ * -n plans the moves on the in-memory allocators and writes nothing.
+ * -t reads every file moved in file order before and after, with
+ * synchronous reads of -b as a player would, and reports the rates.
+ */
+
+#define _XOPEN_SOURCE 600
+#define _LARGEFILE64_SOURCE
+#define _GNU_SOURCE /* O_DIRECT */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <libaio.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <cmfs/cmfs.h>
+#include "../libcmfs/cmfs_err.h"
+
+#define DEFRAG_IO_KB		4096
+#define DEFRAG_DEPTH		8
+#define DEFRAG_FRAGS_PER_GB	8
+
+struct defrag_file {
+	uint64_t df_ino;
+	uint64_t df_bytes;	/* allocated */
+	uint32_t df_frags;
+	double df_score;	/* fragments per GB */
+};
+
+struct defrag_piece {
+	uint32_t dp_cpos;
+	uint32_t dp_len;
+};
+
+struct defrag_io {
+	struct iocb di_iocb;
+	char *di_buf;
+	size_t di_len;
+	uint64_t di_dst;
+	int di_writing;
+};
+
+struct defrag_ctxt {
+	cmfs_filesys *dc_fs;
+	const char *dc_devname;
+	int dc_fd;
+	int dc_verbose;
+	int dc_dry_run;
+	int dc_timed;
+	uint32_t dc_frags_per_gb;
+
+	cmfs_allocator *dc_cluster_ca;
+	cmfs_allocator *dc_eb_ca;
+
+	struct defrag_file *dc_files;
+	size_t dc_nr_files;
+	size_t dc_alloc_files;
+
+	/* while scoring an inode */
+	uint64_t dc_cur_end;
+	uint64_t dc_cur_blocks;
+	uint32_t dc_cur_frags;
+
+	/* the file being moved, its runs in file order */
+	struct cmfs_extent_run *dc_old;
+	size_t dc_nr_old;
+	size_t dc_alloc_old;
+	uint64_t *dc_ebs;
+	size_t dc_nr_ebs;
+	size_t dc_alloc_ebs;
+	struct defrag_piece *dc_pieces;
+	size_t dc_nr_pieces;
+	size_t dc_alloc_pieces;
+	struct cmfs_extent_run *dc_new;
+	uint64_t *dc_src;		/* old first block of each dc_new */
+	size_t dc_nr_new;
+	size_t dc_alloc_new;
+	size_t dc_alloc_src;
+	errcode_t dc_err;
+
+	uint32_t dc_io_blocks;
+	int dc_depth;
+	io_context_t dc_ctx;
+	struct defrag_io *dc_ios;
+	struct defrag_io **dc_idle;
+	struct io_event *dc_events;
+	int dc_nr_idle;
+
+	struct timeval dc_start;
+	unsigned long dc_moved;
+	unsigned long dc_skipped;
+	uint64_t dc_bytes;
+	uint64_t dc_frags_before;
+	uint64_t dc_frags_after;
+	uint64_t dc_timed_bytes;
+	double dc_secs_before;
+	double dc_secs_after;
+};
+
+static char *progname = "defrag.cmfs";
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-n] [-t] [-v] [-e frags_per_GB] [-b io_kb] "
+		"[-q depth] device\n"
+		"  -e  move files with at least this many fragments per GB "
+		"(default %d)\n"
+		"  -b  size of one read or write in KB (default %d)\n"
+		"  -q  buffers in flight (default %d)\n"
+		"  -n  only show what would be moved\n"
+		"  -t  time reading each file before and after\n"
+		"  -v  verbose\n",
+		progname, DEFRAG_FRAGS_PER_GB, DEFRAG_IO_KB, DEFRAG_DEPTH);
+	exit(1);
+}
+
+static double elapsed(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) +
+	       (now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+/* Make room for one more entry of size bytes at *array[nr] */
+static errcode_t grow_array(void *array, size_t *alloc, size_t nr,
+			    size_t size)
+{
+	void **p = array, *n;
+	size_t max;
+
+	if (nr < *alloc)
+		return 0;
+
+	max = *alloc ? *alloc * 2 : 64;
+	n = realloc(*p, max * size);
+	if (!n)
+		return CMFS_ET_NO_MEMORY;
+	*p = n;
+	*alloc = max;
+	return 0;
+}
+
+static double frags_per_gb(uint32_t frags, uint64_t bytes)
+{
+	return bytes ? frags * (1073741824.0 / bytes) : 0;
+}
+
+static int score_extent(cmfs_filesys *fs,
+			struct cmfs_extent_rec *rec,
+			int tree_depth,
+			uint32_t ccount,
+			uint64_t ref_blkno,
+			int ref_recno,
+			void *priv_data)
+{
+	struct defrag_ctxt *dc = priv_data;
+
+	if (!rec->e_leaf_blocks)
+		return 0;
+
+	if (rec->e_blkno != dc->dc_cur_end)
+		dc->dc_cur_frags++;
+	dc->dc_cur_end = rec->e_blkno + rec->e_leaf_blocks;
+	dc->dc_cur_blocks += rec->e_leaf_blocks;
+	return 0;
+}
+
+static int file_cmp(const void *a, const void *b)
+{
+	const struct defrag_file *fa = a, *fb = b;
+
+	if (fa->df_score > fb->df_score)
+		return -1;
+	if (fa->df_score < fb->df_score)
+		return 1;
+	return 0;
+}
+
+/* Score every regular file, keep those over the limit, worst first */
+static errcode_t find_files(struct defrag_ctxt *dc)
+{
+	cmfs_filesys *fs = dc->dc_fs;
+	cmfs_inode_scan *scan = NULL;
+	struct cmfs_dinode *di;
+	struct defrag_file *df;
+	char *buf = NULL;
+	uint64_t blkno, bytes;
+	double score;
+	errcode_t ret;
+
+	ret = cmfs_malloc_block(fs->fs_io, &buf);
+	if (ret)
+		goto out;
+
+	ret = cmfs_open_inode_scan(fs, &scan);
+	if (ret)
+		goto out;
+
+	di = (struct cmfs_dinode *)buf;
+	for (;;) {
+		ret = cmfs_get_next_inode(scan, &blkno, buf);
+		if (ret || !blkno)
+			break;
+
+		if (!(di->i_flags & CMFS_VALID_FL) ||
+		    (di->i_flags & CMFS_SYSTEM_FL) || !S_ISREG(di->i_mode))
+			continue;
+		if (di->i_dyn_features & CMFS_INLINE_DATA_FL)
+			continue;
+
+		dc->dc_cur_end = 0;
+		dc->dc_cur_blocks = 0;
+		dc->dc_cur_frags = 0;
+		ret = cmfs_extent_iterate_leaves(fs, di,
+						 CMFS_EXTENT_FLAG_DATA_ONLY, 0,
+						 score_extent, dc);
+		if (ret) {
+			/* Leave it alone, a damaged tree is fsck's business */
+			fprintf(stderr, "%s: %s while walking the extents of "
+				"inode %"PRIu64", skipped\n", progname,
+				error_message(ret), blkno);
+			dc->dc_skipped++;
+			ret = 0;
+			continue;
+		}
+
+		bytes = dc->dc_cur_blocks * fs->fs_blocksize;
+		score = frags_per_gb(dc->dc_cur_frags, bytes);
+		if ((dc->dc_cur_frags < 2) || (score < dc->dc_frags_per_gb))
+			continue;
+
+		ret = grow_array(&dc->dc_files, &dc->dc_alloc_files,
+				 dc->dc_nr_files, sizeof(struct defrag_file));
+		if (ret)
+			break;
+		df = &dc->dc_files[dc->dc_nr_files++];
+		df->df_ino = blkno;
+		df->df_bytes = bytes;
+		df->df_frags = dc->dc_cur_frags;
+		df->df_score = score;
+	}
+
+	if (!ret)
+		qsort(dc->dc_files, dc->dc_nr_files,
+		      sizeof(struct defrag_file), file_cmp);
+
+out:
+	if (scan)
+		cmfs_close_inode_scan(scan);
+	if (buf)
+		cmfs_free(&buf);
+	return ret;
+}
+
+static int collect_extent(cmfs_filesys *fs,
+			  struct cmfs_extent_rec *rec,
+			  int tree_depth,
+			  uint32_t ccount,
+			  uint64_t ref_blkno,
+			  int ref_recno,
+			  void *priv_data)
+{
+	struct defrag_ctxt *dc = priv_data;
+	struct cmfs_extent_run *run;
+	errcode_t ret;
+
+	if (tree_depth) {
+		ret = grow_array(&dc->dc_ebs, &dc->dc_alloc_ebs,
+				 dc->dc_nr_ebs, sizeof(uint64_t));
+		if (ret)
+			goto out;
+		dc->dc_ebs[dc->dc_nr_ebs++] = rec->e_blkno;
+		return 0;
+	}
+
+	if (!rec->e_leaf_blocks)
+		return 0;
+
+	ret = grow_array(&dc->dc_old, &dc->dc_alloc_old, dc->dc_nr_old,
+			 sizeof(struct cmfs_extent_run));
+	if (ret)
+		goto out;
+	run = &dc->dc_old[dc->dc_nr_old++];
+	run->er_v_blkno = cmfs_clusters_to_blocks(fs, rec->e_cpos);
+	run->er_blkno = rec->e_blkno;
+	run->er_blocks = rec->e_leaf_blocks;
+	run->er_flags = rec->e_flags;
+	return 0;
+
+out:
+	dc->dc_err = ret;
+	return CMFS_EXTENT_ABORT | CMFS_EXTENT_ERROR;
+}
+
+static uint32_t run_clusters(cmfs_filesys *fs, struct cmfs_extent_run *run)
+{
+	uint32_t bpc = cmfs_clusters_to_blocks(fs, 1);
+
+	return (run->er_blocks + bpc - 1) / bpc;
+}
+
+static void free_pieces(struct defrag_ctxt *dc)
+{
+	size_t i;
+
+	for (i = 0; i < dc->dc_nr_pieces; i++)
+		cmfs_free_clusters(dc->dc_cluster_ca,
+				   dc->dc_pieces[i].dp_cpos,
+				   dc->dc_pieces[i].dp_len);
+	dc->dc_nr_pieces = 0;
+}
+
+/*
+ * Get clusters for the whole file, in one free extent if there is one
+ * large enough, else from the largest ones.  CMFS_ET_NO_SPACE when
+ * that would take as many extents as the file has fragments already.
+ */
+static errcode_t alloc_target(struct defrag_ctxt *dc, uint32_t clusters,
+			      uint32_t frags)
+{
+	struct defrag_piece *dp;
+	uint32_t cpos, len;
+	errcode_t ret;
+
+	dc->dc_nr_pieces = 0;
+	while (clusters) {
+		if (dc->dc_nr_pieces + 1 >= frags) {
+			ret = CMFS_ET_NO_SPACE;
+			goto out;
+		}
+
+		ret = cmfs_alloc_clusters_fit(dc->dc_cluster_ca, clusters,
+					      &cpos);
+		if (!ret)
+			len = clusters;
+		else if (ret == CMFS_ET_NO_SPACE) {
+			ret = cmfs_largest_free_clusters(dc->dc_cluster_ca,
+							 &cpos, &len);
+			if (ret)
+				goto out;
+			ret = cmfs_alloc_clusters(dc->dc_cluster_ca, cpos,
+						  len, len, &cpos, &len);
+		}
+		if (ret)
+			goto out;
+
+		ret = grow_array(&dc->dc_pieces, &dc->dc_alloc_pieces,
+				 dc->dc_nr_pieces, sizeof(struct defrag_piece));
+		if (ret) {
+			cmfs_free_clusters(dc->dc_cluster_ca, cpos, len);
+			goto out;
+		}
+		dp = &dc->dc_pieces[dc->dc_nr_pieces++];
+		dp->dp_cpos = cpos;
+		dp->dp_len = len;
+		clusters -= len;
+	}
+
+out:
+	if (ret)
+		free_pieces(dc);
+	return ret;
+}
+
+/*
+ * Lay the old runs out over the pieces in file order.  A run that
+ * doesn't fit in what is left of a piece is split on a cluster, so
+ * each new run still starts on one.  Returns the fragments it makes.
+ */
+static errcode_t map_runs(struct defrag_ctxt *dc, uint32_t *frags)
+{
+	cmfs_filesys *fs = dc->dc_fs;
+	struct cmfs_extent_run *old, *new;
+	struct defrag_piece *dp = dc->dc_pieces;
+	uint32_t bpc = cmfs_clusters_to_blocks(fs, 1);
+	uint64_t avail, end = 0;
+	uint32_t done, n, used = 0;
+	size_t i;
+	errcode_t ret;
+
+	dc->dc_nr_new = 0;
+	*frags = 0;
+	for (i = 0; i < dc->dc_nr_old; i++) {
+		old = &dc->dc_old[i];
+		for (done = 0; done < old->er_blocks; done += n) {
+			ret = grow_array(&dc->dc_new, &dc->dc_alloc_new,
+					 dc->dc_nr_new,
+					 sizeof(struct cmfs_extent_run));
+			if (!ret)
+				ret = grow_array(&dc->dc_src,
+						 &dc->dc_alloc_src,
+						 dc->dc_nr_new,
+						 sizeof(uint64_t));
+			if (ret)
+				return ret;
+
+			avail = (uint64_t)(dp->dp_len - used) * bpc;
+			n = old->er_blocks - done;
+			if (n > avail)
+				n = avail;
+
+			new = &dc->dc_new[dc->dc_nr_new];
+			new->er_v_blkno = old->er_v_blkno + done;
+			new->er_blkno = cmfs_clusters_to_blocks(fs,
+							dp->dp_cpos + used);
+			new->er_blocks = n;
+			new->er_flags = old->er_flags;
+			dc->dc_src[dc->dc_nr_new++] = old->er_blkno + done;
+
+			if (new->er_blkno != end)
+				(*frags)++;
+			end = new->er_blkno + n;
+
+			used += (n + bpc - 1) / bpc;
+			if (used == dp->dp_len) {
+				dp++;
+				used = 0;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static void free_old(struct defrag_ctxt *dc, uint64_t ino)
+{
+	cmfs_filesys *fs = dc->dc_fs;
+	struct cmfs_extent_run *run;
+	errcode_t ret;
+	size_t i;
+
+	for (i = 0; i < dc->dc_nr_old; i++) {
+		run = &dc->dc_old[i];
+		ret = cmfs_free_clusters(dc->dc_cluster_ca,
+					 cmfs_blocks_to_clusters(fs,
+								 run->er_blkno),
+					 run_clusters(fs, run));
+		if (ret)
+			fprintf(stderr, "%s: %s while freeing the old clusters "
+				"at block %"PRIu64" of inode %"PRIu64"\n",
+				progname, error_message(ret), run->er_blkno,
+				ino);
+	}
+
+	/* A dry run plans with the clusters alone */
+	if (dc->dc_dry_run)
+		return;
+
+	for (i = 0; i < dc->dc_nr_ebs; i++) {
+		ret = cmfs_free_block(dc->dc_eb_ca, dc->dc_ebs[i]);
+		if (ret)
+			fprintf(stderr, "%s: %s while freeing the old extent "
+				"block %"PRIu64" of inode %"PRIu64"\n",
+				progname, error_message(ret), dc->dc_ebs[i],
+				ino);
+	}
+}
+
+static errcode_t setup_io(struct defrag_ctxt *dc)
+{
+	int i;
+	errcode_t ret;
+
+	ret = cmfs_malloc0(dc->dc_depth * sizeof(struct defrag_io),
+			   &dc->dc_ios);
+	if (ret)
+		return ret;
+	ret = cmfs_malloc0(dc->dc_depth * sizeof(struct defrag_io *),
+			   &dc->dc_idle);
+	if (ret)
+		return ret;
+	ret = cmfs_malloc0(dc->dc_depth * sizeof(struct io_event),
+			   &dc->dc_events);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < dc->dc_depth; i++) {
+		ret = cmfs_malloc_blocks(dc->dc_fs->fs_io, dc->dc_io_blocks,
+					 &dc->dc_ios[i].di_buf);
+		if (ret)
+			return ret;
+		dc->dc_idle[dc->dc_nr_idle++] = &dc->dc_ios[i];
+	}
+
+	if (io_queue_init(dc->dc_depth, &dc->dc_ctx))
+		return CMFS_ET_IO;
+
+	return 0;
+}
+
+static void teardown_io(struct defrag_ctxt *dc)
+{
+	int i;
+
+	if (dc->dc_ctx)
+		io_queue_release(dc->dc_ctx);
+	if (dc->dc_ios) {
+		for (i = 0; i < dc->dc_depth; i++)
+			if (dc->dc_ios[i].di_buf)
+				cmfs_free(&dc->dc_ios[i].di_buf);
+		cmfs_free(&dc->dc_ios);
+	}
+	if (dc->dc_idle)
+		cmfs_free(&dc->dc_idle);
+	if (dc->dc_events)
+		cmfs_free(&dc->dc_events);
+}
+
+static errcode_t submit(struct defrag_ctxt *dc, struct defrag_io *di)
+{
+	struct iocb *iocb = &di->di_iocb;
+
+	di->di_iocb.data = di;
+	if (io_submit(dc->dc_ctx, 1, &iocb) != 1)
+		return CMFS_ET_IO;
+	return 0;
+}
+
+/*
+ * Copy dc_src to dc_new.  Each buffer is read and then written from
+ * the completion loop, so reads of later chunks overlap the writes of
+ * earlier ones.
+ */
+static errcode_t copy_data(struct defrag_ctxt *dc)
+{
+	unsigned int bs = dc->dc_fs->fs_blocksize;
+	struct cmfs_extent_run *run;
+	struct defrag_io *di;
+	uint32_t off = 0, count;
+	size_t next = 0;
+	int i, n, inflight = 0;
+	errcode_t ret = 0;
+
+	while ((next < dc->dc_nr_new) || inflight) {
+		while ((next < dc->dc_nr_new) && dc->dc_nr_idle) {
+			run = &dc->dc_new[next];
+			count = run->er_blocks - off;
+			if (count > dc->dc_io_blocks)
+				count = dc->dc_io_blocks;
+
+			di = dc->dc_idle[--dc->dc_nr_idle];
+			di->di_len = (size_t)count * bs;
+			di->di_dst = run->er_blkno + off;
+			di->di_writing = 0;
+			io_prep_pread(&di->di_iocb, dc->dc_fd, di->di_buf,
+				      di->di_len,
+				      (dc->dc_src[next] + off) * bs);
+			ret = submit(dc, di);
+			if (ret) {
+				dc->dc_idle[dc->dc_nr_idle++] = di;
+				goto out;
+			}
+			inflight++;
+
+			off += count;
+			if (off == run->er_blocks) {
+				next++;
+				off = 0;
+			}
+		}
+
+		n = io_getevents(dc->dc_ctx, 1, inflight, dc->dc_events,
+				 NULL);
+		if (n == -EINTR)
+			continue;
+		if (n < 0) {
+			ret = CMFS_ET_IO;
+			goto out;
+		}
+
+		for (i = 0; i < n; i++) {
+			di = dc->dc_events[i].data;
+			if ((long)dc->dc_events[i].res != (long)di->di_len) {
+				if (!ret)
+					ret = di->di_writing ?
+						CMFS_ET_SHORT_WRITE :
+						CMFS_ET_SHORT_READ;
+			} else if (!di->di_writing && !ret) {
+				di->di_writing = 1;
+				io_prep_pwrite(&di->di_iocb, dc->dc_fd,
+					       di->di_buf, di->di_len,
+					       di->di_dst * bs);
+				ret = submit(dc, di);
+				if (!ret)
+					continue;
+			} else if (di->di_writing)
+				dc->dc_bytes += di->di_len;
+
+			dc->dc_idle[dc->dc_nr_idle++] = di;
+			inflight--;
+		}
+		if (ret)
+			goto out;
+	}
+
+out:
+	/* Reap what is still in flight before the buffers are reused */
+	while (inflight > 0) {
+		n = io_getevents(dc->dc_ctx, 1, inflight, dc->dc_events,
+				 NULL);
+		if (n == -EINTR)
+			continue;
+		if (n < 0)
+			break;
+		for (i = 0; i < n; i++)
+			dc->dc_idle[dc->dc_nr_idle++] =
+				dc->dc_events[i].data;
+		inflight -= n;
+	}
+	return ret;
+}
+
+/* Read the file in order from its old (after = 0) or new blocks */
+static errcode_t time_reads(struct defrag_ctxt *dc, int after,
+			    double *secs)
+{
+	unsigned int bs = dc->dc_fs->fs_blocksize;
+	char *buf = dc->dc_ios[0].di_buf;
+	struct timeval start;
+	uint64_t blkno;
+	uint32_t done, count;
+	ssize_t got;
+	size_t i;
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < dc->dc_nr_new; i++) {
+		blkno = after ? dc->dc_new[i].er_blkno : dc->dc_src[i];
+		for (done = 0; done < dc->dc_new[i].er_blocks; done += count) {
+			count = dc->dc_new[i].er_blocks - done;
+			if (count > dc->dc_io_blocks)
+				count = dc->dc_io_blocks;
+			got = pread64(dc->dc_fd, buf, (size_t)count * bs,
+				      (blkno + done) * bs);
+			if (got < 0)
+				return errno;
+			if (got != (ssize_t)count * bs)
+				return CMFS_ET_SHORT_READ;
+		}
+	}
+	*secs = elapsed(&start);
+
+	return 0;
+}
+
+/* Everything written so far is on disk before the next step starts */
+static errcode_t sync_volume(struct defrag_ctxt *dc)
+{
+	int fd = io_get_fd(dc->dc_fs->fs_io);
+
+	if (fsync(dc->dc_fd) && (errno != EINVAL))
+		return errno;
+	if ((fd >= 0) && fsync(fd) && (errno != EINVAL))
+		return errno;
+	return 0;
+}
+
+static errcode_t flush_allocators(struct defrag_ctxt *dc)
+{
+	errcode_t ret;
+
+	ret = cmfs_allocator_flush(dc->dc_eb_ca);
+	if (ret)
+		return ret;
+	ret = cmfs_allocator_flush(dc->dc_cluster_ca);
+	if (ret)
+		return ret;
+	return sync_volume(dc);
+}
+
+/* Build the new tree in new_buf and switch the inode over to it */
+static errcode_t switch_tree(struct defrag_ctxt *dc, uint64_t ino,
+			     char *new_buf, uint32_t clusters)
+{
+	cmfs_filesys *fs = dc->dc_fs;
+	struct cmfs_dinode *di = (struct cmfs_dinode *)new_buf;
+	struct cmfs_extent_list *el = &di->id2.i_list;
+	errcode_t ret;
+
+	memset(el->l_recs, 0, sizeof(struct cmfs_extent_rec) * el->l_count);
+	el->l_tree_depth = 0;
+	el->l_next_free_rec = 0;
+	di->i_last_eb_blk = 0;
+	di->i_clusters -= clusters;
+
+	ret = cmfs_build_extent_tree(fs, new_buf, dc->dc_new, dc->dc_nr_new,
+				     dc->dc_eb_ca, dc->dc_cluster_ca);
+	if (ret)
+		return ret;
+	ret = flush_allocators(dc);
+	if (ret)
+		return ret;
+
+	ret = cmfs_write_inode(fs, ino, new_buf);
+	if (ret)
+		return ret;
+	return sync_volume(dc);
+}
+
+static errcode_t defrag_file(struct defrag_ctxt *dc, struct defrag_file *df)
+{
+	cmfs_filesys *fs = dc->dc_fs;
+	char *buf = NULL, *new_buf = NULL;
+	uint32_t clusters = 0, frags = 0;
+	double before = 0, after = 0;
+	size_t i;
+	errcode_t ret;
+
+	ret = cmfs_malloc_block(fs->fs_io, &buf);
+	if (ret)
+		goto out;
+	ret = cmfs_malloc_block(fs->fs_io, &new_buf);
+	if (ret)
+		goto out;
+	ret = cmfs_read_inode(fs, df->df_ino, buf);
+	if (ret)
+		goto out;
+
+	dc->dc_nr_old = 0;
+	dc->dc_nr_ebs = 0;
+	dc->dc_err = 0;
+	ret = cmfs_extent_iterate_leaves(fs, (struct cmfs_dinode *)buf, 0, 0,
+					 collect_extent, dc);
+	if (dc->dc_err)
+		ret = dc->dc_err;
+	if (ret)
+		goto out;
+
+	for (i = 0; i < dc->dc_nr_old; i++)
+		clusters += run_clusters(fs, &dc->dc_old[i]);
+
+	ret = alloc_target(dc, clusters, df->df_frags);
+	if (ret == CMFS_ET_NO_SPACE) {
+		fprintf(stdout, "inode %"PRIu64": %"PRIu64" MB in %"PRIu32
+			" fragments, no free space to do better, skipped\n",
+			df->df_ino, df->df_bytes >> 20, df->df_frags);
+		dc->dc_skipped++;
+		ret = 0;
+		goto out;
+	}
+	if (ret)
+		goto out;
+
+	ret = map_runs(dc, &frags);
+	if (ret) {
+		free_pieces(dc);
+		goto out;
+	}
+
+	if (dc->dc_dry_run || dc->dc_verbose)
+		fprintf(stdout, "inode %"PRIu64": %"PRIu64" MB in %"PRIu32
+			" fragments (%.1f per GB) -> %"PRIu32" at cluster "
+			"%"PRIu32"\n", df->df_ino, df->df_bytes >> 20,
+			df->df_frags, df->df_score, frags,
+			dc->dc_pieces[0].dp_cpos);
+
+	if (dc->dc_dry_run) {
+		/* Later plans may use what this file leaves behind */
+		free_old(dc, df->df_ino);
+		goto done;
+	}
+
+	if (dc->dc_timed) {
+		ret = time_reads(dc, 0, &before);
+		if (ret)
+			goto out;
+	}
+
+	ret = copy_data(dc);
+	if (!ret)
+		ret = sync_volume(dc);
+	if (ret)
+		goto out;
+
+	memcpy(new_buf, buf, fs->fs_blocksize);
+	ret = switch_tree(dc, df->df_ino, new_buf, clusters);
+	if (ret)
+		goto out;
+
+	free_old(dc, df->df_ino);
+	ret = flush_allocators(dc);
+	if (ret)
+		goto out;
+
+	if (dc->dc_timed) {
+		ret = time_reads(dc, 1, &after);
+		if (ret)
+			goto out;
+		dc->dc_timed_bytes += df->df_bytes;
+		dc->dc_secs_before += before;
+		dc->dc_secs_after += after;
+		if (dc->dc_verbose)
+			fprintf(stdout, "inode %"PRIu64": read at %.1f MB/s "
+				"before, %.1f MB/s after\n", df->df_ino,
+				before > 0 ? df->df_bytes / before / 1048576 :
+					     0.0,
+				after > 0 ? df->df_bytes / after / 1048576 :
+					    0.0);
+	}
+
+done:
+	dc->dc_moved++;
+	dc->dc_frags_before += df->df_frags;
+	dc->dc_frags_after += frags;
+
+out:
+	if (new_buf)
+		cmfs_free(&new_buf);
+	if (buf)
+		cmfs_free(&buf);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct defrag_ctxt *dc;
+	int c, io_kb = DEFRAG_IO_KB, mount_flags, rc = 0;
+	size_t i;
+	double secs;
+	errcode_t ret = 0;
+
+	initialize_cmfs_error_table();
+
+	if (argc && *argv)
+		progname = basename(argv[0]);
+
+	dc = calloc(1, sizeof(struct defrag_ctxt));
+	if (!dc) {
+		com_err(progname, CMFS_ET_NO_MEMORY,
+			"while allocating defrag state");
+		return 1;
+	}
+	dc->dc_depth = DEFRAG_DEPTH;
+	dc->dc_frags_per_gb = DEFRAG_FRAGS_PER_GB;
+	dc->dc_fd = -1;
+
+	while ((c = getopt(argc, argv, "ntve:b:q:")) != EOF) {
+		switch (c) {
+		case 'n':
+			dc->dc_dry_run = 1;
+			break;
+		case 't':
+			dc->dc_timed = 1;
+			break;
+		case 'v':
+			dc->dc_verbose = 1;
+			break;
+		case 'e':
+			dc->dc_frags_per_gb = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			io_kb = atoi(optarg);
+			break;
+		case 'q':
+			dc->dc_depth = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if ((optind != argc - 1) || (io_kb <= 0) || (dc->dc_depth <= 0))
+		usage();
+	dc->dc_devname = argv[optind];
+
+	ret = cmfs_check_if_mounted(dc->dc_devname, &mount_flags);
+	if (ret) {
+		com_err(progname, ret, "while determining whether %s is "
+			"mounted", dc->dc_devname);
+		free(dc);
+		return 1;
+	}
+	if ((mount_flags & CMFS_MF_MOUNTED) && !dc->dc_dry_run) {
+		fprintf(stderr, "%s: %s is mounted, it can only be "
+			"defragmented offline\n", progname, dc->dc_devname);
+		free(dc);
+		return 1;
+	}
+
+	/* Even a dry run needs RW for the allocators, it writes nothing */
+	ret = cmfs_open(dc->dc_devname, CMFS_FLAG_RW, 0, CMFS_MAX_BLOCKSIZE,
+			&dc->dc_fs);
+	if (ret) {
+		com_err(progname, ret, "while opening \"%s\"",
+			dc->dc_devname);
+		free(dc);
+		return 1;
+	}
+
+	dc->dc_io_blocks = (io_kb * 1024) / dc->dc_fs->fs_blocksize;
+	if (!dc->dc_io_blocks)
+		dc->dc_io_blocks = 1;
+
+	ret = cmfs_open_allocator(dc->dc_fs, GLOBAL_BITMAP_SYSTEM_INODE,
+				  &dc->dc_cluster_ca);
+	if (!ret)
+		ret = cmfs_open_allocator(dc->dc_fs, EXTENT_ALLOC_SYSTEM_INODE,
+					  &dc->dc_eb_ca);
+	if (ret) {
+		com_err(progname, ret, "while loading the allocators");
+		rc = 1;
+		goto out;
+	}
+
+	gettimeofday(&dc->dc_start, NULL);
+	ret = find_files(dc);
+	if (ret) {
+		com_err(progname, ret, "while scanning the inodes");
+		rc = 1;
+		goto out;
+	}
+	if (dc->dc_verbose)
+		fprintf(stdout, "%zu files with %"PRIu32" or more fragments "
+			"per GB, found in %.2fs\n", dc->dc_nr_files,
+			dc->dc_frags_per_gb, elapsed(&dc->dc_start));
+
+	if (!dc->dc_dry_run) {
+		dc->dc_fd = open64(dc->dc_devname, O_RDWR | O_DIRECT);
+		if ((dc->dc_fd < 0) && (errno == EINVAL)) {
+			fprintf(stderr, "%s: O_DIRECT not supported on %s, "
+				"copying through the page cache\n", progname,
+				dc->dc_devname);
+			dc->dc_fd = open64(dc->dc_devname, O_RDWR);
+		}
+		if (dc->dc_fd < 0) {
+			com_err(progname, errno, "while opening \"%s\"",
+				dc->dc_devname);
+			rc = 1;
+			goto out;
+		}
+
+		ret = setup_io(dc);
+		if (ret) {
+			com_err(progname, ret, "while setting up the copy");
+			rc = 1;
+			goto out;
+		}
+	}
+
+	gettimeofday(&dc->dc_start, NULL);
+	for (i = 0; i < dc->dc_nr_files; i++) {
+		ret = defrag_file(dc, &dc->dc_files[i]);
+		if (ret) {
+			/*
+			 * Stop without flushing, the file in hand is still
+			 * whole on disk with its old tree.
+			 */
+			com_err(progname, ret, "while moving inode %"PRIu64,
+				dc->dc_files[i].df_ino);
+			rc = 1;
+			goto out;
+		}
+	}
+	secs = elapsed(&dc->dc_start);
+
+	if (dc->dc_dry_run)
+		fprintf(stdout, "%lu of %zu files would be moved, %"PRIu64
+			" fragments -> %"PRIu64"\n", dc->dc_moved,
+			dc->dc_nr_files, dc->dc_frags_before,
+			dc->dc_frags_after);
+	else
+		fprintf(stdout, "%lu of %zu files moved, %"PRIu64" fragments "
+			"-> %"PRIu64", %"PRIu64" MB in %.1f seconds (%.1f "
+			"MB/s)\n", dc->dc_moved, dc->dc_nr_files,
+			dc->dc_frags_before, dc->dc_frags_after,
+			dc->dc_bytes >> 20, secs,
+			secs > 0 ? dc->dc_bytes / secs / 1048576 : 0.0);
+	if (dc->dc_timed && dc->dc_timed_bytes)
+		fprintf(stdout, "reading them took %.1f MB/s before, %.1f "
+			"MB/s after\n",
+			dc->dc_secs_before > 0 ? dc->dc_timed_bytes /
+				dc->dc_secs_before / 1048576 : 0.0,
+			dc->dc_secs_after > 0 ? dc->dc_timed_bytes /
+				dc->dc_secs_after / 1048576 : 0.0);
+	if (dc->dc_skipped)
+		rc = 2;
+
+out:
+	teardown_io(dc);
+	if (dc->dc_fd >= 0)
+		close(dc->dc_fd);
+	cmfs_close_allocator(dc->dc_eb_ca);
+	cmfs_close_allocator(dc->dc_cluster_ca);
+	free(dc->dc_files);
+	free(dc->dc_old);
+	free(dc->dc_ebs);
+	free(dc->dc_pieces);
+	free(dc->dc_new);
+	free(dc->dc_src);
+	ret = cmfs_close(dc->dc_fs);
+	if (ret) {
+		com_err(progname, ret, "while closing \"%s\"",
+			dc->dc_devname);
+		rc = 1;
+	}
+	free(dc);
+	return rc;
+}
@@ -0,0 +1,388 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * fsck.c
+ *
+ * Offline consistency checker for CMFS.
+ *
+ * Copyright (C) 2012, Coly Li <i@coly.li>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * fsck.cmfs only checks, it never writes to the volume.
+ *
+ * Pass 1 scans every allocated inode and builds a map of the clusters
+ *        they use (see pass1.c).
+ * Pass 2 compares that map with the global bitmap.
+ * Pass 3 walks the directory tree from the root and system directories
+ *        and checks every inode is reachable with the right link count.
+ */
+
+#define _XOPEN_SOURCE 600
+#define _LARGEFILE64_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <sys/time.h>
+
+#include <cmfs/cmfs.h>
+#include "../libcmfs/cmfs_err.h"
+
+#include "fsck.h"
+
+static char *progname = "fsck.cmfs";
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-nvV] [-t threads] [-r read_kb] [-d depth]\n"
+		"       [-c cache_mb] device\n"
+		"  -n  check only (the default, fsck.cmfs never writes)\n"
+		"  -t  pass 1 worker threads (default: online cpus)\n"
+		"  -r  size of one pass 1 read in KB (default %d)\n"
+		"  -d  pass 1 reads in flight (default %d)\n"
+		"  -c  block cache size in MB for extent blocks and "
+		"directories\n"
+		"  -v  verbose\n"
+		"  -V  print version and exit\n",
+		progname, FSCK_READ_KB, FSCK_READ_DEPTH);
+	exit(FSCK_USAGE);
+}
+
+void fsck_problem(struct fsck_state *st, const char *fmt, ...)
+{
+	va_list ap;
+
+	pthread_mutex_lock(&st->fs_report_lock);
+	st->fs_problems++;
+	va_start(ap, fmt);
+	vfprintf(stdout, fmt, ap);
+	va_end(ap);
+	pthread_mutex_unlock(&st->fs_report_lock);
+}
+
+void fsck_verbose(struct fsck_state *st, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (!st->fs_verbose)
+		return;
+
+	pthread_mutex_lock(&st->fs_report_lock);
+	va_start(ap, fmt);
+	vfprintf(stdout, fmt, ap);
+	va_end(ap);
+	pthread_mutex_unlock(&st->fs_report_lock);
+}
+
+static void report_claimed(struct fsck_state *st, uint64_t first,
+			   uint64_t last, uint64_t owner)
+{
+	if (owner == FSCK_OWNER_META)
+		fsck_problem(st, "Metadata clusters %"PRIu64"-%"PRIu64" are "
+			     "multiply claimed\n", first, last);
+	else
+		fsck_problem(st, "Clusters %"PRIu64"-%"PRIu64" of inode "
+			     "%"PRIu64" are multiply claimed\n",
+			     first, last, owner);
+}
+
+void fsck_mark_clusters(struct fsck_state *st, uint64_t cpos, uint64_t len,
+			uint64_t owner)
+{
+	uint64_t c, mask, old, dup_start = 0;
+	int in_dup = 0;
+
+	if (cpos + len > st->fs_fs->fs_clusters) {
+		fsck_problem(st, "Clusters %"PRIu64"+%"PRIu64" of %s "
+			     "%"PRIu64" are past the end of the volume\n",
+			     cpos, len,
+			     owner == FSCK_OWNER_META ? "metadata" : "inode",
+			     owner);
+		if (cpos >= st->fs_fs->fs_clusters)
+			return;
+		len = st->fs_fs->fs_clusters - cpos;
+	}
+
+	for (c = cpos; c < cpos + len; c++) {
+		mask = 1ULL << (c & 63);
+		old = __sync_fetch_and_or(&st->fs_cluster_map[c >> 6], mask);
+		if (old & mask) {
+			if (!in_dup)
+				dup_start = c;
+			in_dup = 1;
+		} else if (in_dup) {
+			report_claimed(st, dup_start, c - 1, owner);
+			in_dup = 0;
+		}
+	}
+	if (in_dup)
+		report_claimed(st, dup_start, cpos + len - 1, owner);
+}
+
+int fsck_test_cluster(struct fsck_state *st, uint64_t cpos)
+{
+	return !!(st->fs_cluster_map[cpos >> 6] & (1ULL << (cpos & 63)));
+}
+
+int fsck_count_bits(const void *bitmap, int nr_bits)
+{
+	const uint8_t *p = bitmap;
+	int i, count = 0;
+
+	for (i = 0; i < nr_bits / 8; i++)
+		count += __builtin_popcount(p[i]);
+	for (i = (nr_bits / 8) * 8; i < nr_bits; i++)
+		if (p[i / 8] & (1 << (i % 8)))
+			count++;
+
+	return count;
+}
+
+struct fsck_inode *fsck_find_inode(struct fsck_state *st, uint64_t blkno)
+{
+	uint32_t lo = 0, hi = st->fs_nr_inodes, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (st->fs_inodes[mid].fi_blkno == blkno)
+			return &st->fs_inodes[mid];
+		if (st->fs_inodes[mid].fi_blkno < blkno)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return NULL;
+}
+
+static errcode_t find_system_inode(struct fsck_state *st, int type,
+				   uint64_t *blkno)
+{
+	cmfs_filesys *fs = st->fs_fs;
+	char name[CMFS_MAX_FILENAME_LEN];
+	errcode_t ret;
+
+	cmfs_sprintf_system_inode_name(name, sizeof(name), type);
+	ret = cmfs_lookup(fs, fs->fs_sysdir_blkno, name, strlen(name), NULL,
+			  blkno);
+	if (ret == CMFS_ET_FILE_NOT_FOUND) {
+		fsck_problem(st, "System file \"%s\" is missing\n", name);
+		*blkno = 0;
+		ret = 0;
+	}
+
+	return ret;
+}
+
+static double elapsed(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) +
+	       (now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+int main(int argc, char **argv)
+{
+	struct fsck_state *st;
+	cmfs_filesys *fs;
+	struct timeval start;
+	unsigned long cache_mb = 64;
+	int c, read_kb = FSCK_READ_KB, mount_flags, rc = FSCK_OK;
+	double secs;
+	errcode_t ret;
+
+	initialize_cmfs_error_table();
+
+	if (argc && *argv)
+		progname = basename(argv[0]);
+
+	st = calloc(1, sizeof(struct fsck_state));
+	if (!st) {
+		com_err(progname, CMFS_ET_NO_MEMORY,
+			"while allocating fsck state");
+		return FSCK_ERROR;
+	}
+	st->fs_read_depth = FSCK_READ_DEPTH;
+	pthread_mutex_init(&st->fs_report_lock, NULL);
+
+	while ((c = getopt(argc, argv, "nvVt:r:d:c:")) != EOF) {
+		switch (c) {
+		case 'n':
+			break;
+		case 'v':
+			st->fs_verbose = 1;
+			break;
+		case 'V':
+			fprintf(stdout, "%s %s\n", progname, VERSION);
+			exit(FSCK_OK);
+		case 't':
+			st->fs_nr_threads = atoi(optarg);
+			break;
+		case 'r':
+			read_kb = atoi(optarg);
+			break;
+		case 'd':
+			st->fs_read_depth = atoi(optarg);
+			break;
+		case 'c':
+			cache_mb = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind != argc - 1)
+		usage();
+	st->fs_devname = argv[optind];
+
+	if (st->fs_nr_threads <= 0)
+		st->fs_nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (st->fs_nr_threads <= 0)
+		st->fs_nr_threads = 1;
+	if ((read_kb <= 0) || (st->fs_read_depth <= 0))
+		usage();
+	/* Enough buffers to keep every worker and the prefetcher busy */
+	if (st->fs_read_depth < st->fs_nr_threads + 1)
+		st->fs_read_depth = st->fs_nr_threads + 1;
+
+	ret = cmfs_check_if_mounted(st->fs_devname, &mount_flags);
+	if (ret) {
+		com_err(progname, ret, "while determining whether %s is "
+			"mounted", st->fs_devname);
+		return FSCK_ERROR;
+	}
+	if (mount_flags & CMFS_MF_MOUNTED)
+		fprintf(stderr, "%s: %s is mounted, the results may be "
+			"inconsistent\n", progname, st->fs_devname);
+
+	ret = cmfs_open(st->fs_devname, CMFS_FLAG_RO | CMFS_FLAG_THREADED,
+			0, CMFS_MAX_BLOCKSIZE, &st->fs_fs);
+	if (ret) {
+		com_err(progname, ret, "while opening \"%s\"",
+			st->fs_devname);
+		return FSCK_ERROR;
+	}
+	fs = st->fs_fs;
+
+	st->fs_read_blocks = (read_kb * 1024) / fs->fs_blocksize;
+	if (!st->fs_read_blocks)
+		st->fs_read_blocks = 1;
+
+	if (cache_mb) {
+		ret = io_init_cache_size(fs->fs_io, cache_mb * 1024 * 1024);
+		if (ret) {
+			com_err(progname, ret, "while creating a %luMB cache",
+				cache_mb);
+			rc = FSCK_ERROR;
+			goto out;
+		}
+	}
+
+	ret = cmfs_malloc0(((fs->fs_clusters + 63) / 64) * sizeof(uint64_t),
+			   &st->fs_cluster_map);
+	if (ret) {
+		com_err(progname, ret, "while allocating the cluster map");
+		rc = FSCK_ERROR;
+		goto out;
+	}
+
+	fprintf(stdout, "Checking %s: %u clusters of %u bytes, uuid %s\n",
+		st->fs_devname, fs->fs_clusters, fs->fs_clustersize,
+		fs->uuid_str);
+
+	ret = find_system_inode(st, GLOBAL_BITMAP_SYSTEM_INODE,
+				&st->fs_bitmap_blkno);
+	if (!ret)
+		ret = find_system_inode(st, GLOBAL_INODE_ALLOC_SYSTEM_INODE,
+					&st->fs_inode_alloc_blkno[0]);
+	if (!ret)
+		ret = find_system_inode(st, INODE_ALLOC_SYSTEM_INODE,
+					&st->fs_inode_alloc_blkno[1]);
+	if (!ret)
+		ret = find_system_inode(st, EXTENT_ALLOC_SYSTEM_INODE,
+					&st->fs_extent_alloc_blkno);
+	if (ret) {
+		com_err(progname, ret, "while reading the system directory");
+		rc = FSCK_ERROR;
+		goto out;
+	}
+
+	gettimeofday(&start, NULL);
+	fprintf(stdout, "Pass 1: Checking inodes and extent trees "
+		"(%d threads, %uKB reads)\n", st->fs_nr_threads,
+		st->fs_read_blocks * fs->fs_blocksize / 1024);
+	ret = fsck_pass1(st);
+	if (ret) {
+		com_err(progname, ret, "during pass 1");
+		rc = FSCK_ERROR;
+		goto out;
+	}
+	secs = elapsed(&start);
+	fsck_verbose(st, "Pass 1: %u inodes, %"PRIu64" extent blocks, "
+		     "%"PRIu64" MB in %.2fs (%.1f MB/s)\n",
+		     st->fs_nr_inodes, st->fs_nr_eblocks,
+		     st->fs_bytes_scanned >> 20, secs,
+		     secs > 0 ? (st->fs_bytes_scanned >> 20) / secs : 0);
+
+	fprintf(stdout, "Pass 2: Checking cluster allocation\n");
+	ret = fsck_pass2(st);
+	if (ret) {
+		com_err(progname, ret, "during pass 2");
+		rc = FSCK_ERROR;
+		goto out;
+	}
+
+	fprintf(stdout, "Pass 3: Checking directory connectivity\n");
+	ret = fsck_pass3(st);
+	if (ret) {
+		com_err(progname, ret, "during pass 3");
+		rc = FSCK_ERROR;
+		goto out;
+	}
+
+	fprintf(stdout, "%s: %u inodes (%"PRIu64" directories, %"PRIu64
+		" files), %"PRIu64" of %u clusters used, %.2fs\n",
+		st->fs_devname, st->fs_nr_inodes, st->fs_nr_dirs,
+		st->fs_nr_regs, st->fs_used_clusters, fs->fs_clusters,
+		elapsed(&start));
+
+	if (st->fs_problems) {
+		fprintf(stdout, "%s: %lu problems found, nothing was "
+			"changed\n", st->fs_devname, st->fs_problems);
+		rc = FSCK_UNCORRECTED;
+	} else
+		fprintf(stdout, "%s: clean\n", st->fs_devname);
+
+out:
+	if (st->fs_cluster_map)
+		cmfs_free(&st->fs_cluster_map);
+	free(st->fs_inodes);
+	cmfs_close(fs);
+	pthread_mutex_destroy(&st->fs_report_lock);
+	free(st);
+	return rc;
+}
@@ -0,0 +1,119 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * fsck.h
+ *
+ * Shared state and prototypes for fsck.cmfs.
+ *
+ * Copyright (C) 2012, Coly Li <i@coly.li>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __FSCK_H__
+#define __FSCK_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <cmfs/cmfs.h>
+
+/* Exit codes, as e2fsck and fsck.ocfs2 */
+#define FSCK_OK			0
+#define FSCK_UNCORRECTED	4
+#define FSCK_ERROR		8
+#define FSCK_USAGE		16
+
+/* Default size of one pass 1 read, and how many may be in flight */
+#define FSCK_READ_KB		1024
+#define FSCK_READ_DEPTH		8
+
+/* Who claimed a cluster, for the multiply claimed reports */
+#define FSCK_OWNER_META		0	/* superblock, group descriptors */
+
+/* Everything pass 1 learns about an inode that later passes need */
+struct fsck_inode {
+	uint64_t fi_blkno;
+	uint16_t fi_mode;
+	uint16_t fi_links;	/* i_links_count on disk */
+	uint32_t fi_refs;	/* directory entries found by pass 3 */
+};
+
+/* A growable array of fsck_inode, one per pass 1 worker */
+struct fsck_inode_list {
+	struct fsck_inode *il_inodes;
+	uint32_t il_nr;
+	uint32_t il_alloc;
+};
+
+struct fsck_state {
+	cmfs_filesys *fs_fs;
+	const char *fs_devname;
+	int fs_verbose;
+
+	/* pass 1 pipeline tuning */
+	int fs_nr_threads;
+	uint32_t fs_read_blocks;	/* blocks per prefetch read */
+	int fs_read_depth;		/* reads in flight */
+
+	/* system files */
+	uint64_t fs_bitmap_blkno;	/* global_bitmap */
+	uint64_t fs_inode_alloc_blkno[2];	/* global and slot inode_alloc */
+	uint64_t fs_extent_alloc_blkno;
+
+	/*
+	 * Clusters found in use by pass 1, one bit per cluster.  Set
+	 * with atomic fetch-or from all the workers at once.
+	 */
+	uint64_t *fs_cluster_map;
+
+	/* Merged and sorted by fi_blkno after pass 1 */
+	struct fsck_inode *fs_inodes;
+	uint32_t fs_nr_inodes;
+
+	/* Number of problems found, updated under fs_report_lock */
+	pthread_mutex_t fs_report_lock;
+	unsigned long fs_problems;
+
+	/* Totals for the summary */
+	uint64_t fs_used_clusters;
+	uint64_t fs_nr_dirs;
+	uint64_t fs_nr_regs;
+	uint64_t fs_nr_eblocks;
+	uint64_t fs_bytes_scanned;
+};
+
+void fsck_problem(struct fsck_state *st, const char *fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+void fsck_verbose(struct fsck_state *st, const char *fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+
+/*
+ * Mark clusters [cpos, cpos + len) in use for owner (an inode blkno or
+ * FSCK_OWNER_META).  Any cluster that was already set is reported as
+ * multiply claimed.  Safe to call from several threads.
+ */
+void fsck_mark_clusters(struct fsck_state *st, uint64_t cpos, uint64_t len,
+			uint64_t owner);
+int fsck_test_cluster(struct fsck_state *st, uint64_t cpos);
+
+int fsck_count_bits(const void *bitmap, int nr_bits);
+struct fsck_inode *fsck_find_inode(struct fsck_state *st, uint64_t blkno);
+
+errcode_t fsck_pass1(struct fsck_state *st);
+errcode_t fsck_pass2(struct fsck_state *st);
+errcode_t fsck_pass3(struct fsck_state *st);
+
+#endif  /* __FSCK_H__ */
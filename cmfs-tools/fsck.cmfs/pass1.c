@@ -0,0 +1,676 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * pass1.c
+ *
+ * Pass 1 of fsck.cmfs: scan every allocated inode.
+ *
+ * Copyright (C) 2012, Coly Li <i@coly.li>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Pass 1 is a pipeline.  The calling thread is the prefetcher: it walks
+ * the chains of every sub allocator, marks the clusters of each group
+ * in use, and for the inode allocators reads the allocated part of
+ * each group with large uncached reads (fs_read_blocks blocks each).
+ * The filled buffers are queued to fs_nr_threads workers, which check
+ * the dinodes and walk their extent trees, marking data clusters in
+ * the shared cluster map.  At most fs_read_depth buffers exist, so the
+ * prefetcher sleeps when the workers fall behind and vice versa.
+ *
+ * For a volume of large files the extent trees are small and the scan
+ * is bound by how fast the inode groups stream off the disk.
+ */
+
+#define _XOPEN_SOURCE 600
+#define _LARGEFILE64_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+
+#include <cmfs/cmfs.h>
+#include <cmfs/bitops.h>
+#include "../libcmfs/cmfs_err.h"
+
+#include "fsck.h"
+
+struct pass1_batch {
+	uint64_t pb_blkno;		/* first block of the read */
+	int pb_count;			/* blocks read */
+	uint64_t pb_group;		/* blkno of the group descriptor */
+	uint8_t *pb_bitmap;		/* which of the blocks are allocated */
+	char *pb_buf;
+};
+
+struct pass1_worker {
+	struct pass1_ctxt *pw_ctxt;
+	pthread_t pw_thread;
+	struct fsck_inode_list pw_list;
+	uint64_t pw_nr_dirs;
+	uint64_t pw_nr_regs;
+	uint64_t pw_nr_eblocks;
+	errcode_t pw_ret;
+};
+
+struct pass1_ctxt {
+	struct fsck_state *pc_st;
+
+	pthread_mutex_t pc_lock;
+	pthread_cond_t pc_filled;	/* a batch was queued */
+	pthread_cond_t pc_freed;	/* a batch was handed back */
+	struct pass1_batch *pc_batches;
+	struct pass1_batch **pc_free;
+	int pc_nr_free;
+	struct pass1_batch **pc_queue;	/* FIFO of fs_read_depth slots */
+	int pc_head;
+	int pc_nr_queued;
+	int pc_done;
+
+	struct pass1_worker *pc_workers;
+};
+
+static struct pass1_batch *pass1_get_free(struct pass1_ctxt *pc)
+{
+	struct pass1_batch *pb;
+
+	pthread_mutex_lock(&pc->pc_lock);
+	while (!pc->pc_nr_free)
+		pthread_cond_wait(&pc->pc_freed, &pc->pc_lock);
+	pb = pc->pc_free[--pc->pc_nr_free];
+	pthread_mutex_unlock(&pc->pc_lock);
+
+	return pb;
+}
+
+static void pass1_put_free(struct pass1_ctxt *pc, struct pass1_batch *pb)
+{
+	pthread_mutex_lock(&pc->pc_lock);
+	pc->pc_free[pc->pc_nr_free++] = pb;
+	pthread_cond_signal(&pc->pc_freed);
+	pthread_mutex_unlock(&pc->pc_lock);
+}
+
+static void pass1_queue(struct pass1_ctxt *pc, struct pass1_batch *pb)
+{
+	int depth = pc->pc_st->fs_read_depth;
+
+	pthread_mutex_lock(&pc->pc_lock);
+	pc->pc_queue[(pc->pc_head + pc->pc_nr_queued) % depth] = pb;
+	pc->pc_nr_queued++;
+	pthread_cond_signal(&pc->pc_filled);
+	pthread_mutex_unlock(&pc->pc_lock);
+}
+
+/* Returns NULL once the prefetcher is done and the queue is drained */
+static struct pass1_batch *pass1_dequeue(struct pass1_ctxt *pc)
+{
+	struct pass1_batch *pb = NULL;
+
+	pthread_mutex_lock(&pc->pc_lock);
+	while (!pc->pc_nr_queued && !pc->pc_done)
+		pthread_cond_wait(&pc->pc_filled, &pc->pc_lock);
+	if (pc->pc_nr_queued) {
+		pb = pc->pc_queue[pc->pc_head];
+		pc->pc_head = (pc->pc_head + 1) % pc->pc_st->fs_read_depth;
+		pc->pc_nr_queued--;
+	}
+	pthread_mutex_unlock(&pc->pc_lock);
+
+	return pb;
+}
+
+static errcode_t pass1_add_inode(struct fsck_inode_list *il,
+				 struct cmfs_dinode *di)
+{
+	errcode_t ret;
+	struct fsck_inode *fi;
+
+	if (il->il_nr == il->il_alloc) {
+		il->il_alloc = il->il_alloc ? il->il_alloc * 2 : 1024;
+		fi = realloc(il->il_inodes,
+			     il->il_alloc * sizeof(struct fsck_inode));
+		if (!fi) {
+			ret = CMFS_ET_NO_MEMORY;
+			return ret;
+		}
+		il->il_inodes = fi;
+	}
+
+	fi = &il->il_inodes[il->il_nr++];
+	fi->fi_blkno = di->i_blkno;
+	fi->fi_mode = di->i_mode;
+	fi->fi_links = di->i_links_count;
+	fi->fi_refs = 0;
+
+	return 0;
+}
+
+static void pass1_check_extent_list(struct pass1_worker *pw,
+				    uint64_t ino,
+				    struct cmfs_extent_list *el,
+				    int max_recs,
+				    int depth,
+				    uint64_t *clusters)
+{
+	struct fsck_state *st = pw->pw_ctxt->pc_st;
+	cmfs_filesys *fs = st->fs_fs;
+	struct cmfs_extent_rec *rec;
+	struct cmfs_extent_block *eb;
+	char *buf = NULL;
+	uint64_t cpos, end;
+	errcode_t ret;
+	int i;
+
+	if ((el->l_count > max_recs) ||
+	    (el->l_next_free_rec > el->l_count)) {
+		fsck_problem(st, "Inode %"PRIu64" has an extent list with "
+			     "%u of %u records in use, at most %d fit\n",
+			     ino, el->l_next_free_rec, el->l_count, max_recs);
+		return;
+	}
+
+	if ((depth >= 0) && (el->l_tree_depth != depth)) {
+		fsck_problem(st, "Inode %"PRIu64" has an extent list at "
+			     "depth %u where %d was expected\n",
+			     ino, el->l_tree_depth, depth);
+		return;
+	}
+
+	if (el->l_tree_depth) {
+		ret = cmfs_malloc_block(fs->fs_io, &buf);
+		if (ret) {
+			pw->pw_ret = ret;
+			return;
+		}
+	}
+
+	for (i = 0; i < el->l_next_free_rec; i++) {
+		rec = &el->l_recs[i];
+
+		if (i && (rec->e_cpos < el->l_recs[i - 1].e_cpos))
+			fsck_problem(st, "Inode %"PRIu64" extent %d at "
+				     "cpos %"PRIu64" is out of order\n",
+				     ino, i, (uint64_t)rec->e_cpos);
+
+		if (el->l_tree_depth) {
+			ret = cmfs_read_extent_block(fs, rec->e_blkno, buf);
+			if (ret) {
+				fsck_problem(st, "Inode %"PRIu64" extent block "
+					     "%"PRIu64" can't be read: %s\n",
+					     ino, (uint64_t)rec->e_blkno,
+					     error_message(ret));
+				continue;
+			}
+
+			eb = (struct cmfs_extent_block *)buf;
+			if (eb->h_blkno != rec->e_blkno) {
+				fsck_problem(st, "Extent block %"PRIu64" of "
+					     "inode %"PRIu64" claims to be at "
+					     "%"PRIu64"\n",
+					     (uint64_t)rec->e_blkno, ino,
+					     (uint64_t)eb->h_blkno);
+				continue;
+			}
+
+			pw->pw_nr_eblocks++;
+			pass1_check_extent_list(pw, ino, &eb->h_list,
+					cmfs_extent_recs_per_eb(fs->fs_blocksize),
+					el->l_tree_depth - 1, clusters);
+			continue;
+		}
+
+		if (!rec->e_leaf_blocks ||
+		    (rec->e_blkno <= CMFS_SUPER_BLOCK_BLKNO) ||
+		    (rec->e_blkno + rec->e_leaf_blocks > fs->fs_blocks)) {
+			fsck_problem(st, "Inode %"PRIu64" extent %d covers "
+				     "blocks %"PRIu64"+%u, outside the volume\n",
+				     ino, i, (uint64_t)rec->e_blkno,
+				     rec->e_leaf_blocks);
+			continue;
+		}
+
+		cpos = cmfs_blocks_to_clusters(fs, rec->e_blkno);
+		end = cmfs_blocks_to_clusters(fs, rec->e_blkno +
+					      rec->e_leaf_blocks - 1);
+		fsck_mark_clusters(st, cpos, end - cpos + 1, ino);
+		*clusters += end - cpos + 1;
+	}
+
+	if (buf)
+		cmfs_free(&buf);
+}
+
+static void pass1_check_inode(struct pass1_worker *pw, char *buf,
+			      uint64_t blkno, uint64_t group)
+{
+	struct fsck_state *st = pw->pw_ctxt->pc_st;
+	cmfs_filesys *fs = st->fs_fs;
+	struct cmfs_dinode *di = (struct cmfs_dinode *)buf;
+	uint64_t clusters = 0;
+	errcode_t ret;
+
+	if (memcmp(di->i_signature, CMFS_INODE_SIGNATURE,
+		   strlen(CMFS_INODE_SIGNATURE))) {
+		fsck_problem(st, "Inode %"PRIu64" is allocated but has a "
+			     "bad signature\n", blkno);
+		return;
+	}
+
+	if (cmfs_meta_ecc(CMFS_RAW_SB(fs->fs_super))) {
+		ret = cmfs_validate_meta_ecc(fs, buf, &di->i_check);
+		if (ret)
+			fsck_problem(st, "Inode %"PRIu64" fails its "
+				     "checksum\n", blkno);
+	}
+
+	cmfs_swap_inode_to_cpu(fs, di);
+
+	if (di->i_blkno != blkno) {
+		fsck_problem(st, "Inode %"PRIu64" claims to be at block "
+			     "%"PRIu64"\n", blkno, (uint64_t)di->i_blkno);
+		return;
+	}
+	if (!(di->i_flags & CMFS_VALID_FL)) {
+		fsck_problem(st, "Inode %"PRIu64" is allocated but not "
+			     "marked valid\n", blkno);
+		return;
+	}
+	if (di->i_suballoc_bit != blkno - group)
+		fsck_problem(st, "Inode %"PRIu64" records suballoc bit %u, "
+			     "it is bit %"PRIu64" of group %"PRIu64"\n",
+			     blkno, di->i_suballoc_bit, blkno - group, group);
+
+	ret = pass1_add_inode(&pw->pw_list, di);
+	if (ret) {
+		pw->pw_ret = ret;
+		return;
+	}
+
+	if (S_ISDIR(di->i_mode))
+		pw->pw_nr_dirs++;
+	else if (S_ISREG(di->i_mode))
+		pw->pw_nr_regs++;
+
+	/*
+	 * Allocator groups are marked by the prefetcher, the global
+	 * bitmap is pass 2's business.  Neither has an extent list.
+	 */
+	if (di->i_flags & (CMFS_SUPER_BLOCK_FL | CMFS_LOCAL_ALLOC_FL |
+			   CMFS_CHAIN_FL | CMFS_DEALLOC_FL))
+		return;
+	if (di->i_dyn_features & CMFS_INLINE_DATA_FL)
+		return;
+
+	pass1_check_extent_list(pw, blkno, &di->id2.i_list,
+				cmfs_extent_recs_per_inode(fs->fs_blocksize),
+				-1, &clusters);
+
+	if (clusters != di->i_clusters)
+		fsck_problem(st, "Inode %"PRIu64" has %"PRIu64" clusters "
+			     "in its extents but i_clusters is %u\n",
+			     blkno, clusters, di->i_clusters);
+}
+
+static void *pass1_worker_thread(void *arg)
+{
+	struct pass1_worker *pw = arg;
+	struct pass1_ctxt *pc = pw->pw_ctxt;
+	unsigned int blocksize = pc->pc_st->fs_fs->fs_blocksize;
+	struct pass1_batch *pb;
+	int i;
+
+	while ((pb = pass1_dequeue(pc)) != NULL) {
+		for (i = 0; i < pb->pb_count; i++) {
+			if (!cmfs_test_bit(i, pb->pb_bitmap))
+				continue;
+			pass1_check_inode(pw, pb->pb_buf + i * blocksize,
+					  pb->pb_blkno + i, pb->pb_group);
+		}
+		pass1_put_free(pc, pb);
+	}
+
+	return NULL;
+}
+
+/*
+ * Queue the allocated inodes of one group, one read per window of
+ * fs_read_blocks blocks.  Each read spans from the first to the last
+ * allocated block of its window, so a full group is read with a few
+ * large sequential I/Os and an empty one is not read at all.
+ */
+static errcode_t pass1_queue_group(struct pass1_ctxt *pc,
+				   struct cmfs_group_desc *gd)
+{
+	struct fsck_state *st = pc->pc_st;
+	cmfs_filesys *fs = st->fs_fs;
+	struct pass1_batch *pb;
+	int start, end, first, last, i;
+	errcode_t ret;
+
+	/* Bit 0 is the descriptor itself */
+	for (start = 1; start < gd->bg_bits; start += st->fs_read_blocks) {
+		end = start + st->fs_read_blocks;
+		if (end > gd->bg_bits)
+			end = gd->bg_bits;
+
+		first = cmfs_find_next_bit_set(gd->bg_bitmap, end, start);
+		if (first >= end)
+			continue;
+		for (last = end - 1; last > first; last--)
+			if (cmfs_test_bit(last, gd->bg_bitmap))
+				break;
+
+		pb = pass1_get_free(pc);
+		pb->pb_blkno = gd->bg_blkno + first;
+		pb->pb_count = last - first + 1;
+		pb->pb_group = gd->bg_blkno;
+		memset(pb->pb_bitmap, 0, (st->fs_read_blocks + 7) / 8);
+		for (i = first; i <= last; i++)
+			if (cmfs_test_bit(i, gd->bg_bitmap))
+				cmfs_set_bit(i - first, pb->pb_bitmap);
+
+		ret = io_read_block_nocache(fs->fs_io, pb->pb_blkno,
+					    pb->pb_count, pb->pb_buf);
+		if (ret) {
+			fsck_problem(st, "Unable to read inode blocks "
+				     "%"PRIu64"+%d: %s\n", pb->pb_blkno,
+				     pb->pb_count, error_message(ret));
+			pass1_put_free(pc, pb);
+			continue;
+		}
+		st->fs_bytes_scanned += (uint64_t)pb->pb_count * fs->fs_blocksize;
+
+		pass1_queue(pc, pb);
+	}
+
+	return 0;
+}
+
+/*
+ * Walk every chain of a sub allocator, check the group descriptors
+ * and their free counts, and mark the clusters of the groups in use.
+ * For an inode allocator, also queue the inode blocks to the workers.
+ */
+static errcode_t pass1_scan_allocator(struct pass1_ctxt *pc,
+				      uint64_t alloc_blkno,
+				      int inodes)
+{
+	struct fsck_state *st = pc->pc_st;
+	cmfs_filesys *fs = st->fs_fs;
+	struct cmfs_dinode *di;
+	struct cmfs_chain_list *cl;
+	struct cmfs_group_desc *gd;
+	char *di_buf = NULL, *gd_buf = NULL;
+	uint64_t gd_blkno, used = 0, total = 0, nr_groups;
+	uint32_t bpc;
+	int i, free_bits;
+	errcode_t ret;
+
+	ret = cmfs_malloc_block(fs->fs_io, &di_buf);
+	if (ret)
+		goto out;
+	ret = cmfs_malloc_block(fs->fs_io, &gd_buf);
+	if (ret)
+		goto out;
+
+	ret = cmfs_read_inode(fs, alloc_blkno, di_buf);
+	if (ret)
+		goto out;
+
+	di = (struct cmfs_dinode *)di_buf;
+	cl = &di->id2.i_chain;
+	if (!(di->i_flags & CMFS_CHAIN_FL) ||
+	    (cl->cl_next_free_rec > cl->cl_count) ||
+	    (cl->cl_count > cmfs_chain_recs_per_inode(fs->fs_blocksize))) {
+		fsck_problem(st, "Allocator %"PRIu64" has a corrupt chain "
+			     "list, its groups can't be checked\n",
+			     alloc_blkno);
+		goto out;
+	}
+
+	ret = cmfs_prefetch_group_descs(fs, di);
+	if (ret)
+		goto out;
+
+	bpc = cl->cl_bpc ? cl->cl_bpc : 1;
+	gd = (struct cmfs_group_desc *)gd_buf;
+	for (i = 0; i < cl->cl_next_free_rec; i++) {
+		nr_groups = 0;
+		for (gd_blkno = cl->cl_recs[i].c_blkno; gd_blkno;
+		     gd_blkno = gd->bg_next_group) {
+			/* A chain can't have more groups than clusters */
+			if (++nr_groups > fs->fs_clusters) {
+				fsck_problem(st, "Chain %d of allocator "
+					     "%"PRIu64" loops\n",
+					     i, alloc_blkno);
+				break;
+			}
+
+			ret = cmfs_read_group_desc(fs, gd_blkno, gd_buf);
+			if (ret) {
+				fsck_problem(st, "Group %"PRIu64" in chain %d "
+					     "of allocator %"PRIu64" can't be "
+					     "read: %s\n", gd_blkno, i,
+					     alloc_blkno, error_message(ret));
+				break;
+			}
+
+			if ((gd->bg_blkno != gd_blkno) ||
+			    (gd->bg_parent_dinode != alloc_blkno) ||
+			    (gd->bg_chain != i) ||
+			    (gd->bg_bits > gd->bg_size * 8)) {
+				fsck_problem(st, "Group %"PRIu64" doesn't "
+					     "belong to chain %d of allocator "
+					     "%"PRIu64"\n",
+					     gd_blkno, i, alloc_blkno);
+				break;
+			}
+
+			free_bits = gd->bg_bits -
+				    fsck_count_bits(gd->bg_bitmap,
+						    gd->bg_bits);
+			if (free_bits != gd->bg_free_bits_count)
+				fsck_problem(st, "Group %"PRIu64" has %d free "
+					     "bits but records %u\n",
+					     gd_blkno, free_bits,
+					     gd->bg_free_bits_count);
+			used += gd->bg_bits - free_bits;
+			total += gd->bg_bits;
+
+			fsck_mark_clusters(st,
+				cmfs_blocks_to_clusters(fs, gd_blkno),
+				(gd->bg_bits + bpc - 1) / bpc, alloc_blkno);
+
+			if (inodes) {
+				ret = pass1_queue_group(pc, gd);
+				if (ret)
+					goto out;
+			}
+		}
+	}
+
+	if ((used != di->id1.bitmap1.i_used) ||
+	    (total != di->id1.bitmap1.i_total))
+		fsck_problem(st, "Allocator %"PRIu64" records %u of %u bits "
+			     "used, its groups have %"PRIu64" of %"PRIu64"\n",
+			     alloc_blkno, di->id1.bitmap1.i_used,
+			     di->id1.bitmap1.i_total, used, total);
+
+out:
+	if (gd_buf)
+		cmfs_free(&gd_buf);
+	if (di_buf)
+		cmfs_free(&di_buf);
+	return ret;
+}
+
+static int fsck_inode_cmp(const void *a, const void *b)
+{
+	const struct fsck_inode *fa = a, *fb = b;
+
+	if (fa->fi_blkno < fb->fi_blkno)
+		return -1;
+	if (fa->fi_blkno > fb->fi_blkno)
+		return 1;
+	return 0;
+}
+
+/* Gather the per-worker inode lists into one sorted array */
+static errcode_t pass1_merge(struct pass1_ctxt *pc)
+{
+	struct fsck_state *st = pc->pc_st;
+	struct pass1_worker *pw;
+	uint32_t nr = 0;
+	int i;
+
+	for (i = 0; i < st->fs_nr_threads; i++)
+		nr += pc->pc_workers[i].pw_list.il_nr;
+
+	st->fs_inodes = malloc((nr ? nr : 1) * sizeof(struct fsck_inode));
+	if (!st->fs_inodes)
+		return CMFS_ET_NO_MEMORY;
+
+	for (i = 0; i < st->fs_nr_threads; i++) {
+		pw = &pc->pc_workers[i];
+		memcpy(st->fs_inodes + st->fs_nr_inodes,
+		       pw->pw_list.il_inodes,
+		       pw->pw_list.il_nr * sizeof(struct fsck_inode));
+		st->fs_nr_inodes += pw->pw_list.il_nr;
+		st->fs_nr_dirs += pw->pw_nr_dirs;
+		st->fs_nr_regs += pw->pw_nr_regs;
+		st->fs_nr_eblocks += pw->pw_nr_eblocks;
+	}
+
+	qsort(st->fs_inodes, st->fs_nr_inodes, sizeof(struct fsck_inode),
+	      fsck_inode_cmp);
+
+	return 0;
+}
+
+errcode_t fsck_pass1(struct fsck_state *st)
+{
+	cmfs_filesys *fs = st->fs_fs;
+	struct pass1_ctxt pc;
+	struct pass1_batch *pb;
+	errcode_t ret;
+	int i, started = 0;
+
+	memset(&pc, 0, sizeof(pc));
+	pc.pc_st = st;
+	pthread_mutex_init(&pc.pc_lock, NULL);
+	pthread_cond_init(&pc.pc_filled, NULL);
+	pthread_cond_init(&pc.pc_freed, NULL);
+
+	ret = cmfs_malloc0(st->fs_read_depth * sizeof(struct pass1_batch),
+			   &pc.pc_batches);
+	if (ret)
+		goto out;
+	ret = cmfs_malloc0(st->fs_read_depth * sizeof(struct pass1_batch *),
+			   &pc.pc_free);
+	if (ret)
+		goto out;
+	ret = cmfs_malloc0(st->fs_read_depth * sizeof(struct pass1_batch *),
+			   &pc.pc_queue);
+	if (ret)
+		goto out;
+	ret = cmfs_malloc0(st->fs_nr_threads * sizeof(struct pass1_worker),
+			   &pc.pc_workers);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < st->fs_read_depth; i++) {
+		pb = &pc.pc_batches[i];
+		ret = cmfs_malloc_blocks(fs->fs_io, st->fs_read_blocks,
+					 &pb->pb_buf);
+		if (ret)
+			goto out;
+		ret = cmfs_malloc0((st->fs_read_blocks + 7) / 8,
+				   &pb->pb_bitmap);
+		if (ret)
+			goto out;
+		pc.pc_free[pc.pc_nr_free++] = pb;
+	}
+
+	/*
+	 * The superblock and what precedes it.  The descriptor of the
+	 * first global bitmap group is marked by pass 2 with the others.
+	 */
+	fsck_mark_clusters(st, 0,
+			   cmfs_blocks_to_clusters(fs, CMFS_SUPER_BLOCK_BLKNO) + 1,
+			   FSCK_OWNER_META);
+
+	for (i = 0; i < st->fs_nr_threads; i++) {
+		pc.pc_workers[i].pw_ctxt = &pc;
+		if (pthread_create(&pc.pc_workers[i].pw_thread, NULL,
+				   pass1_worker_thread, &pc.pc_workers[i])) {
+			ret = CMFS_ET_INTERNAL_FAILURE;
+			break;
+		}
+		started++;
+	}
+
+	for (i = 0; !ret && (i < 2); i++) {
+		if (!st->fs_inode_alloc_blkno[i])
+			continue;
+		ret = pass1_scan_allocator(&pc, st->fs_inode_alloc_blkno[i], 1);
+	}
+	if (!ret && st->fs_extent_alloc_blkno)
+		ret = pass1_scan_allocator(&pc, st->fs_extent_alloc_blkno, 0);
+
+	pthread_mutex_lock(&pc.pc_lock);
+	pc.pc_done = 1;
+	pthread_cond_broadcast(&pc.pc_filled);
+	pthread_mutex_unlock(&pc.pc_lock);
+
+	for (i = 0; i < started; i++) {
+		pthread_join(pc.pc_workers[i].pw_thread, NULL);
+		if (!ret)
+			ret = pc.pc_workers[i].pw_ret;
+	}
+	if (ret)
+		goto out;
+
+	ret = pass1_merge(&pc);
+
+out:
+	if (pc.pc_workers) {
+		for (i = 0; i < st->fs_nr_threads; i++)
+			free(pc.pc_workers[i].pw_list.il_inodes);
+		cmfs_free(&pc.pc_workers);
+	}
+	if (pc.pc_batches) {
+		for (i = 0; i < st->fs_read_depth; i++) {
+			if (pc.pc_batches[i].pb_buf)
+				cmfs_free(&pc.pc_batches[i].pb_buf);
+			if (pc.pc_batches[i].pb_bitmap)
+				cmfs_free(&pc.pc_batches[i].pb_bitmap);
+		}
+		cmfs_free(&pc.pc_batches);
+	}
+	if (pc.pc_free)
+		cmfs_free(&pc.pc_free);
+	if (pc.pc_queue)
+		cmfs_free(&pc.pc_queue);
+	pthread_cond_destroy(&pc.pc_freed);
+	pthread_cond_destroy(&pc.pc_filled);
+	pthread_mutex_destroy(&pc.pc_lock);
+
+	return ret;
+}
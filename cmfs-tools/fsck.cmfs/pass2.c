@@ -0,0 +1,237 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * pass2.c
+ *
+ * Pass 2 of fsck.cmfs: compare the clusters found in use by pass 1
+ * with the global bitmap.
+ *
+ * Copyright (C) 2012, Coly Li <i@coly.li>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#define _XOPEN_SOURCE 600
+#define _LARGEFILE64_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <cmfs/cmfs.h>
+#include <cmfs/bitops.h>
+#include "../libcmfs/cmfs_err.h"
+
+#include "fsck.h"
+
+/* Report runs of mismatched clusters rather than every single one */
+struct pass2_run {
+	int pr_state;		/* 0 none, 1 used but free, 2 free but used */
+	uint64_t pr_start;
+};
+
+static void pass2_flush(struct fsck_state *st, struct pass2_run *run,
+			uint64_t end)
+{
+	if (run->pr_state == 1)
+		fsck_problem(st, "Clusters %"PRIu64"-%"PRIu64" are in use but "
+			     "marked free in the global bitmap\n",
+			     run->pr_start, end - 1);
+	else if (run->pr_state == 2)
+		fsck_problem(st, "Clusters %"PRIu64"-%"PRIu64" are marked in "
+			     "use in the global bitmap but nothing uses "
+			     "them\n", run->pr_start, end - 1);
+	run->pr_state = 0;
+}
+
+static void pass2_check_group(struct fsck_state *st,
+			      struct cmfs_group_desc *gd,
+			      uint16_t cpg,
+			      struct pass2_run *run,
+			      uint8_t *seen)
+{
+	cmfs_filesys *fs = st->fs_fs;
+	uint64_t base, cpos;
+	int bit, on_disk, in_use, state;
+
+	/*
+	 * Groups start every cpg clusters.  Bit 0 of the first group is
+	 * cluster 0 and its descriptor sits after the superblock, every
+	 * other group starts with its descriptor.
+	 */
+	base = cmfs_blocks_to_clusters(fs, gd->bg_blkno);
+	fsck_mark_clusters(st, base, 1, FSCK_OWNER_META);
+	base -= base % cpg;
+
+	if (base + gd->bg_bits > fs->fs_clusters) {
+		fsck_problem(st, "Group %"PRIu64" covers clusters past the "
+			     "end of the volume\n", (uint64_t)gd->bg_blkno);
+		return;
+	}
+
+	for (bit = 0; bit < gd->bg_bits; bit++) {
+		cpos = base + bit;
+		if (seen[cpos >> 3] & (1 << (cpos & 7))) {
+			fsck_problem(st, "Cluster %"PRIu64" is covered by more "
+				     "than one group\n", cpos);
+			continue;
+		}
+		seen[cpos >> 3] |= 1 << (cpos & 7);
+
+		on_disk = cmfs_test_bit(bit, gd->bg_bitmap);
+		in_use = fsck_test_cluster(st, cpos);
+		if (in_use)
+			st->fs_used_clusters++;
+
+		state = 0;
+		if (in_use && !on_disk)
+			state = 1;
+		else if (!in_use && on_disk)
+			state = 2;
+
+		if (state != run->pr_state) {
+			pass2_flush(st, run, cpos);
+			run->pr_state = state;
+			run->pr_start = cpos;
+		}
+	}
+	pass2_flush(st, run, base + gd->bg_bits);
+}
+
+errcode_t fsck_pass2(struct fsck_state *st)
+{
+	cmfs_filesys *fs = st->fs_fs;
+	struct cmfs_dinode *di;
+	struct cmfs_chain_list *cl;
+	struct cmfs_group_desc *gd;
+	struct pass2_run run = { 0, 0 };
+	char *di_buf = NULL, *gd_buf = NULL;
+	uint8_t *seen = NULL;
+	uint64_t gd_blkno, cpos, end, used = 0, total = 0, nr_groups;
+	int i, free_bits;
+	errcode_t ret;
+
+	if (!st->fs_bitmap_blkno)
+		return 0;
+
+	ret = cmfs_malloc_block(fs->fs_io, &di_buf);
+	if (ret)
+		goto out;
+	ret = cmfs_malloc_block(fs->fs_io, &gd_buf);
+	if (ret)
+		goto out;
+	/* Which clusters some group covers, to find holes and overlaps */
+	ret = cmfs_malloc0((fs->fs_clusters + 7) / 8, &seen);
+	if (ret)
+		goto out;
+
+	ret = cmfs_read_inode(fs, st->fs_bitmap_blkno, di_buf);
+	if (ret)
+		goto out;
+
+	di = (struct cmfs_dinode *)di_buf;
+	cl = &di->id2.i_chain;
+	if (!cl->cl_cpg || (cl->cl_next_free_rec > cl->cl_count) ||
+	    (cl->cl_count > cmfs_chain_recs_per_inode(fs->fs_blocksize))) {
+		fsck_problem(st, "The global bitmap has a corrupt chain "
+			     "list\n");
+		goto out;
+	}
+
+	ret = cmfs_prefetch_group_descs(fs, di);
+	if (ret)
+		goto out;
+
+	gd = (struct cmfs_group_desc *)gd_buf;
+	for (i = 0; i < cl->cl_next_free_rec; i++) {
+		nr_groups = 0;
+		for (gd_blkno = cl->cl_recs[i].c_blkno; gd_blkno;
+		     gd_blkno = gd->bg_next_group) {
+			if (++nr_groups > fs->fs_clusters) {
+				fsck_problem(st, "Chain %d of the global bitmap "
+					     "loops\n", i);
+				break;
+			}
+
+			ret = cmfs_read_group_desc(fs, gd_blkno, gd_buf);
+			if (ret) {
+				fsck_problem(st, "Group %"PRIu64" in chain %d "
+					     "of the global bitmap can't be "
+					     "read: %s\n", gd_blkno, i,
+					     error_message(ret));
+				ret = 0;
+				break;
+			}
+
+			if ((gd->bg_blkno != gd_blkno) ||
+			    (gd->bg_parent_dinode != st->fs_bitmap_blkno) ||
+			    (gd->bg_chain != i) ||
+			    (gd->bg_bits > gd->bg_size * 8)) {
+				fsck_problem(st, "Group %"PRIu64" doesn't "
+					     "belong to chain %d of the global "
+					     "bitmap\n", gd_blkno, i);
+				break;
+			}
+
+			free_bits = gd->bg_bits -
+				    fsck_count_bits(gd->bg_bitmap,
+						    gd->bg_bits);
+			if (free_bits != gd->bg_free_bits_count)
+				fsck_problem(st, "Group %"PRIu64" has %d free "
+					     "bits but records %u\n",
+					     gd_blkno, free_bits,
+					     gd->bg_free_bits_count);
+			used += gd->bg_bits - free_bits;
+			total += gd->bg_bits;
+
+			pass2_check_group(st, gd, cl->cl_cpg, &run, seen);
+		}
+	}
+
+	if ((used != di->id1.bitmap1.i_used) ||
+	    (total != di->id1.bitmap1.i_total))
+		fsck_problem(st, "The global bitmap records %u of %u clusters "
+			     "used, its groups have %"PRIu64" of %"PRIu64"\n",
+			     di->id1.bitmap1.i_used, di->id1.bitmap1.i_total,
+			     used, total);
+
+	/* Clusters no group covers can't be allocated or freed */
+	for (cpos = 0; cpos < fs->fs_clusters; cpos = end) {
+		for (end = cpos; end < fs->fs_clusters; end++)
+			if (!(seen[end >> 3] & (1 << (end & 7))))
+				break;
+		if (end == fs->fs_clusters)
+			break;
+		for (cpos = end; end < fs->fs_clusters; end++) {
+			if (seen[end >> 3] & (1 << (end & 7)))
+				break;
+			if (fsck_test_cluster(st, end))
+				st->fs_used_clusters++;
+		}
+		fsck_problem(st, "Clusters %"PRIu64"-%"PRIu64" are not covered "
+			     "by any group of the global bitmap\n",
+			     cpos, end - 1);
+	}
+
+out:
+	if (seen)
+		cmfs_free(&seen);
+	if (gd_buf)
+		cmfs_free(&gd_buf);
+	if (di_buf)
+		cmfs_free(&di_buf);
+	return ret;
+}
@@ -0,0 +1,214 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * pass3.c
+ *
+ * Pass 3 of fsck.cmfs: check every inode found by pass 1 is reachable
+ * from the root or system directory, and that its link count matches
+ * the directory entries pointing to it.
+ *
+ * Copyright (C) 2012, Coly Li <i@coly.li>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#define _XOPEN_SOURCE 600
+#define _LARGEFILE64_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+
+#include <cmfs/cmfs.h>
+#include "../libcmfs/cmfs_err.h"
+
+#include "fsck.h"
+
+struct pass3_dir {
+	uint64_t pd_blkno;
+	uint64_t pd_parent;
+};
+
+struct pass3_walk {
+	struct fsck_state *pw_st;
+	struct pass3_dir *pw_dirs;	/* directories still to walk */
+	uint32_t pw_nr_dirs;
+	uint32_t pw_alloc;
+	uint8_t *pw_reached;		/* per fs_inodes, has a parent */
+	struct pass3_dir pw_cur;
+	errcode_t pw_ret;
+};
+
+static errcode_t pass3_push(struct pass3_walk *pw, uint64_t blkno,
+			    uint64_t parent)
+{
+	struct pass3_dir *pd;
+
+	if (pw->pw_nr_dirs == pw->pw_alloc) {
+		pw->pw_alloc = pw->pw_alloc ? pw->pw_alloc * 2 : 256;
+		pd = realloc(pw->pw_dirs,
+			     pw->pw_alloc * sizeof(struct pass3_dir));
+		if (!pd)
+			return CMFS_ET_NO_MEMORY;
+		pw->pw_dirs = pd;
+	}
+
+	pd = &pw->pw_dirs[pw->pw_nr_dirs++];
+	pd->pd_blkno = blkno;
+	pd->pd_parent = parent;
+
+	return 0;
+}
+
+static int pass3_dirent(struct cmfs_dir_entry *de,
+			uint64_t blocknr,
+			int offset,
+			int blocksize,
+			char *buf,
+			void *priv_data)
+{
+	struct pass3_walk *pw = priv_data;
+	struct fsck_state *st = pw->pw_st;
+	struct fsck_inode *fi;
+	int len = de->name_len & 0xff;
+	uint32_t idx;
+
+	fi = fsck_find_inode(st, de->inode);
+	if (!fi) {
+		fsck_problem(st, "Entry \"%.*s\" in directory %"PRIu64" points "
+			     "to %"PRIu64", which is not an inode in use\n",
+			     len, de->name, pw->pw_cur.pd_blkno,
+			     (uint64_t)de->inode);
+		return 0;
+	}
+	fi->fi_refs++;
+
+	if ((len == 1) && (de->name[0] == '.')) {
+		if (de->inode != pw->pw_cur.pd_blkno)
+			fsck_problem(st, "Entry \".\" in directory %"PRIu64
+				     " points to %"PRIu64"\n",
+				     pw->pw_cur.pd_blkno,
+				     (uint64_t)de->inode);
+		return 0;
+	}
+	if ((len == 2) && (de->name[0] == '.') && (de->name[1] == '.')) {
+		if (de->inode != pw->pw_cur.pd_parent)
+			fsck_problem(st, "Entry \"..\" in directory %"PRIu64
+				     " points to %"PRIu64", its parent is "
+				     "%"PRIu64"\n", pw->pw_cur.pd_blkno,
+				     (uint64_t)de->inode,
+				     pw->pw_cur.pd_parent);
+		return 0;
+	}
+
+	if (!S_ISDIR(fi->fi_mode))
+		return 0;
+
+	idx = fi - st->fs_inodes;
+	if (pw->pw_reached[idx]) {
+		fsck_problem(st, "Directory %"PRIu64" is linked from more "
+			     "than one directory\n", fi->fi_blkno);
+		return 0;
+	}
+	pw->pw_reached[idx] = 1;
+
+	pw->pw_ret = pass3_push(pw, fi->fi_blkno, pw->pw_cur.pd_blkno);
+	if (pw->pw_ret)
+		return CMFS_DIRENT_ABORT;
+
+	return 0;
+}
+
+static errcode_t pass3_add_top(struct pass3_walk *pw, uint64_t blkno)
+{
+	struct fsck_state *st = pw->pw_st;
+	struct fsck_inode *fi;
+
+	fi = fsck_find_inode(st, blkno);
+	if (!fi || !S_ISDIR(fi->fi_mode)) {
+		fsck_problem(st, "Directory %"PRIu64" named in the superblock "
+			     "is not a directory in use\n", blkno);
+		return 0;
+	}
+	pw->pw_reached[fi - st->fs_inodes] = 1;
+
+	/* The top directories are their own parents */
+	return pass3_push(pw, blkno, blkno);
+}
+
+errcode_t fsck_pass3(struct fsck_state *st)
+{
+	cmfs_filesys *fs = st->fs_fs;
+	struct pass3_walk pw;
+	struct fsck_inode *fi;
+	char *buf = NULL;
+	uint32_t i;
+	errcode_t ret;
+
+	memset(&pw, 0, sizeof(pw));
+	pw.pw_st = st;
+
+	ret = cmfs_malloc0(st->fs_nr_inodes ? st->fs_nr_inodes : 1,
+			   &pw.pw_reached);
+	if (ret)
+		goto out;
+	ret = cmfs_malloc_block(fs->fs_io, &buf);
+	if (ret)
+		goto out;
+
+	ret = pass3_add_top(&pw, fs->fs_root_blkno);
+	if (!ret)
+		ret = pass3_add_top(&pw, fs->fs_sysdir_blkno);
+	if (ret)
+		goto out;
+
+	while (pw.pw_nr_dirs) {
+		pw.pw_cur = pw.pw_dirs[--pw.pw_nr_dirs];
+		ret = cmfs_dir_iterate(fs, pw.pw_cur.pd_blkno, 0, buf,
+				       pass3_dirent, &pw);
+		if (pw.pw_ret) {
+			ret = pw.pw_ret;
+			goto out;
+		}
+		if (ret) {
+			fsck_problem(st, "Directory %"PRIu64" can't be read: "
+				     "%s\n", pw.pw_cur.pd_blkno,
+				     error_message(ret));
+			ret = 0;
+		}
+	}
+
+	for (i = 0; i < st->fs_nr_inodes; i++) {
+		fi = &st->fs_inodes[i];
+		if (!fi->fi_refs)
+			fsck_problem(st, "Inode %"PRIu64" is in use but no "
+				     "directory entry points to it\n",
+				     fi->fi_blkno);
+		else if (fi->fi_refs != fi->fi_links)
+			fsck_problem(st, "Inode %"PRIu64" has link count %u "
+				     "but %u entries point to it\n",
+				     fi->fi_blkno, fi->fi_links, fi->fi_refs);
+	}
+
+out:
+	free(pw.pw_dirs);
+	if (buf)
+		cmfs_free(&buf);
+	if (pw.pw_reached)
+		cmfs_free(&pw.pw_reached);
+	return ret;
+}
@@ -663,6 +663,16 @@ static inline int cmfs_extent_recs_per_inode(int blocksize)
 	return size / (sizeof(struct cmfs_extent_rec));
 }
 
+static inline int cmfs_extent_recs_per_eb(int blocksize)
+{
+	int size;
+
+	size = blocksize -
+		offsetof(struct cmfs_extent_block, h_list.l_recs);
+
+	return size / (sizeof(struct cmfs_extent_rec));
+}
+
 #endif /* KERNEL */
 
 static inline int cmfs_sprintf_system_inode_name(char *buf,
@@ -46,6 +46,19 @@
 #define CMFS_FLAG_IMAGE_FILE		0x20
 #define CMFS_FLAG_NO_ECC_CHECKS		0x40
 #define CMFS_FLAG_HARD_RO		0x80
+/*
+ * Thread-safe mode, chosen at cmfs_open() time.  The block cache is
+ * split into locked shards, the inode cache is locked, stats are
+ * updated atomically and the read helpers use per-thread scratch
+ * buffers, so any number of threads may read through one
+ * cmfs_filesys.  Modifying metadata still needs external serialization.
+ */
+#define CMFS_FLAG_THREADED		0x100
+/*
+ * Read-only, the device or image is mmap()ed whole and read through
+ * the page cache instead of pread() and the io_cache.
+ */
+#define CMFS_FLAG_MMAP			0x200
 
 /* Return flags for the directory iterator functions */
 #define CMFS_DIRENT_CHANGED	0x01
@@ -125,6 +138,8 @@ enum cmfs_block_type {
 	CMFS_BLOCK_EXTENT_BLOCK,
 	CMFS_BLOCK_GROUP_DESCRIPTOR,
 	CMFS_BLOCK_DIR_BLOCK,
+	CMFS_BLOCK_DATA,
+	CMFS_NR_BLOCK_TYPES,
 };
 
 
@@ -134,6 +149,16 @@ typedef struct _cmfs_cached_inode cmfs_cached_inode;
 typedef struct _cmfs_dinode cmfs_dinode;
 typedef struct _cmfs_bitmap cmfs_bitmap;
 typedef struct _cmfs_fs_options cmfs_fs_options;
+typedef struct _cmfs_inode_scan cmfs_inode_scan;
+typedef struct _cmfs_free_index cmfs_free_index;
+typedef struct _cmfs_allocator cmfs_allocator;
+typedef struct _cmfs_group_summary cmfs_group_summary;
+typedef struct _cmfs_image cmfs_image;
+typedef struct _cmfs_image_writer cmfs_image_writer;
+typedef struct _cmfs_trace cmfs_trace;
+typedef struct _cmfs_trace_writer cmfs_trace_writer;
+
+struct cmfs_icache;
 
 struct _cmfs_filesys {
 	char *fs_devname;
@@ -158,6 +183,12 @@ struct _cmfs_filesys {
 //	cmfs_cached_inode **fs_eb_allocs;
 //	cmfs_cached_inode *fs_system_eb_alloc;
 
+	/* By allocator type, see group_summary.c */
+	cmfs_group_summary *fs_group_summaries[NUM_SYSTEM_INODES];
+
+	/* Cached inodes, see cached_inode.c */
+	struct cmfs_icache *fs_icache;
+
 	/* Reserved for the use of the calling application. */
 	void *fs_private;
 };
@@ -167,6 +198,7 @@ struct _cmfs_cached_inode {
 	uint64_t ci_blkno;
 	struct cmfs_dinode *ci_inode;
 	cmfs_bitmap *ci_chains;
+	int ci_refcount;
 };
 
 struct _cmfs_fs_options {
@@ -175,6 +207,58 @@ struct _cmfs_fs_options {
 	uint32_t opt_ro_compat;
 };
 
+/*
+ * Optional settings for cmfs_open_with_params().  With op_cache_bytes
+ * set the device gets an io_cache of that size, backed as
+ * io_set_cache_backing() says, which auto-tunes up to
+ * op_cache_max_bytes if that is larger.
+ */
+struct cmfs_open_params {
+	size_t op_cache_bytes;		/* 0 for no io_cache */
+	size_t op_cache_max_bytes;
+	int op_cache_backing;		/* CMFS_IO_CACHE_* */
+	int op_cache_node;
+	int op_flags;			/* CMFS_OPEN_* */
+};
+
+#define CMFS_OPEN_MLOCK_CACHE	0x0001	/* io_mlock_cache() it */
+#define CMFS_OPEN_PREWARM	0x0002	/* read in the system files */
+#define CMFS_OPEN_GROUP_SUMMARY	0x0004	/* of the global bitmap */
+
+/*
+ * The free space of one group of a chain allocator, in bits.  A full
+ * group has gs_first_free and gs_max_run_start at gs_bits.
+ */
+struct cmfs_group_sum {
+	uint64_t gs_blkno;		/* the descriptor */
+	uint32_t gs_bits;
+	uint32_t gs_free;
+	uint32_t gs_first_free;
+	uint32_t gs_max_run;		/* longest run of free bits */
+	uint32_t gs_max_run_start;
+	uint16_t gs_chain;
+	uint16_t gs_reserved;
+};
+
+struct _cmfs_group_summary {
+	cmfs_filesys *sm_fs;
+	int sm_type;			/* of the allocator */
+	uint64_t sm_blkno;		/* the allocator dinode */
+	uint64_t sm_total_bits;
+	uint64_t sm_free_bits;
+	struct cmfs_group_sum *sm_groups;	/* by gs_blkno */
+	uint32_t sm_nr_groups;
+	uint32_t sm_max_groups;
+};
+
+/* One extent of a new file, for cmfs_build_extent_tree() */
+struct cmfs_extent_run {
+	uint64_t er_v_blkno;		/* logical block in the file */
+	uint64_t er_blkno;		/* where it is on disk */
+	uint32_t er_blocks;
+	uint8_t er_flags;		/* CMFS_EXT_* */
+};
+
 struct cmfs_cluster_group_sizes {
 	uint16_t cgs_cpg;
 	uint16_t cgs_tail_group_bits;
@@ -200,12 +284,43 @@ static inline void cmfs_calc_cluster_groups(
 		cgs->cgs_tail_group_bits = cgs->cgs_cpg;
 }
 
+/*
+ * What backs the io_cache blocks, asked for with io_set_cache_backing()
+ * before io_init_cache().  Huge pages fall back to transparent huge
+ * pages and those to normal pages; a NUMA policy the kernel refuses is
+ * dropped.  io_get_cache_backing() says what the cache got.
+ */
+#define CMFS_IO_CACHE_HUGETLB		0x0001	/* MAP_HUGETLB pool pages */
+#define CMFS_IO_CACHE_THP		0x0002	/* madvise(MADV_HUGEPAGE) */
+#define CMFS_IO_CACHE_INTERLEAVE	0x0004	/* over all online nodes */
+#define CMFS_IO_CACHE_BIND		0x0008	/* on one node */
+
+/* Access pattern hints for io_advise() */
+enum {
+	CMFS_IO_ADVISE_NORMAL = 0,
+	CMFS_IO_ADVISE_SEQUENTIAL,
+	CMFS_IO_ADVISE_RANDOM,
+	CMFS_IO_ADVISE_WILLNEED,
+	CMFS_IO_ADVISE_DONTNEED,
+};
+
 struct io_vec_unit {
 	uint64_t ivu_blkno;
 	char *ivu_buf;
 	uint32_t ivu_buflen;
 };
 
+/*
+ * Histogram buckets of struct cmfs_io_stats.  Latency bucket i counts
+ * I/Os that took [2^i, 2^(i+1)) ns, size bucket i those of [2^i,
+ * 2^(i+1)) blocks.  Seek bucket 0 counts I/Os that started where the
+ * one before ended, bucket i the others [2^(i-1), 2^i) blocks away.
+ * The last bucket of each takes everything above it.
+ */
+#define CMFS_IO_LAT_BUCKETS		32
+#define CMFS_IO_SIZE_BUCKETS		16
+#define CMFS_IO_SEEK_BUCKETS		40
+
 struct cmfs_io_stats {
 	uint64_t is_bytes_read;
 	uint64_t is_bytes_written;
@@ -213,10 +328,60 @@ struct cmfs_io_stats {
 	uint32_t is_cache_misses;
 	uint32_t is_cache_inserts;
 	uint32_t is_cache_removes;
+	uint32_t is_cache_evictions;
+	uint32_t is_icache_hits;
+	uint32_t is_icache_misses;
+	uint32_t is_icache_inserts;
+	uint32_t is_icache_removes;
+
+	/* Reads and writes that went to the device */
+	uint64_t is_reads;
+	uint64_t is_writes;
+	uint64_t is_read_ns;
+	uint64_t is_write_ns;
+	uint64_t is_read_lat[CMFS_IO_LAT_BUCKETS];
+	uint64_t is_write_lat[CMFS_IO_LAT_BUCKETS];
+	uint64_t is_read_size[CMFS_IO_SIZE_BUCKETS];
+	uint64_t is_write_size[CMFS_IO_SIZE_BUCKETS];
+	uint64_t is_seek[CMFS_IO_SEEK_BUCKETS];
+
+	/* Blocks by io_set_block_type() */
+	uint64_t is_type_read[CMFS_NR_BLOCK_TYPES];	/* asked for */
+	uint64_t is_type_disk[CMFS_NR_BLOCK_TYPES];	/* from the device */
+	uint64_t is_type_written[CMFS_NR_BLOCK_TYPES];
+};
+
+/*
+ * One record of an io_channel trace, see cmfs/trace.h.  te_op and
+ * te_flags take the CMFS_TRACE_* values there.
+ */
+struct cmfs_trace_event {
+	uint64_t te_time;		/* ns since the trace started */
+	uint64_t te_blkno;
+	int32_t te_count;
+	uint32_t te_latency;		/* ns */
+	uint32_t te_hits;
+	uint8_t te_op;
+	uint8_t te_flags;
+	uint8_t te_type;
+	uint8_t te_thread;
+};
+
+struct cmfs_trace_info {
+	uint32_t ti_blocksize;		/* when the trace was closed */
+	uint64_t ti_nr_events;		/* held in the file */
+	uint64_t ti_lost;		/* overwritten by the ring */
+	uint64_t ti_start;		/* CLOCK_REALTIME ns */
+	uint64_t ti_cache_bytes;	/* when the trace was closed */
 };
 
 errcode_t cmfs_check_if_mounted(const char *file, int *mount_flags);
 void io_get_stats(io_channel *channel, struct cmfs_io_stats *stats);
+void io_reset_stats(io_channel *channel);
+void io_set_block_type(enum cmfs_block_type type);
+errcode_t io_trace_start(io_channel *channel, const char *path,
+			 uint64_t ring_records);
+errcode_t io_trace_stop(io_channel *channel);
 struct cmfs_dir_block_trailer *cmfs_dir_trailer_from_block(cmfs_filesys *fs,
 							   void  *data);
 void cmfs_init_dir_trailer(cmfs_filesys *fs,
@@ -234,6 +399,12 @@ errcode_t cmfs_open(const char *name,
 		    unsigned int superblock,
 		    unsigned int block_size,
 		    cmfs_filesys **ret_fs);
+errcode_t cmfs_open_with_params(const char *name,
+				int flags,
+				unsigned int superblock,
+				unsigned int block_size,
+				const struct cmfs_open_params *params,
+				cmfs_filesys **ret_fs);
 errcode_t cmfs_close(cmfs_filesys *fs);
 errcode_t cmfs_flush(cmfs_filesys *fs);
 errcode_t cmfs_validate_meta_ecc(cmfs_filesys *fs,
@@ -245,7 +416,9 @@ errcode_t cmfs_malloc0(unsigned long size, void *ptr);
 errcode_t cmfs_malloc_blocks(io_channel *channel, int num_blocks, void *ptr);
 errcode_t cmfs_malloc_block(io_channel *channel, void *ptr);
 errcode_t cmfs_free(void *ptr);
+errcode_t cmfs_scratch_block(io_channel *channel, void *ptr);
 int io_get_blksize(io_channel *channel);
+int io_get_fd(io_channel *channel);
 errcode_t cmfs_get_device_size(const char *file,
 			       int blocksize,
 			       uint64_t *retblocks);
@@ -254,21 +427,43 @@ errcode_t io_read_block_nocache(io_channel *channel,
 				int64_t blkno,
 				int count,
 				char *data);
+errcode_t io_write_block_nocache(io_channel *channel,
+				 int64_t blkno,
+				 int count,
+				 const char *data);
 void cmfs_swap_inode_to_cpu(cmfs_filesys *fs, struct cmfs_dinode *di);
 void cmfs_swap_inode_from_cpu(cmfs_filesys *fs, struct cmfs_dinode *di);
 errcode_t io_open(const char *name, int flags, io_channel **channel);
 int io_is_device_readonly(io_channel *channel);
+int io_is_image(io_channel *channel);
 errcode_t io_read_block(io_channel *channel,
 			int64_t blkno,
 			int count,
 			char *data);
 errcode_t io_close(io_channel *channel);
+errcode_t io_map_block(io_channel *channel, int64_t blkno, int count,
+		       const char **ptr);
+void io_advise(io_channel *channel, int64_t blkno, int count, int advice);
+errcode_t io_init_cache(io_channel *channel, size_t nr_blocks);
+errcode_t io_init_cache_size(io_channel *channel, size_t bytes);
+errcode_t io_mlock_cache(io_channel *channel);
+errcode_t io_resize_cache(io_channel *channel, size_t nr_blocks);
+errcode_t io_set_cache_autotune(io_channel *channel, size_t max_bytes);
+size_t io_get_cache_size(io_channel *channel);
+void io_destroy_cache(io_channel *channel);
+void io_set_nocache(io_channel *channel, int nocache);
+void io_set_cache_backing(io_channel *channel, int backing, int node);
+int io_get_cache_backing(io_channel *channel);
 void cmfs_swap_extent_list_to_cpu(cmfs_filesys *fs,
 				  void *obj,
 				  struct cmfs_extent_list *el);
 void cmfs_swap_extent_list_from_cpu(cmfs_filesys *fs,
 				    void *obj,
 				    struct cmfs_extent_list *el);
+void cmfs_swap_extent_block_to_cpu(cmfs_filesys *fs,
+				   struct cmfs_extent_block *eb);
+void cmfs_swap_extent_block_from_cpu(cmfs_filesys *fs,
+				     struct cmfs_extent_block *eb);
 void cmfs_swap_group_desc_from_cpu(cmfs_filesys *fs,
 				   struct cmfs_group_desc *gd);
 void cmfs_swap_group_desc_to_cpu(cmfs_filesys *fs,
@@ -282,6 +477,9 @@ errcode_t cmfs_merge_feature_with_default_flags(cmfs_fs_options *dest,
 errcode_t cmfs_read_extent_block(cmfs_filesys *fs,
 				 uint64_t blkno,
 				 char *eb_buf);
+errcode_t cmfs_write_extent_block(cmfs_filesys *fs,
+				  uint64_t blkno,
+				  char *eb_buf);
 errcode_t cmfs_lookup(cmfs_filesys *fs,
 		      uint64_t dir,
 		      const char *name,
@@ -304,12 +502,24 @@ errcode_t cmfs_dir_iterate(cmfs_filesys *fs,
 errcode_t cmfs_read_inode(cmfs_filesys *fs,
 			  uint64_t blkno,
 			  char *inode_buf);
+errcode_t cmfs_read_inodes(cmfs_filesys *fs,
+			   uint64_t *blknos,
+			   int count,
+			   char **bufs);
 errcode_t cmfs_write_inode(cmfs_filesys *fs,
 			  uint64_t blkno,
 			  char *inode_buf);
+errcode_t io_vec_read_blocks(io_channel *channel,
+			     struct io_vec_unit *ivus,
+			     int count);
 errcode_t cmfs_read_group_desc(cmfs_filesys *fs,
 			       uint64_t blkno,
 			       char *gd_buf);
+errcode_t cmfs_write_group_desc(cmfs_filesys *fs,
+				uint64_t blkno,
+				char *gd_buf);
+errcode_t cmfs_prefetch_group_chain(cmfs_filesys *fs, uint64_t gd_blkno);
+errcode_t cmfs_prefetch_group_descs(cmfs_filesys *fs, struct cmfs_dinode *di);
 errcode_t cmfs_read_dir_block(cmfs_filesys *fs,
 			      struct cmfs_dinode *di,
 			      uint64_t block,
@@ -341,6 +551,144 @@ errcode_t cmfs_block_iterate_inode(cmfs_filesys *fs,
 					       uint16_t ext_flags,
 					       void *priv_data),
 				   void *priv_data);
+errcode_t cmfs_extent_iterate_inode(cmfs_filesys *fs,
+				    struct cmfs_dinode *inode,
+				    int flags,
+				    char *block_buf,
+				    int (*func)(cmfs_filesys *fs,
+					        struct cmfs_extent_rec *rec,
+						int tree_depth,
+						uint32_t ccount,
+						uint64_t ref_blkno,
+						int ref_recno,
+						void *priv_data),
+				    void *priv_data);
+errcode_t cmfs_extent_iterate_leaves(cmfs_filesys *fs,
+				     struct cmfs_dinode *inode,
+				     int flags,
+				     int window,
+				     int (*func)(cmfs_filesys *fs,
+						 struct cmfs_extent_rec *rec,
+						 int tree_depth,
+						 uint32_t ccount,
+						 uint64_t ref_blkno,
+						 int ref_recno,
+						 void *priv_data),
+				     void *priv_data);
+errcode_t cmfs_open_inode_scan(cmfs_filesys *fs, cmfs_inode_scan **ret_scan);
+errcode_t cmfs_get_next_inode(cmfs_inode_scan *scan, uint64_t *blkno,
+			      char *inode_buf);
+void cmfs_close_inode_scan(cmfs_inode_scan *scan);
+errcode_t cmfs_open_image(int fd, cmfs_image **ret_img);
+errcode_t cmfs_image_read(cmfs_image *img, uint64_t offset, uint64_t len,
+			  char *buf);
+uint64_t cmfs_image_dev_blocks(cmfs_image *img, uint32_t *blocksize);
+uint64_t cmfs_image_nr_blocks(cmfs_image *img);
+void cmfs_close_image(cmfs_image *img);
+errcode_t cmfs_open_image_writer(int fd, uint32_t blocksize,
+				 uint64_t dev_blocks, const uint8_t *map,
+				 int flags, cmfs_image_writer **ret_iw);
+errcode_t cmfs_image_write_blocks(cmfs_image_writer *iw, int count,
+				  const char *buf);
+errcode_t cmfs_image_writer_finish(cmfs_image_writer *iw,
+				   const uint8_t *uuid, uint64_t *ret_size);
+void cmfs_close_image_writer(cmfs_image_writer *iw);
+errcode_t cmfs_open_trace_writer(const char *path, uint32_t blocksize,
+				 uint64_t ring_records,
+				 cmfs_trace_writer **ret_tw);
+void cmfs_trace_log(cmfs_trace_writer *tw, uint32_t blocksize,
+		    struct cmfs_trace_event *ev, struct io_vec_unit *ivus,
+		    int count);
+errcode_t cmfs_close_trace_writer(cmfs_trace_writer *tw,
+				  uint64_t cache_bytes);
+errcode_t cmfs_open_trace(const char *path, cmfs_trace **ret_trace);
+void cmfs_trace_get_info(cmfs_trace *trace, struct cmfs_trace_info *info);
+errcode_t cmfs_trace_read(cmfs_trace *trace, uint64_t first, uint64_t count,
+			  struct cmfs_trace_event *evs);
+void cmfs_close_trace(cmfs_trace *trace);
+errcode_t cmfs_new_free_index(cmfs_filesys *fs, cmfs_free_index **ret_fi);
+errcode_t cmfs_load_free_index(cmfs_filesys *fs, cmfs_free_index **ret_fi);
+void cmfs_close_free_index(cmfs_free_index *fi);
+errcode_t cmfs_free_index_insert(cmfs_free_index *fi, uint32_t cpos,
+				 uint32_t len);
+errcode_t cmfs_free_index_claim(cmfs_free_index *fi, uint32_t cpos,
+				uint32_t len);
+errcode_t cmfs_free_index_best_fit(cmfs_free_index *fi, uint32_t len,
+				   uint32_t *cpos);
+errcode_t cmfs_free_index_near(cmfs_free_index *fi, uint32_t goal,
+			       uint32_t min_len, uint32_t max_len,
+			       uint32_t *cpos, uint32_t *len);
+errcode_t cmfs_free_index_largest(cmfs_free_index *fi, uint32_t *cpos,
+				  uint32_t *len);
+void cmfs_free_index_stats(cmfs_free_index *fi, uint32_t *nr_extents,
+			   uint32_t *free_clusters);
+errcode_t cmfs_free_index_add_group(cmfs_free_index *fi,
+				    struct cmfs_group_desc *gd,
+				    uint16_t cpg);
+errcode_t cmfs_open_allocator(cmfs_filesys *fs, int type,
+			      cmfs_allocator **ret_ca);
+errcode_t cmfs_allocator_flush(cmfs_allocator *ca);
+void cmfs_close_allocator(cmfs_allocator *ca);
+errcode_t cmfs_alloc_clusters(cmfs_allocator *ca, uint32_t goal,
+			      uint32_t min_len, uint32_t max_len,
+			      uint32_t *cpos, uint32_t *len);
+errcode_t cmfs_alloc_clusters_fit(cmfs_allocator *ca, uint32_t len,
+				  uint32_t *cpos);
+errcode_t cmfs_largest_free_clusters(cmfs_allocator *ca, uint32_t *cpos,
+				     uint32_t *len);
+errcode_t cmfs_free_clusters(cmfs_allocator *ca, uint32_t cpos,
+			     uint32_t len);
+errcode_t cmfs_alloc_block(cmfs_allocator *ca, cmfs_allocator *cluster_ca,
+			   uint64_t *blkno, uint16_t *suballoc_bit);
+errcode_t cmfs_alloc_blocks(cmfs_allocator *ca, cmfs_allocator *cluster_ca,
+			    uint32_t want, uint64_t *blkno,
+			    uint16_t *suballoc_bit, uint32_t *got);
+errcode_t cmfs_free_block(cmfs_allocator *ca, uint64_t blkno);
+errcode_t cmfs_new_inode(cmfs_allocator *ca, cmfs_allocator *cluster_ca,
+			 uint16_t mode, char *inode_buf, uint64_t *ret_blkno);
+errcode_t cmfs_build_group_summary(cmfs_filesys *fs, int type,
+				   cmfs_group_summary **ret_sm);
+void cmfs_close_group_summary(cmfs_group_summary *sm);
+errcode_t cmfs_get_group_summary(cmfs_filesys *fs, int type,
+				 cmfs_group_summary **ret_sm);
+void cmfs_free_group_summaries(cmfs_filesys *fs);
+errcode_t cmfs_save_group_summary(cmfs_filesys *fs, int type,
+				  cmfs_allocator *inode_ca,
+				  cmfs_allocator *eb_ca,
+				  cmfs_allocator *cluster_ca);
+struct cmfs_group_sum *cmfs_group_summary_lookup(cmfs_group_summary *sm,
+						 uint64_t blkno);
+errcode_t cmfs_group_summary_find(cmfs_group_summary *sm, uint32_t len,
+				  uint32_t *idx);
+void cmfs_group_summary_update(cmfs_filesys *fs, int type,
+			       struct cmfs_group_desc *gd, uint32_t bit,
+			       uint32_t n, int set);
+void cmfs_group_summary_add(cmfs_filesys *fs, int type,
+			    struct cmfs_group_desc *gd);
+errcode_t cmfs_insert_extent(cmfs_filesys *fs, char *inode_buf,
+			     uint64_t v_blkno, uint64_t blkno, uint32_t blocks,
+			     uint8_t flags, cmfs_allocator *eb_ca,
+			     cmfs_allocator *cluster_ca);
+errcode_t cmfs_build_extent_tree(cmfs_filesys *fs, char *inode_buf,
+				 struct cmfs_extent_run *runs, uint32_t nr,
+				 cmfs_allocator *eb_ca,
+				 cmfs_allocator *cluster_ca);
+errcode_t cmfs_extent_make_room(cmfs_filesys *fs, char *inode_buf,
+				uint64_t cpos, cmfs_allocator *eb_ca,
+				cmfs_allocator *cluster_ca);
+errcode_t cmfs_link(cmfs_filesys *fs, uint64_t dir, const char *name,
+		    uint64_t ino, int type, cmfs_allocator *eb_ca,
+		    cmfs_allocator *cluster_ca);
+errcode_t cmfs_mkdir(cmfs_filesys *fs, uint64_t parent, const char *name,
+		     uint16_t mode, cmfs_allocator *inode_ca,
+		     cmfs_allocator *eb_ca, cmfs_allocator *cluster_ca,
+		     uint64_t *ret_blkno);
+errcode_t cmfs_allocate_unwritten(cmfs_cached_inode *ci, uint64_t offset,
+				  uint64_t len, cmfs_allocator *eb_ca,
+				  cmfs_allocator *cluster_ca);
+errcode_t cmfs_mark_extents_written(cmfs_cached_inode *ci, uint64_t offset,
+				    uint64_t len, cmfs_allocator *eb_ca,
+				    cmfs_allocator *cluster_ca);
 errcode_t cmfs_snprint_extent_flags(char *str,
 				    size_t size,
 				    uint8_t flags);
@@ -352,8 +700,28 @@ errcode_t cmfs_file_read(cmfs_cached_inode *ci,
 			 uint32_t count,
 			 uint64_t offset,
 			 uint32_t *got);
+errcode_t cmfs_file_map_iterate(cmfs_cached_inode *ci,
+				uint64_t offset,
+				int (*func)(cmfs_cached_inode *ci,
+					    uint64_t offset,
+					    uint64_t len,
+					    uint64_t p_blkno,
+					    uint16_t ext_flags,
+					    void *priv_data),
+				void *priv_data);
+errcode_t cmfs_file_seek_data(cmfs_cached_inode *ci, uint64_t offset,
+			      uint64_t *data_offset);
+errcode_t cmfs_file_seek_hole(cmfs_cached_inode *ci, uint64_t offset,
+			      uint64_t *hole_offset);
 errcode_t cmfs_free_cached_inode(cmfs_filesys *fs,
 				 cmfs_cached_inode *cinode);
+errcode_t cmfs_icache_init(cmfs_filesys *fs);
+errcode_t cmfs_icache_set_limit(cmfs_filesys *fs, unsigned int nr_inodes);
+void cmfs_icache_refresh(cmfs_filesys *fs, uint64_t blkno,
+			 const char *inode_buf);
+void cmfs_icache_destroy(cmfs_filesys *fs);
+void cmfs_get_stats(cmfs_filesys *fs, struct cmfs_io_stats *stats);
+void cmfs_reset_stats(cmfs_filesys *fs);
 errcode_t cmfs_read_dir_block(cmfs_filesys *fs,
 			      struct cmfs_dinode *di,
 			      uint64_t block,
@@ -377,6 +745,11 @@ errcode_t cmfs_write_dir_block(cmfs_filesys *fs,
 			      uint64_t block,
 			      void *inbuf);
 void cmfs_bitmap_free(cmfs_bitmap *bitmap);
+errcode_t cmfs_get_clusters(cmfs_cached_inode *cinode,
+			    uint64_t v_cluster,
+			    uint64_t *p_cluster,
+			    uint64_t *num_clusters,
+			    uint16_t *extent_flags);
 errcode_t cmfs_extent_map_get_blocks(cmfs_cached_inode *cinode,
 				     uint64_t v_blkno,
 				     int count,
@@ -413,7 +786,7 @@ static inline uint64_t cmfs_clusters_to_blocks(cmfs_filesys *fs,
 		CMFS_RAW_SB(fs->fs_super)->s_clustersize_bits -
 		CMFS_RAW_SB(fs->fs_super)->s_blocksize_bits;
 
-	return (uint64_t)(clusters << c_to_b_bits);
+	return ((uint64_t)clusters) << c_to_b_bits;
 }
 
 static inline uint64_t cmfs_blocks_to_clusters(cmfs_filesys *fs,
@@ -0,0 +1,78 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * group_summary.h
+ *
+ * On-disk format of the saved group summaries.
+ *
+ * Copyright (C) 2012, Coly Li <i@coly.li>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef _CMFS_GROUP_SUMMARY_H
+#define _CMFS_GROUP_SUMMARY_H
+
+#include <stdint.h>
+#include <linux/types.h>
+
+/*
+ * The summary of a chain allocator is saved in the system directory as
+ * "<allocator name>.summary", a regular system file laid out as:
+ *
+ *   header	CMFS_GROUP_SUMMARY_HDR_SIZE bytes, struct
+ *		cmfs_group_summary_hdr
+ *   records	sh_nr_groups struct cmfs_group_summary_rec, in
+ *		descriptor block order
+ *
+ * All fields are little endian.  The header keeps a copy of the chain
+ * list of the allocator dinode as it was when the summary was saved.
+ * Every allocation or free changes the c_free of some chain, so a
+ * summary whose copy doesn't match the dinode any more is stale and
+ * is rebuilt from the descriptors instead.
+ */
+#define CMFS_GROUP_SUMMARY_MAGIC	"CMFSGSUM"
+#define CMFS_GROUP_SUMMARY_MAGIC_LEN	8
+#define CMFS_GROUP_SUMMARY_VERSION	1
+#define CMFS_GROUP_SUMMARY_HDR_SIZE	4096
+#define CMFS_GROUP_SUMMARY_SUFFIX	".summary"
+
+struct cmfs_group_summary_hdr {
+/*00*/	uint8_t sh_magic[CMFS_GROUP_SUMMARY_MAGIC_LEN];
+	__le32 sh_version;
+	__le32 sh_nr_groups;
+/*10*/	__le64 sh_alloc_blkno;		/* the allocator dinode */
+	__le64 sh_ctime;		/* when it was saved */
+/*20*/	__le64 sh_total_bits;
+	__le64 sh_free_bits;
+/*30*/	__le16 sh_nr_chains;		/* cl_next_free_rec */
+	__le16 sh_reserved1;
+	__le32 sh_reserved2;
+/*38*/	struct cmfs_chain_rec sh_chains[0];	/* cl_recs */
+};
+
+struct cmfs_group_summary_rec {
+/*00*/	__le64 sr_blkno;
+	__le32 sr_bits;
+	__le32 sr_free;
+/*10*/	__le32 sr_first_free;
+	__le32 sr_max_run;
+/*18*/	__le32 sr_max_run_start;
+	__le16 sr_chain;
+	__le16 sr_reserved;
+/*20*/
+};
+
+#endif  /* _CMFS_GROUP_SUMMARY_H */
@@ -0,0 +1,82 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * image.h
+ *
+ * On-disk format of CMFS metadata images.
+ *
+ * Copyright (C) 2012, Coly Li <i@coly.li>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef _CMFS_IMAGE_H
+#define _CMFS_IMAGE_H
+
+#include <stdint.h>
+#include <linux/types.h>
+
+/*
+ * A metadata image holds a copy of some blocks of a volume, normally
+ * its metadata, and reads as the whole volume with zeros everywhere
+ * else.  All fields are little endian.  The file is laid out as:
+ *
+ *   header	CMFS_IMAGE_HDR_SIZE bytes, struct cmfs_image_hdr
+ *   map	one bit per block of the volume, set for the blocks held,
+ *		bit n in byte n / 8 as cmfs_set_bit() does
+ *   rank	a __le64 per CMFS_IMAGE_RANK_BITS bits of the map, the
+ *		number of blocks held before them
+ *   chunks	compressed images only: ih_nr_chunks + 1 __le64 offsets
+ *		in the file, chunk n is [off[n], off[n + 1])
+ *   data	the blocks held, in block number order
+ *
+ * Each part starts on a CMFS_IMAGE_ALIGN boundary.  The rank table
+ * makes finding a block O(1): its index among the held blocks is the
+ * rank entry plus the set bits before it in at most eight map words.
+ * A compressed image deflates ih_chunk_blocks of those blocks at a
+ * time; a chunk no smaller than its blocks is stored as they are.
+ *
+ * The header is written last, so an image that was not finished
+ * doesn't have the magic.
+ */
+#define CMFS_IMAGE_MAGIC		"CMFSIMG\0"
+#define CMFS_IMAGE_MAGIC_LEN		8
+#define CMFS_IMAGE_VERSION		1
+#define CMFS_IMAGE_HDR_SIZE		4096
+#define CMFS_IMAGE_ALIGN		4096
+#define CMFS_IMAGE_RANK_BITS		512
+#define CMFS_IMAGE_CHUNK_BLOCKS		64
+
+#define CMFS_IMAGE_FL_COMPRESSED	0x0001	/* zlib chunks */
+
+struct cmfs_image_hdr {
+/*00*/	uint8_t ih_magic[CMFS_IMAGE_MAGIC_LEN];
+	__le32 ih_version;
+	__le32 ih_flags;
+/*10*/	__le32 ih_blocksize;
+	__le32 ih_chunk_blocks;
+	__le64 ih_dev_blocks;		/* blocks in the volume */
+/*20*/	__le64 ih_nr_blocks;		/* blocks held */
+	__le64 ih_nr_chunks;
+/*30*/	__le64 ih_map_offset;
+	__le64 ih_rank_offset;
+/*40*/	__le64 ih_chunk_offset;
+	__le64 ih_data_offset;
+/*50*/	__le64 ih_ctime;		/* when the image was taken */
+	uint8_t ih_uuid[16];		/* of the volume */
+/*68*/
+};
+
+#endif  /* _CMFS_IMAGE_H */
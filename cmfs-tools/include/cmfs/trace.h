@@ -0,0 +1,92 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * trace.h
+ *
+ * On-disk format of CMFS io_channel traces.
+ *
+ * Copyright (C) 2012, Coly Li <i@coly.li>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef _CMFS_TRACE_H
+#define _CMFS_TRACE_H
+
+#include <stdint.h>
+#include <linux/types.h>
+
+/*
+ * A trace is a ring of th_ring_records fixed size records after a
+ * CMFS_TRACE_HDR_SIZE header.  Record n of the trace, counting from
+ * the first call traced, sits in slot n % th_ring_records, so once
+ * th_nr_records passes the ring size the file holds the last
+ * th_ring_records calls.  All fields are little endian.
+ *
+ * Each io_read_block(), io_write_block() and their _nocache() forms
+ * make one record.  io_vec_read_blocks() makes one record per unit,
+ * the ones after the first flagged CMFS_TRACE_FL_CONT; the latency and
+ * hits of the call are on the first.  The records of one call are
+ * never split by those of another thread.
+ *
+ * Block numbers and counts are in the channel blocksize of their
+ * time.  When it changes a CMFS_TRACE_BLKSIZE record is logged with
+ * the old size in tr_blkno and the new one in tr_count; th_blocksize
+ * is the size when the trace was closed.
+ *
+ * The header is written when the trace is closed, so a trace that was
+ * not closed doesn't have the magic.
+ */
+#define CMFS_TRACE_MAGIC		"CMFSTRC\0"
+#define CMFS_TRACE_MAGIC_LEN		8
+#define CMFS_TRACE_VERSION		1
+#define CMFS_TRACE_HDR_SIZE		512
+
+/* tr_op */
+#define CMFS_TRACE_READ			1
+#define CMFS_TRACE_WRITE		2
+#define CMFS_TRACE_VEC_READ		3
+#define CMFS_TRACE_BLKSIZE		4
+
+/* tr_flags */
+#define CMFS_TRACE_FL_NOCACHE		0x01	/* bypassed the io_cache */
+#define CMFS_TRACE_FL_CONT		0x02	/* more units of a vec read */
+#define CMFS_TRACE_FL_ERROR		0x04	/* the call failed */
+
+struct cmfs_trace_hdr {
+/*00*/	uint8_t th_magic[CMFS_TRACE_MAGIC_LEN];
+	__le32 th_version;
+	__le32 th_blocksize;
+/*10*/	__le64 th_ring_records;		/* slots in the file */
+	__le64 th_nr_records;		/* records ever logged */
+/*20*/	__le64 th_start;		/* CLOCK_REALTIME ns at the start */
+	__le64 th_cache_bytes;		/* io_cache at the close, 0 if none */
+/*30*/
+};
+
+struct cmfs_trace_rec {
+/*00*/	__le64 tr_time;			/* ns since the trace started */
+	__le64 tr_blkno;
+/*10*/	__le32 tr_count;		/* blocks, or -bytes as callers pass */
+	__le32 tr_latency;		/* ns, saturates at ~4.3s */
+/*18*/	__le32 tr_hits;			/* blocks served by the io_cache */
+	uint8_t tr_op;
+	uint8_t tr_flags;
+	uint8_t tr_type;		/* enum cmfs_block_type */
+	uint8_t tr_thread;		/* tracing thread, numbered from 0 */
+/*20*/
+};
+
+#endif  /* _CMFS_TRACE_H */
@@ -0,0 +1,77 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * probe.h
+ *
+ * Find the CMFS volumes among the devices scan_for_dev() lists.
+ *
+ * Copyright (C) 2012, Coly Li <i@coly.li>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef _INTERNAL_PROBE_H
+#define _INTERNAL_PROBE_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/param.h>
+
+#include <cmfs-kernel/cmfs_fs.h>
+#include <tools-internal/scandisk.h>
+
+/* dp_status */
+enum {
+	DEVPROBE_NOT_CMFS = 0,
+	DEVPROBE_CMFS,
+	DEVPROBE_ERROR,		/* dp_error has the errno */
+	DEVPROBE_TIMEDOUT,
+};
+
+/*
+ * What probing one device found.  Results are kept in the devlisthead
+ * keyed by (dp_maj, dp_min, dp_size), so they live across rescans.
+ */
+struct devprobe {
+	struct devprobe *next;
+	int dp_maj;
+	int dp_min;
+	uint64_t dp_size;		/* bytes, from sysfs */
+	time_t dp_time;			/* when it was probed */
+	int dp_status;
+	int dp_error;
+	char dp_path[MAXPATHLEN];	/* the path probed */
+
+	/* From the superblock when DEVPROBE_CMFS */
+	char dp_label[CMFS_MAX_VOL_LABEL_LEN + 1];
+	uint8_t dp_uuid[CMFS_VOL_UUID_LEN];
+	uint32_t dp_blocksize;
+	uint32_t dp_clustersize;
+};
+
+#define DEVPROBE_THREADS	16
+#define DEVPROBE_TIMEOUT_MS	5000
+
+/*
+ * Read the volume header and superblock of each device in devlisthead
+ * that has a /dev path, a size and no holders, threads at a time, and
+ * point its devnode->probe at the result.  A result younger than the
+ * devlisthead cache_timeout for the same device and size is reused
+ * without any I/O.  Devices that have not answered in timeout_ms are
+ * DEVPROBE_TIMEDOUT, and are probed again next time.
+ *
+ * ret:
+ * the number of CMFS volumes found
+ * -1 -ENOMEM or no threads could be started
+ */
+int probe_cmfs_devices(struct devlisthead *devlisthead, int threads,
+		       int timeout_ms);
+
+#endif  /* _INTERNAL_PROBE_H */
@@ -58,6 +58,8 @@ struct devpath {
 	char path[MAXPATHLEN];
 };
 
+struct devprobe;
+
 /* this structure holds all the data for each maj/min found in the system
  * that is a block device
  */
@@ -73,6 +75,8 @@ struct devnode {
 				 * 2 is raid slave - data from /proc/mdstat */
 	int mapper;		/* 0 nothing, 1 we believe it's a devmap dev */
 	void *filter;		/* your filter output.. whatever it is */
+	struct devprobe *probe;	/* set by probe_cmfs_devices(), points into
+				 * devlisthead->probecache */
 };
 
 /* this is what you get after a scan... if you are lucky */
@@ -92,6 +96,8 @@ struct devlisthead {
 				 * /proc/mdstat */
 	int mapper;		/* set to 1 if we were able to run
 				 * something against mapper */
+	struct devprobe *probecache;	/* probe results, kept across
+					 * rescans */
 };
 
 typedef void (*devfilter) (struct devnode * cur, void *arg);
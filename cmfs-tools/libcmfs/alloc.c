@@ -0,0 +1,713 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * alloc.c
+ *
+ * Allocate clusters and blocks from the chain allocators.  For the
+ * CMFS userspace library.
+ *
+ * Copyright (C) 2012, Coly Li <i@coly.li>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#define _XOPEN_SOURCE 600  /* Triggers XOPEN2K in features.h */
+#define _LARGEFILE64_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <cmfs/cmfs.h>
+#include <cmfs/bitops.h>
+#include "cmfs_err.h"
+
+/*
+ * An allocator holds its dinode and every group descriptor of its
+ * chains in memory.  Allocations only change the in-memory copies and
+ * mark them dirty; cmfs_allocator_flush() writes the dirty ones back.
+ * A tool that creates many files therefore updates each descriptor
+ * once per flush instead of once per allocation.
+ *
+ * The global bitmap allocator also keeps a cmfs_free_index, so finding
+ * a free extent doesn't scan the bitmaps.  Every change is also passed
+ * on to the group summary of the allocator type, if fs has one.  Sub
+ * allocators (inode_alloc, extent_alloc, ...) hand out single blocks,
+ * or runs of them, and grow by one group of cl_cpg clusters, taken
+ * from the global bitmap, when they are full.
+ */
+struct cmfs_alloc_group {
+	uint64_t ag_blkno;
+	char *ag_buf;			/* descriptor, cpu order */
+	int ag_dirty;
+};
+
+struct _cmfs_allocator {
+	cmfs_filesys *ca_fs;
+	int ca_type;
+	uint64_t ca_blkno;
+	char *ca_di_buf;		/* allocator dinode, cpu order */
+	int ca_dirty;
+
+	struct cmfs_alloc_group *ca_groups;
+	uint32_t ca_nr_groups;
+	uint32_t ca_max_groups;
+	uint32_t ca_hint;		/* group of the last allocation */
+
+	/* Global bitmap only */
+	cmfs_free_index *ca_index;
+	uint32_t *ca_slots;		/* group + 1 by cluster / cl_cpg */
+	uint32_t ca_nr_slots;
+};
+
+#define ca_dinode(ca)	((struct cmfs_dinode *)(ca)->ca_di_buf)
+#define ca_chain(ca)	(&ca_dinode(ca)->id2.i_chain)
+#define ag_desc(ag)	((struct cmfs_group_desc *)(ag)->ag_buf)
+
+static errcode_t add_group(cmfs_allocator *ca, uint64_t blkno, char *buf)
+{
+	struct cmfs_alloc_group *groups;
+	uint32_t max;
+
+	if (ca->ca_nr_groups == ca->ca_max_groups) {
+		max = ca->ca_max_groups ? ca->ca_max_groups * 2 : 16;
+		groups = realloc(ca->ca_groups,
+				 max * sizeof(struct cmfs_alloc_group));
+		if (!groups)
+			return CMFS_ET_NO_MEMORY;
+		ca->ca_groups = groups;
+		ca->ca_max_groups = max;
+	}
+
+	ca->ca_groups[ca->ca_nr_groups].ag_blkno = blkno;
+	ca->ca_groups[ca->ca_nr_groups].ag_buf = buf;
+	ca->ca_groups[ca->ca_nr_groups].ag_dirty = 0;
+	ca->ca_nr_groups++;
+
+	return 0;
+}
+
+/* First cluster covered by a global bitmap group */
+static uint32_t group_base(cmfs_allocator *ca, struct cmfs_group_desc *gd)
+{
+	uint32_t base;
+
+	base = cmfs_blocks_to_clusters(ca->ca_fs, gd->bg_blkno);
+	return base - base % ca_chain(ca)->cl_cpg;
+}
+
+static errcode_t load_index(cmfs_allocator *ca)
+{
+	cmfs_filesys *fs = ca->ca_fs;
+	struct cmfs_group_desc *gd;
+	uint32_t cpg = ca_chain(ca)->cl_cpg, slot, i;
+	errcode_t ret;
+
+	ret = cmfs_new_free_index(fs, &ca->ca_index);
+	if (ret)
+		return ret;
+
+	ca->ca_nr_slots = (fs->fs_clusters + cpg - 1) / cpg;
+	ret = cmfs_malloc0(ca->ca_nr_slots * sizeof(uint32_t),
+			   &ca->ca_slots);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < ca->ca_nr_groups; i++) {
+		gd = ag_desc(&ca->ca_groups[i]);
+		slot = group_base(ca, gd) / cpg;
+		if ((slot >= ca->ca_nr_slots) || ca->ca_slots[slot])
+			return CMFS_ET_BAD_GROUP_DESC_MAGIC;
+		ca->ca_slots[slot] = i + 1;
+
+		ret = cmfs_free_index_add_group(ca->ca_index, gd, cpg);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+void cmfs_close_allocator(cmfs_allocator *ca)
+{
+	uint32_t i;
+
+	if (!ca)
+		return;
+
+	for (i = 0; i < ca->ca_nr_groups; i++)
+		cmfs_free(&ca->ca_groups[i].ag_buf);
+	if (ca->ca_groups)
+		free(ca->ca_groups);
+	if (ca->ca_slots)
+		cmfs_free(&ca->ca_slots);
+	cmfs_close_free_index(ca->ca_index);
+	if (ca->ca_di_buf)
+		cmfs_free(&ca->ca_di_buf);
+	cmfs_free(&ca);
+}
+
+/*
+ * Load the system allocator of the given type (GLOBAL_BITMAP_SYSTEM_INODE,
+ * INODE_ALLOC_SYSTEM_INODE, ...) with all of its group descriptors.
+ */
+errcode_t cmfs_open_allocator(cmfs_filesys *fs, int type,
+			      cmfs_allocator **ret_ca)
+{
+	cmfs_allocator *ca;
+	struct cmfs_dinode *di;
+	struct cmfs_chain_list *cl;
+	struct cmfs_group_desc *gd;
+	char name[CMFS_MAX_FILENAME_LEN];
+	char *gd_buf = NULL;
+	uint64_t gd_blkno, nr_groups;
+	int i;
+	errcode_t ret;
+
+	if (!(fs->fs_flags & CMFS_FLAG_RW))
+		return CMFS_ET_RO_FILESYS;
+	if ((type < 0) || (type >= NUM_SYSTEM_INODES))
+		return CMFS_ET_INVALID_ARGUMENT;
+
+	ret = cmfs_malloc0(sizeof(cmfs_allocator), &ca);
+	if (ret)
+		return ret;
+
+	ca->ca_fs = fs;
+	ca->ca_type = type;
+
+	ret = cmfs_malloc_block(fs->fs_io, &ca->ca_di_buf);
+	if (ret)
+		goto out;
+
+	cmfs_sprintf_system_inode_name(name, sizeof(name), type);
+	ret = cmfs_lookup(fs, fs->fs_sysdir_blkno, name, strlen(name),
+			  NULL, &ca->ca_blkno);
+	if (ret)
+		goto out;
+	ret = cmfs_read_inode(fs, ca->ca_blkno, ca->ca_di_buf);
+	if (ret)
+		goto out;
+
+	di = ca_dinode(ca);
+	cl = ca_chain(ca);
+	ret = CMFS_ET_INODE_CANNOT_BE_ITERATED;
+	if (!(di->i_flags & CMFS_CHAIN_FL) || !cl->cl_cpg || !cl->cl_bpc ||
+	    (cl->cl_next_free_rec > cl->cl_count) ||
+	    (cl->cl_count > cmfs_chain_recs_per_inode(fs->fs_blocksize)))
+		goto out;
+
+	ret = cmfs_prefetch_group_descs(fs, di);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < cl->cl_next_free_rec; i++) {
+		nr_groups = 0;
+		for (gd_blkno = cl->cl_recs[i].c_blkno; gd_blkno;
+		     gd_blkno = gd->bg_next_group) {
+			ret = CMFS_ET_BAD_GROUP_DESC_MAGIC;
+			if (++nr_groups > fs->fs_clusters)
+				goto out;
+
+			ret = cmfs_malloc_block(fs->fs_io, &gd_buf);
+			if (ret)
+				goto out;
+			ret = cmfs_read_group_desc(fs, gd_blkno, gd_buf);
+			if (ret)
+				goto out;
+
+			gd = (struct cmfs_group_desc *)gd_buf;
+			if ((gd->bg_blkno != gd_blkno) ||
+			    (gd->bg_parent_dinode != ca->ca_blkno) ||
+			    (gd->bg_chain != i) ||
+			    (gd->bg_bits > gd->bg_size * 8)) {
+				ret = CMFS_ET_BAD_GROUP_DESC_MAGIC;
+				goto out;
+			}
+
+			ret = add_group(ca, gd_blkno, gd_buf);
+			if (ret)
+				goto out;
+			gd_buf = NULL;
+			gd = ag_desc(&ca->ca_groups[ca->ca_nr_groups - 1]);
+		}
+	}
+
+	if (type == GLOBAL_BITMAP_SYSTEM_INODE) {
+		ret = load_index(ca);
+		if (ret)
+			goto out;
+	}
+
+	*ret_ca = ca;
+	ca = NULL;
+	ret = 0;
+
+out:
+	if (gd_buf)
+		cmfs_free(&gd_buf);
+	cmfs_close_allocator(ca);
+	return ret;
+}
+
+/* Write back every descriptor and the dinode changed since the last flush */
+errcode_t cmfs_allocator_flush(cmfs_allocator *ca)
+{
+	struct cmfs_alloc_group *ag;
+	uint32_t i;
+	errcode_t ret;
+
+	for (i = 0; i < ca->ca_nr_groups; i++) {
+		ag = &ca->ca_groups[i];
+		if (!ag->ag_dirty)
+			continue;
+		ret = cmfs_write_group_desc(ca->ca_fs, ag->ag_blkno,
+					    ag->ag_buf);
+		if (ret)
+			return ret;
+		ag->ag_dirty = 0;
+	}
+
+	if (ca->ca_dirty) {
+		ret = cmfs_write_inode(ca->ca_fs, ca->ca_blkno,
+				       ca->ca_di_buf);
+		if (ret)
+			return ret;
+		ca->ca_dirty = 0;
+	}
+
+	return 0;
+}
+
+/* Account for nr bits of a group becoming used (nr > 0) or free */
+static void account_bits(cmfs_allocator *ca, struct cmfs_alloc_group *ag,
+			 int nr)
+{
+	struct cmfs_group_desc *gd = ag_desc(ag);
+
+	gd->bg_free_bits_count -= nr;
+	ca_chain(ca)->cl_recs[gd->bg_chain].c_free -= nr;
+	ca_dinode(ca)->id1.bitmap1.i_used += nr;
+	ag->ag_dirty = 1;
+	ca->ca_dirty = 1;
+}
+
+/*
+ * Set or clear the bits of clusters [cpos, cpos + len) in the global
+ * bitmap.  The whole range is checked before anything is changed, so
+ * on error the bitmap is untouched.
+ */
+static errcode_t change_clusters(cmfs_allocator *ca, uint32_t cpos,
+				 uint32_t len, int set)
+{
+	struct cmfs_alloc_group *ag;
+	struct cmfs_group_desc *gd;
+	uint32_t cpg = ca_chain(ca)->cl_cpg, slot, pos, end, bit, n, i;
+	int pass;
+
+	if (!len || (cpos + len < cpos) ||
+	    (cpos + len > ca->ca_fs->fs_clusters))
+		return CMFS_ET_INVALID_ARGUMENT;
+
+	for (pass = 0; pass < 2; pass++) {
+		for (pos = cpos, end = cpos + len; pos < end; pos += n) {
+			slot = pos / cpg;
+			if (!ca->ca_slots[slot])
+				return CMFS_ET_INVALID_ARGUMENT;
+			ag = &ca->ca_groups[ca->ca_slots[slot] - 1];
+			gd = ag_desc(ag);
+
+			bit = pos - slot * cpg;
+			if (bit >= gd->bg_bits)
+				return CMFS_ET_INVALID_ARGUMENT;
+			n = gd->bg_bits - bit;
+			if (n > end - pos)
+				n = end - pos;
+
+			if (!pass) {
+				if (set && (cmfs_find_next_bit_set(gd->bg_bitmap,
+						bit + n, bit) < bit + n))
+					return CMFS_ET_INVALID_ARGUMENT;
+				if (!set && (cmfs_find_next_bit_clear(gd->bg_bitmap,
+						bit + n, bit) < bit + n))
+					return CMFS_ET_INVALID_ARGUMENT;
+				continue;
+			}
+
+			for (i = 0; i < n; i++) {
+				if (set)
+					cmfs_set_bit(bit + i, gd->bg_bitmap);
+				else
+					cmfs_clear_bit(bit + i, gd->bg_bitmap);
+			}
+			account_bits(ca, ag, set ? (int)n : -(int)n);
+			cmfs_group_summary_update(ca->ca_fs, ca->ca_type, gd,
+						  bit, n, set);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Allocate between min_len and max_len contiguous clusters, as close
+ * to goal as possible.  Only valid on the global bitmap.
+ */
+errcode_t cmfs_alloc_clusters(cmfs_allocator *ca, uint32_t goal,
+			      uint32_t min_len, uint32_t max_len,
+			      uint32_t *cpos, uint32_t *len)
+{
+	errcode_t ret;
+
+	if (!ca->ca_index)
+		return CMFS_ET_INVALID_ARGUMENT;
+	if (goal >= ca->ca_fs->fs_clusters)
+		goal = 0;
+
+	ret = cmfs_free_index_near(ca->ca_index, goal, min_len, max_len,
+				   cpos, len);
+	if (ret)
+		return ret;
+
+	ret = change_clusters(ca, *cpos, *len, 1);
+	if (ret)
+		cmfs_free_index_insert(ca->ca_index, *cpos, *len);
+	return ret;
+}
+
+/* Allocate exactly len clusters from the smallest free extent that fits */
+errcode_t cmfs_alloc_clusters_fit(cmfs_allocator *ca, uint32_t len,
+				  uint32_t *cpos)
+{
+	errcode_t ret;
+
+	if (!ca->ca_index)
+		return CMFS_ET_INVALID_ARGUMENT;
+
+	ret = cmfs_free_index_best_fit(ca->ca_index, len, cpos);
+	if (ret)
+		return ret;
+
+	ret = change_clusters(ca, *cpos, len, 1);
+	if (ret)
+		cmfs_free_index_insert(ca->ca_index, *cpos, len);
+	return ret;
+}
+
+/* The longest run of free clusters, without allocating it */
+errcode_t cmfs_largest_free_clusters(cmfs_allocator *ca, uint32_t *cpos,
+				     uint32_t *len)
+{
+	if (!ca->ca_index)
+		return CMFS_ET_INVALID_ARGUMENT;
+
+	return cmfs_free_index_largest(ca->ca_index, cpos, len);
+}
+
+errcode_t cmfs_free_clusters(cmfs_allocator *ca, uint32_t cpos,
+			     uint32_t len)
+{
+	errcode_t ret;
+
+	if (!ca->ca_index)
+		return CMFS_ET_INVALID_ARGUMENT;
+
+	ret = change_clusters(ca, cpos, len, 0);
+	if (ret)
+		return ret;
+
+	return cmfs_free_index_insert(ca->ca_index, cpos, len);
+}
+
+/*
+ * Add a group of cl_cpg clusters from the global bitmap to a sub
+ * allocator, the same way mkfs lays out its first group.  An unused
+ * chain record is filled first, otherwise the group goes to the head
+ * of the chain with the fewest bits.
+ */
+static errcode_t grow_suballocator(cmfs_allocator *ca,
+				   cmfs_allocator *cluster_ca)
+{
+	cmfs_filesys *fs = ca->ca_fs;
+	struct cmfs_dinode *di = ca_dinode(ca);
+	struct cmfs_chain_list *cl = ca_chain(ca);
+	struct cmfs_group_desc *gd;
+	char *gd_buf = NULL;
+	uint32_t cpos;
+	uint16_t chain = 0;
+	int i;
+	errcode_t ret;
+
+	for (i = 0; i < cl->cl_next_free_rec; i++) {
+		if (!cl->cl_recs[i].c_blkno) {
+			chain = i;
+			break;
+		}
+		if (cl->cl_recs[i].c_total < cl->cl_recs[chain].c_total)
+			chain = i;
+	}
+	if ((i == cl->cl_next_free_rec) && (i < cl->cl_count)) {
+		chain = i;
+		memset(&cl->cl_recs[chain], 0, sizeof(struct cmfs_chain_rec));
+		cl->cl_next_free_rec++;
+	}
+
+	ret = cmfs_malloc_block(fs->fs_io, &gd_buf);
+	if (ret)
+		return ret;
+	ret = cmfs_alloc_clusters_fit(cluster_ca, cl->cl_cpg, &cpos);
+	if (ret)
+		goto out;
+
+	memset(gd_buf, 0, fs->fs_blocksize);
+	gd = (struct cmfs_group_desc *)gd_buf;
+	strcpy((char *)gd->bg_signature, CMFS_GROUP_DESC_SIGNATURE);
+	gd->bg_generation = fs->fs_super->i_fs_generation;
+	gd->bg_size = (uint32_t)cmfs_group_bitmap_size(fs->fs_blocksize, 0);
+	gd->bg_bits = cl->cl_cpg * cl->cl_bpc;
+	gd->bg_chain = chain;
+	gd->bg_parent_dinode = ca->ca_blkno;
+	gd->bg_blkno = cmfs_clusters_to_blocks(fs, cpos);
+	gd->bg_next_group = cl->cl_recs[chain].c_blkno;
+	cmfs_set_bit(0, gd->bg_bitmap);		/* the descriptor */
+	gd->bg_free_bits_count = gd->bg_bits - 1;
+
+	ret = add_group(ca, gd->bg_blkno, gd_buf);
+	if (ret) {
+		cmfs_free_clusters(cluster_ca, cpos, cl->cl_cpg);
+		goto out;
+	}
+	gd_buf = NULL;
+	ca->ca_groups[ca->ca_nr_groups - 1].ag_dirty = 1;
+	ca->ca_hint = ca->ca_nr_groups - 1;
+	cmfs_group_summary_add(fs, ca->ca_type, gd);
+
+	cl->cl_recs[chain].c_blkno = gd->bg_blkno;
+	cl->cl_recs[chain].c_total += gd->bg_bits;
+	cl->cl_recs[chain].c_free += gd->bg_free_bits_count;
+	di->id1.bitmap1.i_total += gd->bg_bits;
+	di->id1.bitmap1.i_used++;
+	di->i_clusters += cl->cl_cpg;
+	di->i_size = (uint64_t)di->i_clusters * fs->fs_clustersize;
+	ca->ca_dirty = 1;
+
+out:
+	if (gd_buf)
+		cmfs_free(&gd_buf);
+	return ret;
+}
+
+/*
+ * Allocate one block from a sub allocator, growing it from cluster_ca
+ * when all of its groups are full.  The suballoc bit is the offset of
+ * the block in its group, the group starts at blkno - suballoc_bit.
+ */
+errcode_t cmfs_alloc_block(cmfs_allocator *ca, cmfs_allocator *cluster_ca,
+			   uint64_t *blkno, uint16_t *suballoc_bit)
+{
+	struct cmfs_alloc_group *ag;
+	struct cmfs_group_desc *gd;
+	uint32_t i, idx;
+	int bit;
+	errcode_t ret;
+
+	if (ca->ca_index)
+		return CMFS_ET_INVALID_ARGUMENT;
+
+	for (i = 0; i <= ca->ca_nr_groups; i++) {
+		if (i == ca->ca_nr_groups) {
+			ret = grow_suballocator(ca, cluster_ca);
+			if (ret)
+				return ret;
+			idx = ca->ca_nr_groups - 1;
+		} else
+			idx = (ca->ca_hint + i) % ca->ca_nr_groups;
+
+		ag = &ca->ca_groups[idx];
+		gd = ag_desc(ag);
+		if (!gd->bg_free_bits_count)
+			continue;
+
+		bit = cmfs_find_next_bit_clear(gd->bg_bitmap, gd->bg_bits, 1);
+		if (bit >= gd->bg_bits)
+			continue;
+
+		cmfs_set_bit(bit, gd->bg_bitmap);
+		account_bits(ca, ag, 1);
+		cmfs_group_summary_update(ca->ca_fs, ca->ca_type, gd, bit, 1,
+					  1);
+		ca->ca_hint = idx;
+		*blkno = gd->bg_blkno + bit;
+		*suballoc_bit = bit;
+		return 0;
+	}
+
+	return CMFS_ET_NO_SPACE;
+}
+
+/* The longest run of clear bits in gd, stopping at one of want */
+static uint32_t longest_clear_run(struct cmfs_group_desc *gd, uint32_t want,
+				  uint32_t *start)
+{
+	uint32_t bit, end, best = 0;
+
+	*start = 0;
+	for (bit = cmfs_find_next_bit_clear(gd->bg_bitmap, gd->bg_bits, 0);
+	     bit < gd->bg_bits;
+	     bit = cmfs_find_next_bit_clear(gd->bg_bitmap, gd->bg_bits,
+					     end)) {
+		end = cmfs_find_next_bit_set(gd->bg_bitmap, gd->bg_bits, bit);
+		if (end - bit > best) {
+			best = end - bit;
+			*start = bit;
+			if (best >= want)
+				break;
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Allocate up to want contiguous blocks from a sub allocator, for
+ * callers that write many blocks at once.  A group with a free run of
+ * want is taken first, then a new group, and only when cluster_ca is
+ * out of space too the longest run left anywhere.  *got says how many
+ * blocks start at *blkno; their suballoc bits follow *suballoc_bit.
+ */
+errcode_t cmfs_alloc_blocks(cmfs_allocator *ca, cmfs_allocator *cluster_ca,
+			    uint32_t want, uint64_t *blkno,
+			    uint16_t *suballoc_bit, uint32_t *got)
+{
+	struct cmfs_alloc_group *ag;
+	struct cmfs_group_desc *gd;
+	uint32_t i, idx, run, start, best = 0, best_idx = 0, best_start = 0;
+	errcode_t ret;
+
+	if (ca->ca_index || !want)
+		return CMFS_ET_INVALID_ARGUMENT;
+
+	for (i = 0; i < ca->ca_nr_groups; i++) {
+		idx = (ca->ca_hint + i) % ca->ca_nr_groups;
+		gd = ag_desc(&ca->ca_groups[idx]);
+		if (gd->bg_free_bits_count <= best)
+			continue;
+		run = longest_clear_run(gd, want, &start);
+		if (run > best) {
+			best = run;
+			best_idx = idx;
+			best_start = start;
+			if (best >= want)
+				break;
+		}
+	}
+
+	if (best < want) {
+		ret = grow_suballocator(ca, cluster_ca);
+		if (!ret) {
+			best_idx = ca->ca_nr_groups - 1;
+			gd = ag_desc(&ca->ca_groups[best_idx]);
+			best = longest_clear_run(gd, want, &best_start);
+		} else if ((ret != CMFS_ET_NO_SPACE) || !best)
+			return ret;
+	}
+
+	if (best > want)
+		best = want;
+
+	ag = &ca->ca_groups[best_idx];
+	gd = ag_desc(ag);
+	for (i = 0; i < best; i++)
+		cmfs_set_bit(best_start + i, gd->bg_bitmap);
+	account_bits(ca, ag, best);
+	cmfs_group_summary_update(ca->ca_fs, ca->ca_type, gd, best_start,
+				  best, 1);
+	ca->ca_hint = best_idx;
+	*blkno = gd->bg_blkno + best_start;
+	*suballoc_bit = best_start;
+	*got = best;
+	return 0;
+}
+
+/* Give back a block of a sub allocator, such as an old extent block */
+errcode_t cmfs_free_block(cmfs_allocator *ca, uint64_t blkno)
+{
+	struct cmfs_alloc_group *ag;
+	struct cmfs_group_desc *gd;
+	uint32_t i, bit;
+
+	if (ca->ca_index)
+		return CMFS_ET_INVALID_ARGUMENT;
+
+	for (i = 0; i < ca->ca_nr_groups; i++) {
+		ag = &ca->ca_groups[i];
+		gd = ag_desc(ag);
+		if ((blkno < gd->bg_blkno) ||
+		    (blkno >= gd->bg_blkno + gd->bg_bits))
+			continue;
+
+		/* Bit 0 is the descriptor itself */
+		bit = blkno - gd->bg_blkno;
+		if (!bit || !cmfs_test_bit(bit, gd->bg_bitmap))
+			return CMFS_ET_INVALID_ARGUMENT;
+
+		cmfs_clear_bit(bit, gd->bg_bitmap);
+		account_bits(ca, ag, -1);
+		cmfs_group_summary_update(ca->ca_fs, ca->ca_type, gd, bit, 1,
+					  0);
+		return 0;
+	}
+
+	return CMFS_ET_INVALID_ARGUMENT;
+}
+
+/*
+ * Allocate an inode block from ca and set up a valid, empty inode in
+ * inode_buf, as mkfs does for the files it creates.  Nothing is written,
+ * the caller fills in the rest and writes the inode.
+ */
+errcode_t cmfs_new_inode(cmfs_allocator *ca, cmfs_allocator *cluster_ca,
+			 uint16_t mode, char *inode_buf, uint64_t *ret_blkno)
+{
+	cmfs_filesys *fs = ca->ca_fs;
+	struct cmfs_dinode *di = (struct cmfs_dinode *)inode_buf;
+	uint64_t blkno, now = time(NULL);
+	uint16_t bit;
+	errcode_t ret;
+
+	ret = cmfs_alloc_block(ca, cluster_ca, &blkno, &bit);
+	if (ret)
+		return ret;
+
+	memset(inode_buf, 0, fs->fs_blocksize);
+	strcpy((char *)di->i_signature, CMFS_INODE_SIGNATURE);
+	di->i_generation = fs->fs_super->i_fs_generation;
+	di->i_fs_generation = fs->fs_super->i_fs_generation;
+	if (ca->ca_type == INODE_ALLOC_SYSTEM_INODE)
+		di->i_suballoc_slot = 0;
+	else
+		di->i_suballoc_slot = (uint16_t)CMFS_INVALID_SLOT;
+	di->i_suballoc_bit = bit;
+	di->i_suballoc_loc = blkno - bit;
+	di->i_blkno = blkno;
+	di->i_mode = mode;
+	di->i_links_count = S_ISDIR(mode) ? 2 : 1;
+	di->i_flags = CMFS_VALID_FL;
+	di->i_atime = di->i_ctime = di->i_mtime = now;
+	di->id2.i_list.l_count = cmfs_extent_recs_per_inode(fs->fs_blocksize);
+
+	*ret_blkno = blkno;
+	return 0;
+}
@@ -26,26 +26,211 @@
 #define _LARGEFILE64_SOURCE
 
 #include <string.h>
+#include <pthread.h>
 
 #include <cmfs/cmfs.h>
+#include <cmfs-kernel/kernel-list.h>
 #include "cmfs_err.h"
 
+/*
+ * The inode cache keeps cmfs_cached_inode objects alive after the
+ * last cmfs_free_cached_inode(), so tools which come back to the same
+ * inodes (the global bitmap, the allocators, the journal) do not have
+ * to allocate a new object and re-read the dinode every time.
+ *
+ * 1) Every cached inode is hashed by ci_blkno into ic_hash.  A lookup
+ *    takes a reference on the object it finds.
+ *
+ * 2) When the last reference is dropped, the object is not freed but
+ *    moved to the tail of ic_lru.  Once more than ic_limit unused
+ *    objects sit on ic_lru, the oldest ones are freed.
+ *
+ * Referenced objects are never reclaimed.  All cached inodes must be
+ * released before cmfs_close(), which frees whatever is left.
+ *
+ * With CMFS_FLAG_THREADED the hash, the LRU and the refcounts are
+ * protected by ic_lock.  The dinode is read without the lock held; if
+ * another thread inserted the same inode meanwhile, ours is dropped.
+ */
+#define CMFS_ICACHE_HASH_BITS		8
+#define CMFS_ICACHE_HASH_SIZE		(1 << CMFS_ICACHE_HASH_BITS)
+#define CMFS_ICACHE_DEFAULT_LIMIT	128
+
+struct cmfs_icache_entry {
+	cmfs_cached_inode ice_ci;	/* must be first */
+	struct list_head ice_hash;
+	struct list_head ice_lru;
+};
+
+struct cmfs_icache {
+	int ic_threaded;
+	pthread_mutex_t ic_lock;
+	unsigned int ic_limit;
+	unsigned int ic_nr_unused;
+	struct list_head ic_lru;
+	struct list_head ic_hash[CMFS_ICACHE_HASH_SIZE];
+
+	/* stats */
+	uint32_t ic_hits;
+	uint32_t ic_misses;
+	uint32_t ic_inserts;
+	uint32_t ic_removes;
+};
+
+static inline struct cmfs_icache_entry *to_entry(cmfs_cached_inode *cinode)
+{
+	return (struct cmfs_icache_entry *)cinode;
+}
+
+static inline struct list_head *icache_bucket(struct cmfs_icache *icache,
+					      uint64_t blkno)
+{
+	return &icache->ic_hash[blkno & (CMFS_ICACHE_HASH_SIZE - 1)];
+}
+
+static inline void icache_lock(struct cmfs_icache *icache)
+{
+	if (icache->ic_threaded)
+		pthread_mutex_lock(&icache->ic_lock);
+}
+
+static inline void icache_unlock(struct cmfs_icache *icache)
+{
+	if (icache->ic_threaded)
+		pthread_mutex_unlock(&icache->ic_lock);
+}
+
+/* Called by cmfs_open(), before the filesystem can be shared */
+errcode_t cmfs_icache_init(cmfs_filesys *fs)
+{
+	errcode_t ret;
+	int i;
+	struct cmfs_icache *icache;
+
+	if (fs->fs_icache)
+		return 0;
+
+	ret = cmfs_malloc0(sizeof(struct cmfs_icache), &icache);
+	if (ret)
+		return ret;
+
+	icache->ic_threaded = !!(fs->fs_flags & CMFS_FLAG_THREADED);
+	if (icache->ic_threaded)
+		pthread_mutex_init(&icache->ic_lock, NULL);
+	icache->ic_limit = CMFS_ICACHE_DEFAULT_LIMIT;
+	INIT_LIST_HEAD(&icache->ic_lru);
+	for (i = 0; i < CMFS_ICACHE_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&icache->ic_hash[i]);
+
+	fs->fs_icache = icache;
+	return 0;
+}
+
+static void icache_destroy_entry(struct cmfs_icache_entry *ice)
+{
+	cmfs_cached_inode *cinode = &ice->ice_ci;
+
+	if (cinode->ci_chains)
+		cmfs_bitmap_free(cinode->ci_chains);
+
+	if (cinode->ci_inode)
+		cmfs_free(&cinode->ci_inode);
+
+	cmfs_free(&ice);
+}
+
+static void icache_remove(struct cmfs_icache *icache,
+			  struct cmfs_icache_entry *ice)
+{
+	list_del(&ice->ice_hash);
+	INIT_LIST_HEAD(&ice->ice_hash);
+	if (!list_empty(&ice->ice_lru)) {
+		list_del(&ice->ice_lru);
+		INIT_LIST_HEAD(&ice->ice_lru);
+		icache->ic_nr_unused--;
+	}
+	icache->ic_removes++;
+}
+
+/* Free unused entries from the head of the LRU until we fit in limit */
+static void icache_shrink(struct cmfs_icache *icache, unsigned int limit)
+{
+	struct cmfs_icache_entry *ice;
+
+	while (icache->ic_nr_unused > limit) {
+		ice = list_entry(icache->ic_lru.next,
+				 struct cmfs_icache_entry, ice_lru);
+		icache_remove(icache, ice);
+		icache_destroy_entry(ice);
+	}
+}
+
+static struct cmfs_icache_entry *icache_lookup(struct cmfs_icache *icache,
+					       uint64_t blkno)
+{
+	struct list_head *bucket, *p;
+	struct cmfs_icache_entry *ice;
+
+	bucket = icache_bucket(icache, blkno);
+	list_for_each(p, bucket) {
+		ice = list_entry(p, struct cmfs_icache_entry, ice_hash);
+		if (ice->ice_ci.ci_blkno == blkno)
+			return ice;
+	}
+
+	return NULL;
+}
+
+/* Take a reference on a looked up entry, with ic_lock held */
+static void icache_get(struct cmfs_icache *icache,
+		       struct cmfs_icache_entry *ice)
+{
+	if (!ice->ice_ci.ci_refcount) {
+		list_del(&ice->ice_lru);
+		INIT_LIST_HEAD(&ice->ice_lru);
+		icache->ic_nr_unused--;
+	}
+	ice->ice_ci.ci_refcount++;
+}
+
 errcode_t cmfs_read_cached_inode(cmfs_filesys *fs,
 				 uint64_t blkno,
 				 cmfs_cached_inode **ret_ci)
 {
 	errcode_t ret;
 	char *blk;
+	struct cmfs_icache *icache;
+	struct cmfs_icache_entry *ice, *found;
 	cmfs_cached_inode *cinode;
 
 	if ((blkno < CMFS_SUPER_BLOCK_BLKNO) ||
 	    (blkno > fs->fs_blocks))
 		return CMFS_ET_BAD_BLKNO;
 
-	ret = cmfs_malloc0(sizeof(cmfs_cached_inode), &cinode);
+	ret = cmfs_icache_init(fs);
 	if (ret)
 		return ret;
+	icache = fs->fs_icache;
 
+	icache_lock(icache);
+	ice = icache_lookup(icache, blkno);
+	if (ice) {
+		icache->ic_hits++;
+		icache_get(icache, ice);
+		icache_unlock(icache);
+		*ret_ci = &ice->ice_ci;
+		return 0;
+	}
+	icache->ic_misses++;
+	icache_unlock(icache);
+
+	ret = cmfs_malloc0(sizeof(struct cmfs_icache_entry), &ice);
+	if (ret)
+		return ret;
+
+	INIT_LIST_HEAD(&ice->ice_hash);
+	INIT_LIST_HEAD(&ice->ice_lru);
+	cinode = &ice->ice_ci;
 	cinode->ci_fs = fs;
 	cinode->ci_blkno = blkno;
 
@@ -58,29 +243,155 @@ errcode_t cmfs_read_cached_inode(cmfs_filesys *fs,
 	if (ret)
 		goto cleanup;
 
+	icache_lock(icache);
+	found = icache_lookup(icache, blkno);
+	if (found) {
+		/* Lost a race with another reader */
+		icache_get(icache, found);
+		icache_unlock(icache);
+		icache_destroy_entry(ice);
+		*ret_ci = &found->ice_ci;
+		return 0;
+	}
+	cinode->ci_refcount = 1;
+	list_add(&ice->ice_hash, icache_bucket(icache, blkno));
+	icache->ic_inserts++;
+	icache_unlock(icache);
+
 	*ret_ci = cinode;
 
 	return 0;
 
 cleanup:
-	cmfs_free_cached_inode(fs, cinode);
+	icache_destroy_entry(ice);
 	return ret;
 
 }
 
+/*
+ * Drop a reference to a cached inode.  The object stays in the cache
+ * until it is reclaimed from the LRU or the filesystem is closed.
+ */
 errcode_t cmfs_free_cached_inode(cmfs_filesys *fs,
 				 cmfs_cached_inode *cinode)
 {
-	if (!cinode)
+	errcode_t ret = 0;
+	struct cmfs_icache *icache = fs->fs_icache;
+	struct cmfs_icache_entry *ice;
+
+	if (!cinode || !icache)
 		return CMFS_ET_INVALID_ARGUMENT;
 
-	if (cinode->ci_chains)
-		cmfs_bitmap_free(cinode->ci_chains);
+	icache_lock(icache);
+	if (cinode->ci_refcount <= 0) {
+		ret = CMFS_ET_INVALID_ARGUMENT;
+		goto out;
+	}
 
-	if (cinode->ci_inode)
-		cmfs_free(&cinode->ci_inode);
+	ice = to_entry(cinode);
+	if (--cinode->ci_refcount)
+		goto out;
+
+	list_add_tail(&ice->ice_lru, &icache->ic_lru);
+	icache->ic_nr_unused++;
+	icache_shrink(icache, icache->ic_limit);
 
-	cmfs_free(&cinode);
+out:
+	icache_unlock(icache);
+	return ret;
+}
+
+/*
+ * Set how many unused inodes are kept around.  A limit of 0 frees
+ * every cached inode as soon as its last reference is dropped.
+ */
+errcode_t cmfs_icache_set_limit(cmfs_filesys *fs, unsigned int nr_inodes)
+{
+	errcode_t ret;
+
+	ret = cmfs_icache_init(fs);
+	if (ret)
+		return ret;
+
+	icache_lock(fs->fs_icache);
+	fs->fs_icache->ic_limit = nr_inodes;
+	icache_shrink(fs->fs_icache, nr_inodes);
+	icache_unlock(fs->fs_icache);
 
 	return 0;
 }
+
+/*
+ * Called after an inode block was written, so the cached copy does
+ * not go stale.  inode_buf is in cpu byte order.
+ */
+void cmfs_icache_refresh(cmfs_filesys *fs, uint64_t blkno,
+			 const char *inode_buf)
+{
+	struct cmfs_icache_entry *ice;
+
+	if (!fs->fs_icache)
+		return;
+
+	icache_lock(fs->fs_icache);
+	ice = icache_lookup(fs->fs_icache, blkno);
+	if (ice && ((char *)ice->ice_ci.ci_inode != inode_buf))
+		memcpy(ice->ice_ci.ci_inode, inode_buf, fs->fs_blocksize);
+	icache_unlock(fs->fs_icache);
+}
+
+void cmfs_icache_destroy(cmfs_filesys *fs)
+{
+	int i;
+	struct list_head *p, *n;
+	struct cmfs_icache_entry *ice;
+	struct cmfs_icache *icache = fs->fs_icache;
+
+	if (!icache)
+		return;
+
+	for (i = 0; i < CMFS_ICACHE_HASH_SIZE; i++) {
+		list_for_each_safe(p, n, &icache->ic_hash[i]) {
+			ice = list_entry(p, struct cmfs_icache_entry,
+					 ice_hash);
+			icache_remove(icache, ice);
+			icache_destroy_entry(ice);
+		}
+	}
+
+	if (icache->ic_threaded)
+		pthread_mutex_destroy(&icache->ic_lock);
+	cmfs_free(&fs->fs_icache);
+}
+
+/* io_get_stats() plus the counters of the inode cache */
+void cmfs_get_stats(cmfs_filesys *fs, struct cmfs_io_stats *stats)
+{
+	struct cmfs_icache *icache = fs->fs_icache;
+
+	io_get_stats(fs->fs_io, stats);
+	if (icache) {
+		icache_lock(icache);
+		stats->is_icache_hits = icache->ic_hits;
+		stats->is_icache_misses = icache->ic_misses;
+		stats->is_icache_inserts = icache->ic_inserts;
+		stats->is_icache_removes = icache->ic_removes;
+		icache_unlock(icache);
+	}
+}
+
+/* io_reset_stats() plus the counters of the inode cache */
+void cmfs_reset_stats(cmfs_filesys *fs)
+{
+	struct cmfs_icache *icache = fs->fs_icache;
+
+	io_reset_stats(fs->fs_io);
+	if (icache) {
+		icache_lock(icache);
+		icache->ic_hits = 0;
+		icache->ic_misses = 0;
+		icache->ic_inserts = 0;
+		icache->ic_removes = 0;
+		icache_unlock(icache);
+	}
+}
@@ -81,13 +81,14 @@ errcode_t cmfs_read_group_desc(cmfs_filesys *fs,
 	if (ret)
 		return ret;
 
+	io_set_block_type(CMFS_BLOCK_GROUP_DESCRIPTOR);
 	ret = cmfs_read_blocks(fs, blkno, 1, blk);
 	if (ret)
 		goto out;
 
 	gd = (struct cmfs_group_desc *)blk;
 	ret = CMFS_ET_BAD_GROUP_DESC_MAGIC;
-	if (memcpy(gd->bg_signature, CMFS_GROUP_DESC_SIGNATURE,
+	if (memcmp(gd->bg_signature, CMFS_GROUP_DESC_SIGNATURE,
 		   strlen(CMFS_GROUP_DESC_SIGNATURE)))
 		goto out;
 
@@ -101,3 +102,257 @@ out:
 	cmfs_free(&blk);
 	return ret;
 }
+
+errcode_t cmfs_write_group_desc(cmfs_filesys *fs,
+				uint64_t blkno,
+				char *gd_buf)
+{
+	errcode_t ret;
+	char *blk;
+	struct cmfs_group_desc *gd;
+
+	if (!(fs->fs_flags & CMFS_FLAG_RW))
+		return CMFS_ET_RO_FILESYS;
+
+	if ((blkno < CMFS_SUPER_BLOCK_BLKNO) ||
+	    (blkno > fs->fs_blocks))
+		return CMFS_ET_BAD_BLKNO;
+
+	ret = cmfs_malloc_block(fs->fs_io, &blk);
+	if (ret)
+		return ret;
+
+	memcpy(blk, gd_buf, fs->fs_blocksize);
+
+	gd = (struct cmfs_group_desc *)blk;
+	cmfs_swap_group_desc_from_cpu(fs, gd);
+
+	io_set_block_type(CMFS_BLOCK_GROUP_DESCRIPTOR);
+	ret = io_write_block(fs->fs_io, blkno, 1, blk);
+	if (ret)
+		goto out;
+
+	fs->fs_flags |= CMFS_FLAG_CHANGED;
+	ret = 0;
+
+out:
+	cmfs_free(&blk);
+	return ret;
+}
+
+/*
+ * Group descriptor prefetch.
+ *
+ * Walking a chain is one dependent block read per group, which on a
+ * large volume is all seek latency.  The prefetcher reads the
+ * descriptors into the io_cache with large io_vec_read_blocks()
+ * calls, so that the walk the caller does next finds them there.
+ *
+ * The global bitmap is laid out by mkfs: group 0 at fs_first_cg_blkno
+ * and group i at i * cpg clusters, so its descriptors are all read up
+ * front.  Then the chains of the allocator are walked side by side, one
+ * vectored read for the next group of every chain, so a group the
+ * layout didn't predict costs a chain step rather than a read of its
+ * own.  Other allocators get their groups from wherever the global
+ * bitmap had space and only get the side by side walk.
+ *
+ * A single chain can only be walked group by group.  Once two steps
+ * have had the same stride the next groups are guessed along it, in
+ * batches that double while the guesses hold.
+ *
+ * It is only a warm up: without an io_cache it does nothing, and
+ * errors other than running out of memory are left for the real walk
+ * to find.
+ */
+#define CMFS_GD_PREFETCH_MIN	8
+#define CMFS_GD_PREFETCH_MAX	256	/* blocks per io_vec_read_blocks() */
+
+struct gd_prefetch {
+	cmfs_filesys *gp_fs;
+	struct io_vec_unit *gp_ivus;
+	char *gp_bufs;
+	char *gp_gd_buf;
+};
+
+static errcode_t gd_prefetch_init(cmfs_filesys *fs, struct gd_prefetch *gp)
+{
+	errcode_t ret;
+
+	memset(gp, 0, sizeof(struct gd_prefetch));
+	gp->gp_fs = fs;
+	ret = cmfs_malloc(sizeof(struct io_vec_unit) * CMFS_GD_PREFETCH_MAX,
+			  &gp->gp_ivus);
+	if (ret)
+		return ret;
+	ret = cmfs_malloc_blocks(fs->fs_io, CMFS_GD_PREFETCH_MAX,
+				 &gp->gp_bufs);
+	if (ret)
+		return ret;
+	return cmfs_malloc_block(fs->fs_io, &gp->gp_gd_buf);
+}
+
+static void gd_prefetch_free(struct gd_prefetch *gp)
+{
+	if (gp->gp_gd_buf)
+		cmfs_free(&gp->gp_gd_buf);
+	if (gp->gp_bufs)
+		cmfs_free(&gp->gp_bufs);
+	if (gp->gp_ivus)
+		cmfs_free(&gp->gp_ivus);
+}
+
+/* Read nr descriptors at blknos into the io_cache, errors ignored */
+static void gd_prefetch_read(struct gd_prefetch *gp, uint64_t *blknos,
+			     int nr)
+{
+	cmfs_filesys *fs = gp->gp_fs;
+	int i, n;
+
+	for (n = 0; n < nr; ) {
+		for (i = 0; i < CMFS_GD_PREFETCH_MAX && n < nr; n++) {
+			if (blknos[n] <= CMFS_SUPER_BLOCK_BLKNO ||
+			    blknos[n] > fs->fs_blocks)
+				continue;
+			gp->gp_ivus[i].ivu_blkno = blknos[n];
+			gp->gp_ivus[i].ivu_buf = gp->gp_bufs +
+				(uint64_t)i * fs->fs_blocksize;
+			gp->gp_ivus[i].ivu_buflen = fs->fs_blocksize;
+			i++;
+		}
+		if (!i)
+			break;
+		io_set_block_type(CMFS_BLOCK_GROUP_DESCRIPTOR);
+		io_vec_read_blocks(fs->fs_io, gp->gp_ivus, i);
+	}
+}
+
+/* The group after blkno, 0 at the end of the chain or on errors */
+static uint64_t gd_prefetch_next(struct gd_prefetch *gp, uint64_t blkno)
+{
+	struct cmfs_group_desc *gd =
+		(struct cmfs_group_desc *)gp->gp_gd_buf;
+
+	if (cmfs_read_group_desc(gp->gp_fs, blkno, gp->gp_gd_buf) ||
+	    (gd->bg_blkno != blkno))
+		return 0;
+	return gd->bg_next_group;
+}
+
+/*
+ * Prefetch the chain that starts at group descriptor gd_blkno, as
+ * debugfs "group" walks it.
+ */
+errcode_t cmfs_prefetch_group_chain(cmfs_filesys *fs, uint64_t gd_blkno)
+{
+	struct gd_prefetch gp;
+	uint64_t blknos[CMFS_GD_PREFETCH_MAX];
+	uint64_t next, guessed = 0, nr_groups = 0;
+	int64_t stride = 0;
+	int i, batch = CMFS_GD_PREFETCH_MIN, left = 0;
+	errcode_t ret;
+
+	if (!io_get_cache_size(fs->fs_io))
+		return 0;
+
+	ret = gd_prefetch_init(fs, &gp);
+	if (ret)
+		goto out;
+
+	while (gd_blkno && ++nr_groups <= fs->fs_clusters) {
+		next = gd_prefetch_next(&gp, gd_blkno);
+		if (!next)
+			break;
+
+		if (left && (next == guessed + stride)) {
+			/* as guessed */
+			guessed = next;
+			left--;
+		} else if (stride && ((int64_t)(next - gd_blkno) == stride)) {
+			/* the stride held, guess along it */
+			if (left)
+				batch = CMFS_GD_PREFETCH_MIN;
+			else if (batch < CMFS_GD_PREFETCH_MAX)
+				batch *= 2;
+			for (i = 0; i < batch; i++)
+				blknos[i] = next + i * stride;
+			gd_prefetch_read(&gp, blknos, batch);
+			guessed = next;
+			left = batch - 1;
+		} else {
+			stride = next - gd_blkno;
+			left = 0;
+		}
+		gd_blkno = next;
+	}
+
+out:
+	gd_prefetch_free(&gp);
+	return ret;
+}
+
+/*
+ * Prefetch every group descriptor of the chain allocator di, before
+ * walking its chains.
+ */
+errcode_t cmfs_prefetch_group_descs(cmfs_filesys *fs, struct cmfs_dinode *di)
+{
+	struct cmfs_chain_list *cl = &di->id2.i_chain;
+	struct cmfs_cluster_group_sizes cgs;
+	struct gd_prefetch gp;
+	uint64_t *blknos = NULL, stride, level;
+	int i, nr, live;
+	errcode_t ret;
+
+	if (!io_get_cache_size(fs->fs_io))
+		return 0;
+	if (!(di->i_flags & CMFS_CHAIN_FL) || !cl->cl_next_free_rec ||
+	    (cl->cl_next_free_rec > cl->cl_count) ||
+	    (cl->cl_count > cmfs_chain_recs_per_inode(fs->fs_blocksize)))
+		return 0;
+
+	ret = gd_prefetch_init(fs, &gp);
+	if (ret)
+		goto out;
+
+	/* Only the global bitmap has group 0 where mkfs put it */
+	if (cl->cl_recs[0].c_blkno == fs->fs_first_cg_blkno) {
+		cmfs_calc_cluster_groups(fs->fs_clusters, fs->fs_blocksize,
+					 &cgs);
+		nr = cgs.cgs_cluster_groups;
+		stride = cmfs_clusters_to_blocks(fs, cgs.cgs_cpg);
+
+		ret = cmfs_malloc(sizeof(uint64_t) * nr, &blknos);
+		if (ret)
+			goto out;
+		blknos[0] = fs->fs_first_cg_blkno;
+		for (i = 1; i < nr; i++)
+			blknos[i] = i * stride;
+		gd_prefetch_read(&gp, blknos, nr);
+		cmfs_free(&blknos);
+	}
+
+	nr = cl->cl_next_free_rec;
+	ret = cmfs_malloc(sizeof(uint64_t) * nr, &blknos);
+	if (ret)
+		goto out;
+	for (i = 0; i < nr; i++)
+		blknos[i] = cl->cl_recs[i].c_blkno;
+
+	/* Level by level: read the next group of every chain at once */
+	for (level = 0, live = nr; live && level < fs->fs_clusters; level++) {
+		gd_prefetch_read(&gp, blknos, nr);
+		for (i = 0, live = 0; i < nr; i++) {
+			if (!blknos[i])
+				continue;
+			blknos[i] = gd_prefetch_next(&gp, blknos[i]);
+			if (blknos[i])
+				live++;
+		}
+	}
+
+out:
+	if (blknos)
+		cmfs_free(&blknos);
+	gd_prefetch_free(&gp);
+	return ret;
+}
@@ -144,6 +144,7 @@ errcode_t cmfs_read_dir_block(cmfs_filesys *fs,
 	errcode_t ret;
 	int end = fs->fs_blocksize;
 
+	io_set_block_type(CMFS_BLOCK_DIR_BLOCK);
 	ret = cmfs_read_blocks(fs, block, 1, buf);
 	if (ret)
 		goto out;
@@ -173,6 +174,7 @@ errcode_t cmfs_write_dir_block(cmfs_filesys *fs,
 	if (ret)
 		goto out;
 
+	io_set_block_type(CMFS_BLOCK_DIR_BLOCK);
 	ret = io_write_block(fs->fs_io, block, 1, buf);
 out:
 	cmfs_free(&buf);
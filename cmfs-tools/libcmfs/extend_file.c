@@ -0,0 +1,784 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * extend_file.c
+ *
+ * Add extents to the end of an inode's extent tree.  For the CMFS
+ * userspace library.
+ *
+ * Copyright (C) 2012, Coly Li <i@coly.li>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#define _XOPEN_SOURCE 600  /* Triggers XOPEN2K in features.h */
+#define _LARGEFILE64_SOURCE
+
+#include <string.h>
+
+#include <cmfs/cmfs.h>
+#include "cmfs_err.h"
+#include "extent_tree.h"
+
+/*
+ * Only appends are supported: the new extent goes after the last one
+ * in the tree, so the insertion always walks the rightmost path.  When
+ * a node on that path is full, a new subtree is started to its right
+ * in the lowest ancestor with a free record.  When the root is full,
+ * its records move into a new extent block and the tree gets one level
+ * deeper, as in the kernel.
+ *
+ * Interior records cover whole clusters.  A leaf record may end inside
+ * a cluster (directories grow a block at a time), so the interior
+ * e_int_blocks is rounded up to the cluster.
+ */
+struct insert_ctxt {
+	cmfs_filesys *fs;
+	struct cmfs_dinode *di;
+	struct cmfs_extent_rec rec;	/* the leaf record to append */
+	uint64_t v_blkno;		/* logical block of rec */
+	uint64_t v_end;			/* logical end block after the append */
+	cmfs_allocator *eb_ca;
+	cmfs_allocator *cluster_ca;
+	uint64_t new_leaf;		/* extent block of a new leaf */
+};
+
+static errcode_t new_extent_block(struct insert_ctxt *ctxt, int depth,
+				  char *buf, uint64_t *blkno)
+{
+	cmfs_filesys *fs = ctxt->fs;
+	struct cmfs_extent_block *eb = (struct cmfs_extent_block *)buf;
+	uint16_t bit;
+	errcode_t ret;
+
+	ret = cmfs_alloc_block(ctxt->eb_ca, ctxt->cluster_ca, blkno, &bit);
+	if (ret)
+		return ret;
+
+	memset(buf, 0, fs->fs_blocksize);
+	strcpy((char *)eb->h_signature, CMFS_EXTENT_BLOCK_SIGNATURE);
+	eb->h_suballoc_slot = 0;
+	eb->h_suballoc_bit = bit;
+	eb->h_fs_generation = fs->fs_super->i_fs_generation;
+	eb->h_blkno = *blkno;
+	eb->h_list.l_tree_depth = depth;
+	eb->h_list.l_count = cmfs_extent_recs_per_eb(fs->fs_blocksize);
+
+	return 0;
+}
+
+/* Blocks covered by an interior record starting at cpos */
+static uint64_t interior_blocks(struct insert_ctxt *ctxt, uint64_t cpos)
+{
+	uint64_t bpc = cmfs_clusters_to_blocks(ctxt->fs, 1);
+
+	return (ctxt->v_end + bpc - 1) / bpc * bpc -
+		cmfs_clusters_to_blocks(ctxt->fs, cpos);
+}
+
+/*
+ * Build a branch from depth down to a leaf holding ctxt->rec, and
+ * return the block of its top in *top.
+ */
+static errcode_t new_branch(struct insert_ctxt *ctxt, int depth,
+			    uint64_t *top)
+{
+	struct cmfs_extent_block *eb;
+	struct cmfs_extent_rec *rec;
+	char *buf = NULL;
+	uint64_t blkno, child = 0;
+	errcode_t ret;
+
+	if (depth > 0) {
+		ret = new_branch(ctxt, depth - 1, &child);
+		if (ret)
+			return ret;
+	}
+
+	ret = cmfs_malloc_block(ctxt->fs->fs_io, &buf);
+	if (ret)
+		return ret;
+	ret = new_extent_block(ctxt, depth, buf, &blkno);
+	if (ret)
+		goto out;
+
+	eb = (struct cmfs_extent_block *)buf;
+	rec = &eb->h_list.l_recs[0];
+	eb->h_list.l_next_free_rec = 1;
+	if (depth) {
+		rec->e_cpos = ctxt->rec.e_cpos;
+		rec->e_blkno = child;
+		rec->e_int_blocks = interior_blocks(ctxt, rec->e_cpos);
+	} else {
+		*rec = ctxt->rec;
+		ctxt->new_leaf = blkno;
+	}
+
+	ret = cmfs_write_extent_block(ctxt->fs, blkno, buf);
+	if (ret)
+		goto out;
+	*top = blkno;
+
+out:
+	cmfs_free(&buf);
+	return ret;
+}
+
+/*
+ * Append ctxt->rec under el, which is the rightmost node at its depth.
+ * *full is set when neither el nor anything below it has room; el is
+ * unchanged then.
+ */
+static errcode_t append_rec(struct insert_ctxt *ctxt,
+			    struct cmfs_extent_list *el, int *full)
+{
+	cmfs_filesys *fs = ctxt->fs;
+	struct cmfs_extent_rec *last = NULL;
+	struct cmfs_extent_block *eb;
+	uint64_t last_end, child;
+	char *buf = NULL;
+	int child_full = 0;
+	errcode_t ret;
+
+	*full = 0;
+	if (el->l_next_free_rec)
+		last = &el->l_recs[el->l_next_free_rec - 1];
+
+	if (!el->l_tree_depth) {
+		if (last) {
+			last_end = cmfs_clusters_to_blocks(fs, last->e_cpos) +
+				   last->e_leaf_blocks;
+			if (ctxt->v_blkno < last_end)
+				return CMFS_ET_INVALID_ARGUMENT;
+			if ((ctxt->v_blkno == last_end) &&
+			    (last->e_blkno + last->e_leaf_blocks ==
+			     ctxt->rec.e_blkno) &&
+			    (last->e_flags == ctxt->rec.e_flags) &&
+			    ((uint64_t)last->e_leaf_blocks +
+			     ctxt->rec.e_leaf_blocks <= UINT32_MAX)) {
+				last->e_leaf_blocks += ctxt->rec.e_leaf_blocks;
+				return 0;
+			}
+		}
+
+		/* A new record has to start on a cluster */
+		if (ctxt->v_blkno != cmfs_clusters_to_blocks(fs,
+							     ctxt->rec.e_cpos))
+			return CMFS_ET_INVALID_ARGUMENT;
+
+		if (el->l_next_free_rec == el->l_count) {
+			*full = 1;
+			return 0;
+		}
+		el->l_recs[el->l_next_free_rec++] = ctxt->rec;
+		return 0;
+	}
+
+	if (!last)
+		return CMFS_ET_CORRUPT_EXTENT_BLOCK;
+
+	ret = cmfs_malloc_block(fs->fs_io, &buf);
+	if (ret)
+		return ret;
+	ret = cmfs_read_extent_block(fs, last->e_blkno, buf);
+	if (ret)
+		goto out;
+
+	eb = (struct cmfs_extent_block *)buf;
+	if (eb->h_list.l_tree_depth != el->l_tree_depth - 1) {
+		ret = CMFS_ET_CORRUPT_EXTENT_BLOCK;
+		goto out;
+	}
+
+	ret = append_rec(ctxt, &eb->h_list, &child_full);
+	if (ret)
+		goto out;
+
+	if (!child_full) {
+		ret = cmfs_write_extent_block(fs, last->e_blkno, buf);
+		if (ret)
+			goto out;
+		last->e_int_blocks = interior_blocks(ctxt, last->e_cpos);
+		goto out;
+	}
+
+	if (el->l_next_free_rec == el->l_count) {
+		*full = 1;
+		goto out;
+	}
+
+	ret = new_branch(ctxt, el->l_tree_depth - 1, &child);
+	if (ret)
+		goto out;
+
+	last = &el->l_recs[el->l_next_free_rec++];
+	last->e_cpos = ctxt->rec.e_cpos;
+	last->e_blkno = child;
+	last->e_int_blocks = interior_blocks(ctxt, last->e_cpos);
+
+out:
+	cmfs_free(&buf);
+	return ret;
+}
+
+/* Move the root records into a new extent block, one level down */
+static errcode_t push_root(struct insert_ctxt *ctxt)
+{
+	cmfs_filesys *fs = ctxt->fs;
+	struct cmfs_extent_list *el = &ctxt->di->id2.i_list;
+	struct cmfs_extent_block *eb;
+	struct cmfs_extent_rec *last;
+	uint64_t bpc = cmfs_clusters_to_blocks(fs, 1);
+	uint64_t blkno, cpos, end, blocks;
+	char *buf = NULL;
+	errcode_t ret;
+
+	if (el->l_tree_depth + 1 >= CMFS_MAX_PATH_DEPTH)
+		return CMFS_ET_NO_SPACE;
+
+	ret = cmfs_malloc_block(fs->fs_io, &buf);
+	if (ret)
+		return ret;
+	ret = new_extent_block(ctxt, el->l_tree_depth, buf, &blkno);
+	if (ret)
+		goto out;
+
+	eb = (struct cmfs_extent_block *)buf;
+	memcpy(eb->h_list.l_recs, el->l_recs,
+	       el->l_next_free_rec * sizeof(struct cmfs_extent_rec));
+	eb->h_list.l_next_free_rec = el->l_next_free_rec;
+
+	ret = cmfs_write_extent_block(fs, blkno, buf);
+	if (ret)
+		goto out;
+
+	last = &el->l_recs[el->l_next_free_rec - 1];
+	cpos = el->l_recs[0].e_cpos;
+	end = cmfs_clusters_to_blocks(fs, last->e_cpos) +
+	      cmfs_rec_blocks(fs, el->l_tree_depth, last);
+	blocks = (end + bpc - 1) / bpc * bpc -
+		 cmfs_clusters_to_blocks(fs, cpos);
+
+	if (!el->l_tree_depth)
+		ctxt->di->i_last_eb_blk = blkno;
+
+	memset(el->l_recs, 0, el->l_count * sizeof(struct cmfs_extent_rec));
+	el->l_recs[0].e_cpos = cpos;
+	el->l_recs[0].e_blkno = blkno;
+	el->l_recs[0].e_int_blocks = blocks;
+	el->l_next_free_rec = 1;
+	el->l_tree_depth++;
+
+out:
+	cmfs_free(&buf);
+	return ret;
+}
+
+/*
+ * Append blocks [v_blkno, v_blkno + blocks) of the inode in inode_buf,
+ * stored at blkno, to its extent tree.  The extent is merged into the
+ * last one when both are contiguous and have the same flags.  Otherwise
+ * v_blkno and blkno must start a cluster.  New extent blocks come from
+ * eb_ca, which grows from cluster_ca when full.
+ *
+ * i_clusters is updated, the caller still has to write the inode.
+ */
+errcode_t cmfs_insert_extent(cmfs_filesys *fs, char *inode_buf,
+			     uint64_t v_blkno, uint64_t blkno, uint32_t blocks,
+			     uint8_t flags, cmfs_allocator *eb_ca,
+			     cmfs_allocator *cluster_ca)
+{
+	struct cmfs_dinode *di = (struct cmfs_dinode *)inode_buf;
+	struct cmfs_extent_block *eb;
+	struct insert_ctxt ctxt;
+	uint64_t bpc = cmfs_clusters_to_blocks(fs, 1);
+	char *buf = NULL;
+	int full;
+	errcode_t ret;
+
+	if (!(fs->fs_flags & CMFS_FLAG_RW))
+		return CMFS_ET_RO_FILESYS;
+	if ((di->i_flags & (CMFS_CHAIN_FL | CMFS_LOCAL_ALLOC_FL |
+			    CMFS_DEALLOC_FL | CMFS_SUPER_BLOCK_FL)) ||
+	    (di->i_dyn_features & CMFS_INLINE_DATA_FL))
+		return CMFS_ET_INODE_CANNOT_BE_ITERATED;
+	if (!blocks || (blkno <= CMFS_SUPER_BLOCK_BLKNO) ||
+	    (blkno + blocks > fs->fs_blocks))
+		return CMFS_ET_INVALID_ARGUMENT;
+
+	memset(&ctxt, 0, sizeof(ctxt));
+	ctxt.fs = fs;
+	ctxt.di = di;
+	ctxt.v_blkno = v_blkno;
+	ctxt.v_end = v_blkno + blocks;
+	ctxt.eb_ca = eb_ca;
+	ctxt.cluster_ca = cluster_ca;
+	ctxt.rec.e_cpos = cmfs_blocks_to_clusters(fs, v_blkno);
+	ctxt.rec.e_blkno = blkno;
+	ctxt.rec.e_leaf_blocks = blocks;
+	ctxt.rec.e_flags = flags;
+
+	for (;;) {
+		ret = append_rec(&ctxt, &di->id2.i_list, &full);
+		if (ret || !full)
+			break;
+		ret = push_root(&ctxt);
+		if (ret)
+			break;
+	}
+	if (ret)
+		return ret;
+
+	/* Chain a new leaf after the old last one */
+	if (ctxt.new_leaf) {
+		ret = cmfs_malloc_block(fs->fs_io, &buf);
+		if (ret)
+			return ret;
+		ret = cmfs_read_extent_block(fs, di->i_last_eb_blk, buf);
+		if (ret)
+			goto out;
+		eb = (struct cmfs_extent_block *)buf;
+		eb->h_next_leaf_block = ctxt.new_leaf;
+		ret = cmfs_write_extent_block(fs, di->i_last_eb_blk, buf);
+		if (ret)
+			goto out;
+		di->i_last_eb_blk = ctxt.new_leaf;
+	}
+
+	di->i_clusters += (ctxt.v_end + bpc - 1) / bpc -
+			  (v_blkno + bpc - 1) / bpc;
+
+out:
+	if (buf)
+		cmfs_free(&buf);
+	return ret;
+}
+
+/*
+ * Bulk build.
+ *
+ * Tools that know every extent of a new file before they write any
+ * metadata (import, defrag, restore) would otherwise append them one
+ * by one, rewriting the rightmost path of the tree each time.
+ * cmfs_build_extent_tree() lays the whole tree out in memory instead,
+ * bottom up.  Every node but the last of its level is full, so the
+ * tree has the least depth the records allow.  The extent blocks are
+ * allocated in as few runs as eb_ca allows, the leaves first and in
+ * file order, and each run goes to disk in one io_write_block().
+ */
+
+/* The record pointing at the node eb, as push_root() sets it up */
+static void node_rec(cmfs_filesys *fs, struct cmfs_extent_block *eb,
+		     struct cmfs_extent_rec *rec)
+{
+	struct cmfs_extent_list *el = &eb->h_list;
+	struct cmfs_extent_rec *last = &el->l_recs[el->l_next_free_rec - 1];
+	uint64_t bpc = cmfs_clusters_to_blocks(fs, 1);
+	uint64_t end;
+
+	end = cmfs_clusters_to_blocks(fs, last->e_cpos) +
+	      cmfs_rec_blocks(fs, el->l_tree_depth, last);
+
+	memset(rec, 0, sizeof(struct cmfs_extent_rec));
+	rec->e_cpos = el->l_recs[0].e_cpos;
+	rec->e_blkno = eb->h_blkno;
+	rec->e_int_blocks = (end + bpc - 1) / bpc * bpc -
+			    cmfs_clusters_to_blocks(fs, rec->e_cpos);
+}
+
+/*
+ * Turn runs into leaf records in recs, merging runs that continue one
+ * another as cmfs_insert_extent() would, and count the clusters they
+ * add to the inode.
+ */
+static errcode_t runs_to_recs(cmfs_filesys *fs, struct cmfs_extent_run *runs,
+			      uint32_t nr, struct cmfs_extent_rec *recs,
+			      uint32_t *nr_recs, uint64_t *clusters)
+{
+	struct cmfs_extent_run *run;
+	struct cmfs_extent_rec *last = NULL;
+	uint64_t bpc = cmfs_clusters_to_blocks(fs, 1);
+	uint64_t v_end = 0, end;
+	uint32_t i, n = 0;
+
+	*clusters = 0;
+	for (i = 0; i < nr; i++) {
+		run = &runs[i];
+		end = run->er_v_blkno + run->er_blocks;
+		if (!run->er_blocks || (run->er_v_blkno < v_end) ||
+		    (run->er_blkno <= CMFS_SUPER_BLOCK_BLKNO) ||
+		    (run->er_blkno + run->er_blocks > fs->fs_blocks))
+			return CMFS_ET_INVALID_ARGUMENT;
+
+		if (last && (run->er_v_blkno == v_end) &&
+		    (last->e_blkno + last->e_leaf_blocks == run->er_blkno) &&
+		    (last->e_flags == run->er_flags) &&
+		    ((uint64_t)last->e_leaf_blocks + run->er_blocks <=
+		     UINT32_MAX)) {
+			last->e_leaf_blocks += run->er_blocks;
+		} else {
+			/* A new record has to start on a cluster */
+			if (run->er_v_blkno % bpc)
+				return CMFS_ET_INVALID_ARGUMENT;
+			last = &recs[n++];
+			memset(last, 0, sizeof(struct cmfs_extent_rec));
+			last->e_cpos = cmfs_blocks_to_clusters(fs,
+							       run->er_v_blkno);
+			last->e_blkno = run->er_blkno;
+			last->e_leaf_blocks = run->er_blocks;
+			last->e_flags = run->er_flags;
+		}
+
+		*clusters += (end + bpc - 1) / bpc -
+			     (run->er_v_blkno + bpc - 1) / bpc;
+		v_end = end;
+	}
+
+	*nr_recs = n;
+	return 0;
+}
+
+/*
+ * Give the inode in inode_buf, whose extent tree must be empty, the nr
+ * runs, sorted by er_v_blkno and not overlapping.  A run that doesn't
+ * continue the one before it must start a cluster.  Extent blocks come
+ * from eb_ca, which grows from cluster_ca when full; they are not given
+ * back on errors.
+ *
+ * i_clusters and i_last_eb_blk are updated, the caller still has to
+ * write the inode.
+ */
+errcode_t cmfs_build_extent_tree(cmfs_filesys *fs, char *inode_buf,
+				 struct cmfs_extent_run *runs, uint32_t nr,
+				 cmfs_allocator *eb_ca,
+				 cmfs_allocator *cluster_ca)
+{
+	struct cmfs_dinode *di = (struct cmfs_dinode *)inode_buf;
+	struct cmfs_extent_list *el = &di->id2.i_list;
+	struct cmfs_extent_rec *recs = NULL, *up = NULL;
+	struct cmfs_extent_block *eb;
+	uint32_t level_nodes[CMFS_MAX_PATH_DEPTH];
+	uint32_t i, j, k, n, nodes, base, epb, got;
+	uint64_t clusters, *blknos = NULL, blkno;
+	uint16_t *bits = NULL, bit;
+	char *bufs = NULL;
+	int d, depth;
+	errcode_t ret;
+
+	if (!(fs->fs_flags & CMFS_FLAG_RW))
+		return CMFS_ET_RO_FILESYS;
+	if ((di->i_flags & (CMFS_CHAIN_FL | CMFS_LOCAL_ALLOC_FL |
+			    CMFS_DEALLOC_FL | CMFS_SUPER_BLOCK_FL)) ||
+	    (di->i_dyn_features & CMFS_INLINE_DATA_FL))
+		return CMFS_ET_INODE_CANNOT_BE_ITERATED;
+	if (el->l_tree_depth || el->l_next_free_rec)
+		return CMFS_ET_INVALID_ARGUMENT;
+	if (!nr)
+		return 0;
+
+	ret = cmfs_malloc(sizeof(struct cmfs_extent_rec) * nr, &recs);
+	if (ret)
+		return ret;
+	ret = runs_to_recs(fs, runs, nr, recs, &n, &clusters);
+	if (ret)
+		goto out;
+
+	if (n <= el->l_count) {
+		memcpy(el->l_recs, recs, sizeof(struct cmfs_extent_rec) * n);
+		el->l_next_free_rec = n;
+		di->i_clusters += clusters;
+		goto out;
+	}
+
+	/* Nodes per level, the leaves at depth 0 */
+	epb = cmfs_extent_recs_per_eb(fs->fs_blocksize);
+	for (depth = 0, k = n, nodes = 0; k > el->l_count; depth++) {
+		if (depth + 1 >= CMFS_MAX_PATH_DEPTH) {
+			ret = CMFS_ET_NO_SPACE;
+			goto out;
+		}
+		k = (k + epb - 1) / epb;
+		level_nodes[depth] = k;
+		nodes += k;
+	}
+
+	ret = cmfs_malloc_blocks(fs->fs_io, nodes, &bufs);
+	if (ret)
+		goto out;
+	memset(bufs, 0, (size_t)nodes * fs->fs_blocksize);
+	ret = cmfs_malloc(sizeof(uint64_t) * nodes, &blknos);
+	if (ret)
+		goto out;
+	ret = cmfs_malloc(sizeof(uint16_t) * nodes, &bits);
+	if (ret)
+		goto out;
+	ret = cmfs_malloc(sizeof(struct cmfs_extent_rec) * level_nodes[0],
+			  &up);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < nodes; i += got) {
+		ret = cmfs_alloc_blocks(eb_ca, cluster_ca, nodes - i, &blkno,
+					&bit, &got);
+		if (ret)
+			goto out;
+		for (j = 0; j < got; j++) {
+			blknos[i + j] = blkno + j;
+			bits[i + j] = bit + j;
+		}
+	}
+
+	/* Fill each level from the records of the one below, in recs */
+	for (d = 0, base = 0; d < depth; base += level_nodes[d++]) {
+		for (i = 0; i < level_nodes[d]; i++) {
+			eb = (struct cmfs_extent_block *)(bufs +
+				(uint64_t)(base + i) * fs->fs_blocksize);
+			strcpy((char *)eb->h_signature,
+			       CMFS_EXTENT_BLOCK_SIGNATURE);
+			eb->h_suballoc_slot = 0;
+			eb->h_suballoc_bit = bits[base + i];
+			eb->h_fs_generation = fs->fs_super->i_fs_generation;
+			eb->h_blkno = blknos[base + i];
+			if (!d && (i + 1 < level_nodes[d]))
+				eb->h_next_leaf_block = blknos[base + i + 1];
+			eb->h_list.l_tree_depth = d;
+			eb->h_list.l_count = epb;
+			k = (i + 1 < level_nodes[d]) ? epb : n - i * epb;
+			memcpy(eb->h_list.l_recs, recs + i * epb,
+			       sizeof(struct cmfs_extent_rec) * k);
+			eb->h_list.l_next_free_rec = k;
+			node_rec(fs, eb, &up[i]);
+		}
+		n = level_nodes[d];
+		memcpy(recs, up, sizeof(struct cmfs_extent_rec) * n);
+	}
+
+	for (i = 0; i < nodes; i++)
+		cmfs_swap_extent_block_from_cpu(fs,
+			(struct cmfs_extent_block *)(bufs +
+				(uint64_t)i * fs->fs_blocksize));
+
+	for (i = 0; i < nodes; i = j) {
+		for (j = i + 1; (j < nodes) && (blknos[j] == blknos[j - 1] + 1);
+		     j++)
+			;
+		io_set_block_type(CMFS_BLOCK_EXTENT_BLOCK);
+		ret = io_write_block(fs->fs_io, blknos[i], j - i,
+				     bufs + (uint64_t)i * fs->fs_blocksize);
+		if (ret)
+			goto out;
+	}
+	fs->fs_flags |= CMFS_FLAG_CHANGED;
+
+	memcpy(el->l_recs, recs, sizeof(struct cmfs_extent_rec) * n);
+	el->l_next_free_rec = n;
+	el->l_tree_depth = depth;
+	di->i_last_eb_blk = blknos[level_nodes[0] - 1];
+	di->i_clusters += clusters;
+
+out:
+	if (up)
+		cmfs_free(&up);
+	if (bits)
+		cmfs_free(&bits);
+	if (blknos)
+		cmfs_free(&blknos);
+	if (bufs)
+		cmfs_free(&bufs);
+	cmfs_free(&recs);
+	return ret;
+}
+
+/*
+ * Splitting.
+ *
+ * Appends only ever touch the rightmost path, but converting unwritten
+ * extents splits records anywhere in the tree.  When the leaf holding
+ * a record is full, cmfs_extent_make_room() walks down to it and splits
+ * every full node on the way: the upper half of its records moves into
+ * a new extent block right after it, and the parent, which has room by
+ * then, gets a record for the new block.  A full root is pushed down
+ * first, as an append does.  The leaf holding cpos is left at most half
+ * full.
+ */
+
+/* A leaf needs two free records: one record split in the middle is three */
+static int node_full(struct cmfs_extent_list *el)
+{
+	return (el->l_count - el->l_next_free_rec) <
+	       (el->l_tree_depth ? 1 : 2);
+}
+
+/* Split the full node cbuf, the child under record i of parent */
+static errcode_t split_node(struct insert_ctxt *ctxt,
+			    struct cmfs_extent_list *parent, int i,
+			    char *cbuf, char *nbuf)
+{
+	cmfs_filesys *fs = ctxt->fs;
+	struct cmfs_extent_block *ceb = (struct cmfs_extent_block *)cbuf;
+	struct cmfs_extent_block *neb = (struct cmfs_extent_block *)nbuf;
+	struct cmfs_extent_list *cel = &ceb->h_list, *nel;
+	struct cmfs_extent_rec *rec;
+	uint64_t nblkno, cpos;
+	int mid;
+	errcode_t ret;
+
+	ret = new_extent_block(ctxt, cel->l_tree_depth, nbuf, &nblkno);
+	if (ret)
+		return ret;
+
+	nel = &neb->h_list;
+	mid = cel->l_next_free_rec / 2;
+	nel->l_next_free_rec = cel->l_next_free_rec - mid;
+	memcpy(nel->l_recs, &cel->l_recs[mid],
+	       nel->l_next_free_rec * sizeof(struct cmfs_extent_rec));
+	memset(&cel->l_recs[mid], 0,
+	       nel->l_next_free_rec * sizeof(struct cmfs_extent_rec));
+	cel->l_next_free_rec = mid;
+
+	if (!cel->l_tree_depth) {
+		neb->h_next_leaf_block = ceb->h_next_leaf_block;
+		ceb->h_next_leaf_block = nblkno;
+		if (ctxt->di->i_last_eb_blk == ceb->h_blkno)
+			ctxt->di->i_last_eb_blk = nblkno;
+	}
+
+	/* The new block first, so the old records are never lost */
+	ret = cmfs_write_extent_block(fs, nblkno, nbuf);
+	if (ret)
+		return ret;
+	ret = cmfs_write_extent_block(fs, ceb->h_blkno, cbuf);
+	if (ret)
+		return ret;
+
+	memmove(&parent->l_recs[i + 2], &parent->l_recs[i + 1],
+		(parent->l_next_free_rec - i - 1) *
+		sizeof(struct cmfs_extent_rec));
+	parent->l_next_free_rec++;
+
+	/* The left record keeps its start, a hole before it included */
+	rec = &parent->l_recs[i];
+	cpos = rec->e_cpos;
+	node_rec(fs, ceb, rec);
+	rec->e_int_blocks += cmfs_clusters_to_blocks(fs, rec->e_cpos - cpos);
+	rec->e_cpos = cpos;
+	node_rec(fs, neb, &parent->l_recs[i + 1]);
+
+	return 0;
+}
+
+/*
+ * Make sure the leaf holding cpos of the inode in inode_buf has room
+ * for two more records.  New extent blocks come from eb_ca, which grows
+ * from cluster_ca when full.  Extent blocks are written as they
+ * change, the caller still has to write the inode.
+ */
+errcode_t cmfs_extent_make_room(cmfs_filesys *fs, char *inode_buf,
+				uint64_t cpos, cmfs_allocator *eb_ca,
+				cmfs_allocator *cluster_ca)
+{
+	struct cmfs_dinode *di = (struct cmfs_dinode *)inode_buf;
+	struct cmfs_extent_list *el = &di->id2.i_list, *cel;
+	struct cmfs_extent_block *eb;
+	struct insert_ctxt ctxt;
+	char *pbuf = NULL, *cbuf = NULL, *nbuf = NULL, *tmp;
+	uint64_t pblkno = 0, cblkno;
+	int i;
+	errcode_t ret;
+
+	if (!(fs->fs_flags & CMFS_FLAG_RW))
+		return CMFS_ET_RO_FILESYS;
+	if ((di->i_flags & (CMFS_CHAIN_FL | CMFS_LOCAL_ALLOC_FL |
+			    CMFS_DEALLOC_FL | CMFS_SUPER_BLOCK_FL)) ||
+	    (di->i_dyn_features & CMFS_INLINE_DATA_FL))
+		return CMFS_ET_INODE_CANNOT_BE_ITERATED;
+
+	memset(&ctxt, 0, sizeof(ctxt));
+	ctxt.fs = fs;
+	ctxt.di = di;
+	ctxt.eb_ca = eb_ca;
+	ctxt.cluster_ca = cluster_ca;
+
+	if (node_full(el)) {
+		ret = push_root(&ctxt);
+		if (ret)
+			return ret;
+	}
+
+	ret = cmfs_malloc_block(fs->fs_io, &pbuf);
+	if (ret)
+		goto out;
+	ret = cmfs_malloc_block(fs->fs_io, &cbuf);
+	if (ret)
+		goto out;
+	ret = cmfs_malloc_block(fs->fs_io, &nbuf);
+	if (ret)
+		goto out;
+
+	/* el always has room here, it is the root or was just split */
+	while (el->l_tree_depth) {
+		if (!el->l_next_free_rec) {
+			ret = CMFS_ET_CORRUPT_EXTENT_BLOCK;
+			goto out;
+		}
+		for (i = el->l_next_free_rec - 1; i > 0; i--)
+			if (el->l_recs[i].e_cpos <= cpos)
+				break;
+
+		cblkno = el->l_recs[i].e_blkno;
+		ret = cmfs_read_extent_block(fs, cblkno, cbuf);
+		if (ret)
+			goto out;
+		eb = (struct cmfs_extent_block *)cbuf;
+		cel = &eb->h_list;
+		if (cel->l_tree_depth != el->l_tree_depth - 1) {
+			ret = CMFS_ET_CORRUPT_EXTENT_BLOCK;
+			goto out;
+		}
+
+		if (node_full(cel)) {
+			ret = split_node(&ctxt, el, i, cbuf, nbuf);
+			if (ret)
+				goto out;
+			if (pblkno) {
+				ret = cmfs_write_extent_block(fs, pblkno,
+							      pbuf);
+				if (ret)
+					goto out;
+			}
+			if (cpos >= el->l_recs[i + 1].e_cpos) {
+				cblkno = el->l_recs[i + 1].e_blkno;
+				tmp = cbuf;
+				cbuf = nbuf;
+				nbuf = tmp;
+			}
+		}
+
+		tmp = pbuf;
+		pbuf = cbuf;
+		cbuf = tmp;
+		pblkno = cblkno;
+		el = &((struct cmfs_extent_block *)pbuf)->h_list;
+	}
+
+out:
+	if (nbuf)
+		cmfs_free(&nbuf);
+	if (cbuf)
+		cmfs_free(&cbuf);
+	if (pbuf)
+		cmfs_free(&pbuf);
+	return ret;
+}
@@ -39,6 +39,7 @@
 #include <cmfs/byteorder.h>
 
 #include "cmfs_err.h"
+#include "extent_tree.h"
 
 static void cmfs_swap_extent_list_primary(struct cmfs_extent_list *el)
 {
@@ -132,10 +133,11 @@ errcode_t cmfs_read_extent_block_nocheck(cmfs_filesys *fs,
 	    (blkno > fs->fs_blocks))
 		return CMFS_ET_BAD_BLKNO;
 
-	ret = cmfs_malloc_block(fs->fs_io, &blk);
+	ret = cmfs_scratch_block(fs->fs_io, &blk);
 	if (ret)
 		return ret;
 
+	io_set_block_type(CMFS_BLOCK_EXTENT_BLOCK);
 	ret = cmfs_read_blocks(fs, blkno, 1, blk);
 	if (ret)
 		goto out;
@@ -153,7 +155,6 @@ errcode_t cmfs_read_extent_block_nocheck(cmfs_filesys *fs,
 	cmfs_swap_extent_block_to_cpu(fs, eb);
 
 out:
-	cmfs_free(&blk);
 	return ret;
 }
 
@@ -197,6 +198,7 @@ errcode_t cmfs_write_extent_block(cmfs_filesys *fs,
 	eb = (struct cmfs_extent_block *)blk;
 	cmfs_swap_extent_block_from_cpu(fs, eb);
 
+	io_set_block_type(CMFS_BLOCK_EXTENT_BLOCK);
 	ret = io_write_block(fs->fs_io, blkno, 1, blk);
 	if (ret)
 		goto out;
@@ -496,6 +498,312 @@ out:
 	return ret;
 }
 
+/*
+ * Leaf walk.
+ *
+ * cmfs_extent_iterate_inode() walks the tree depth first and reads
+ * each extent block by itself when it gets there, one dependent read
+ * per leaf.  A walk of the whole file only wants the leaves in order,
+ * and those are chained by h_next_leaf_block.  The leaf walk descends
+ * once to the first leaf and then follows the chain.  The depth 1 list
+ * above the current leaf already says which leaves come next, so they
+ * are read lw_window at a time with one io_vec_read_blocks(), all in
+ * flight together.
+ *
+ * The interior lists are kept as a path of cursors which steps along
+ * with the chain, reading an interior block when a cursor gets to it.
+ * A chain that doesn't go where the parents say is a corrupt tree.
+ */
+#define CMFS_LEAF_WINDOW	16
+
+struct leaf_walk {
+	cmfs_filesys *lw_fs;
+	int (*lw_func)(cmfs_filesys *fs,
+		       struct cmfs_extent_rec *rec,
+		       int tree_depth,
+		       uint32_t ccount,
+		       uint64_t ref_blkno,
+		       int ref_recno,
+		       void *priv_data);
+	void *lw_priv_data;
+	int lw_flags;
+	uint32_t lw_ccount;
+	errcode_t lw_errcode;
+
+	/* the path, lw_lists[lw_depth] is the inode's list */
+	int lw_depth;
+	struct cmfs_extent_list *lw_lists[CMFS_MAX_PATH_DEPTH];
+	uint64_t lw_blknos[CMFS_MAX_PATH_DEPTH];
+	int lw_pos[CMFS_MAX_PATH_DEPTH];
+	char *lw_bufs;			/* interior blocks, depth 1 first */
+
+	/* leaves lw_win_start.. of the depth 1 list at lw_win_list */
+	int lw_window;
+	int lw_win_start;
+	int lw_win_nr;
+	uint64_t lw_win_list;
+	char *lw_win_bufs;
+	struct io_vec_unit *lw_ivus;
+};
+
+static int leaf_walk_list(struct leaf_walk *lw, struct cmfs_extent_list *el,
+			  uint64_t ref_blkno)
+{
+	int i, iret = 0;
+
+	for (i = 0; i < el->l_next_free_rec; i++) {
+		/* As extent_iterate_el(), skip an empty left most record */
+		if (!i && !el->l_recs[i].e_leaf_blocks)
+			continue;
+		iret |= lw->lw_func(lw->lw_fs, &el->l_recs[i], 0,
+				    lw->lw_ccount, ref_blkno, i,
+				    lw->lw_priv_data);
+		lw->lw_ccount += cmfs_rec_clusters(lw->lw_fs, 0,
+						   &el->l_recs[i]);
+		if (iret & (CMFS_EXTENT_ABORT | CMFS_EXTENT_ERROR))
+			break;
+	}
+
+	return iret;
+}
+
+/*
+ * Move the path to the next leaf, starting with the record at the
+ * cursor of depth d: the first usable record there or, when that list
+ * is done, at the nearest depth above that has one, then down the left
+ * edge of its branch.  *leaf is 0 past the last leaf.
+ */
+static int leaf_walk_next(struct leaf_walk *lw, int d, uint64_t *leaf)
+{
+	cmfs_filesys *fs = lw->lw_fs;
+	struct cmfs_extent_list *el;
+	struct cmfs_extent_rec *rec;
+	struct cmfs_extent_block *eb;
+	char *buf;
+	int iret = 0;
+
+	*leaf = 0;
+	for (;;) {
+		el = lw->lw_lists[d];
+		if (lw->lw_pos[d] >= el->l_next_free_rec) {
+			if (d == lw->lw_depth)
+				break;
+			lw->lw_pos[++d]++;
+			continue;
+		}
+
+		rec = &el->l_recs[lw->lw_pos[d]];
+		if (!(lw->lw_flags & CMFS_EXTENT_FLAG_DATA_ONLY)) {
+			iret |= lw->lw_func(fs, rec, d, lw->lw_ccount,
+					    lw->lw_blknos[d], lw->lw_pos[d],
+					    lw->lw_priv_data);
+			if (iret & (CMFS_EXTENT_ABORT | CMFS_EXTENT_ERROR))
+				break;
+		}
+		if (!rec->e_blkno) {
+			lw->lw_pos[d]++;
+			continue;
+		}
+		if ((rec->e_blkno < CMFS_SUPER_BLOCK_BLKNO) ||
+		    (rec->e_blkno > fs->fs_blocks)) {
+			lw->lw_errcode = CMFS_ET_BAD_BLKNO;
+			iret |= CMFS_EXTENT_ERROR;
+			break;
+		}
+		if (d == 1) {
+			*leaf = rec->e_blkno;
+			break;
+		}
+
+		buf = lw->lw_bufs + (uint64_t)(d - 2) * fs->fs_blocksize;
+		lw->lw_errcode = cmfs_read_extent_block(fs, rec->e_blkno,
+							buf);
+		if (lw->lw_errcode) {
+			iret |= CMFS_EXTENT_ERROR;
+			break;
+		}
+		eb = (struct cmfs_extent_block *)buf;
+		if ((eb->h_list.l_tree_depth != d - 1) ||
+		    (eb->h_blkno != rec->e_blkno)) {
+			lw->lw_errcode = CMFS_ET_CORRUPT_EXTENT_BLOCK;
+			iret |= CMFS_EXTENT_ERROR;
+			break;
+		}
+		d--;
+		lw->lw_lists[d] = &eb->h_list;
+		lw->lw_blknos[d] = eb->h_blkno;
+		lw->lw_pos[d] = 0;
+	}
+
+	return iret;
+}
+
+/*
+ * Get the leaf at the depth 1 cursor, reading it with the ones after
+ * it when it isn't in the window yet.
+ */
+static errcode_t leaf_walk_read(struct leaf_walk *lw, uint64_t leaf,
+				struct cmfs_extent_block **ret_eb)
+{
+	cmfs_filesys *fs = lw->lw_fs;
+	struct cmfs_extent_list *el = lw->lw_lists[1];
+	struct cmfs_extent_block *eb;
+	int pos = lw->lw_pos[1];
+	int i, n;
+	uint64_t blkno;
+	errcode_t ret;
+
+	if ((lw->lw_win_list != lw->lw_blknos[1]) || !lw->lw_win_nr ||
+	    (pos < lw->lw_win_start) ||
+	    (pos >= lw->lw_win_start + lw->lw_win_nr)) {
+		lw->lw_win_nr = 0;
+		for (i = pos, n = 0;
+		     (i < el->l_next_free_rec) && (n < lw->lw_window);
+		     i++, n++) {
+			blkno = el->l_recs[i].e_blkno;
+			if ((blkno < CMFS_SUPER_BLOCK_BLKNO) ||
+			    (blkno > fs->fs_blocks))
+				break;
+			lw->lw_ivus[n].ivu_blkno = blkno;
+			lw->lw_ivus[n].ivu_buf = lw->lw_win_bufs +
+				(uint64_t)n * fs->fs_blocksize;
+			lw->lw_ivus[n].ivu_buflen = fs->fs_blocksize;
+		}
+
+		io_set_block_type(CMFS_BLOCK_EXTENT_BLOCK);
+		ret = io_vec_read_blocks(fs->fs_io, lw->lw_ivus, n);
+		if (ret)
+			return ret;
+		lw->lw_win_list = lw->lw_blknos[1];
+		lw->lw_win_start = pos;
+		lw->lw_win_nr = n;
+	}
+
+	eb = (struct cmfs_extent_block *)(lw->lw_win_bufs +
+		(uint64_t)(pos - lw->lw_win_start) * fs->fs_blocksize);
+	if (memcmp(eb->h_signature, CMFS_EXTENT_BLOCK_SIGNATURE,
+		   strlen(CMFS_EXTENT_BLOCK_SIGNATURE)))
+		return CMFS_ET_BAD_EXTENT_BLOCK_MAGIC;
+	cmfs_swap_extent_block_to_cpu(fs, eb);
+	if ((eb->h_list.l_next_free_rec > eb->h_list.l_count) ||
+	    eb->h_list.l_tree_depth || (eb->h_blkno != leaf))
+		return CMFS_ET_CORRUPT_EXTENT_BLOCK;
+
+	*ret_eb = eb;
+	return 0;
+}
+
+/*
+ * Call func on the records of inode as cmfs_extent_iterate_inode()
+ * does without CMFS_EXTENT_FLAG_DEPTH_TRAVERSE, reading the leaves
+ * window at a time along the leaf chain (0 for the default window).
+ * The walk is read only, changes func makes to a record are not
+ * written back.
+ */
+errcode_t cmfs_extent_iterate_leaves(cmfs_filesys *fs,
+				     struct cmfs_dinode *inode,
+				     int flags,
+				     int window,
+				     int (*func)(cmfs_filesys *fs,
+						 struct cmfs_extent_rec *rec,
+						 int tree_depth,
+						 uint32_t ccount,
+						 uint64_t ref_blkno,
+						 int ref_recno,
+						 void *priv_data),
+				     void *priv_data)
+{
+	struct cmfs_extent_list *el = &inode->id2.i_list;
+	struct cmfs_extent_block *eb;
+	struct leaf_walk lw;
+	uint64_t leaf, next;
+	int iret = 0;
+	errcode_t ret;
+
+	ret = CMFS_ET_INODE_NOT_VALID;
+	if (!(inode->i_flags & CMFS_VALID_FL))
+		return ret;
+
+	ret = CMFS_ET_INODE_CANNOT_BE_ITERATED;
+	if (inode->i_flags & (CMFS_SUPER_BLOCK_FL |
+			      CMFS_LOCAL_ALLOC_FL |
+			      CMFS_CHAIN_FL |
+			      CMFS_DEALLOC_FL))
+		return ret;
+	if (inode->i_dyn_features & CMFS_INLINE_DATA_FL)
+		return ret;
+
+	if (flags & ~CMFS_EXTENT_FLAG_DATA_ONLY)
+		return CMFS_ET_INVALID_ARGUMENT;
+	if (el->l_tree_depth >= CMFS_MAX_PATH_DEPTH)
+		return CMFS_ET_CORRUPT_EXTENT_BLOCK;
+
+	memset(&lw, 0, sizeof(lw));
+	lw.lw_fs = fs;
+	lw.lw_func = func;
+	lw.lw_priv_data = priv_data;
+	lw.lw_flags = flags;
+
+	ret = 0;
+	if (!el->l_tree_depth) {
+		leaf_walk_list(&lw, el, 0);
+		goto out;
+	}
+
+	lw.lw_window = window > 0 ? window : CMFS_LEAF_WINDOW;
+	if (lw.lw_window > cmfs_extent_recs_per_eb(fs->fs_blocksize))
+		lw.lw_window = cmfs_extent_recs_per_eb(fs->fs_blocksize);
+
+	ret = cmfs_malloc_blocks(fs->fs_io, lw.lw_window, &lw.lw_win_bufs);
+	if (ret)
+		goto out;
+	ret = cmfs_malloc(sizeof(struct io_vec_unit) * lw.lw_window,
+			  &lw.lw_ivus);
+	if (ret)
+		goto out;
+	if (el->l_tree_depth > 1) {
+		ret = cmfs_malloc_blocks(fs->fs_io, el->l_tree_depth - 1,
+					 &lw.lw_bufs);
+		if (ret)
+			goto out;
+	}
+
+	lw.lw_depth = el->l_tree_depth;
+	lw.lw_lists[lw.lw_depth] = el;
+
+	iret = leaf_walk_next(&lw, lw.lw_depth, &leaf);
+	while (leaf && !(iret & (CMFS_EXTENT_ABORT | CMFS_EXTENT_ERROR))) {
+		ret = leaf_walk_read(&lw, leaf, &eb);
+		if (ret)
+			goto out;
+
+		iret |= leaf_walk_list(&lw, &eb->h_list, leaf);
+		if (iret & (CMFS_EXTENT_ABORT | CMFS_EXTENT_ERROR))
+			break;
+
+		next = eb->h_next_leaf_block;
+		lw.lw_pos[1]++;
+		iret |= leaf_walk_next(&lw, 1, &leaf);
+		if (!(iret & (CMFS_EXTENT_ABORT | CMFS_EXTENT_ERROR)) &&
+		    (next != leaf)) {
+			ret = CMFS_ET_CORRUPT_EXTENT_BLOCK;
+			goto out;
+		}
+	}
+
+	if (iret & CMFS_EXTENT_ERROR)
+		ret = lw.lw_errcode;
+
+out:
+	if (lw.lw_bufs)
+		cmfs_free(&lw.lw_bufs);
+	if (lw.lw_ivus)
+		cmfs_free(&lw.lw_ivus);
+	if (lw.lw_win_bufs)
+		cmfs_free(&lw.lw_win_bufs);
+	return ret;
+}
+
 struct block_context {
 	int (*func)(cmfs_filesys *fs,
 		    uint64_t blkno,
@@ -74,6 +74,11 @@ static struct fs_feature_flags cmfs_supported_features[] = {
 		{CMFS_FEATURE_COMPAT_HAS_JOURNAL, 0, 0},
 		{CMFS_FEATURE_COMPAT_HAS_JOURNAL, 0, 0}
 	},
+	{
+		"unwritten",
+		{CMFS_FEATURE_COMPAT_UNWRITTEN, 0, 0},
+		{CMFS_FEATURE_COMPAT_UNWRITTEN, 0, 0}
+	},
 	{
 		NULL,
 		{0, 0, 0},
@@ -330,6 +335,10 @@ static struct feature_name cmfs_feature_names[] = {
 		.fn_name = "journal",
 		.fn_flag = {CMFS_FEATURE_COMPAT_HAS_JOURNAL, 0, 0},
 	},
+	{
+		.fn_name = "unwritten",
+		.fn_flag = {CMFS_FEATURE_COMPAT_UNWRITTEN, 0, 0},
+	},
 	{
 		.fn_name = NULL,
 	},
@@ -102,6 +102,7 @@ errcode_t cmfs_file_read(cmfs_cached_inode *ci,
 			 */
 			memset(ptr, 0, contig_blocks * fs->fs_blocksize);
 		} else {
+			io_set_block_type(CMFS_BLOCK_DATA);
 			ret = cmfs_read_blocks(fs,
 					       p_blkno,
 					       contig_blocks,
@@ -128,3 +129,127 @@ errcode_t cmfs_file_read(cmfs_cached_inode *ci,
 
 	return ret;
 }
+
+/*
+ * Call func for each range of the file from offset up to i_size, in
+ * order: written extents with the physical block the range starts at,
+ * unwritten extents with CMFS_EXT_UNWRITTEN in ext_flags, and holes
+ * with p_blkno 0.  Ranges are in bytes and start on a cluster, except
+ * the first one, which starts at offset.  func returns
+ * CMFS_EXTENT_ABORT to stop.
+ */
+errcode_t cmfs_file_map_iterate(cmfs_cached_inode *ci,
+				uint64_t offset,
+				int (*func)(cmfs_cached_inode *ci,
+					    uint64_t offset,
+					    uint64_t len,
+					    uint64_t p_blkno,
+					    uint16_t ext_flags,
+					    void *priv_data),
+				void *priv_data)
+{
+	cmfs_filesys *fs = ci->ci_fs;
+	int bits = CMFS_RAW_SB(fs->fs_super)->s_clustersize_bits;
+	uint64_t size = ci->ci_inode->i_size;
+	uint64_t v_cluster, p_cluster, num_clusters, left;
+	uint64_t start, end, p_blkno;
+	uint16_t extent_flags;
+	errcode_t ret;
+	int iret;
+
+	if (ci->ci_inode->i_dyn_features & CMFS_INLINE_DATA_FL)
+		return CMFS_ET_INODE_CANNOT_BE_ITERATED;
+
+	v_cluster = offset >> bits;
+	while ((v_cluster << bits) < size) {
+		ret = cmfs_get_clusters(ci, v_cluster, &p_cluster,
+					&num_clusters, &extent_flags);
+		if (ret)
+			return ret;
+		if (!num_clusters)
+			return CMFS_ET_CORRUPT_EXTENT_BLOCK;
+
+		/* A hole past the last extent runs to "infinity" */
+		left = (size - (v_cluster << bits) + fs->fs_clustersize - 1)
+			>> bits;
+		if (num_clusters > left)
+			num_clusters = left;
+
+		start = v_cluster << bits;
+		if (start < offset)
+			start = offset;
+		end = (v_cluster + num_clusters) << bits;
+		if (end > size)
+			end = size;
+
+		p_blkno = 0;
+		if (p_cluster)
+			p_blkno = cmfs_clusters_to_blocks(fs, p_cluster) +
+				  ((start - (v_cluster << bits)) >>
+				   CMFS_RAW_SB(fs->fs_super)->s_blocksize_bits);
+
+		iret = func(ci, start, end - start, p_blkno, extent_flags,
+			    priv_data);
+		if (iret & CMFS_EXTENT_ABORT)
+			break;
+
+		v_cluster += num_clusters;
+	}
+
+	return 0;
+}
+
+struct seek_context {
+	int		want_data;
+	uint64_t	found;
+};
+
+static int seek_proc(cmfs_cached_inode *ci, uint64_t offset, uint64_t len,
+		     uint64_t p_blkno, uint16_t ext_flags, void *priv_data)
+{
+	struct seek_context *ctxt = priv_data;
+	int data = p_blkno && !(ext_flags & CMFS_EXT_UNWRITTEN);
+
+	if (data != ctxt->want_data)
+		return 0;
+
+	ctxt->found = offset;
+	return CMFS_EXTENT_ABORT;
+}
+
+static errcode_t file_seek(cmfs_cached_inode *ci, uint64_t offset,
+			   int want_data, uint64_t *ret_offset)
+{
+	struct seek_context ctxt;
+	errcode_t ret;
+
+	ctxt.want_data = want_data;
+	ctxt.found = ci->ci_inode->i_size;
+
+	ret = cmfs_file_map_iterate(ci, offset, seek_proc, &ctxt);
+	if (!ret)
+		*ret_offset = ctxt.found;
+	return ret;
+}
+
+/*
+ * As lseek(SEEK_DATA): the first offset at or after offset which is
+ * backed by written data.  Unwritten extents count as holes.  i_size
+ * is returned when there is no more data.
+ */
+errcode_t cmfs_file_seek_data(cmfs_cached_inode *ci, uint64_t offset,
+			      uint64_t *data_offset)
+{
+	return file_seek(ci, offset, 1, data_offset);
+}
+
+/*
+ * As lseek(SEEK_HOLE): the first offset at or after offset which is in
+ * a hole or an unwritten extent, or i_size, the implicit hole at the
+ * end of the file.
+ */
+errcode_t cmfs_file_seek_hole(cmfs_cached_inode *ci, uint64_t offset,
+			      uint64_t *hole_offset)
+{
+	return file_seek(ci, offset, 0, hole_offset);
+}
@@ -0,0 +1,569 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * free_index.c
+ *
+ * In-memory index of the free extents of the global bitmap.  For the
+ * CMFS userspace library.
+ *
+ * Copyright (C) 2012, Coly Li <i@coly.li>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#define _XOPEN_SOURCE 600  /* Triggers XOPEN2K in features.h */
+#define _LARGEFILE64_SOURCE
+
+#include <string.h>
+
+#include <cmfs/cmfs.h>
+#include <cmfs/bitops.h>
+#include <cmfs/kernel-rbtree.h>
+#include "cmfs_err.h"
+
+/*
+ * Every run of free clusters is one cmfs_free_extent, kept in two
+ * trees.  fi_by_off is ordered by start cluster and each node also
+ * records the longest extent of its subtree, which lets the search
+ * for "at least n clusters near goal" skip whole subtrees.  fi_by_len
+ * is ordered by length, then start, for best fit.  Both searches and
+ * every update are O(log n) in the number of free extents.
+ *
+ * The index only mirrors the bitmap.  Whoever allocates or frees with
+ * it also has to update the group descriptors on disk.
+ */
+struct cmfs_free_extent {
+	struct rb_node fe_off_node;
+	struct rb_node fe_len_node;
+	uint32_t fe_cpos;
+	uint32_t fe_len;
+	uint32_t fe_max_len;	/* longest fe_len below fe_off_node */
+};
+
+struct _cmfs_free_index {
+	cmfs_filesys *fi_fs;
+	struct rb_root fi_by_off;
+	struct rb_root fi_by_len;
+	uint32_t fi_nr_extents;
+	uint32_t fi_free_clusters;
+};
+
+#define off_entry(n)	rb_entry((n), struct cmfs_free_extent, fe_off_node)
+#define len_entry(n)	rb_entry((n), struct cmfs_free_extent, fe_len_node)
+
+static inline uint32_t fe_end(struct cmfs_free_extent *fe)
+{
+	return fe->fe_cpos + fe->fe_len;
+}
+
+static inline uint32_t subtree_max(struct rb_node *n)
+{
+	return n ? off_entry(n)->fe_max_len : 0;
+}
+
+static void update_max_len(struct rb_node *n, void *data)
+{
+	struct cmfs_free_extent *fe = off_entry(n);
+	uint32_t max = fe->fe_len;
+
+	if (subtree_max(n->rb_left) > max)
+		max = subtree_max(n->rb_left);
+	if (subtree_max(n->rb_right) > max)
+		max = subtree_max(n->rb_right);
+	fe->fe_max_len = max;
+}
+
+static void link_extent(cmfs_free_index *fi, struct cmfs_free_extent *fe)
+{
+	struct rb_node **p, *parent = NULL;
+	struct cmfs_free_extent *tmp;
+
+	p = &fi->fi_by_off.rb_node;
+	while (*p) {
+		parent = *p;
+		if (fe->fe_cpos < off_entry(parent)->fe_cpos)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	fe->fe_max_len = fe->fe_len;
+	rb_link_node(&fe->fe_off_node, parent, p);
+	rb_insert_color(&fe->fe_off_node, &fi->fi_by_off);
+	rb_augment_insert(&fe->fe_off_node, update_max_len, NULL);
+
+	parent = NULL;
+	p = &fi->fi_by_len.rb_node;
+	while (*p) {
+		parent = *p;
+		tmp = len_entry(parent);
+		if ((fe->fe_len < tmp->fe_len) ||
+		    ((fe->fe_len == tmp->fe_len) &&
+		     (fe->fe_cpos < tmp->fe_cpos)))
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&fe->fe_len_node, parent, p);
+	rb_insert_color(&fe->fe_len_node, &fi->fi_by_len);
+
+	fi->fi_nr_extents++;
+	fi->fi_free_clusters += fe->fe_len;
+}
+
+static void unlink_extent(cmfs_free_index *fi, struct cmfs_free_extent *fe)
+{
+	struct rb_node *deepest;
+
+	deepest = rb_augment_erase_begin(&fe->fe_off_node);
+	rb_erase(&fe->fe_off_node, &fi->fi_by_off);
+	rb_augment_erase_end(deepest, update_max_len, NULL);
+
+	rb_erase(&fe->fe_len_node, &fi->fi_by_len);
+
+	fi->fi_nr_extents--;
+	fi->fi_free_clusters -= fe->fe_len;
+}
+
+/* The extent starting at or before cpos, NULL if there is none */
+static struct cmfs_free_extent *lookup_floor(cmfs_free_index *fi,
+					     uint32_t cpos)
+{
+	struct rb_node *n = fi->fi_by_off.rb_node;
+	struct cmfs_free_extent *fe, *found = NULL;
+
+	while (n) {
+		fe = off_entry(n);
+		if (fe->fe_cpos <= cpos) {
+			found = fe;
+			n = n->rb_right;
+		} else
+			n = n->rb_left;
+	}
+
+	return found;
+}
+
+/* Leftmost extent in the subtree with at least len clusters */
+static struct cmfs_free_extent *first_fit(struct rb_node *n, uint32_t len)
+{
+	while (n && (subtree_max(n) >= len)) {
+		if (subtree_max(n->rb_left) >= len)
+			n = n->rb_left;
+		else if (off_entry(n)->fe_len >= len)
+			return off_entry(n);
+		else
+			n = n->rb_right;
+	}
+
+	return NULL;
+}
+
+/* Rightmost extent in the subtree with at least len clusters */
+static struct cmfs_free_extent *last_fit(struct rb_node *n, uint32_t len)
+{
+	while (n && (subtree_max(n) >= len)) {
+		if (subtree_max(n->rb_right) >= len)
+			n = n->rb_right;
+		else if (off_entry(n)->fe_len >= len)
+			return off_entry(n);
+		else
+			n = n->rb_left;
+	}
+
+	return NULL;
+}
+
+/*
+ * The first extent starting after goal with at least len clusters.
+ * Going down, every node after goal leaves its right subtree behind
+ * as a fallback; only the deepest fallback that fits is ever searched,
+ * so this stays O(log n).
+ */
+static struct cmfs_free_extent *fit_after(struct rb_node *n, uint32_t goal,
+					  uint32_t len)
+{
+	struct cmfs_free_extent *fe, *found;
+
+	if (!n || (subtree_max(n) < len))
+		return NULL;
+
+	fe = off_entry(n);
+	if (fe->fe_cpos <= goal)
+		return fit_after(n->rb_right, goal, len);
+
+	found = fit_after(n->rb_left, goal, len);
+	if (found)
+		return found;
+	if (fe->fe_len >= len)
+		return fe;
+	return first_fit(n->rb_right, len);
+}
+
+/* The last extent starting at or before goal with at least len clusters */
+static struct cmfs_free_extent *fit_before(struct rb_node *n, uint32_t goal,
+					   uint32_t len)
+{
+	struct cmfs_free_extent *fe, *found;
+
+	if (!n || (subtree_max(n) < len))
+		return NULL;
+
+	fe = off_entry(n);
+	if (fe->fe_cpos > goal)
+		return fit_before(n->rb_left, goal, len);
+
+	found = fit_before(n->rb_right, goal, len);
+	if (found)
+		return found;
+	if (fe->fe_len >= len)
+		return fe;
+	return last_fit(n->rb_left, len);
+}
+
+errcode_t cmfs_new_free_index(cmfs_filesys *fs, cmfs_free_index **ret_fi)
+{
+	cmfs_free_index *fi;
+	errcode_t ret;
+
+	ret = cmfs_malloc0(sizeof(cmfs_free_index), &fi);
+	if (ret)
+		return ret;
+
+	fi->fi_fs = fs;
+	fi->fi_by_off = RB_ROOT;
+	fi->fi_by_len = RB_ROOT;
+
+	*ret_fi = fi;
+	return 0;
+}
+
+void cmfs_close_free_index(cmfs_free_index *fi)
+{
+	struct rb_node *n;
+	struct cmfs_free_extent *fe;
+
+	if (!fi)
+		return;
+
+	while ((n = rb_first(&fi->fi_by_len)) != NULL) {
+		fe = len_entry(n);
+		rb_erase(n, &fi->fi_by_len);
+		cmfs_free(&fe);
+	}
+	cmfs_free(&fi);
+}
+
+/*
+ * Clusters [cpos, cpos + len) became free.  They are merged with the
+ * free extents on either side.  Freeing clusters that are already free
+ * returns CMFS_ET_INVALID_ARGUMENT.
+ */
+errcode_t cmfs_free_index_insert(cmfs_free_index *fi, uint32_t cpos,
+				 uint32_t len)
+{
+	struct cmfs_free_extent *prev, *next = NULL, *fe;
+	struct rb_node *n;
+	errcode_t ret;
+
+	if (!len || (cpos + len < cpos) ||
+	    (cpos + len > fi->fi_fs->fs_clusters))
+		return CMFS_ET_INVALID_ARGUMENT;
+
+	prev = lookup_floor(fi, cpos);
+	if (prev)
+		n = rb_next(&prev->fe_off_node);
+	else
+		n = rb_first(&fi->fi_by_off);
+	if (n)
+		next = off_entry(n);
+
+	if ((prev && (fe_end(prev) > cpos)) ||
+	    (next && (next->fe_cpos < cpos + len)))
+		return CMFS_ET_INVALID_ARGUMENT;
+
+	if (prev && (fe_end(prev) == cpos)) {
+		unlink_extent(fi, prev);
+		prev->fe_len += len;
+		fe = prev;
+	} else {
+		ret = cmfs_malloc0(sizeof(struct cmfs_free_extent), &fe);
+		if (ret)
+			return ret;
+		fe->fe_cpos = cpos;
+		fe->fe_len = len;
+	}
+
+	if (next && (next->fe_cpos == cpos + len)) {
+		unlink_extent(fi, next);
+		fe->fe_len += next->fe_len;
+		cmfs_free(&next);
+	}
+
+	link_extent(fi, fe);
+	return 0;
+}
+
+/*
+ * Clusters [cpos, cpos + len) are now in use.  They must lie inside one
+ * free extent, which is trimmed or split around them.
+ */
+errcode_t cmfs_free_index_claim(cmfs_free_index *fi, uint32_t cpos,
+				uint32_t len)
+{
+	struct cmfs_free_extent *fe, *tail;
+	uint32_t end;
+	errcode_t ret;
+
+	fe = lookup_floor(fi, cpos);
+	if (!len || !fe || (cpos + len < cpos) || (cpos + len > fe_end(fe)))
+		return CMFS_ET_INVALID_ARGUMENT;
+
+	end = fe_end(fe);
+	if ((fe->fe_cpos < cpos) && (cpos + len < end)) {
+		ret = cmfs_malloc0(sizeof(struct cmfs_free_extent), &tail);
+		if (ret)
+			return ret;
+		tail->fe_cpos = cpos + len;
+		tail->fe_len = end - tail->fe_cpos;
+		link_extent(fi, tail);
+		end = cpos + len;
+	}
+
+	unlink_extent(fi, fe);
+	if (fe->fe_cpos < cpos) {
+		fe->fe_len = cpos - fe->fe_cpos;
+	} else if (cpos + len < end) {
+		fe->fe_cpos = cpos + len;
+		fe->fe_len = end - fe->fe_cpos;
+	} else {
+		cmfs_free(&fe);
+		return 0;
+	}
+	link_extent(fi, fe);
+
+	return 0;
+}
+
+/*
+ * Claim len clusters from the smallest free extent that can hold them.
+ * The start of the extent is used, so the remainder stays contiguous.
+ */
+errcode_t cmfs_free_index_best_fit(cmfs_free_index *fi, uint32_t len,
+				   uint32_t *cpos)
+{
+	struct rb_node *n = fi->fi_by_len.rb_node;
+	struct cmfs_free_extent *fe, *found = NULL;
+
+	if (!len)
+		return CMFS_ET_INVALID_ARGUMENT;
+
+	while (n) {
+		fe = len_entry(n);
+		if (fe->fe_len >= len) {
+			found = fe;
+			n = n->rb_left;
+		} else
+			n = n->rb_right;
+	}
+	if (!found)
+		return CMFS_ET_NO_SPACE;
+
+	*cpos = found->fe_cpos;
+	return cmfs_free_index_claim(fi, *cpos, len);
+}
+
+/*
+ * Claim between min_len and max_len clusters as close to goal as
+ * possible.  A free extent holding goal and min_len clusters after it
+ * is used from goal.  Otherwise the nearest extent of at least min_len
+ * clusters wins: one after goal is used from its start, one before
+ * goal from its end.
+ */
+errcode_t cmfs_free_index_near(cmfs_free_index *fi, uint32_t goal,
+			       uint32_t min_len, uint32_t max_len,
+			       uint32_t *cpos, uint32_t *len)
+{
+	struct cmfs_free_extent *before, *after;
+	uint64_t dist_before = UINT64_MAX, dist_after = UINT64_MAX;
+	uint32_t start, take;
+
+	if (!min_len || (max_len < min_len))
+		return CMFS_ET_INVALID_ARGUMENT;
+
+	before = fit_before(fi->fi_by_off.rb_node, goal, min_len);
+	if (before && (fe_end(before) >= goal) &&
+	    (fe_end(before) - goal >= min_len)) {
+		start = goal;
+		take = fe_end(before) - goal;
+		goto claim;
+	}
+
+	after = fit_after(fi->fi_by_off.rb_node, goal, min_len);
+	if (before)
+		dist_before = fe_end(before) >= goal ?
+			0 : goal - fe_end(before);
+	if (after)
+		dist_after = after->fe_cpos - goal;
+
+	if (!before && !after)
+		return CMFS_ET_NO_SPACE;
+
+	if (dist_after < dist_before) {
+		start = after->fe_cpos;
+		take = after->fe_len < max_len ? after->fe_len : max_len;
+	} else {
+		take = before->fe_len < max_len ? before->fe_len : max_len;
+		start = fe_end(before) - take;
+	}
+
+claim:
+	if (take > max_len)
+		take = max_len;
+	*cpos = start;
+	*len = take;
+	return cmfs_free_index_claim(fi, start, take);
+}
+
+/* The longest free extent, without claiming it */
+errcode_t cmfs_free_index_largest(cmfs_free_index *fi, uint32_t *cpos,
+				  uint32_t *len)
+{
+	struct rb_node *n = rb_last(&fi->fi_by_len);
+
+	if (!n)
+		return CMFS_ET_NO_SPACE;
+
+	*cpos = len_entry(n)->fe_cpos;
+	*len = len_entry(n)->fe_len;
+	return 0;
+}
+
+void cmfs_free_index_stats(cmfs_free_index *fi, uint32_t *nr_extents,
+			   uint32_t *free_clusters)
+{
+	if (nr_extents)
+		*nr_extents = fi->fi_nr_extents;
+	if (free_clusters)
+		*free_clusters = fi->fi_free_clusters;
+}
+
+/* Add the clear runs of one global bitmap group */
+errcode_t cmfs_free_index_add_group(cmfs_free_index *fi,
+				    struct cmfs_group_desc *gd,
+				    uint16_t cpg)
+{
+	uint32_t base;
+	int bit, end;
+	errcode_t ret;
+
+	base = cmfs_blocks_to_clusters(fi->fi_fs, gd->bg_blkno);
+	base -= base % cpg;
+	if ((gd->bg_bits > gd->bg_size * 8) ||
+	    (base + gd->bg_bits > fi->fi_fs->fs_clusters))
+		return CMFS_ET_BAD_GROUP_DESC_MAGIC;
+
+	bit = 0;
+	for (;;) {
+		bit = cmfs_find_next_bit_clear(gd->bg_bitmap, gd->bg_bits,
+					       bit);
+		if (bit >= gd->bg_bits)
+			break;
+		end = cmfs_find_next_bit_set(gd->bg_bitmap, gd->bg_bits,
+					     bit);
+		if (end > gd->bg_bits)
+			end = gd->bg_bits;
+
+		ret = cmfs_free_index_insert(fi, base + bit, end - bit);
+		if (ret)
+			return CMFS_ET_BAD_GROUP_DESC_MAGIC;
+		bit = end;
+	}
+
+	return 0;
+}
+
+/* Build the index from the groups of the global bitmap */
+errcode_t cmfs_load_free_index(cmfs_filesys *fs, cmfs_free_index **ret_fi)
+{
+	cmfs_free_index *fi = NULL;
+	struct cmfs_dinode *di;
+	struct cmfs_chain_list *cl;
+	struct cmfs_group_desc *gd;
+	char name[CMFS_MAX_FILENAME_LEN];
+	char *di_buf = NULL, *gd_buf = NULL;
+	uint64_t blkno, gd_blkno, nr_groups;
+	int i;
+	errcode_t ret;
+
+	ret = cmfs_malloc_block(fs->fs_io, &di_buf);
+	if (ret)
+		goto out;
+	ret = cmfs_malloc_block(fs->fs_io, &gd_buf);
+	if (ret)
+		goto out;
+	ret = cmfs_new_free_index(fs, &fi);
+	if (ret)
+		goto out;
+
+	cmfs_sprintf_system_inode_name(name, sizeof(name),
+				       GLOBAL_BITMAP_SYSTEM_INODE);
+	ret = cmfs_lookup(fs, fs->fs_sysdir_blkno, name, strlen(name),
+			  NULL, &blkno);
+	if (ret)
+		goto out;
+	ret = cmfs_read_inode(fs, blkno, di_buf);
+	if (ret)
+		goto out;
+
+	di = (struct cmfs_dinode *)di_buf;
+	cl = &di->id2.i_chain;
+	ret = CMFS_ET_INODE_CANNOT_BE_ITERATED;
+	if (!(di->i_flags & CMFS_CHAIN_FL) || !cl->cl_cpg ||
+	    (cl->cl_next_free_rec > cl->cl_count) ||
+	    (cl->cl_count > cmfs_chain_recs_per_inode(fs->fs_blocksize)))
+		goto out;
+
+	ret = cmfs_prefetch_group_descs(fs, di);
+	if (ret)
+		goto out;
+
+	gd = (struct cmfs_group_desc *)gd_buf;
+	for (i = 0; i < cl->cl_next_free_rec; i++) {
+		nr_groups = 0;
+		for (gd_blkno = cl->cl_recs[i].c_blkno; gd_blkno;
+		     gd_blkno = gd->bg_next_group) {
+			ret = CMFS_ET_BAD_GROUP_DESC_MAGIC;
+			if (++nr_groups > fs->fs_clusters)
+				goto out;
+			ret = cmfs_read_group_desc(fs, gd_blkno, gd_buf);
+			if (ret)
+				goto out;
+			ret = cmfs_free_index_add_group(fi, gd, cl->cl_cpg);
+			if (ret)
+				goto out;
+		}
+	}
+
+	*ret_fi = fi;
+	fi = NULL;
+
+out:
+	cmfs_close_free_index(fi);
+	if (gd_buf)
+		cmfs_free(&gd_buf);
+	if (di_buf)
+		cmfs_free(&di_buf);
+	return ret;
+}
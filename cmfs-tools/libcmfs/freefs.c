@@ -39,6 +39,8 @@ void cmfs_freefs(cmfs_filesys *fs)
 	if (!fs)
 		abort();
 
+	cmfs_icache_destroy(fs);
+	cmfs_free_group_summaries(fs);
 	if (fs->fs_orig_super)
 		cmfs_free(&fs->fs_orig_super);
 	if (fs->fs_super)
@@ -38,11 +38,18 @@ errcode_t cmfs_get_device_size(const char *file, int blocksize,
 	struct utsname ut;
 	uint64_t size64;
 	uint64_t size;
+	struct stat64 st;
 
 	fd = open64(file, O_RDONLY);
 	if (fd < 0)
 		return errno;
 
+	/* A volume image in a regular file */
+	if (!fstat64(fd, &st) && S_ISREG(st.st_mode)) {
+		*retblocks = st.st_size / blocksize;
+		goto out;
+	}
+
 	/* for linux < 2.6, BLKGETSIZE64 is not valid */
 	if ((uname(&ut) == 0) &&
 	    ((ut.release[0] == '2') && (ut.release[1] == '.') &&
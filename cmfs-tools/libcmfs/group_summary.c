@@ -0,0 +1,803 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * group_summary.c
+ *
+ * Per group free space summary of the chain allocators.  For the CMFS
+ * userspace library.
+ *
+ * Copyright (C) 2012, Coly Li <i@coly.li>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#define _XOPEN_SOURCE 600  /* Triggers XOPEN2K in features.h */
+#define _LARGEFILE64_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <cmfs/cmfs.h>
+#include <cmfs/bitops.h>
+#include <cmfs/byteorder.h>
+#include <cmfs/group_summary.h>
+#include "cmfs_err.h"
+
+/*
+ * A summary holds a struct cmfs_group_sum for every group of a chain
+ * allocator, sorted by descriptor block, and the totals over them.
+ * How much is free and which groups have a run of n free bits is then
+ * answered without reading a descriptor.
+ *
+ * The summaries of a filesystem hang off fs_group_summaries, one per
+ * allocator type, from cmfs_get_group_summary() until cmfs_close().
+ * The allocators of alloc.c keep them current as they change the
+ * bitmaps, so they must be loaded before allocating, or after a
+ * cmfs_allocator_flush().  The bitmaps stay the truth: a summary is a
+ * hint for where to look.
+ */
+
+#define GROUP_SUMMARY_REC_SIZE	sizeof(struct cmfs_group_summary_rec)
+
+static errcode_t new_summary(cmfs_filesys *fs, int type, uint64_t blkno,
+			     cmfs_group_summary **ret_sm)
+{
+	cmfs_group_summary *sm;
+	errcode_t ret;
+
+	ret = cmfs_malloc0(sizeof(cmfs_group_summary), &sm);
+	if (ret)
+		return ret;
+
+	sm->sm_fs = fs;
+	sm->sm_type = type;
+	sm->sm_blkno = blkno;
+	*ret_sm = sm;
+	return 0;
+}
+
+void cmfs_close_group_summary(cmfs_group_summary *sm)
+{
+	if (!sm)
+		return;
+
+	if (sm->sm_groups)
+		free(sm->sm_groups);
+	cmfs_free(&sm);
+}
+
+static errcode_t grow_summary(cmfs_group_summary *sm, uint32_t nr)
+{
+	struct cmfs_group_sum *groups;
+	uint32_t max;
+
+	if (nr <= sm->sm_max_groups)
+		return 0;
+
+	max = sm->sm_max_groups ? sm->sm_max_groups : 16;
+	while (max < nr)
+		max *= 2;
+	groups = realloc(sm->sm_groups, max * sizeof(struct cmfs_group_sum));
+	if (!groups)
+		return CMFS_ET_NO_MEMORY;
+	sm->sm_groups = groups;
+	sm->sm_max_groups = max;
+
+	return 0;
+}
+
+/* Where the group at blkno is, or would be inserted */
+static uint32_t summary_pos(cmfs_group_summary *sm, uint64_t blkno)
+{
+	uint32_t lo = 0, hi = sm->sm_nr_groups, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (sm->sm_groups[mid].gs_blkno < blkno)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+struct cmfs_group_sum *cmfs_group_summary_lookup(cmfs_group_summary *sm,
+						 uint64_t blkno)
+{
+	uint32_t pos = summary_pos(sm, blkno);
+
+	if ((pos < sm->sm_nr_groups) && (sm->sm_groups[pos].gs_blkno == blkno))
+		return &sm->sm_groups[pos];
+	return NULL;
+}
+
+/* Fill in gs from the bitmap of gd */
+static void sum_group(struct cmfs_group_sum *gs, struct cmfs_group_desc *gd)
+{
+	int bits = gd->bg_bits, start, end;
+
+	memset(gs, 0, sizeof(struct cmfs_group_sum));
+	gs->gs_blkno = gd->bg_blkno;
+	gs->gs_bits = gd->bg_bits;
+	gs->gs_free = gd->bg_free_bits_count;
+	gs->gs_chain = gd->bg_chain;
+	gs->gs_max_run_start = gd->bg_bits;
+
+	start = cmfs_find_next_bit_clear(gd->bg_bitmap, bits, 0);
+	gs->gs_first_free = start;
+	while (start < bits) {
+		end = cmfs_find_next_bit_set(gd->bg_bitmap, bits, start);
+		if (end - start > gs->gs_max_run) {
+			gs->gs_max_run = end - start;
+			gs->gs_max_run_start = start;
+		}
+		if (end >= bits)
+			break;
+		start = cmfs_find_next_bit_clear(gd->bg_bitmap, bits, end);
+	}
+}
+
+static errcode_t insert_group(cmfs_group_summary *sm,
+			      struct cmfs_group_desc *gd)
+{
+	uint32_t pos;
+	errcode_t ret;
+
+	pos = summary_pos(sm, gd->bg_blkno);
+	if ((pos < sm->sm_nr_groups) &&
+	    (sm->sm_groups[pos].gs_blkno == gd->bg_blkno))
+		return CMFS_ET_BAD_GROUP_DESC_MAGIC;
+
+	ret = grow_summary(sm, sm->sm_nr_groups + 1);
+	if (ret)
+		return ret;
+
+	memmove(&sm->sm_groups[pos + 1], &sm->sm_groups[pos],
+		(sm->sm_nr_groups - pos) * sizeof(struct cmfs_group_sum));
+	sum_group(&sm->sm_groups[pos], gd);
+	sm->sm_nr_groups++;
+	sm->sm_total_bits += gd->bg_bits;
+	sm->sm_free_bits += gd->bg_free_bits_count;
+
+	return 0;
+}
+
+static int group_sum_cmp(const void *a, const void *b)
+{
+	const struct cmfs_group_sum *ga = a, *gb = b;
+
+	if (ga->gs_blkno < gb->gs_blkno)
+		return -1;
+	return ga->gs_blkno > gb->gs_blkno;
+}
+
+static errcode_t read_alloc_inode(cmfs_filesys *fs, int type, char *buf,
+				  uint64_t *blkno)
+{
+	struct cmfs_dinode *di = (struct cmfs_dinode *)buf;
+	struct cmfs_chain_list *cl = &di->id2.i_chain;
+	char name[CMFS_MAX_FILENAME_LEN];
+	errcode_t ret;
+
+	if ((type < 0) || (type >= NUM_SYSTEM_INODES))
+		return CMFS_ET_INVALID_ARGUMENT;
+
+	cmfs_sprintf_system_inode_name(name, sizeof(name), type);
+	ret = cmfs_lookup(fs, fs->fs_sysdir_blkno, name, strlen(name),
+			  NULL, blkno);
+	if (ret)
+		return ret;
+	ret = cmfs_read_inode(fs, *blkno, buf);
+	if (ret)
+		return ret;
+
+	if (!(di->i_flags & CMFS_CHAIN_FL) ||
+	    (cl->cl_next_free_rec > cl->cl_count) ||
+	    (cl->cl_count > cmfs_chain_recs_per_inode(fs->fs_blocksize)))
+		return CMFS_ET_INODE_CANNOT_BE_ITERATED;
+
+	return 0;
+}
+
+static errcode_t build_summary(cmfs_filesys *fs, int type, char *di_buf,
+			       uint64_t di_blkno, cmfs_group_summary **ret_sm)
+{
+	struct cmfs_dinode *di = (struct cmfs_dinode *)di_buf;
+	struct cmfs_chain_list *cl = &di->id2.i_chain;
+	struct cmfs_group_desc *gd;
+	cmfs_group_summary *sm = NULL;
+	uint64_t gd_blkno, nr_groups = 0;
+	char *gd_buf = NULL;
+	uint32_t i;
+	errcode_t ret;
+
+	ret = new_summary(fs, type, di_blkno, &sm);
+	if (ret)
+		return ret;
+	ret = cmfs_malloc_block(fs->fs_io, &gd_buf);
+	if (ret)
+		goto out;
+	gd = (struct cmfs_group_desc *)gd_buf;
+
+	/* The descriptors come in large vectored reads */
+	ret = cmfs_prefetch_group_descs(fs, di);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < cl->cl_next_free_rec; i++) {
+		for (gd_blkno = cl->cl_recs[i].c_blkno; gd_blkno;
+		     gd_blkno = gd->bg_next_group) {
+			ret = CMFS_ET_BAD_GROUP_DESC_MAGIC;
+			if (++nr_groups > fs->fs_clusters)
+				goto out;
+
+			ret = cmfs_read_group_desc(fs, gd_blkno, gd_buf);
+			if (ret)
+				goto out;
+			if ((gd->bg_blkno != gd_blkno) ||
+			    (gd->bg_parent_dinode != di_blkno) ||
+			    (gd->bg_chain != i) ||
+			    (gd->bg_bits > gd->bg_size * 8)) {
+				ret = CMFS_ET_BAD_GROUP_DESC_MAGIC;
+				goto out;
+			}
+
+			ret = grow_summary(sm, sm->sm_nr_groups + 1);
+			if (ret)
+				goto out;
+			sum_group(&sm->sm_groups[sm->sm_nr_groups++], gd);
+			sm->sm_total_bits += gd->bg_bits;
+			sm->sm_free_bits += gd->bg_free_bits_count;
+		}
+	}
+
+	qsort(sm->sm_groups, sm->sm_nr_groups, sizeof(struct cmfs_group_sum),
+	      group_sum_cmp);
+
+	*ret_sm = sm;
+	sm = NULL;
+
+out:
+	if (gd_buf)
+		cmfs_free(&gd_buf);
+	cmfs_close_group_summary(sm);
+	return ret;
+}
+
+/*
+ * Summarize the allocator of the given type (GLOBAL_BITMAP_SYSTEM_INODE,
+ * INODE_ALLOC_SYSTEM_INODE, ...) from its group descriptors.  The
+ * caller owns the result, which nothing keeps current.
+ */
+errcode_t cmfs_build_group_summary(cmfs_filesys *fs, int type,
+				   cmfs_group_summary **ret_sm)
+{
+	char *di_buf = NULL;
+	uint64_t di_blkno;
+	errcode_t ret;
+
+	ret = cmfs_malloc_block(fs->fs_io, &di_buf);
+	if (ret)
+		return ret;
+
+	ret = read_alloc_inode(fs, type, di_buf, &di_blkno);
+	if (!ret)
+		ret = build_summary(fs, type, di_buf, di_blkno, ret_sm);
+
+	cmfs_free(&di_buf);
+	return ret;
+}
+
+static void summary_file_name(char *name, int len, int type)
+{
+	int n;
+
+	n = cmfs_sprintf_system_inode_name(name, len, type);
+	snprintf(name + n, len - n, "%s", CMFS_GROUP_SUMMARY_SUFFIX);
+}
+
+static int summary_is_fresh(struct cmfs_group_summary_hdr *hdr,
+			    struct cmfs_dinode *di, uint64_t di_blkno,
+			    uint64_t size)
+{
+	struct cmfs_chain_list *cl = &di->id2.i_chain;
+	struct cmfs_chain_rec *cr;
+	uint64_t nr = le32_to_cpu(hdr->sh_nr_groups);
+	int i;
+
+	if (memcmp(hdr->sh_magic, CMFS_GROUP_SUMMARY_MAGIC,
+		   CMFS_GROUP_SUMMARY_MAGIC_LEN) ||
+	    (le32_to_cpu(hdr->sh_version) != CMFS_GROUP_SUMMARY_VERSION))
+		return 0;
+	if (size < CMFS_GROUP_SUMMARY_HDR_SIZE + nr * GROUP_SUMMARY_REC_SIZE)
+		return 0;
+
+	if ((le64_to_cpu(hdr->sh_alloc_blkno) != di_blkno) ||
+	    (le64_to_cpu(hdr->sh_total_bits) != di->id1.bitmap1.i_total) ||
+	    (le64_to_cpu(hdr->sh_free_bits) !=
+	     (uint64_t)di->id1.bitmap1.i_total - di->id1.bitmap1.i_used) ||
+	    (le16_to_cpu(hdr->sh_nr_chains) != cl->cl_next_free_rec))
+		return 0;
+
+	for (i = 0; i < cl->cl_next_free_rec; i++) {
+		cr = &hdr->sh_chains[i];
+		if ((le32_to_cpu(cr->c_free) != cl->cl_recs[i].c_free) ||
+		    (le32_to_cpu(cr->c_total) != cl->cl_recs[i].c_total) ||
+		    (le64_to_cpu(cr->c_blkno) != cl->cl_recs[i].c_blkno))
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Read the saved summary of the allocator in di_buf.  It is one read
+ * when the file is contiguous, which cmfs_save_group_summary() tries
+ * for.  CMFS_ET_FILE_NOT_FOUND when there is none, CMFS_ET_BAD_MAGIC
+ * when it is stale.
+ */
+static errcode_t load_summary(cmfs_filesys *fs, int type, char *di_buf,
+			      uint64_t di_blkno, cmfs_group_summary **ret_sm)
+{
+	struct cmfs_dinode *di = (struct cmfs_dinode *)di_buf;
+	struct cmfs_group_summary_hdr *hdr;
+	struct cmfs_group_summary_rec *sr;
+	struct cmfs_group_sum *gs;
+	cmfs_group_summary *sm = NULL;
+	cmfs_cached_inode *ci = NULL;
+	char name[CMFS_MAX_FILENAME_LEN];
+	char *buf = NULL;
+	uint64_t blkno, size;
+	uint32_t i, got, nr;
+	errcode_t ret;
+
+	summary_file_name(name, sizeof(name), type);
+	ret = cmfs_lookup(fs, fs->fs_sysdir_blkno, name, strlen(name),
+			  NULL, &blkno);
+	if (ret)
+		return ret;
+	ret = cmfs_read_cached_inode(fs, blkno, &ci);
+	if (ret)
+		return ret;
+
+	ret = CMFS_ET_BAD_MAGIC;
+	size = ci->ci_inode->i_size;
+	if ((size < CMFS_GROUP_SUMMARY_HDR_SIZE) || (size > UINT32_MAX / 2))
+		goto out;
+	size = (size + fs->fs_blocksize - 1) & ~((uint64_t)fs->fs_blocksize - 1);
+
+	ret = cmfs_malloc_blocks(fs->fs_io, size / fs->fs_blocksize, &buf);
+	if (ret)
+		goto out;
+	ret = cmfs_file_read(ci, buf, size, 0, &got);
+	if (ret)
+		goto out;
+
+	hdr = (struct cmfs_group_summary_hdr *)buf;
+	ret = CMFS_ET_BAD_MAGIC;
+	if (!summary_is_fresh(hdr, di, di_blkno, got))
+		goto out;
+
+	ret = new_summary(fs, type, di_blkno, &sm);
+	if (ret)
+		goto out;
+	nr = le32_to_cpu(hdr->sh_nr_groups);
+	ret = grow_summary(sm, nr);
+	if (ret)
+		goto out;
+
+	sr = (struct cmfs_group_summary_rec *)(buf +
+					       CMFS_GROUP_SUMMARY_HDR_SIZE);
+	for (i = 0; i < nr; i++, sr++) {
+		gs = &sm->sm_groups[i];
+		gs->gs_blkno = le64_to_cpu(sr->sr_blkno);
+		gs->gs_bits = le32_to_cpu(sr->sr_bits);
+		gs->gs_free = le32_to_cpu(sr->sr_free);
+		gs->gs_first_free = le32_to_cpu(sr->sr_first_free);
+		gs->gs_max_run = le32_to_cpu(sr->sr_max_run);
+		gs->gs_max_run_start = le32_to_cpu(sr->sr_max_run_start);
+		gs->gs_chain = le16_to_cpu(sr->sr_chain);
+		gs->gs_reserved = 0;
+
+		ret = CMFS_ET_BAD_MAGIC;
+		if ((i && (gs->gs_blkno <= gs[-1].gs_blkno)) ||
+		    (gs->gs_free > gs->gs_bits) ||
+		    (gs->gs_max_run > gs->gs_free))
+			goto out;
+		sm->sm_total_bits += gs->gs_bits;
+		sm->sm_free_bits += gs->gs_free;
+	}
+	sm->sm_nr_groups = nr;
+
+	ret = CMFS_ET_BAD_MAGIC;
+	if ((sm->sm_total_bits != le64_to_cpu(hdr->sh_total_bits)) ||
+	    (sm->sm_free_bits != le64_to_cpu(hdr->sh_free_bits)))
+		goto out;
+
+	*ret_sm = sm;
+	sm = NULL;
+	ret = 0;
+
+out:
+	if (buf)
+		cmfs_free(&buf);
+	cmfs_close_group_summary(sm);
+	cmfs_free_cached_inode(fs, ci);
+	return ret;
+}
+
+/*
+ * The summary of the allocator of the given type kept with fs.  The
+ * first call loads the one saved on the volume, or builds it when
+ * there is none or it is stale.
+ */
+errcode_t cmfs_get_group_summary(cmfs_filesys *fs, int type,
+				 cmfs_group_summary **ret_sm)
+{
+	char *di_buf = NULL;
+	uint64_t di_blkno;
+	errcode_t ret;
+
+	if ((type < 0) || (type >= NUM_SYSTEM_INODES))
+		return CMFS_ET_INVALID_ARGUMENT;
+
+	if (fs->fs_group_summaries[type]) {
+		*ret_sm = fs->fs_group_summaries[type];
+		return 0;
+	}
+
+	ret = cmfs_malloc_block(fs->fs_io, &di_buf);
+	if (ret)
+		return ret;
+	ret = read_alloc_inode(fs, type, di_buf, &di_blkno);
+	if (ret)
+		goto out;
+
+	ret = load_summary(fs, type, di_buf, di_blkno,
+			   &fs->fs_group_summaries[type]);
+	if ((ret == CMFS_ET_FILE_NOT_FOUND) || (ret == CMFS_ET_BAD_MAGIC))
+		ret = build_summary(fs, type, di_buf, di_blkno,
+				    &fs->fs_group_summaries[type]);
+	if (!ret)
+		*ret_sm = fs->fs_group_summaries[type];
+
+out:
+	cmfs_free(&di_buf);
+	return ret;
+}
+
+void cmfs_free_group_summaries(cmfs_filesys *fs)
+{
+	int i;
+
+	for (i = 0; i < NUM_SYSTEM_INODES; i++) {
+		cmfs_close_group_summary(fs->fs_group_summaries[i]);
+		fs->fs_group_summaries[i] = NULL;
+	}
+}
+
+/*
+ * Called by the allocators after they set (or cleared) bits [bit,
+ * bit + n) of gd and updated bg_free_bits_count.  Only the part of
+ * the group that changed is looked at unless the longest run was cut.
+ */
+void cmfs_group_summary_update(cmfs_filesys *fs, int type,
+			       struct cmfs_group_desc *gd, uint32_t bit,
+			       uint32_t n, int set)
+{
+	cmfs_group_summary *sm = fs->fs_group_summaries[type];
+	struct cmfs_group_sum *gs;
+	uint32_t start, end;
+
+	if (!sm)
+		return;
+	gs = cmfs_group_summary_lookup(sm, gd->bg_blkno);
+	if (!gs)
+		return;
+
+	sm->sm_free_bits += (int64_t)gd->bg_free_bits_count - gs->gs_free;
+	gs->gs_free = gd->bg_free_bits_count;
+
+	if (set) {
+		if ((bit < gs->gs_max_run_start + gs->gs_max_run) &&
+		    (gs->gs_max_run_start < bit + n)) {
+			sum_group(gs, gd);
+			return;
+		}
+		if ((gs->gs_first_free >= bit) && (gs->gs_first_free < bit + n))
+			gs->gs_first_free =
+				cmfs_find_next_bit_clear(gd->bg_bitmap,
+							 gd->bg_bits, bit + n);
+		return;
+	}
+
+	if (bit < gs->gs_first_free)
+		gs->gs_first_free = bit;
+
+	/* The run holding the freed bits */
+	for (start = bit; start && !cmfs_test_bit(start - 1, gd->bg_bitmap);
+	     start--)
+		;
+	end = cmfs_find_next_bit_set(gd->bg_bitmap, gd->bg_bits, bit + n);
+	if (end - start > gs->gs_max_run) {
+		gs->gs_max_run = end - start;
+		gs->gs_max_run_start = start;
+	}
+}
+
+/*
+ * Called by the allocators when they add gd to a chain.  A summary
+ * that can't take it is dropped, to be built again on the next
+ * cmfs_get_group_summary().
+ */
+void cmfs_group_summary_add(cmfs_filesys *fs, int type,
+			    struct cmfs_group_desc *gd)
+{
+	cmfs_group_summary *sm = fs->fs_group_summaries[type];
+
+	if (sm && insert_group(sm, gd)) {
+		cmfs_close_group_summary(sm);
+		fs->fs_group_summaries[type] = NULL;
+	}
+}
+
+/*
+ * The first group at or after group index *idx with a run of at least
+ * len free bits.  CMFS_ET_NO_SPACE when none has.
+ */
+errcode_t cmfs_group_summary_find(cmfs_group_summary *sm, uint32_t len,
+				  uint32_t *idx)
+{
+	uint32_t i;
+
+	for (i = *idx; i < sm->sm_nr_groups; i++) {
+		if (sm->sm_groups[i].gs_max_run >= len) {
+			*idx = i;
+			return 0;
+		}
+	}
+
+	return CMFS_ET_NO_SPACE;
+}
+
+/* Give the summary file at least bytes, in as few extents as we can */
+static errcode_t extend_summary_file(cmfs_filesys *fs, char *inode_buf,
+				     uint64_t bytes, cmfs_allocator *eb_ca,
+				     cmfs_allocator *cluster_ca)
+{
+	struct cmfs_dinode *di = (struct cmfs_dinode *)inode_buf;
+	uint32_t want, cpos, len;
+	errcode_t ret;
+
+	while ((uint64_t)di->i_clusters * fs->fs_clustersize < bytes) {
+		want = (bytes - (uint64_t)di->i_clusters * fs->fs_clustersize +
+			fs->fs_clustersize - 1) / fs->fs_clustersize;
+
+		ret = cmfs_alloc_clusters_fit(cluster_ca, want, &cpos);
+		len = want;
+		if (ret == CMFS_ET_NO_SPACE) {
+			ret = cmfs_largest_free_clusters(cluster_ca, &cpos,
+							 &len);
+			if (ret)
+				return ret;
+			if (len > want)
+				len = want;
+			ret = cmfs_alloc_clusters(cluster_ca, cpos, len, len,
+						  &cpos, &len);
+		}
+		if (ret)
+			return ret;
+
+		ret = cmfs_insert_extent(fs, inode_buf,
+				cmfs_clusters_to_blocks(fs, di->i_clusters),
+				cmfs_clusters_to_blocks(fs, cpos),
+				cmfs_clusters_to_blocks(fs, len), 0,
+				eb_ca, cluster_ca);
+		if (ret) {
+			cmfs_free_clusters(cluster_ca, cpos, len);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+struct summary_write_ctxt {
+	char *sw_buf;
+	uint64_t sw_size;		/* of sw_buf, whole blocks */
+	errcode_t sw_ret;
+};
+
+static int write_summary_proc(cmfs_cached_inode *ci, uint64_t offset,
+			      uint64_t len, uint64_t p_blkno,
+			      uint16_t ext_flags, void *priv_data)
+{
+	struct summary_write_ctxt *ctxt = priv_data;
+	cmfs_filesys *fs = ci->ci_fs;
+	uint64_t blocks;
+
+	if (offset >= ctxt->sw_size)
+		return CMFS_EXTENT_ABORT;
+	if (len > ctxt->sw_size - offset)
+		len = ctxt->sw_size - offset;
+	blocks = (len + fs->fs_blocksize - 1) / fs->fs_blocksize;
+
+	if (!p_blkno) {
+		ctxt->sw_ret = CMFS_ET_INTERNAL_FAILURE;
+		return CMFS_EXTENT_ABORT;
+	}
+
+	ctxt->sw_ret = io_write_block(fs->fs_io, p_blkno, blocks,
+				      ctxt->sw_buf + offset);
+	return ctxt->sw_ret ? CMFS_EXTENT_ABORT : 0;
+}
+
+static void fill_summary(cmfs_group_summary *sm, struct cmfs_dinode *di,
+			 char *buf)
+{
+	struct cmfs_group_summary_hdr *hdr =
+		(struct cmfs_group_summary_hdr *)buf;
+	struct cmfs_chain_list *cl = &di->id2.i_chain;
+	struct cmfs_group_summary_rec *sr;
+	struct cmfs_group_sum *gs;
+	uint32_t i;
+
+	memcpy(hdr->sh_magic, CMFS_GROUP_SUMMARY_MAGIC,
+	       CMFS_GROUP_SUMMARY_MAGIC_LEN);
+	hdr->sh_version = cpu_to_le32(CMFS_GROUP_SUMMARY_VERSION);
+	hdr->sh_nr_groups = cpu_to_le32(sm->sm_nr_groups);
+	hdr->sh_alloc_blkno = cpu_to_le64(sm->sm_blkno);
+	hdr->sh_ctime = cpu_to_le64(time(NULL));
+	hdr->sh_total_bits = cpu_to_le64(sm->sm_total_bits);
+	hdr->sh_free_bits = cpu_to_le64(sm->sm_free_bits);
+	hdr->sh_nr_chains = cpu_to_le16(cl->cl_next_free_rec);
+	for (i = 0; i < cl->cl_next_free_rec; i++) {
+		hdr->sh_chains[i].c_free = cpu_to_le32(cl->cl_recs[i].c_free);
+		hdr->sh_chains[i].c_total = cpu_to_le32(cl->cl_recs[i].c_total);
+		hdr->sh_chains[i].c_blkno = cpu_to_le64(cl->cl_recs[i].c_blkno);
+	}
+
+	sr = (struct cmfs_group_summary_rec *)(buf +
+					       CMFS_GROUP_SUMMARY_HDR_SIZE);
+	for (i = 0, gs = sm->sm_groups; i < sm->sm_nr_groups; i++, gs++, sr++) {
+		sr->sr_blkno = cpu_to_le64(gs->gs_blkno);
+		sr->sr_bits = cpu_to_le32(gs->gs_bits);
+		sr->sr_free = cpu_to_le32(gs->gs_free);
+		sr->sr_first_free = cpu_to_le32(gs->gs_first_free);
+		sr->sr_max_run = cpu_to_le32(gs->gs_max_run);
+		sr->sr_max_run_start = cpu_to_le32(gs->gs_max_run_start);
+		sr->sr_chain = cpu_to_le16(gs->gs_chain);
+	}
+}
+
+/*
+ * Save the summary of the allocator of the given type kept with fs,
+ * so that the next cmfs_get_group_summary() reads it instead of every
+ * descriptor.  The file is created in the system directory the first
+ * time and grown as needed, its inode coming from inode_ca and its
+ * space from cluster_ca.  Those allocators are flushed: the summary
+ * has to match the allocator dinode on disk to be used again.  Any
+ * other allocator of that type must be flushed by the caller first.
+ */
+errcode_t cmfs_save_group_summary(cmfs_filesys *fs, int type,
+				  cmfs_allocator *inode_ca,
+				  cmfs_allocator *eb_ca,
+				  cmfs_allocator *cluster_ca)
+{
+	cmfs_group_summary *sm;
+	cmfs_cached_inode *ci = NULL;
+	struct cmfs_dinode *di;
+	struct summary_write_ctxt ctxt;
+	char name[CMFS_MAX_FILENAME_LEN];
+	char *inode_buf = NULL, *di_buf = NULL, *buf = NULL;
+	uint64_t ino, di_blkno, bytes, size;
+	errcode_t ret;
+
+	if (!(fs->fs_flags & CMFS_FLAG_RW))
+		return CMFS_ET_RO_FILESYS;
+
+	ret = cmfs_get_group_summary(fs, type, &sm);
+	if (ret)
+		return ret;
+
+	ret = cmfs_malloc_block(fs->fs_io, &inode_buf);
+	if (ret)
+		goto out;
+	ret = cmfs_malloc_block(fs->fs_io, &di_buf);
+	if (ret)
+		goto out;
+	di = (struct cmfs_dinode *)inode_buf;
+
+	summary_file_name(name, sizeof(name), type);
+	ret = cmfs_lookup(fs, fs->fs_sysdir_blkno, name, strlen(name),
+			  NULL, &ino);
+	if (!ret)
+		ret = cmfs_read_inode(fs, ino, inode_buf);
+	else if (ret == CMFS_ET_FILE_NOT_FOUND) {
+		ret = cmfs_new_inode(inode_ca, cluster_ca, S_IFREG | 0644,
+				     inode_buf, &ino);
+		if (ret)
+			goto out;
+		di->i_flags |= CMFS_SYSTEM_FL;
+		ret = cmfs_write_inode(fs, ino, inode_buf);
+		if (ret)
+			goto out;
+		ret = cmfs_link(fs, fs->fs_sysdir_blkno, name, ino,
+				CMFS_FT_REG_FILE, eb_ca, cluster_ca);
+	}
+	if (ret)
+		goto out;
+
+	/* Growing the file may add groups to the summary being saved */
+	do {
+		bytes = CMFS_GROUP_SUMMARY_HDR_SIZE +
+			(uint64_t)sm->sm_nr_groups * GROUP_SUMMARY_REC_SIZE;
+		ret = extend_summary_file(fs, inode_buf, bytes, eb_ca,
+					  cluster_ca);
+		if (ret)
+			goto out;
+	} while (bytes < CMFS_GROUP_SUMMARY_HDR_SIZE +
+			 (uint64_t)sm->sm_nr_groups * GROUP_SUMMARY_REC_SIZE);
+
+	di->i_size = bytes;
+	di->i_mtime = di->i_ctime = time(NULL);
+	ret = cmfs_write_inode(fs, ino, inode_buf);
+	if (ret)
+		goto out;
+
+	ret = cmfs_allocator_flush(inode_ca);
+	if (!ret)
+		ret = cmfs_allocator_flush(eb_ca);
+	if (!ret)
+		ret = cmfs_allocator_flush(cluster_ca);
+	if (ret)
+		goto out;
+
+	/* The chains the summary is stamped with, as they are on disk */
+	ret = read_alloc_inode(fs, type, di_buf, &di_blkno);
+	if (ret)
+		goto out;
+
+	size = (bytes + fs->fs_blocksize - 1) / fs->fs_blocksize;
+	ret = cmfs_malloc_blocks(fs->fs_io, size, &buf);
+	if (ret)
+		goto out;
+	memset(buf, 0, size * fs->fs_blocksize);
+	fill_summary(sm, (struct cmfs_dinode *)di_buf, buf);
+
+	ret = cmfs_read_cached_inode(fs, ino, &ci);
+	if (ret)
+		goto out;
+	ctxt.sw_buf = buf;
+	ctxt.sw_size = size * fs->fs_blocksize;
+	ctxt.sw_ret = 0;
+	io_set_block_type(CMFS_BLOCK_DATA);
+	ret = cmfs_file_map_iterate(ci, 0, write_summary_proc, &ctxt);
+	if (!ret)
+		ret = ctxt.sw_ret;
+
+out:
+	if (ci)
+		cmfs_free_cached_inode(fs, ci);
+	if (buf)
+		cmfs_free(&buf);
+	if (di_buf)
+		cmfs_free(&di_buf);
+	if (inode_buf)
+		cmfs_free(&inode_buf);
+	return ret;
+}
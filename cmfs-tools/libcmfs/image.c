@@ -0,0 +1,706 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * image.c
+ *
+ * Read and write CMFS metadata images.  For the CMFS userspace library.
+ *
+ * Copyright (C) 2012, Coly Li <i@coly.li>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#define _XOPEN_SOURCE 600  /* Triggers XOPEN2K in features.h */
+#define _LARGEFILE64_SOURCE
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include <cmfs/cmfs.h>
+#include <cmfs/byteorder.h>
+#include <cmfs/image.h>
+#include "cmfs_err.h"
+
+/* Inflated chunks kept around, a directory walk keeps coming back */
+#define IMAGE_CACHE_CHUNKS	8
+
+struct image_chunk {
+	uint64_t ic_chunk;		/* UINT64_MAX when empty */
+	unsigned long ic_last;		/* for LRU */
+	char *ic_buf;
+};
+
+struct _cmfs_image {
+	int ci_fd;
+	uint32_t ci_flags;
+	uint32_t ci_blocksize;
+	uint32_t ci_chunk_blocks;
+	uint64_t ci_dev_blocks;
+	uint64_t ci_nr_blocks;
+	uint64_t ci_nr_chunks;
+	uint64_t ci_data_offset;
+
+	uint64_t *ci_map;		/* cpu order words */
+	uint64_t *ci_rank;
+	uint64_t *ci_chunks;		/* nr_chunks + 1 file offsets */
+
+	pthread_mutex_t ci_lock;	/* protects all below */
+	unsigned long ci_clock;
+	char *ci_zbuf;
+	struct image_chunk ci_cache[IMAGE_CACHE_CHUNKS];
+};
+
+struct _cmfs_image_writer {
+	int iw_fd;
+	uint32_t iw_flags;
+	uint32_t iw_blocksize;
+	uint64_t iw_dev_blocks;
+	uint64_t iw_nr_blocks;
+	uint64_t iw_nr_chunks;
+	uint64_t iw_map_offset;
+	uint64_t iw_rank_offset;
+	uint64_t iw_chunk_offset;
+	uint64_t iw_data_offset;
+
+	uint64_t iw_written;		/* blocks taken so far */
+	uint64_t iw_pos;		/* where the next data goes */
+	uint64_t *iw_chunks;
+
+	char *iw_chunk_buf;		/* the chunk being filled */
+	uint32_t iw_chunk_fill;		/* in blocks */
+	char *iw_zbuf;
+	uLong iw_zbuf_len;
+};
+
+static inline uint64_t image_align(uint64_t off)
+{
+	return (off + CMFS_IMAGE_ALIGN - 1) & ~((uint64_t)CMFS_IMAGE_ALIGN - 1);
+}
+
+static inline uint64_t image_map_words(uint64_t dev_blocks)
+{
+	return (dev_blocks + 63) / 64;
+}
+
+static inline uint64_t image_rank_entries(uint64_t dev_blocks)
+{
+	return (dev_blocks + CMFS_IMAGE_RANK_BITS - 1) / CMFS_IMAGE_RANK_BITS;
+}
+
+static errcode_t image_pread(int fd, void *buf, size_t len, uint64_t off)
+{
+	ssize_t rd;
+
+	while (len) {
+		rd = pread64(fd, buf, len, off);
+		if (rd < 0) {
+			if (errno == EINTR)
+				continue;
+			return CMFS_ET_IO;
+		}
+		if (!rd)
+			return CMFS_ET_SHORT_READ;
+		buf = (char *)buf + rd;
+		len -= rd;
+		off += rd;
+	}
+	return 0;
+}
+
+static errcode_t image_pwrite(int fd, const void *buf, size_t len,
+			      uint64_t off)
+{
+	ssize_t wr;
+
+	while (len) {
+		wr = pwrite64(fd, buf, len, off);
+		if (wr < 0) {
+			if (errno == EINTR)
+				continue;
+			return CMFS_ET_IO;
+		}
+		if (!wr)
+			return CMFS_ET_SHORT_WRITE;
+		buf = (const char *)buf + wr;
+		len -= wr;
+		off += wr;
+	}
+	return 0;
+}
+
+/*
+ * Where blkno is among the blocks held, or -1 if the image doesn't
+ * hold it.
+ */
+static int64_t image_block_index(cmfs_image *img, uint64_t blkno)
+{
+	uint64_t word = blkno / 64, i;
+	uint64_t bit = 1ULL << (blkno % 64);
+	int64_t idx;
+
+	if (!(img->ci_map[word] & bit))
+		return -1;
+
+	idx = img->ci_rank[blkno / CMFS_IMAGE_RANK_BITS];
+	for (i = (blkno / CMFS_IMAGE_RANK_BITS) * (CMFS_IMAGE_RANK_BITS / 64);
+	     i < word; i++)
+		idx += __builtin_popcountll(img->ci_map[i]);
+	idx += __builtin_popcountll(img->ci_map[word] & (bit - 1));
+
+	return idx;
+}
+
+static uint32_t image_chunk_bytes(cmfs_image *img, uint64_t chunk)
+{
+	uint64_t blocks = img->ci_nr_blocks - chunk * img->ci_chunk_blocks;
+
+	if (blocks > img->ci_chunk_blocks)
+		blocks = img->ci_chunk_blocks;
+	return blocks * img->ci_blocksize;
+}
+
+/* Called with ci_lock held */
+static errcode_t image_get_chunk(cmfs_image *img, uint64_t chunk,
+				 char **ret_buf)
+{
+	struct image_chunk *ic, *victim = &img->ci_cache[0];
+	uint64_t zlen;
+	uLongf len;
+	uint32_t bytes;
+	errcode_t ret;
+	int i;
+
+	for (i = 0; i < IMAGE_CACHE_CHUNKS; i++) {
+		ic = &img->ci_cache[i];
+		if (ic->ic_chunk == chunk) {
+			ic->ic_last = ++img->ci_clock;
+			*ret_buf = ic->ic_buf;
+			return 0;
+		}
+		if (ic->ic_last < victim->ic_last)
+			victim = ic;
+	}
+
+	ic = victim;
+	ic->ic_chunk = UINT64_MAX;
+	bytes = image_chunk_bytes(img, chunk);
+	zlen = img->ci_chunks[chunk + 1] - img->ci_chunks[chunk];
+	if (zlen > bytes)
+		return CMFS_ET_IO;
+
+	/* Stored, it didn't compress */
+	if (zlen == bytes) {
+		ret = image_pread(img->ci_fd, ic->ic_buf, bytes,
+				  img->ci_chunks[chunk]);
+		if (ret)
+			return ret;
+	} else {
+		ret = image_pread(img->ci_fd, img->ci_zbuf, zlen,
+				  img->ci_chunks[chunk]);
+		if (ret)
+			return ret;
+		len = bytes;
+		if ((uncompress((Bytef *)ic->ic_buf, &len,
+				(Bytef *)img->ci_zbuf, zlen) != Z_OK) ||
+		    (len != bytes))
+			return CMFS_ET_IO;
+	}
+
+	ic->ic_chunk = chunk;
+	ic->ic_last = ++img->ci_clock;
+	*ret_buf = ic->ic_buf;
+	return 0;
+}
+
+static errcode_t image_read_held(cmfs_image *img, uint64_t idx,
+				 uint32_t off, uint32_t len, char *buf)
+{
+	uint64_t chunk;
+	char *cbuf;
+	errcode_t ret;
+
+	if (!(img->ci_flags & CMFS_IMAGE_FL_COMPRESSED))
+		return image_pread(img->ci_fd, buf, len,
+				   img->ci_data_offset +
+				   idx * img->ci_blocksize + off);
+
+	chunk = idx / img->ci_chunk_blocks;
+	pthread_mutex_lock(&img->ci_lock);
+	ret = image_get_chunk(img, chunk, &cbuf);
+	if (!ret)
+		memcpy(buf, cbuf + (idx % img->ci_chunk_blocks) *
+		       img->ci_blocksize + off, len);
+	pthread_mutex_unlock(&img->ci_lock);
+
+	return ret;
+}
+
+/*
+ * Read len bytes at offset of the volume in the image.  Blocks the
+ * image doesn't hold read as zeros.  Past the end of the volume the
+ * buffer is zeroed too and CMFS_ET_SHORT_READ returned, as a device
+ * would.  Safe to call from several threads.
+ */
+errcode_t cmfs_image_read(cmfs_image *img, uint64_t offset, uint64_t len,
+			  char *buf)
+{
+	uint64_t dev_bytes = img->ci_dev_blocks * img->ci_blocksize;
+	uint64_t blkno;
+	uint32_t off, n;
+	int64_t idx;
+	errcode_t ret;
+
+	if (offset >= dev_bytes) {
+		memset(buf, 0, len);
+		return CMFS_ET_SHORT_READ;
+	}
+	if (len > dev_bytes - offset) {
+		memset(buf + (dev_bytes - offset), 0,
+		       len - (dev_bytes - offset));
+		ret = cmfs_image_read(img, offset, dev_bytes - offset, buf);
+		return ret ? ret : CMFS_ET_SHORT_READ;
+	}
+
+	while (len) {
+		blkno = offset / img->ci_blocksize;
+		off = offset % img->ci_blocksize;
+		n = img->ci_blocksize - off;
+		if (n > len)
+			n = len;
+
+		idx = image_block_index(img, blkno);
+		if (idx < 0)
+			memset(buf, 0, n);
+		else {
+			ret = image_read_held(img, idx, off, n, buf);
+			if (ret)
+				return ret;
+		}
+
+		buf += n;
+		offset += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+uint64_t cmfs_image_dev_blocks(cmfs_image *img, uint32_t *blocksize)
+{
+	if (blocksize)
+		*blocksize = img->ci_blocksize;
+	return img->ci_dev_blocks;
+}
+
+uint64_t cmfs_image_nr_blocks(cmfs_image *img)
+{
+	return img->ci_nr_blocks;
+}
+
+void cmfs_close_image(cmfs_image *img)
+{
+	int i;
+
+	if (!img)
+		return;
+
+	for (i = 0; i < IMAGE_CACHE_CHUNKS; i++)
+		if (img->ci_cache[i].ic_buf)
+			cmfs_free(&img->ci_cache[i].ic_buf);
+	if (img->ci_zbuf)
+		cmfs_free(&img->ci_zbuf);
+	if (img->ci_chunks)
+		cmfs_free(&img->ci_chunks);
+	if (img->ci_rank)
+		cmfs_free(&img->ci_rank);
+	if (img->ci_map)
+		cmfs_free(&img->ci_map);
+	pthread_mutex_destroy(&img->ci_lock);
+	cmfs_free(&img);
+}
+
+static errcode_t image_load_table(int fd, uint64_t off, uint64_t count,
+				  uint64_t **ret_table)
+{
+	uint64_t *table = NULL, i;
+	errcode_t ret;
+
+	ret = cmfs_malloc(count * sizeof(uint64_t), &table);
+	if (ret)
+		return ret;
+
+	ret = image_pread(fd, table, count * sizeof(uint64_t), off);
+	if (ret) {
+		cmfs_free(&table);
+		return ret;
+	}
+
+	for (i = 0; i < count; i++)
+		table[i] = le64_to_cpu(table[i]);
+	*ret_table = table;
+	return 0;
+}
+
+/*
+ * Open the image in fd.  CMFS_ET_BAD_MAGIC means fd is not an image,
+ * so callers can try it as a device.  The image only reads fd with
+ * pread(), and doesn't close it.
+ */
+errcode_t cmfs_open_image(int fd, cmfs_image **ret_img)
+{
+	struct cmfs_image_hdr hdr;
+	cmfs_image *img = NULL;
+	uint64_t i;
+	errcode_t ret;
+
+	ret = image_pread(fd, &hdr, sizeof(hdr), 0);
+	if (ret == CMFS_ET_SHORT_READ)
+		return CMFS_ET_BAD_MAGIC;
+	if (ret)
+		return ret;
+	if (memcmp(hdr.ih_magic, CMFS_IMAGE_MAGIC, CMFS_IMAGE_MAGIC_LEN))
+		return CMFS_ET_BAD_MAGIC;
+	if (le32_to_cpu(hdr.ih_version) != CMFS_IMAGE_VERSION)
+		return CMFS_ET_UNSUPP_FEATURE;
+	if (le32_to_cpu(hdr.ih_flags) & ~CMFS_IMAGE_FL_COMPRESSED)
+		return CMFS_ET_UNSUPP_FEATURE;
+
+	ret = cmfs_malloc0(sizeof(cmfs_image), &img);
+	if (ret)
+		return ret;
+	pthread_mutex_init(&img->ci_lock, NULL);
+
+	img->ci_fd = fd;
+	img->ci_flags = le32_to_cpu(hdr.ih_flags);
+	img->ci_blocksize = le32_to_cpu(hdr.ih_blocksize);
+	img->ci_chunk_blocks = le32_to_cpu(hdr.ih_chunk_blocks);
+	img->ci_dev_blocks = le64_to_cpu(hdr.ih_dev_blocks);
+	img->ci_nr_blocks = le64_to_cpu(hdr.ih_nr_blocks);
+	img->ci_nr_chunks = le64_to_cpu(hdr.ih_nr_chunks);
+	img->ci_data_offset = le64_to_cpu(hdr.ih_data_offset);
+
+	ret = CMFS_ET_UNEXPECTED_BLOCK_SIZE;
+	if ((img->ci_blocksize < CMFS_MIN_BLOCKSIZE) ||
+	    (img->ci_blocksize > CMFS_MAX_BLOCKSIZE) ||
+	    (img->ci_blocksize & (img->ci_blocksize - 1)))
+		goto out;
+
+	ret = image_load_table(fd, le64_to_cpu(hdr.ih_map_offset),
+			       image_map_words(img->ci_dev_blocks),
+			       &img->ci_map);
+	if (ret)
+		goto out;
+	ret = image_load_table(fd, le64_to_cpu(hdr.ih_rank_offset),
+			       image_rank_entries(img->ci_dev_blocks),
+			       &img->ci_rank);
+	if (ret)
+		goto out;
+
+	if (img->ci_flags & CMFS_IMAGE_FL_COMPRESSED) {
+		ret = CMFS_ET_CORRUPT_SUPERBLOCK;
+		if (!img->ci_chunk_blocks ||
+		    (img->ci_nr_chunks !=
+		     (img->ci_nr_blocks + img->ci_chunk_blocks - 1) /
+		     img->ci_chunk_blocks))
+			goto out;
+
+		ret = image_load_table(fd, le64_to_cpu(hdr.ih_chunk_offset),
+				       img->ci_nr_chunks + 1, &img->ci_chunks);
+		if (ret)
+			goto out;
+
+		ret = cmfs_malloc((size_t)img->ci_chunk_blocks *
+				  img->ci_blocksize, &img->ci_zbuf);
+		if (ret)
+			goto out;
+		for (i = 0; i < IMAGE_CACHE_CHUNKS; i++) {
+			img->ci_cache[i].ic_chunk = UINT64_MAX;
+			ret = cmfs_malloc((size_t)img->ci_chunk_blocks *
+					  img->ci_blocksize,
+					  &img->ci_cache[i].ic_buf);
+			if (ret)
+				goto out;
+		}
+	}
+
+	*ret_img = img;
+	img = NULL;
+
+out:
+	cmfs_close_image(img);
+	return ret;
+}
+
+/*
+ * Start an image of a volume of dev_blocks blocks in fd, which should
+ * be empty.  map has a bit set, as cmfs_set_bit() would, for each
+ * block the image will hold; the caller passes exactly those blocks to
+ * cmfs_image_write_blocks(), lowest first, then calls
+ * cmfs_image_writer_finish().  flags takes CMFS_IMAGE_FL_COMPRESSED.
+ */
+errcode_t cmfs_open_image_writer(int fd, uint32_t blocksize,
+				 uint64_t dev_blocks, const uint8_t *map,
+				 int flags, cmfs_image_writer **ret_iw)
+{
+	cmfs_image_writer *iw = NULL;
+	uint64_t words = image_map_words(dev_blocks);
+	uint64_t ranks = image_rank_entries(dev_blocks);
+	uint64_t *table = NULL, word, i, held = 0;
+	errcode_t ret;
+
+	if ((flags & ~CMFS_IMAGE_FL_COMPRESSED) || !dev_blocks ||
+	    (blocksize < CMFS_MIN_BLOCKSIZE) ||
+	    (blocksize > CMFS_MAX_BLOCKSIZE))
+		return CMFS_ET_INVALID_ARGUMENT;
+
+	ret = cmfs_malloc0(sizeof(cmfs_image_writer), &iw);
+	if (ret)
+		return ret;
+	iw->iw_fd = fd;
+	iw->iw_flags = flags;
+	iw->iw_blocksize = blocksize;
+	iw->iw_dev_blocks = dev_blocks;
+
+	ret = cmfs_malloc0(words * sizeof(uint64_t), &table);
+	if (ret)
+		goto out;
+
+	/* The map, and count what it holds; whole words are easier */
+	memcpy(table, map, (dev_blocks + 7) / 8);
+	if (dev_blocks % 64)
+		table[words - 1] &= cpu_to_le64((1ULL << (dev_blocks % 64)) -
+						1);
+	for (i = 0; i < words; i++)
+		held += __builtin_popcountll(le64_to_cpu(table[i]));
+	iw->iw_nr_blocks = held;
+
+	iw->iw_map_offset = CMFS_IMAGE_HDR_SIZE;
+	ret = image_pwrite(fd, table, words * sizeof(uint64_t),
+			   iw->iw_map_offset);
+	if (ret)
+		goto out;
+
+	/* Turn it into the rank table in place */
+	held = 0;
+	for (i = 0; i < words; i++) {
+		word = le64_to_cpu(table[i]);
+		if (!(i % (CMFS_IMAGE_RANK_BITS / 64)))
+			table[i / (CMFS_IMAGE_RANK_BITS / 64)] =
+				cpu_to_le64(held);
+		held += __builtin_popcountll(word);
+	}
+	iw->iw_rank_offset = image_align(iw->iw_map_offset +
+					 words * sizeof(uint64_t));
+	ret = image_pwrite(fd, table, ranks * sizeof(uint64_t),
+			   iw->iw_rank_offset);
+	if (ret)
+		goto out;
+
+	iw->iw_chunk_offset = image_align(iw->iw_rank_offset +
+					  ranks * sizeof(uint64_t));
+	iw->iw_data_offset = iw->iw_chunk_offset;
+	if (flags & CMFS_IMAGE_FL_COMPRESSED) {
+		iw->iw_nr_chunks = (iw->iw_nr_blocks +
+				    CMFS_IMAGE_CHUNK_BLOCKS - 1) /
+				   CMFS_IMAGE_CHUNK_BLOCKS;
+		iw->iw_data_offset =
+			image_align(iw->iw_chunk_offset +
+				    (iw->iw_nr_chunks + 1) * sizeof(uint64_t));
+		ret = cmfs_malloc0((iw->iw_nr_chunks + 1) * sizeof(uint64_t),
+				   &iw->iw_chunks);
+		if (ret)
+			goto out;
+		ret = cmfs_malloc(CMFS_IMAGE_CHUNK_BLOCKS * blocksize,
+				  &iw->iw_chunk_buf);
+		if (ret)
+			goto out;
+		iw->iw_zbuf_len = compressBound(CMFS_IMAGE_CHUNK_BLOCKS *
+						blocksize);
+		ret = cmfs_malloc(iw->iw_zbuf_len, &iw->iw_zbuf);
+		if (ret)
+			goto out;
+	}
+	iw->iw_pos = iw->iw_data_offset;
+
+	*ret_iw = iw;
+	iw = NULL;
+
+out:
+	if (table)
+		cmfs_free(&table);
+	cmfs_close_image_writer(iw);
+	return ret;
+}
+
+static errcode_t image_flush_chunk(cmfs_image_writer *iw)
+{
+	uint64_t chunk = iw->iw_written / CMFS_IMAGE_CHUNK_BLOCKS;
+	uLong raw = iw->iw_chunk_fill * iw->iw_blocksize;
+	uLongf zlen = iw->iw_zbuf_len;
+	const char *out = iw->iw_zbuf;
+	errcode_t ret;
+
+	if (!iw->iw_chunk_fill)
+		return 0;
+
+	/* iw_written doesn't count the chunk yet */
+	if ((compress2((Bytef *)iw->iw_zbuf, &zlen,
+		       (Bytef *)iw->iw_chunk_buf, raw,
+		       Z_DEFAULT_COMPRESSION) != Z_OK) || (zlen >= raw)) {
+		out = iw->iw_chunk_buf;
+		zlen = raw;
+	}
+
+	ret = image_pwrite(iw->iw_fd, out, zlen, iw->iw_pos);
+	if (ret)
+		return ret;
+
+	iw->iw_chunks[chunk] = iw->iw_pos;
+	iw->iw_pos += zlen;
+	iw->iw_chunks[chunk + 1] = iw->iw_pos;
+	iw->iw_written += iw->iw_chunk_fill;
+	iw->iw_chunk_fill = 0;
+	return 0;
+}
+
+/* The next count blocks the map says the image holds */
+errcode_t cmfs_image_write_blocks(cmfs_image_writer *iw, int count,
+				  const char *buf)
+{
+	uint32_t n;
+	errcode_t ret;
+
+	if (iw->iw_written + iw->iw_chunk_fill + count > iw->iw_nr_blocks)
+		return CMFS_ET_INVALID_ARGUMENT;
+
+	if (!(iw->iw_flags & CMFS_IMAGE_FL_COMPRESSED)) {
+		ret = image_pwrite(iw->iw_fd, buf,
+				   (size_t)count * iw->iw_blocksize,
+				   iw->iw_pos);
+		if (ret)
+			return ret;
+		iw->iw_pos += (uint64_t)count * iw->iw_blocksize;
+		iw->iw_written += count;
+		return 0;
+	}
+
+	while (count) {
+		n = CMFS_IMAGE_CHUNK_BLOCKS - iw->iw_chunk_fill;
+		if (n > count)
+			n = count;
+		memcpy(iw->iw_chunk_buf + iw->iw_chunk_fill * iw->iw_blocksize,
+		       buf, n * iw->iw_blocksize);
+		iw->iw_chunk_fill += n;
+		buf += n * iw->iw_blocksize;
+		count -= n;
+
+		if (iw->iw_chunk_fill == CMFS_IMAGE_CHUNK_BLOCKS) {
+			ret = image_flush_chunk(iw);
+			if (ret)
+				return ret;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Write what's left, then the header, which makes the image valid.
+ * uuid is the volume's, 16 bytes.  The image bytes are returned in
+ * *ret_size if it isn't NULL.
+ */
+errcode_t cmfs_image_writer_finish(cmfs_image_writer *iw,
+				   const uint8_t *uuid, uint64_t *ret_size)
+{
+	struct cmfs_image_hdr *hdr;
+	char *buf = NULL;
+	uint64_t i;
+	errcode_t ret;
+
+	if (iw->iw_flags & CMFS_IMAGE_FL_COMPRESSED) {
+		ret = image_flush_chunk(iw);
+		if (ret)
+			return ret;
+	}
+	if (iw->iw_written != iw->iw_nr_blocks)
+		return CMFS_ET_INVALID_ARGUMENT;
+
+	if (iw->iw_flags & CMFS_IMAGE_FL_COMPRESSED) {
+		if (!iw->iw_nr_chunks)
+			iw->iw_chunks[0] = iw->iw_pos;
+		for (i = 0; i <= iw->iw_nr_chunks; i++)
+			iw->iw_chunks[i] = cpu_to_le64(iw->iw_chunks[i]);
+		ret = image_pwrite(iw->iw_fd, iw->iw_chunks,
+				   (iw->iw_nr_chunks + 1) * sizeof(uint64_t),
+				   iw->iw_chunk_offset);
+		for (i = 0; i <= iw->iw_nr_chunks; i++)
+			iw->iw_chunks[i] = le64_to_cpu(iw->iw_chunks[i]);
+		if (ret)
+			return ret;
+	}
+
+	/* Everything is down before the header says it is */
+	if (fsync(iw->iw_fd) && (errno != EINVAL))
+		return CMFS_ET_IO;
+
+	ret = cmfs_malloc0(CMFS_IMAGE_HDR_SIZE, &buf);
+	if (ret)
+		return ret;
+	hdr = (struct cmfs_image_hdr *)buf;
+	memcpy(hdr->ih_magic, CMFS_IMAGE_MAGIC, CMFS_IMAGE_MAGIC_LEN);
+	hdr->ih_version = cpu_to_le32(CMFS_IMAGE_VERSION);
+	hdr->ih_flags = cpu_to_le32(iw->iw_flags);
+	hdr->ih_blocksize = cpu_to_le32(iw->iw_blocksize);
+	hdr->ih_chunk_blocks = cpu_to_le32((iw->iw_flags &
+					    CMFS_IMAGE_FL_COMPRESSED) ?
+					   CMFS_IMAGE_CHUNK_BLOCKS : 0);
+	hdr->ih_dev_blocks = cpu_to_le64(iw->iw_dev_blocks);
+	hdr->ih_nr_blocks = cpu_to_le64(iw->iw_nr_blocks);
+	hdr->ih_nr_chunks = cpu_to_le64(iw->iw_nr_chunks);
+	hdr->ih_map_offset = cpu_to_le64(iw->iw_map_offset);
+	hdr->ih_rank_offset = cpu_to_le64(iw->iw_rank_offset);
+	hdr->ih_chunk_offset = cpu_to_le64(iw->iw_chunk_offset);
+	hdr->ih_data_offset = cpu_to_le64(iw->iw_data_offset);
+	hdr->ih_ctime = cpu_to_le64(time(NULL));
+	if (uuid)
+		memcpy(hdr->ih_uuid, uuid, sizeof(hdr->ih_uuid));
+
+	ret = image_pwrite(iw->iw_fd, buf, CMFS_IMAGE_HDR_SIZE, 0);
+	if (!ret && fsync(iw->iw_fd) && (errno != EINVAL))
+		ret = CMFS_ET_IO;
+	if (!ret && ret_size)
+		*ret_size = iw->iw_pos;
+
+	cmfs_free(&buf);
+	return ret;
+}
+
+void cmfs_close_image_writer(cmfs_image_writer *iw)
+{
+	if (!iw)
+		return;
+
+	if (iw->iw_zbuf)
+		cmfs_free(&iw->iw_zbuf);
+	if (iw->iw_chunk_buf)
+		cmfs_free(&iw->iw_chunk_buf);
+	if (iw->iw_chunks)
+		cmfs_free(&iw->iw_chunks);
+	cmfs_free(&iw);
+}
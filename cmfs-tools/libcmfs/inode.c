@@ -30,6 +30,7 @@
 #define _LARGEFILE64_SOURCE
 
 #include <string.h>
+#include <stdlib.h>
 #include <inttypes.h>
 #include <sys/stat.h>
 
@@ -285,10 +286,11 @@ errcode_t cmfs_read_inode(cmfs_filesys *fs,
 	    (blkno > fs->fs_blocks))
 		return CMFS_ET_BAD_BLKNO;
 
-	ret = cmfs_malloc_block(fs->fs_io, &blk);
+	ret = cmfs_scratch_block(fs->fs_io, &blk);
 	if (ret)
 		return ret;
 
+	io_set_block_type(CMFS_BLOCK_INODE);
 	ret = cmfs_read_blocks(fs, blkno, 1, blk);
 	if (ret)
 		goto out;
@@ -306,7 +308,153 @@ errcode_t cmfs_read_inode(cmfs_filesys *fs,
 	ret = 0;
 
 out:
-	cmfs_free(&blk);
+	return ret;
+}
+
+/*
+ * Batched inode reads.
+ *
+ * The requested block numbers are sorted and deduplicated, neighbours
+ * are coalesced into multi-block runs, and the runs are submitted
+ * through io_vec_read_blocks() CMFS_READ_INODES_QDEPTH at a time.
+ */
+#define CMFS_READ_INODES_QDEPTH		128
+#define CMFS_READ_INODES_MAX_RUN	256	/* blocks, 1MB at 4K */
+
+struct inode_read_req {
+	uint64_t ir_blkno;
+	int ir_index;		/* into the caller's arrays */
+	int ir_slot;		/* into the read buffer */
+};
+
+static int inode_read_req_cmp(const void *a, const void *b)
+{
+	const struct inode_read_req *l = a, *r = b;
+
+	if (l->ir_blkno < r->ir_blkno)
+		return -1;
+	if (l->ir_blkno > r->ir_blkno)
+		return 1;
+	return 0;
+}
+
+/*
+ * Read count inodes at blknos[] into bufs[], which must each be
+ * fs_blocksize bytes. The same block may appear more than once.
+ *
+ * An I/O error fails the whole call. An inode with a bad block number
+ * or a bad signature leaves its buffer zeroed; the other inodes are
+ * still read and swapped, and the first such error is returned.
+ */
+errcode_t cmfs_read_inodes(cmfs_filesys *fs,
+			   uint64_t *blknos,
+			   int count,
+			   char **bufs)
+{
+	errcode_t ret, bad = 0;
+	int i, nr_reqs = 0, nr_slots = 0, nr_ivus = 0, done;
+	char *blks = NULL, *blk;
+	struct inode_read_req *reqs = NULL;
+	struct io_vec_unit *ivus = NULL;
+	struct cmfs_dinode *di;
+	int blksize = fs->fs_blocksize;
+
+	if (count <= 0)
+		return 0;
+
+	ret = cmfs_malloc(sizeof(struct inode_read_req) * count, &reqs);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < count; i++) {
+		memset(bufs[i], 0, blksize);
+		if ((blknos[i] < CMFS_SUPER_BLOCK_BLKNO) ||
+		    (blknos[i] > fs->fs_blocks)) {
+			if (!bad)
+				bad = CMFS_ET_BAD_BLKNO;
+			continue;
+		}
+		reqs[nr_reqs].ir_blkno = blknos[i];
+		reqs[nr_reqs].ir_index = i;
+		nr_reqs++;
+	}
+	if (!nr_reqs)
+		goto out;
+
+	qsort(reqs, nr_reqs, sizeof(struct inode_read_req),
+	      inode_read_req_cmp);
+
+	/* Dedupe into slots, one slot per distinct block */
+	for (i = 0; i < nr_reqs; i++) {
+		if (i && (reqs[i].ir_blkno == reqs[i - 1].ir_blkno)) {
+			reqs[i].ir_slot = reqs[i - 1].ir_slot;
+			continue;
+		}
+		reqs[i].ir_slot = nr_slots++;
+	}
+
+	ret = cmfs_malloc_blocks(fs->fs_io, nr_slots, &blks);
+	if (ret)
+		goto out;
+
+	ret = cmfs_malloc(sizeof(struct io_vec_unit) * nr_slots, &ivus);
+	if (ret)
+		goto out;
+
+	/* Coalesce neighbouring slots into runs */
+	for (i = 0; i < nr_reqs; i++) {
+		if (i && (reqs[i].ir_slot == reqs[i - 1].ir_slot))
+			continue;
+		if (nr_ivus &&
+		    (reqs[i].ir_blkno ==
+		     ivus[nr_ivus - 1].ivu_blkno +
+		     ivus[nr_ivus - 1].ivu_buflen / blksize) &&
+		    (ivus[nr_ivus - 1].ivu_buflen <
+		     CMFS_READ_INODES_MAX_RUN * blksize)) {
+			ivus[nr_ivus - 1].ivu_buflen += blksize;
+			continue;
+		}
+		ivus[nr_ivus].ivu_blkno = reqs[i].ir_blkno;
+		ivus[nr_ivus].ivu_buf = blks +
+			(uint64_t)reqs[i].ir_slot * blksize;
+		ivus[nr_ivus].ivu_buflen = blksize;
+		nr_ivus++;
+	}
+
+	for (done = 0; done < nr_ivus; done += CMFS_READ_INODES_QDEPTH) {
+		i = nr_ivus - done;
+		if (i > CMFS_READ_INODES_QDEPTH)
+			i = CMFS_READ_INODES_QDEPTH;
+		io_set_block_type(CMFS_BLOCK_INODE);
+		ret = io_vec_read_blocks(fs->fs_io, ivus + done, i);
+		if (ret)
+			goto out;
+	}
+
+	for (i = 0; i < nr_reqs; i++) {
+		blk = blks + (uint64_t)reqs[i].ir_slot * blksize;
+		di = (struct cmfs_dinode *)blk;
+		if (memcmp(di->i_signature, CMFS_INODE_SIGNATURE,
+			   strlen(CMFS_INODE_SIGNATURE))) {
+			if (!bad)
+				bad = CMFS_ET_BAD_INODE_MAGIC;
+			continue;
+		}
+
+		memcpy(bufs[reqs[i].ir_index], blk, blksize);
+		di = (struct cmfs_dinode *)bufs[reqs[i].ir_index];
+		cmfs_swap_inode_to_cpu(fs, di);
+	}
+
+out:
+	if (ivus)
+		cmfs_free(&ivus);
+	if (blks)
+		cmfs_free(&blks);
+	if (reqs)
+		cmfs_free(&reqs);
+	if (!ret)
+		ret = bad;
 	return ret;
 }
 
@@ -334,10 +482,12 @@ errcode_t cmfs_write_inode(cmfs_filesys *fs,
 	di = (struct cmfs_dinode *)blk;
 	cmfs_swap_inode_from_cpu(fs, di);
 
+	io_set_block_type(CMFS_BLOCK_INODE);
 	ret = io_write_block(fs->fs_io, blkno, 1, blk);
 	if (ret)
 		goto out;
 
+	cmfs_icache_refresh(fs, blkno, inode_buf);
 	fs->fs_flags |= CMFS_FLAG_CHANGED;
 	ret = 0;
 
@@ -0,0 +1,261 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * inode_scan.c
+ *
+ * Scan all inodes in a filesystem.  For the CMFS userspace library.
+ *
+ * Copyright (C) 2012, Coly Li <i@coly.li>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#define _XOPEN_SOURCE 600  /* Triggers XOPEN2K in features.h */
+#define _LARGEFILE64_SOURCE
+
+#include <string.h>
+
+#include <cmfs/cmfs.h>
+#include <cmfs/bitops.h>
+#include "cmfs_err.h"
+
+/*
+ * The scan walks the chains of global_inode_alloc and inode_alloc in
+ * on-disk order and returns the valid inodes of each group.  The
+ * allocated part of a group is read CMFS_INODE_SCAN_BLOCKS at a time
+ * without going through the block cache, so a full scan is a series
+ * of large sequential reads and leaves the cache alone.
+ */
+#define CMFS_INODE_SCAN_BLOCKS		256	/* 1MB at 4K */
+#define CMFS_INODE_SCAN_ALLOCS		2
+
+struct _cmfs_inode_scan {
+	cmfs_filesys *is_fs;
+
+	uint64_t is_allocs[CMFS_INODE_SCAN_ALLOCS];
+	int is_nr_allocs;
+	int is_cur_alloc;
+	char *is_alloc_buf;		/* dinode of the current allocator */
+
+	int is_cur_chain;
+	uint64_t is_next_group;		/* 0 at the end of the chain */
+	uint64_t is_chain_groups;	/* groups walked, to stop loops */
+
+	char *is_gd_buf;		/* current group descriptor */
+	int is_have_group;
+	int is_cur_bit;
+
+	char *is_buf;			/* blocks read ahead */
+	uint64_t is_buf_blkno;
+	int is_buf_count;
+};
+
+errcode_t cmfs_open_inode_scan(cmfs_filesys *fs, cmfs_inode_scan **ret_scan)
+{
+	cmfs_inode_scan *scan;
+	char name[CMFS_MAX_FILENAME_LEN];
+	int i, types[CMFS_INODE_SCAN_ALLOCS] = {
+		GLOBAL_INODE_ALLOC_SYSTEM_INODE,
+		INODE_ALLOC_SYSTEM_INODE,
+	};
+	errcode_t ret;
+
+	ret = cmfs_malloc0(sizeof(cmfs_inode_scan), &scan);
+	if (ret)
+		return ret;
+
+	scan->is_fs = fs;
+	scan->is_cur_alloc = -1;
+
+	ret = cmfs_malloc_block(fs->fs_io, &scan->is_alloc_buf);
+	if (ret)
+		goto out;
+	ret = cmfs_malloc_block(fs->fs_io, &scan->is_gd_buf);
+	if (ret)
+		goto out;
+	ret = cmfs_malloc_blocks(fs->fs_io, CMFS_INODE_SCAN_BLOCKS,
+				 &scan->is_buf);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < CMFS_INODE_SCAN_ALLOCS; i++) {
+		cmfs_sprintf_system_inode_name(name, sizeof(name), types[i]);
+		ret = cmfs_lookup(fs, fs->fs_sysdir_blkno, name, strlen(name),
+				  NULL, &scan->is_allocs[scan->is_nr_allocs]);
+		if (ret == CMFS_ET_FILE_NOT_FOUND)
+			continue;
+		if (ret)
+			goto out;
+		scan->is_nr_allocs++;
+	}
+
+	*ret_scan = scan;
+	return 0;
+
+out:
+	cmfs_close_inode_scan(scan);
+	return ret;
+}
+
+void cmfs_close_inode_scan(cmfs_inode_scan *scan)
+{
+	if (!scan)
+		return;
+
+	if (scan->is_buf)
+		cmfs_free(&scan->is_buf);
+	if (scan->is_gd_buf)
+		cmfs_free(&scan->is_gd_buf);
+	if (scan->is_alloc_buf)
+		cmfs_free(&scan->is_alloc_buf);
+	cmfs_free(&scan);
+}
+
+/* Move to the next group, chain or allocator.  Returns 1 at the end. */
+static int next_group(cmfs_inode_scan *scan, errcode_t *ret)
+{
+	cmfs_filesys *fs = scan->is_fs;
+	struct cmfs_dinode *di = (struct cmfs_dinode *)scan->is_alloc_buf;
+	struct cmfs_group_desc *gd = (struct cmfs_group_desc *)scan->is_gd_buf;
+	struct cmfs_chain_list *cl = &di->id2.i_chain;
+
+	*ret = 0;
+	scan->is_have_group = 0;
+
+	while (!scan->is_next_group) {
+		if ((scan->is_cur_alloc >= 0) &&
+		    (scan->is_cur_chain + 1 < cl->cl_next_free_rec)) {
+			scan->is_cur_chain++;
+			scan->is_next_group =
+				cl->cl_recs[scan->is_cur_chain].c_blkno;
+			scan->is_chain_groups = 0;
+			continue;
+		}
+
+		if (++scan->is_cur_alloc >= scan->is_nr_allocs)
+			return 1;
+
+		*ret = cmfs_read_inode(fs, scan->is_allocs[scan->is_cur_alloc],
+				       scan->is_alloc_buf);
+		if (*ret)
+			return 1;
+		if (!(di->i_flags & CMFS_CHAIN_FL) ||
+		    (cl->cl_next_free_rec > cl->cl_count) ||
+		    (cl->cl_count > cmfs_chain_recs_per_inode(fs->fs_blocksize))) {
+			*ret = CMFS_ET_INODE_CANNOT_BE_ITERATED;
+			return 1;
+		}
+		scan->is_cur_chain = -1;
+	}
+
+	if (++scan->is_chain_groups > fs->fs_clusters) {
+		*ret = CMFS_ET_BAD_GROUP_DESC_MAGIC;
+		return 1;
+	}
+
+	*ret = cmfs_read_group_desc(fs, scan->is_next_group, scan->is_gd_buf);
+	if (*ret)
+		return 1;
+	if ((gd->bg_blkno != scan->is_next_group) ||
+	    (gd->bg_bits > gd->bg_size * 8)) {
+		*ret = CMFS_ET_BAD_GROUP_DESC_MAGIC;
+		return 1;
+	}
+
+	scan->is_next_group = gd->bg_next_group;
+	scan->is_have_group = 1;
+	scan->is_cur_bit = 1;	/* bit 0 is the descriptor */
+	scan->is_buf_count = 0;
+
+	return 0;
+}
+
+/* Read from bit up to the last allocated bit of the window */
+static errcode_t fill_buffer(cmfs_inode_scan *scan, int bit)
+{
+	struct cmfs_group_desc *gd = (struct cmfs_group_desc *)scan->is_gd_buf;
+	int end, last;
+
+	end = bit + CMFS_INODE_SCAN_BLOCKS;
+	if (end > gd->bg_bits)
+		end = gd->bg_bits;
+	for (last = end - 1; last > bit; last--)
+		if (cmfs_test_bit(last, gd->bg_bitmap))
+			break;
+
+	scan->is_buf_blkno = gd->bg_blkno + bit;
+	scan->is_buf_count = last - bit + 1;
+
+	io_set_block_type(CMFS_BLOCK_INODE);
+	return io_read_block_nocache(scan->is_fs->fs_io, scan->is_buf_blkno,
+				     scan->is_buf_count, scan->is_buf);
+}
+
+/*
+ * Return the next valid inode in inode_buf, swapped to cpu order, and
+ * its block number in *blkno.  *blkno is 0 when the scan is done.
+ * Allocated blocks without an inode signature are skipped.
+ */
+errcode_t cmfs_get_next_inode(cmfs_inode_scan *scan, uint64_t *blkno,
+			      char *inode_buf)
+{
+	cmfs_filesys *fs = scan->is_fs;
+	struct cmfs_group_desc *gd = (struct cmfs_group_desc *)scan->is_gd_buf;
+	struct cmfs_dinode *di;
+	uint64_t this;
+	char *blk;
+	int bit;
+	errcode_t ret;
+
+	*blkno = 0;
+	for (;;) {
+		if (!scan->is_have_group) {
+			if (next_group(scan, &ret))
+				return ret;
+		}
+
+		bit = cmfs_find_next_bit_set(gd->bg_bitmap, gd->bg_bits,
+					     scan->is_cur_bit);
+		if (bit >= gd->bg_bits) {
+			scan->is_have_group = 0;
+			continue;
+		}
+		scan->is_cur_bit = bit + 1;
+
+		this = gd->bg_blkno + bit;
+		if ((this < scan->is_buf_blkno) ||
+		    (this >= scan->is_buf_blkno + scan->is_buf_count)) {
+			ret = fill_buffer(scan, bit);
+			if (ret)
+				return ret;
+		}
+
+		blk = scan->is_buf +
+		      (this - scan->is_buf_blkno) * fs->fs_blocksize;
+		di = (struct cmfs_dinode *)blk;
+		if (memcmp(di->i_signature, CMFS_INODE_SIGNATURE,
+			   strlen(CMFS_INODE_SIGNATURE)))
+			continue;
+
+		memcpy(inode_buf, blk, fs->fs_blocksize);
+		di = (struct cmfs_dinode *)inode_buf;
+		cmfs_swap_inode_to_cpu(fs, di);
+		if (!(di->i_flags & CMFS_VALID_FL))
+			continue;
+
+		*blkno = this;
+		return 0;
+	}
+}
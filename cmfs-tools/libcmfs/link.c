@@ -0,0 +1,344 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * link.c
+ *
+ * Create directory entries and directories.  For the CMFS userspace
+ * library.
+ *
+ * Copyright (C) 2012, Coly Li <i@coly.li>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ *
+ *  This code is a port of e2fsprogs/lib/ext2fs/link.c
+ *  Copyright (C) 1993, 1994 Theodore Ts'o.
+ */
+
+#define _XOPEN_SOURCE 600  /* Triggers XOPEN2K in features.h */
+#define _LARGEFILE64_SOURCE
+
+#include <string.h>
+
+#include <cmfs/cmfs.h>
+#include "cmfs_err.h"
+#include "dir_iterate.h"
+
+struct link_struct {
+	cmfs_filesys *fs;
+	const char *name;
+	int namelen;
+	uint64_t inode;
+	int flags;
+	int done;
+};
+
+static int link_proc(struct cmfs_dir_entry *dirent,
+		     uint64_t blocknr,
+		     int offset,
+		     int blocksize,
+		     char *buf,
+		     void *priv_data)
+{
+	struct link_struct *ls = (struct link_struct *)priv_data;
+	struct cmfs_dir_entry *next;
+	int rec_len, min_rec_len;
+
+	if (ls->done)
+		return CMFS_DIRENT_ABORT;
+
+	/* The trailer looks like an empty entry, leave it alone */
+	if (cmfs_supports_dir_trailer(ls->fs) &&
+	    (offset >= cmfs_dir_trailer_blk_off(ls->fs)))
+		return 0;
+
+	rec_len = CMFS_DIR_REC_LEN(ls->namelen);
+
+	/* Split the space after a used entry off into an empty one */
+	if (dirent->inode) {
+		min_rec_len = CMFS_DIR_REC_LEN(dirent->name_len);
+		if (dirent->rec_len < (min_rec_len + rec_len))
+			return 0;
+		next = (struct cmfs_dir_entry *)(buf + offset + min_rec_len);
+		next->inode = 0;
+		next->name_len = 0;
+		next->file_type = 0;
+		next->rec_len = dirent->rec_len - min_rec_len;
+		dirent->rec_len = min_rec_len;
+		dirent = next;
+	}
+
+	if (dirent->rec_len < rec_len)
+		return 0;
+
+	dirent->inode = ls->inode;
+	dirent->name_len = ls->namelen;
+	dirent->file_type = ls->flags;
+	memcpy(dirent->name, ls->name, ls->namelen);
+	ls->done++;
+
+	return CMFS_DIRENT_ABORT | CMFS_DIRENT_CHANGED;
+}
+
+static int last_extent_proc(cmfs_filesys *fs,
+			    struct cmfs_extent_rec *rec,
+			    int tree_depth,
+			    uint32_t ccount,
+			    uint64_t ref_blkno,
+			    int ref_recno,
+			    void *priv_data)
+{
+	struct cmfs_extent_rec *last = priv_data;
+
+	if (!last->e_leaf_blocks || (rec->e_cpos >= last->e_cpos))
+		*last = *rec;
+
+	return 0;
+}
+
+/*
+ * Add one block to the end of a directory.  Directories map whole
+ * clusters, as mkfs lays them out, so the block after the last one is
+ * used while it is still in the last cluster, otherwise a new cluster
+ * is allocated close to the directory.
+ */
+static errcode_t expand_dir(cmfs_filesys *fs, char *di_buf,
+			    cmfs_allocator *eb_ca,
+			    cmfs_allocator *cluster_ca)
+{
+	struct cmfs_dinode *di = (struct cmfs_dinode *)di_buf;
+	struct cmfs_dir_entry *de;
+	struct cmfs_extent_rec last;
+	uint64_t v_blkno, blkno, start;
+	uint32_t cpos, len;
+	char *buf = NULL;
+	int mapped = 0;
+	errcode_t ret;
+
+	ret = cmfs_malloc_block(fs->fs_io, &buf);
+	if (ret)
+		return ret;
+
+	v_blkno = di->i_size / fs->fs_blocksize;
+	if (v_blkno < cmfs_clusters_to_blocks(fs, di->i_clusters)) {
+		memset(&last, 0, sizeof(last));
+		ret = cmfs_extent_iterate_inode(fs, di,
+						CMFS_EXTENT_FLAG_DATA_ONLY,
+						NULL, last_extent_proc, &last);
+		if (ret)
+			goto out;
+		start = cmfs_clusters_to_blocks(fs, last.e_cpos);
+		if ((v_blkno < start) ||
+		    (v_blkno >= start + last.e_leaf_blocks)) {
+			ret = CMFS_ET_DIR_CORRUPTED;
+			goto out;
+		}
+		blkno = last.e_blkno + (v_blkno - start);
+		mapped = 1;
+	} else {
+		ret = cmfs_alloc_clusters(cluster_ca,
+				cmfs_blocks_to_clusters(fs, di->i_blkno),
+				1, 1, &cpos, &len);
+		if (ret)
+			goto out;
+		blkno = cmfs_clusters_to_blocks(fs, cpos);
+	}
+
+	memset(buf, 0, fs->fs_blocksize);
+	de = (struct cmfs_dir_entry *)buf;
+	de->rec_len = fs->fs_blocksize;
+	if (cmfs_supports_dir_trailer(fs)) {
+		de->rec_len = cmfs_dir_trailer_blk_off(fs);
+		cmfs_init_dir_trailer(fs, di, blkno, buf);
+	}
+	ret = cmfs_write_dir_block(fs, di, blkno, buf);
+	if (ret)
+		goto out;
+
+	if (!mapped) {
+		ret = cmfs_insert_extent(fs, di_buf, v_blkno, blkno,
+					 cmfs_clusters_to_blocks(fs, 1), 0,
+					 eb_ca, cluster_ca);
+		if (ret)
+			goto out;
+	}
+
+	di->i_size += fs->fs_blocksize;
+	ret = cmfs_write_inode(fs, di->i_blkno, di_buf);
+
+out:
+	cmfs_free(&buf);
+	return ret;
+}
+
+/*
+ * Add an entry for ino to directory dir.  The name is not checked for
+ * duplicates, use cmfs_lookup() first.  If every block is full the
+ * directory grows by a block, with blocks from cluster_ca and, if its
+ * extent tree needs them, extent blocks from eb_ca.
+ */
+errcode_t cmfs_link(cmfs_filesys *fs, uint64_t dir, const char *name,
+		    uint64_t ino, int type, cmfs_allocator *eb_ca,
+		    cmfs_allocator *cluster_ca)
+{
+	struct cmfs_dinode *di;
+	struct link_struct ls;
+	char *buf = NULL;
+	errcode_t ret;
+
+	if (!(fs->fs_flags & CMFS_FLAG_RW))
+		return CMFS_ET_RO_FILESYS;
+
+	ls.fs = fs;
+	ls.name = name;
+	ls.namelen = name ? strlen(name) : 0;
+	ls.inode = ino;
+	ls.flags = type;
+	ls.done = 0;
+
+	if (!ls.namelen || (ls.namelen > CMFS_MAX_FILENAME_LEN))
+		return CMFS_ET_INVALID_ARGUMENT;
+
+	ret = cmfs_malloc_block(fs->fs_io, &buf);
+	if (ret)
+		return ret;
+
+	ret = cmfs_read_inode(fs, dir, buf);
+	if (ret)
+		goto out;
+
+	di = (struct cmfs_dinode *)buf;
+	if (!S_ISDIR(di->i_mode)) {
+		ret = CMFS_ET_NO_DIRECTORY;
+		goto out;
+	}
+	if (di->i_dyn_features & CMFS_INLINE_DATA_FL) {
+		ret = CMFS_ET_UNSUPP_FEATURE;
+		goto out;
+	}
+
+	ret = cmfs_dir_iterate(fs, dir, CMFS_DIRENT_FLAG_INCLUDE_EMPTY,
+			       NULL, link_proc, &ls);
+	if (ret || ls.done)
+		goto out;
+
+	ret = expand_dir(fs, buf, eb_ca, cluster_ca);
+	if (ret)
+		goto out;
+
+	ret = cmfs_dir_iterate(fs, dir, CMFS_DIRENT_FLAG_INCLUDE_EMPTY,
+			       NULL, link_proc, &ls);
+	if (!ret && !ls.done)
+		ret = CMFS_ET_DIR_CORRUPTED;
+
+out:
+	cmfs_free(&buf);
+	return ret;
+}
+
+/*
+ * Create an empty directory called name in parent, with one block in
+ * use of a whole new cluster, as mkfs lays out the directories it
+ * makes.  The new
+ * inode is returned in *ret_blkno.
+ */
+errcode_t cmfs_mkdir(cmfs_filesys *fs, uint64_t parent, const char *name,
+		     uint16_t mode, cmfs_allocator *inode_ca,
+		     cmfs_allocator *eb_ca, cmfs_allocator *cluster_ca,
+		     uint64_t *ret_blkno)
+{
+	struct cmfs_dinode *di;
+	struct cmfs_dir_entry *de;
+	char *di_buf = NULL, *buf = NULL;
+	uint64_t ino, blkno;
+	uint32_t cpos, len;
+	errcode_t ret;
+
+	ret = cmfs_malloc_block(fs->fs_io, &di_buf);
+	if (ret)
+		return ret;
+	ret = cmfs_malloc_block(fs->fs_io, &buf);
+	if (ret)
+		goto out;
+
+	ret = cmfs_new_inode(inode_ca, cluster_ca, S_IFDIR | (mode & 07777),
+			     di_buf, &ino);
+	if (ret)
+		goto out;
+	di = (struct cmfs_dinode *)di_buf;
+
+	ret = cmfs_alloc_clusters(cluster_ca,
+				  cmfs_blocks_to_clusters(fs, parent),
+				  1, 1, &cpos, &len);
+	if (ret)
+		goto out;
+	blkno = cmfs_clusters_to_blocks(fs, cpos);
+
+	memset(buf, 0, fs->fs_blocksize);
+	de = (struct cmfs_dir_entry *)buf;
+	de->inode = ino;
+	de->name_len = 1;
+	de->file_type = CMFS_FT_DIR;
+	de->name[0] = '.';
+	de->rec_len = CMFS_DIR_REC_LEN(1);
+
+	de = (struct cmfs_dir_entry *)(buf + de->rec_len);
+	de->inode = parent;
+	de->name_len = 2;
+	de->file_type = CMFS_FT_DIR;
+	de->name[0] = de->name[1] = '.';
+	de->rec_len = fs->fs_blocksize - CMFS_DIR_REC_LEN(1);
+	if (cmfs_supports_dir_trailer(fs)) {
+		de->rec_len = cmfs_dir_trailer_blk_off(fs) -
+			      CMFS_DIR_REC_LEN(1);
+		cmfs_init_dir_trailer(fs, di, blkno, buf);
+	}
+
+	ret = cmfs_write_dir_block(fs, di, blkno, buf);
+	if (ret)
+		goto out;
+
+	ret = cmfs_insert_extent(fs, di_buf, 0, blkno,
+				 cmfs_clusters_to_blocks(fs, 1), 0, eb_ca,
+				 cluster_ca);
+	if (ret)
+		goto out;
+	di->i_size = fs->fs_blocksize;
+
+	ret = cmfs_write_inode(fs, ino, di_buf);
+	if (ret)
+		goto out;
+
+	ret = cmfs_link(fs, parent, name, ino, CMFS_FT_DIR, eb_ca,
+			cluster_ca);
+	if (ret)
+		goto out;
+
+	/* The new ".." */
+	ret = cmfs_read_inode(fs, parent, di_buf);
+	if (ret)
+		goto out;
+	di->i_links_count++;
+	ret = cmfs_write_inode(fs, parent, di_buf);
+	if (ret)
+		goto out;
+
+	*ret_blkno = ino;
+
+out:
+	if (buf)
+		cmfs_free(&buf);
+	cmfs_free(&di_buf);
+	return ret;
+}
@@ -34,6 +34,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <cmfs/cmfs.h>
 #include "cmfs_err.h"
@@ -97,3 +98,72 @@ errcode_t cmfs_malloc_block(io_channel *channel, void *ptr)
 {
 	return cmfs_malloc_blocks(channel, 1, ptr);
 }
+
+/*
+ * Per-thread scratch block.
+ *
+ * Read helpers like cmfs_read_inode() need a bounce block to check a
+ * block before copying it to the caller.  Rather than allocating one
+ * per call, each thread keeps one aligned block around; it is freed
+ * when the thread exits.  The buffer belongs to the calling thread and
+ * is only valid until its next cmfs_scratch_block() call, so only leaf
+ * functions which do not call back into other scratch users may use it.
+ */
+struct cmfs_scratch {
+	int s_len;
+	char *s_buf;
+};
+
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+static int scratch_key_ok;
+
+static void scratch_destroy(void *arg)
+{
+	struct cmfs_scratch *scratch = arg;
+
+	if (scratch->s_buf)
+		cmfs_free(&scratch->s_buf);
+	cmfs_free(&scratch);
+}
+
+static void scratch_key_init(void)
+{
+	scratch_key_ok = !pthread_key_create(&scratch_key, scratch_destroy);
+}
+
+errcode_t cmfs_scratch_block(io_channel *channel, void *ptr)
+{
+	errcode_t ret;
+	struct cmfs_scratch *scratch;
+	void **pp = (void **)ptr;
+	int blksize = io_get_blksize(channel);
+
+	pthread_once(&scratch_once, scratch_key_init);
+	if (!scratch_key_ok)
+		return CMFS_ET_NO_MEMORY;
+
+	scratch = pthread_getspecific(scratch_key);
+	if (!scratch) {
+		ret = cmfs_malloc0(sizeof(struct cmfs_scratch), &scratch);
+		if (ret)
+			return ret;
+		if (pthread_setspecific(scratch_key, scratch)) {
+			cmfs_free(&scratch);
+			return CMFS_ET_NO_MEMORY;
+		}
+	}
+
+	if (scratch->s_len < blksize) {
+		if (scratch->s_buf)
+			cmfs_free(&scratch->s_buf);
+		scratch->s_len = 0;
+		ret = cmfs_malloc_block(channel, &scratch->s_buf);
+		if (ret)
+			return ret;
+		scratch->s_len = blksize;
+	}
+
+	*pp = scratch->s_buf;
+	return 0;
+}
@@ -98,6 +98,7 @@ static errcode_t follow_link(cmfs_filesys *fs,
 	if (ret)
 		goto bail;
 
+	io_set_block_type(CMFS_BLOCK_DATA);
 	ret = cmfs_read_blocks(fs, blkno, 1, buffer);
 	if (ret)
 		goto bail;
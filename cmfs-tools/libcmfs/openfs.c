@@ -75,6 +75,7 @@ errcode_t cmfs_read_super(cmfs_filesys *fs, uint64_t superblock, char *sb)
 	if (ret)
 		return ret;
 
+	io_set_block_type(CMFS_BLOCK_SUPERBLOCK);
 	ret = cmfs_read_blocks(fs, superblock, 1, blk);
 	if (ret)
 		goto out_blk;
@@ -130,13 +131,144 @@ out_blk:
 	return ret;
 }
 
+struct prewarm_ctxt {
+	cmfs_filesys *pc_fs;
+	char *pc_di_buf;
+	char *pc_gd_buf;
+	uint64_t pc_budget;		/* blocks we may still read */
+};
+
+/* Read the group descriptors of a chain allocator */
+static void prewarm_chains(struct prewarm_ctxt *pc, struct cmfs_dinode *di)
+{
+	cmfs_filesys *fs = pc->pc_fs;
+	struct cmfs_chain_list *cl = &di->id2.i_chain;
+	struct cmfs_group_desc *gd = (struct cmfs_group_desc *)pc->pc_gd_buf;
+	uint64_t gd_blkno;
+	int i;
+
+	if ((cl->cl_next_free_rec > cl->cl_count) ||
+	    (cl->cl_count > cmfs_chain_recs_per_inode(fs->fs_blocksize)))
+		return;
+
+	for (i = 0; i < cl->cl_next_free_rec; i++) {
+		for (gd_blkno = cl->cl_recs[i].c_blkno;
+		     gd_blkno && pc->pc_budget;
+		     gd_blkno = gd->bg_next_group) {
+			pc->pc_budget--;
+			if (cmfs_read_group_desc(fs, gd_blkno, pc->pc_gd_buf) ||
+			    (gd->bg_blkno != gd_blkno))
+				break;
+		}
+	}
+}
+
+static int prewarm_sysfile(struct cmfs_dir_entry *dirent, uint64_t blocknr,
+			   int offset, int blocksize, char *buf,
+			   void *priv_data)
+{
+	struct prewarm_ctxt *pc = priv_data;
+	struct cmfs_dinode *di = (struct cmfs_dinode *)pc->pc_di_buf;
+
+	if (!pc->pc_budget)
+		return CMFS_DIRENT_ABORT;
+
+	pc->pc_budget--;
+	if (cmfs_read_inode(pc->pc_fs, dirent->inode, pc->pc_di_buf))
+		return 0;
+	if (di->i_flags & CMFS_CHAIN_FL)
+		prewarm_chains(pc, di);
+
+	return 0;
+}
+
+/*
+ * Pull the system directory, the system inodes and the group
+ * descriptors of the allocators into the io_cache, which every
+ * lookup and allocation goes through.  It is only a warm up, so it
+ * stops at half the cache and doesn't care about errors; whatever is
+ * wrong will show when the blocks are really needed.
+ */
+static void cmfs_prewarm_system_files(cmfs_filesys *fs)
+{
+	struct prewarm_ctxt pc;
+
+	memset(&pc, 0, sizeof(pc));
+	pc.pc_fs = fs;
+	pc.pc_budget = io_get_cache_size(fs->fs_io) / fs->fs_blocksize / 2;
+	if (!pc.pc_budget)
+		return;
+
+	if (cmfs_malloc_block(fs->fs_io, &pc.pc_di_buf))
+		return;
+	if (cmfs_malloc_block(fs->fs_io, &pc.pc_gd_buf))
+		goto out;
+
+	cmfs_dir_iterate(fs, fs->fs_sysdir_blkno,
+			 CMFS_DIRENT_FLAG_EXCLUDE_DOTS, NULL,
+			 prewarm_sysfile, &pc);
+
+out:
+	if (pc.pc_gd_buf)
+		cmfs_free(&pc.pc_gd_buf);
+	cmfs_free(&pc.pc_di_buf);
+}
+
+/* Set up the io_cache the caller asked for, before anything is read */
+static errcode_t cmfs_open_cache(cmfs_filesys *fs,
+				 const struct cmfs_open_params *params)
+{
+	errcode_t ret;
+
+	if (!params->op_cache_bytes)
+		return 0;
+
+	io_set_cache_backing(fs->fs_io, params->op_cache_backing,
+			     params->op_cache_node);
+	ret = io_init_cache_size(fs->fs_io, params->op_cache_bytes);
+	if (ret)
+		return ret;
+
+	/* A mapped device or an image has no io_cache */
+	if (!io_get_cache_size(fs->fs_io))
+		return 0;
+
+	if (params->op_flags & CMFS_OPEN_MLOCK_CACHE) {
+		ret = io_mlock_cache(fs->fs_io);
+		if (ret)
+			return ret;
+	}
+
+	if (params->op_cache_max_bytes > params->op_cache_bytes)
+		ret = io_set_cache_autotune(fs->fs_io,
+					    params->op_cache_max_bytes);
+
+	return ret;
+}
+
 errcode_t cmfs_open(const char *name,
 		    int flags,
 		    unsigned int superblock,
 		    unsigned int block_size,
 		    cmfs_filesys **ret_fs)
+{
+	return cmfs_open_with_params(name, flags, superblock, block_size,
+				     NULL, ret_fs);
+}
+
+/*
+ * cmfs_open() with the settings in params, which may be NULL.  A
+ * zeroed cmfs_open_params opens the filesystem as cmfs_open() does.
+ */
+errcode_t cmfs_open_with_params(const char *name,
+				int flags,
+				unsigned int superblock,
+				unsigned int block_size,
+				const struct cmfs_open_params *params,
+				cmfs_filesys **ret_fs)
 {
 	cmfs_filesys *fs;
+	cmfs_group_summary *sm;
 	errcode_t ret;
 	int i, len;
 	char *ptr;
@@ -157,7 +289,9 @@ errcode_t cmfs_open(const char *name,
 	ret = io_open(name,
 		      (flags & (CMFS_FLAG_RO |
 				CMFS_FLAG_RW |
-				CMFS_FLAG_BUFFERED)),
+				CMFS_FLAG_BUFFERED |
+				CMFS_FLAG_THREADED |
+				CMFS_FLAG_MMAP)),
 		      &fs->fs_io);
 	if (ret)
 		goto out;
@@ -167,14 +301,26 @@ errcode_t cmfs_open(const char *name,
 		goto out;
 	strcpy(fs->fs_devname, name);
 
-	/* don't support image file yet */
-	if (io_is_device_readonly(fs->fs_io))
-			fs->fs_flags |= CMFS_FLAG_HARD_RO;
+	ret = cmfs_icache_init(fs);
+	if (ret)
+		goto out;
+
+	/* A metadata image opens read-only, io_open() refuses RW */
+	if (io_is_image(fs->fs_io))
+		fs->fs_flags |= CMFS_FLAG_IMAGE_FILE;
+	else if (io_is_device_readonly(fs->fs_io))
+		fs->fs_flags |= CMFS_FLAG_HARD_RO;
 
 	if (!superblock)
 		superblock = CMFS_SUPER_BLOCK_BLKNO;
 	io_set_blksize(fs->fs_io, block_size);
 
+	if (params) {
+		ret = cmfs_open_cache(fs, params);
+		if (ret)
+			goto out;
+	}
+
 	ret = cmfs_read_super(fs, (uint64_t)superblock, NULL);
 	if (ret)
 		goto out;
@@ -234,6 +380,13 @@ errcode_t cmfs_open(const char *name,
 		ptr += 2;
 	}
 
+	if (params && (params->op_flags & CMFS_OPEN_PREWARM))
+		cmfs_prewarm_system_files(fs);
+
+	/* Only a convenience, cmfs_get_group_summary() tries again */
+	if (params && (params->op_flags & CMFS_OPEN_GROUP_SUMMARY))
+		cmfs_get_group_summary(fs, GLOBAL_BITMAP_SYSTEM_INODE, &sm);
+
 	*ret_fs = fs;
 	return 0;
 out:
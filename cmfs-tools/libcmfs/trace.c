@@ -0,0 +1,443 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * trace.c
+ *
+ * Record and read back io_channel traces.  For the CMFS userspace
+ * library.
+ *
+ * Copyright (C) 2012, Coly Li <i@coly.li>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#define _XOPEN_SOURCE 600  /* Triggers XOPEN2K in features.h */
+#define _LARGEFILE64_SOURCE
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <cmfs/cmfs.h>
+#include <cmfs/byteorder.h>
+#include <cmfs/trace.h>
+#include "cmfs_err.h"
+
+/* 32MB of records, about the last million calls */
+#define TRACE_DEFAULT_RECORDS	(1024 * 1024)
+
+/* Records gathered before they are written out */
+#define TRACE_BUF_RECORDS	1024
+
+struct _cmfs_trace_writer {
+	int tw_fd;
+	uint64_t tw_ring;		/* slots in the file */
+	uint64_t tw_epoch;		/* CLOCK_MONOTONIC ns at the start */
+	uint64_t tw_start;		/* CLOCK_REALTIME ns at the start */
+
+	pthread_mutex_t tw_lock;	/* protects all below */
+	uint32_t tw_blocksize;
+	uint64_t tw_nr;			/* records logged */
+	int tw_fill;			/* the last tw_fill of them, unwritten */
+	struct cmfs_trace_rec *tw_buf;
+	errcode_t tw_error;		/* the first write that failed */
+};
+
+struct _cmfs_trace {
+	int ct_fd;
+	uint32_t ct_blocksize;
+	uint64_t ct_ring;
+	uint64_t ct_nr;			/* records ever logged */
+	uint64_t ct_first;		/* the oldest one still held */
+	uint64_t ct_start;
+	uint64_t ct_cache_bytes;
+};
+
+/* Threads are numbered as they first log, for tr_thread */
+static int trace_threads;
+static __thread int trace_thread = -1;
+
+static errcode_t trace_pread(int fd, void *buf, size_t len, uint64_t off)
+{
+	ssize_t rd;
+
+	while (len) {
+		rd = pread64(fd, buf, len, off);
+		if (rd < 0) {
+			if (errno == EINTR)
+				continue;
+			return CMFS_ET_IO;
+		}
+		if (!rd)
+			return CMFS_ET_SHORT_READ;
+		buf = (char *)buf + rd;
+		len -= rd;
+		off += rd;
+	}
+	return 0;
+}
+
+static errcode_t trace_pwrite(int fd, const void *buf, size_t len,
+			      uint64_t off)
+{
+	ssize_t wr;
+
+	while (len) {
+		wr = pwrite64(fd, buf, len, off);
+		if (wr < 0) {
+			if (errno == EINTR)
+				continue;
+			return CMFS_ET_IO;
+		}
+		if (!wr)
+			return CMFS_ET_SHORT_WRITE;
+		buf = (const char *)buf + wr;
+		len -= wr;
+		off += wr;
+	}
+	return 0;
+}
+
+static inline uint64_t trace_slot_offset(uint64_t ring, uint64_t seq)
+{
+	return CMFS_TRACE_HDR_SIZE +
+		(seq % ring) * sizeof(struct cmfs_trace_rec);
+}
+
+static uint64_t trace_clock(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Write out the buffered records.  They never run past the end of the
+ * ring, trace_add() flushes when the ring wraps.  Caller holds tw_lock.
+ */
+static void trace_flush(cmfs_trace_writer *tw)
+{
+	errcode_t ret;
+
+	if (!tw->tw_fill)
+		return;
+
+	ret = trace_pwrite(tw->tw_fd, tw->tw_buf,
+			   tw->tw_fill * sizeof(struct cmfs_trace_rec),
+			   trace_slot_offset(tw->tw_ring,
+					     tw->tw_nr - tw->tw_fill));
+	if (ret && !tw->tw_error)
+		tw->tw_error = ret;
+	tw->tw_fill = 0;
+}
+
+/* Caller holds tw_lock */
+static struct cmfs_trace_rec *trace_add(cmfs_trace_writer *tw)
+{
+	struct cmfs_trace_rec *tr;
+
+	if ((tw->tw_fill == TRACE_BUF_RECORDS) ||
+	    (tw->tw_fill && !(tw->tw_nr % tw->tw_ring)))
+		trace_flush(tw);
+
+	tr = &tw->tw_buf[tw->tw_fill++];
+	tw->tw_nr++;
+	return tr;
+}
+
+static void trace_fill(struct cmfs_trace_rec *tr, struct cmfs_trace_event *ev)
+{
+	tr->tr_time = cpu_to_le64(ev->te_time);
+	tr->tr_blkno = cpu_to_le64(ev->te_blkno);
+	tr->tr_count = cpu_to_le32((uint32_t)ev->te_count);
+	tr->tr_latency = cpu_to_le32(ev->te_latency);
+	tr->tr_hits = cpu_to_le32(ev->te_hits);
+	tr->tr_op = ev->te_op;
+	tr->tr_flags = ev->te_flags;
+	tr->tr_type = ev->te_type;
+	tr->tr_thread = ev->te_thread;
+}
+
+/*
+ * Start a trace of at most ring_records records in path, 0 for the
+ * default.  The file is created or truncated, and sized for the whole
+ * ring up front.
+ */
+errcode_t cmfs_open_trace_writer(const char *path, uint32_t blocksize,
+				 uint64_t ring_records,
+				 cmfs_trace_writer **ret_tw)
+{
+	cmfs_trace_writer *tw = NULL;
+	errcode_t ret;
+
+	if (!ring_records)
+		ring_records = TRACE_DEFAULT_RECORDS;
+
+	ret = cmfs_malloc0(sizeof(cmfs_trace_writer), &tw);
+	if (ret)
+		return ret;
+	tw->tw_fd = -1;
+	pthread_mutex_init(&tw->tw_lock, NULL);
+
+	ret = cmfs_malloc(TRACE_BUF_RECORDS * sizeof(struct cmfs_trace_rec),
+			  &tw->tw_buf);
+	if (ret)
+		goto out;
+
+	tw->tw_fd = open64(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (tw->tw_fd < 0) {
+		ret = (errno == ENOENT) ? CMFS_ET_NAMED_DEVICE_NOT_FOUND :
+			CMFS_ET_IO;
+		goto out;
+	}
+	if (ftruncate64(tw->tw_fd, trace_slot_offset(ring_records, 0) +
+			ring_records * sizeof(struct cmfs_trace_rec))) {
+		ret = CMFS_ET_IO;
+		goto out;
+	}
+
+	tw->tw_ring = ring_records;
+	tw->tw_blocksize = blocksize;
+	tw->tw_epoch = trace_clock(CLOCK_MONOTONIC);
+	tw->tw_start = trace_clock(CLOCK_REALTIME);
+
+	*ret_tw = tw;
+	tw = NULL;
+
+out:
+	if (tw) {
+		if (tw->tw_fd >= 0)
+			close(tw->tw_fd);
+		if (tw->tw_buf)
+			cmfs_free(&tw->tw_buf);
+		pthread_mutex_destroy(&tw->tw_lock);
+		cmfs_free(&tw);
+	}
+	return ret;
+}
+
+/*
+ * Log one call.  ev->te_time is the CLOCK_MONOTONIC ns it started at
+ * and te_thread is filled in here.  A vec read passes its units in
+ * ivus and gets a record for each; ev's blkno and count are ignored
+ * then.  blocksize is that of the channel, a change is logged first.
+ * Errors writing the trace are kept for cmfs_close_trace_writer().
+ */
+void cmfs_trace_log(cmfs_trace_writer *tw, uint32_t blocksize,
+		    struct cmfs_trace_event *ev, struct io_vec_unit *ivus,
+		    int count)
+{
+	struct cmfs_trace_event bs;
+	int i;
+
+	if (trace_thread < 0)
+		trace_thread = __sync_fetch_and_add(&trace_threads, 1);
+	ev->te_thread = trace_thread;
+	ev->te_time = (ev->te_time > tw->tw_epoch) ?
+		ev->te_time - tw->tw_epoch : 0;
+
+	pthread_mutex_lock(&tw->tw_lock);
+
+	if (blocksize != tw->tw_blocksize) {
+		memset(&bs, 0, sizeof(bs));
+		bs.te_time = ev->te_time;
+		bs.te_op = CMFS_TRACE_BLKSIZE;
+		bs.te_blkno = tw->tw_blocksize;
+		bs.te_count = blocksize;
+		bs.te_thread = ev->te_thread;
+		trace_fill(trace_add(tw), &bs);
+		tw->tw_blocksize = blocksize;
+	}
+
+	if (!ivus) {
+		trace_fill(trace_add(tw), ev);
+		goto out;
+	}
+
+	for (i = 0; i < count; i++) {
+		ev->te_blkno = ivus[i].ivu_blkno;
+		ev->te_count = ivus[i].ivu_buflen / blocksize;
+		trace_fill(trace_add(tw), ev);
+
+		/* The call's latency and hits go on the first unit */
+		ev->te_flags |= CMFS_TRACE_FL_CONT;
+		ev->te_latency = 0;
+		ev->te_hits = 0;
+	}
+
+out:
+	pthread_mutex_unlock(&tw->tw_lock);
+}
+
+/*
+ * Write out what is left and the header, and free tw.  cache_bytes is
+ * the io_cache the calls ran against, for whoever replays them.
+ */
+errcode_t cmfs_close_trace_writer(cmfs_trace_writer *tw,
+				  uint64_t cache_bytes)
+{
+	struct cmfs_trace_hdr hdr;
+	errcode_t ret;
+
+	pthread_mutex_lock(&tw->tw_lock);
+	trace_flush(tw);
+	ret = tw->tw_error;
+	pthread_mutex_unlock(&tw->tw_lock);
+
+	if (!ret) {
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.th_magic, CMFS_TRACE_MAGIC, CMFS_TRACE_MAGIC_LEN);
+		hdr.th_version = cpu_to_le32(CMFS_TRACE_VERSION);
+		hdr.th_blocksize = cpu_to_le32(tw->tw_blocksize);
+		hdr.th_ring_records = cpu_to_le64(tw->tw_ring);
+		hdr.th_nr_records = cpu_to_le64(tw->tw_nr);
+		hdr.th_start = cpu_to_le64(tw->tw_start);
+		hdr.th_cache_bytes = cpu_to_le64(cache_bytes);
+		ret = trace_pwrite(tw->tw_fd, &hdr, sizeof(hdr), 0);
+	}
+
+	if (close(tw->tw_fd) && !ret)
+		ret = CMFS_ET_IO;
+	cmfs_free(&tw->tw_buf);
+	pthread_mutex_destroy(&tw->tw_lock);
+	cmfs_free(&tw);
+	return ret;
+}
+
+/*
+ * Open a finished trace.  When the ring has wrapped the oldest records
+ * held may be the tail units of a vec read, flagged
+ * CMFS_TRACE_FL_CONT without the first.
+ */
+errcode_t cmfs_open_trace(const char *path, cmfs_trace **ret_trace)
+{
+	struct cmfs_trace_hdr hdr;
+	cmfs_trace *trace = NULL;
+	errcode_t ret;
+
+	ret = cmfs_malloc0(sizeof(cmfs_trace), &trace);
+	if (ret)
+		return ret;
+
+	trace->ct_fd = open64(path, O_RDONLY);
+	if (trace->ct_fd < 0) {
+		ret = (errno == ENOENT) ? CMFS_ET_NAMED_DEVICE_NOT_FOUND :
+			CMFS_ET_IO;
+		goto out;
+	}
+
+	ret = trace_pread(trace->ct_fd, &hdr, sizeof(hdr), 0);
+	if (ret == CMFS_ET_SHORT_READ)
+		ret = CMFS_ET_BAD_MAGIC;
+	if (ret)
+		goto out;
+	ret = CMFS_ET_BAD_MAGIC;
+	if (memcmp(hdr.th_magic, CMFS_TRACE_MAGIC, CMFS_TRACE_MAGIC_LEN))
+		goto out;
+	ret = CMFS_ET_UNSUPP_FEATURE;
+	if (le32_to_cpu(hdr.th_version) != CMFS_TRACE_VERSION)
+		goto out;
+
+	trace->ct_blocksize = le32_to_cpu(hdr.th_blocksize);
+	trace->ct_ring = le64_to_cpu(hdr.th_ring_records);
+	trace->ct_nr = le64_to_cpu(hdr.th_nr_records);
+	trace->ct_start = le64_to_cpu(hdr.th_start);
+	trace->ct_cache_bytes = le64_to_cpu(hdr.th_cache_bytes);
+	ret = CMFS_ET_CORRUPT_SUPERBLOCK;
+	if (!trace->ct_ring)
+		goto out;
+	if (trace->ct_nr > trace->ct_ring)
+		trace->ct_first = trace->ct_nr - trace->ct_ring;
+
+	*ret_trace = trace;
+	trace = NULL;
+	ret = 0;
+
+out:
+	cmfs_close_trace(trace);
+	return ret;
+}
+
+void cmfs_trace_get_info(cmfs_trace *trace, struct cmfs_trace_info *info)
+{
+	memset(info, 0, sizeof(struct cmfs_trace_info));
+	info->ti_blocksize = trace->ct_blocksize;
+	info->ti_nr_events = trace->ct_nr - trace->ct_first;
+	info->ti_lost = trace->ct_first;
+	info->ti_start = trace->ct_start;
+	info->ti_cache_bytes = trace->ct_cache_bytes;
+}
+
+/*
+ * Read events [first, first + count) of those held, oldest first, into
+ * evs.
+ */
+errcode_t cmfs_trace_read(cmfs_trace *trace, uint64_t first, uint64_t count,
+			  struct cmfs_trace_event *evs)
+{
+	struct cmfs_trace_rec recs[TRACE_BUF_RECORDS], *tr;
+	uint64_t seq, todo;
+	errcode_t ret;
+	int i;
+
+	if (first + count > trace->ct_nr - trace->ct_first)
+		return CMFS_ET_INVALID_ARGUMENT;
+
+	seq = trace->ct_first + first;
+	while (count) {
+		/* Up to the end of the buffer or the ring */
+		todo = trace->ct_ring - seq % trace->ct_ring;
+		if (todo > TRACE_BUF_RECORDS)
+			todo = TRACE_BUF_RECORDS;
+		if (todo > count)
+			todo = count;
+
+		ret = trace_pread(trace->ct_fd, recs,
+				  todo * sizeof(struct cmfs_trace_rec),
+				  trace_slot_offset(trace->ct_ring, seq));
+		if (ret)
+			return ret;
+
+		for (i = 0, tr = recs; i < todo; i++, tr++, evs++) {
+			evs->te_time = le64_to_cpu(tr->tr_time);
+			evs->te_blkno = le64_to_cpu(tr->tr_blkno);
+			evs->te_count = (int32_t)le32_to_cpu(tr->tr_count);
+			evs->te_latency = le32_to_cpu(tr->tr_latency);
+			evs->te_hits = le32_to_cpu(tr->tr_hits);
+			evs->te_op = tr->tr_op;
+			evs->te_flags = tr->tr_flags;
+			evs->te_type = tr->tr_type;
+			evs->te_thread = tr->tr_thread;
+		}
+
+		seq += todo;
+		count -= todo;
+	}
+
+	return 0;
+}
+
+void cmfs_close_trace(cmfs_trace *trace)
+{
+	if (!trace)
+		return;
+	if (trace->ct_fd >= 0)
+		close(trace->ct_fd);
+	cmfs_free(&trace);
+}
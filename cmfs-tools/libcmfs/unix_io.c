@@ -32,6 +32,8 @@
 #define _LARGEFILE64_SOURCE
 #define _GNU_SOURCE /* Because libc really doesn't want us using O_DIRECT? */
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <et/com_err.h>
 #include <libaio.h>
@@ -45,11 +47,16 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <time.h>
 
 
 #include <cmfs/cmfs.h>
 #include <cmfs-kernel/kernel-list.h>
 #include <cmfs/kernel-rbtree.h>
+#include <cmfs/trace.h>
 #include "cmfs_err.h"
 
 /*
@@ -61,13 +68,44 @@
 
 
 /*
- * The cache looks up blocks in two ways:
+ * Number of shards of the cache in thread-safe mode.  Must be a power
+ * of two.
+ */
+#define IO_CACHE_THREADED_SHARDS	16
+
+/* Transparent huge pages are PMD sized, 2MB on the machines we run on */
+#define IO_CACHE_THP_SIZE		(2 * ONE_MEGABYTE)
+#define IO_CACHE_MAX_NODES		1024
+
+/*
+ * The cache grows and shrinks a slab at a time.  Auto-tuning looks at
+ * the cache every IO_CACHE_TUNE_INTERVAL block reads and adds a slab
+ * when more than 1 / IO_CACHE_TUNE_GROW of them pushed a valid block
+ * out, or drops one after IO_CACHE_TUNE_QUIET intervals in a row with
+ * fewer than 1 / IO_CACHE_TUNE_SHRINK misses.
+ */
+#define IO_CACHE_SLAB_BYTES		(64 * ONE_MEGABYTE)
+#define IO_CACHE_TUNE_INTERVAL		65536
+#define IO_CACHE_TUNE_GROW		8
+#define IO_CACHE_TUNE_SHRINK		64
+#define IO_CACHE_TUNE_QUIET		8
+
+/*
+ * The cache is split into shards by block number, blkno & ic_shard_mask.
+ * Each shard owns a fixed slice of the cache blocks.  A channel opened
+ * without CMFS_FLAG_THREADED has a single shard and never takes the
+ * shard locks.
+ *
+ * A shard looks up blocks in two ways:
  *
- * 1) If it needs a new block, it gets one off of ic->ic_lru.  The blocks
+ * 1) If it needs a new block, it gets one off of ics->ics_lru.  The blocks
  *    attach to that list via icb->icb_list.
  *
  * 2) If it wants to look up an existing block, it gets it from
- *    ic->ic_lookup.  The blocks are attached vai icb->icb_node.
+ *    ics->ics_lookup.  The blocks are attached vai icb->icb_node.
+ *
+ * In thread-safe mode a cache block is only touched with its shard
+ * locked, so the data is copied in or out before the lock is dropped.
  */
 struct io_cache_block {
 	struct rb_node icb_node;
@@ -76,24 +114,59 @@ struct io_cache_block {
 	char *icb_buf;
 };
 
+struct io_cache_shard {
+	pthread_mutex_t ics_lock;
+	struct list_head ics_lru;
+	struct rb_root ics_lookup;
+};
+
+/*
+ * The cache blocks come in slabs, each one allocation of data and
+ * icbs.  Block i of the cache, counting over all the slabs, belongs to
+ * shard i & ic_shard_mask.  Slabs are added at the end of ic_slabs and
+ * removed from the end, so the index of a slab's first block never
+ * changes.  The first slab stays for the life of the cache; it gives
+ * every shard at least one block.
+ */
+struct io_cache_slab {
+	struct list_head icsl_list;
+	size_t icsl_first;		/* index of its first block */
+	size_t icsl_nr_blocks;
+	struct io_cache_block *icsl_blocks;
+	char *icsl_data;
+	unsigned long icsl_data_len;
+	unsigned long icsl_map_len;	/* mmap()ed if not 0 */
+	int icsl_backing;		/* CMFS_IO_CACHE_* it got */
+};
+
 struct io_cache {
 	size_t ic_nr_blocks;
-	struct list_head ic_lru;
-	struct rb_root ic_lookup;
+	int ic_threaded;
+	unsigned int ic_shard_mask;
+	struct io_cache_shard *ic_shards;
 
 	/* Housekeeping */
-	struct io_cache_block *ic_metadata_buffer;
-	unsigned long ic_metadata_buffer_len;
-	char *ic_data_buffer;
-	unsigned long ic_data_buffer_len;
+	struct list_head ic_slabs;
+	pthread_mutex_t ic_resize_lock;	/* held to add or remove slabs */
+	int ic_want_backing;		/* CMFS_IO_CACHE_* asked for */
+	int ic_node;			/* for CMFS_IO_CACHE_BIND */
 	int ic_locked;
 	int ic_use_count;
 
-	/* stats */
+	/* Auto-tuning, off while ic_tune_max is 0 */
+	size_t ic_tune_min;
+	size_t ic_tune_max;
+	uint32_t ic_tune_hits;		/* stats at the last look */
+	uint32_t ic_tune_misses;
+	uint32_t ic_tune_evictions;
+	int ic_tune_quiet;
+
+	/* stats, updated with io_stat_add() */
 	uint32_t ic_hits;
 	uint32_t ic_misses;
 	uint32_t ic_inserts;
 	uint32_t ic_removes;
+	uint32_t ic_evictions;		/* valid blocks stolen */
 };
 
 struct _io_channel {
@@ -103,13 +176,123 @@ struct _io_channel {
 	int io_error;
 	int io_fd;
 	int io_nocache;
+	int io_threaded;
 	struct io_cache *io_cache;
+	int io_cache_backing;		/* CMFS_IO_CACHE_* wanted */
+	int io_cache_node;		/* for CMFS_IO_CACHE_BIND */
+
+	/* CMFS_FLAG_MMAP: the whole device, mapped read-only */
+	char *io_map;
+	uint64_t io_map_len;
 
-	/* stats */
+	/* A metadata image, read through cmfs_image_read() */
+	cmfs_image *io_image;
+
+	/* Set by io_trace_start(), every call is logged to it */
+	cmfs_trace_writer *io_trace;
+
+	/* stats, updated with io_stat_add() */
 	uint64_t io_bytes_read;
 	uint64_t io_bytes_written;
+	uint64_t io_reads;
+	uint64_t io_writes;
+	uint64_t io_read_ns;
+	uint64_t io_write_ns;
+	uint64_t io_read_lat[CMFS_IO_LAT_BUCKETS];
+	uint64_t io_write_lat[CMFS_IO_LAT_BUCKETS];
+	uint64_t io_read_size[CMFS_IO_SIZE_BUCKETS];
+	uint64_t io_write_size[CMFS_IO_SIZE_BUCKETS];
+	uint64_t io_seek[CMFS_IO_SEEK_BUCKETS];
+	uint64_t io_type_read[CMFS_NR_BLOCK_TYPES];
+	uint64_t io_type_disk[CMFS_NR_BLOCK_TYPES];
+	uint64_t io_type_written[CMFS_NR_BLOCK_TYPES];
+	uint64_t io_next_blkno;		/* where the last I/O ended */
 };
 
+/*
+ * Stats may be bumped from several threads at once.  An atomic add is
+ * cheap next to the I/O or memcpy it accounts for, so we always use it.
+ */
+#define io_stat_add(stat, n)	__sync_fetch_and_add(&(stat), (n))
+
+/*
+ * What the next read or write of this thread is for, set by
+ * io_set_block_type() and cleared when that I/O returns.
+ */
+static __thread enum cmfs_block_type io_block_type;
+
+/* Blocks the io_cache has served this thread, for the trace */
+static __thread uint32_t io_thread_hits;
+
+static inline uint64_t io_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline int io_stat_bucket(uint64_t val, int nr_buckets)
+{
+	int bucket = val ? 63 - __builtin_clzll(val) : 0;
+
+	return (bucket < nr_buckets) ? bucket : nr_buckets - 1;
+}
+
+/*
+ * Account one I/O to the device.  Nothing is locked: each counter is
+ * bumped atomically, and io_next_blkno is a plain store, so with
+ * several threads a seek may be measured from another thread's I/O.
+ * That is what the device sees anyway.
+ */
+static void io_stat_io(io_channel *channel, int write, int64_t blkno,
+		       uint64_t bytes, uint64_t ns)
+{
+	uint64_t blocks, last, dist;
+	int seek;
+
+	blocks = (bytes + channel->io_blksize - 1) / channel->io_blksize;
+	last = channel->io_next_blkno;
+	dist = (blkno > last) ? blkno - last : last - blkno;
+	seek = dist ? io_stat_bucket(dist, CMFS_IO_SEEK_BUCKETS - 1) + 1 : 0;
+	channel->io_next_blkno = blkno + blocks;
+	io_stat_add(channel->io_seek[seek], 1);
+
+	if (write) {
+		io_stat_add(channel->io_writes, 1);
+		io_stat_add(channel->io_write_ns, ns);
+		io_stat_add(channel->io_write_lat[io_stat_bucket(ns,
+						CMFS_IO_LAT_BUCKETS)], 1);
+		io_stat_add(channel->io_write_size[io_stat_bucket(blocks,
+						CMFS_IO_SIZE_BUCKETS)], 1);
+	} else {
+		io_stat_add(channel->io_reads, 1);
+		io_stat_add(channel->io_read_ns, ns);
+		io_stat_add(channel->io_read_lat[io_stat_bucket(ns,
+						CMFS_IO_LAT_BUCKETS)], 1);
+		io_stat_add(channel->io_read_size[io_stat_bucket(blocks,
+						CMFS_IO_SIZE_BUCKETS)], 1);
+		io_stat_add(channel->io_type_disk[io_block_type], blocks);
+	}
+}
+
+static inline struct io_cache_shard *io_cache_lock(struct io_cache *ic,
+						   uint64_t blkno)
+{
+	struct io_cache_shard *ics = &ic->ic_shards[blkno & ic->ic_shard_mask];
+
+	if (ic->ic_threaded)
+		pthread_mutex_lock(&ics->ics_lock);
+	return ics;
+}
+
+static inline void io_cache_unlock(struct io_cache *ic,
+				   struct io_cache_shard *ics)
+{
+	if (ic->ic_threaded)
+		pthread_mutex_unlock(&ics->ics_lock);
+}
+
 /*
  * We open code this because we don't have the cmfs_filesys to call
  * cmfs_blocks_in_bytes().
@@ -124,24 +307,30 @@ static errcode_t unix_vec_read_blocks(io_channel *channel,
 				      struct io_vec_unit *ivus, int count)
 {
 	int i;
-	int ret;
+	int rc;
+	errcode_t ret;
 	io_context_t io_ctx;
 	struct iocb *iocb = NULL, **iocbs = NULL;
 	struct io_event *events = NULL;
 	int64_t offset;
 	int submitted, completed = 0;
+	uint64_t bytes = 0, start;
+
+	memset(&io_ctx, 0, sizeof(io_ctx));
 
 	ret = CMFS_ET_NO_MEMORY;
 	iocb = malloc((sizeof(struct iocb) * count));
 	iocbs = malloc((sizeof(struct iocb *) * count));
 	events = malloc((sizeof(struct io_event) * count));
 	if (!iocb || !iocbs || !events)
-		goto out;
+		goto free;
 
-	memset(&io_ctx, 0, sizeof(io_ctx));
-	ret = io_queue_init(count, &io_ctx);
-	if (ret)
-		return ret;
+	rc = io_queue_init(count, &io_ctx);
+	if (rc) {
+		channel->io_error = -rc;
+		ret = CMFS_ET_IO;
+		goto free;
+	}
 
 	for (i = 0; i < count; ++i) {
 		offset = ivus[i].ivu_blkno * channel->io_blksize;
@@ -150,31 +339,61 @@ static errcode_t unix_vec_read_blocks(io_channel *channel,
 		iocbs[i] = &iocb[i];
 	}
 
+	/*
+	 * libaio returns -errno, those become CMFS_ET_IO with the errno
+	 * left in io_error.  Our own CMFS_ET_* codes go back as they are.
+	 */
+	ret = 0;
 resubmit:
-	ret = io_submit(io_ctx, count - completed, &iocbs[completed]);
-	if (!ret && (count - completed))
+	start = io_now_ns();
+	rc = io_submit(io_ctx, count - completed, &iocbs[completed]);
+	if (!rc) {
 		ret = CMFS_ET_SHORT_READ;
-	if (ret < 0)
 		goto out;
-	submitted = ret;
+	}
+	if (rc < 0) {
+		channel->io_error = -rc;
+		ret = CMFS_ET_IO;
+		goto out;
+	}
+	submitted = rc;
 
-	ret = io_getevents(io_ctx, submitted, submitted, events, NULL);
-	if (ret < 0)
+	rc = io_getevents(io_ctx, submitted, submitted, events, NULL);
+	if (rc < 0) {
+		channel->io_error = -rc;
+		ret = CMFS_ET_IO;
 		goto out;
+	}
+
+	/* Each read of the batch took as long as the batch */
+	start = io_now_ns() - start;
+	for (i = 0; i < rc; i++) {
+		if ((long)events[i].res < 0) {
+			channel->io_error = -(long)events[i].res;
+			ret = CMFS_ET_IO;
+			goto out;
+		}
+		if (events[i].res != events[i].obj->u.c.nbytes) {
+			ret = CMFS_ET_SHORT_READ;
+			goto out;
+		}
+		bytes += events[i].res;
+		io_stat_io(channel, 0,
+			   events[i].obj->u.c.offset / channel->io_blksize,
+			   events[i].res, start);
+	}
 
 	completed += submitted;
 	if (completed < count)
 		goto resubmit;
 
 out:
-	if (ret >= 0)
-		ret = 0;
-	if (!ret)
-		channel->io_bytes_read += (count * channel->io_blksize);
+	io_stat_add(channel->io_bytes_read, bytes);
+	io_queue_release(io_ctx);
+free:
 	free(iocb);
 	free(iocbs);
 	free(events);
-	io_queue_release(io_ctx);
 
 	return ret;
 }
@@ -184,12 +403,13 @@ static errcode_t unix_io_read_block(io_channel *channel, int64_t blkno,
 {
 	int ret;
 	ssize_t size, tot, rd;
-	uint64_t location;
+	uint64_t location, start;
 
 	/* -ative means count is in bytes */
 	size = (count < 0) ? -count : count * channel->io_blksize;
 	location = blkno * channel->io_blksize;
 
+	start = io_now_ns();
 	tot = 0;
 	while (tot < size) {
 		rd = pread64(channel->io_fd, data + tot,
@@ -214,7 +434,8 @@ out:
 		memset(data + tot, 0, size - tot);
 	}
 
-	channel->io_bytes_read += tot;
+	io_stat_add(channel->io_bytes_read, tot);
+	io_stat_io(channel, 0, blkno, tot, io_now_ns() - start);
 
 	return ret;
 }
@@ -225,12 +446,13 @@ static errcode_t unix_io_write_block_full(io_channel *channel, int64_t blkno,
 {
 	int ret;
 	ssize_t size, tot, wr;
-	uint64_t location;
+	uint64_t location, start;
 
 	/* -ative means count is in bytes */
 	size = (count < 0) ? -count : count * channel->io_blksize;
 	location = blkno * channel->io_blksize;
 
+	start = io_now_ns();
 	tot = 0;
 	while (tot < size) {
 		wr = pwrite64(channel->io_fd, data + tot,
@@ -254,7 +476,8 @@ out:
 	if (!ret && (tot != size))
 		ret = CMFS_ET_SHORT_WRITE;
 
-	channel->io_bytes_written += tot;
+	io_stat_add(channel->io_bytes_written, tot);
+	io_stat_io(channel, 1, blkno, tot, io_now_ns() - start);
 
 	return ret;
 }
@@ -265,16 +488,255 @@ static errcode_t unix_io_write_block(io_channel *channel, int64_t blkno,
 	return unix_io_write_block_full(channel, blkno, count, data, NULL);
 }
 
+/*
+ * Metadata images made by cmfs-image are opened in place of a device
+ * when io_open() is handed one.  Reads go through cmfs_image_read(),
+ * which fills in zeros for the blocks the image leaves out.  Images
+ * are never written.  Like the mmap backend there is no io_cache, the
+ * image file sits in the page cache.
+ */
+static errcode_t image_io_probe(io_channel *channel, int flags)
+{
+	struct stat st;
+	errcode_t ret;
+	int fd;
+
+	/* Let the device open report a missing or odd name */
+	if (stat(channel->io_name, &st) || !S_ISREG(st.st_mode))
+		return CMFS_ET_BAD_MAGIC;
+
+	fd = open64(channel->io_name, O_RDONLY);
+	if (fd < 0)
+		return CMFS_ET_BAD_MAGIC;
+
+	ret = cmfs_open_image(fd, &channel->io_image);
+	if (!ret && (flags & CMFS_FLAG_RW)) {
+		cmfs_close_image(channel->io_image);
+		channel->io_image = NULL;
+		ret = CMFS_ET_RO_FILESYS;
+	}
+	if (ret) {
+		close(fd);
+		return ret;
+	}
+
+	channel->io_fd = fd;
+	return 0;
+}
+
+static errcode_t image_io_read_block(io_channel *channel, int64_t blkno,
+				     int count, char *data)
+{
+	uint64_t size;
+	errcode_t ret;
+
+	/* -ative means count is in bytes */
+	size = (count < 0) ? -count : (uint64_t)count * channel->io_blksize;
+	if (blkno < 0)
+		return CMFS_ET_INVALID_ARGUMENT;
+
+	ret = cmfs_image_read(channel->io_image, blkno * channel->io_blksize,
+			      size, data);
+	if (!ret)
+		io_stat_add(channel->io_bytes_read, size);
+	return ret;
+}
+
+static errcode_t image_vec_read_blocks(io_channel *channel,
+				       struct io_vec_unit *ivus, int count)
+{
+	errcode_t ret = 0, err;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		err = image_io_read_block(channel, ivus[i].ivu_blkno,
+					  -(int)ivus[i].ivu_buflen,
+					  ivus[i].ivu_buf);
+		if (err && !ret)
+			ret = err;
+	}
+
+	return ret;
+}
+
+/*
+ * The mmap backend, chosen with CMFS_FLAG_MMAP.  The device or image
+ * is mapped read-only in one piece and reads are served from the page
+ * cache: io_read_block() is a memcpy, and io_map_block() hands out a
+ * pointer into the mapping with no copy at all.  There is no io_cache
+ * to fill or look up, the kernel does the caching and the readahead,
+ * steered by io_advise().  Meant for offline work on images on hosts
+ * with the memory for them.  The image must not shrink while it is
+ * mapped, or the readers get SIGBUS.
+ */
+static errcode_t mmap_io_open(io_channel *channel)
+{
+	struct stat st;
+	uint64_t size;
+	void *map;
+
+	if (fstat(channel->io_fd, &st))
+		goto io_error;
+	if (S_ISBLK(st.st_mode)) {
+		if (ioctl(channel->io_fd, BLKGETSIZE64, &size))
+			goto io_error;
+	} else
+		size = st.st_size;
+
+	if (!size)
+		return CMFS_ET_SHORT_READ;
+	if (size != (size_t)size)
+		return CMFS_ET_NO_MEMORY;
+
+	map = mmap(NULL, size, PROT_READ, MAP_SHARED, channel->io_fd, 0);
+	if (map == MAP_FAILED)
+		goto io_error;
+
+	channel->io_map = map;
+	channel->io_map_len = size;
+	return 0;
+
+io_error:
+	channel->io_error = errno;
+	return CMFS_ET_IO;
+}
+
+/* Where a read of count blocks at blkno starts, and how much of it fits */
+static inline uint64_t mmap_io_range(io_channel *channel, int64_t blkno,
+				     int count, uint64_t *size)
+{
+	uint64_t location;
+
+	/* -ative means count is in bytes */
+	*size = (count < 0) ? -count : (uint64_t)count * channel->io_blksize;
+	location = blkno * channel->io_blksize;
+
+	if ((blkno < 0) || (location >= channel->io_map_len))
+		return 0;
+	if (*size > channel->io_map_len - location)
+		return channel->io_map_len - location;
+	return *size;
+}
+
+static errcode_t mmap_io_read_block(io_channel *channel, int64_t blkno,
+				    int count, char *data)
+{
+	uint64_t size, tot;
+
+	tot = mmap_io_range(channel, blkno, count, &size);
+	if (tot)
+		memcpy(data, channel->io_map + blkno * channel->io_blksize,
+		       tot);
+	io_stat_add(channel->io_bytes_read, tot);
+
+	if (tot != size) {
+		memset(data + tot, 0, size - tot);
+		return CMFS_ET_SHORT_READ;
+	}
+	return 0;
+}
+
+static errcode_t mmap_vec_read_blocks(io_channel *channel,
+				      struct io_vec_unit *ivus, int count)
+{
+	errcode_t ret = 0, err;
+	int i;
+
+	/* Get the page cache going on all of them before the first copy */
+	for (i = 0; i < count; i++)
+		io_advise(channel, ivus[i].ivu_blkno,
+			  -(int)ivus[i].ivu_buflen, CMFS_IO_ADVISE_WILLNEED);
+
+	for (i = 0; i < count; i++) {
+		err = mmap_io_read_block(channel, ivus[i].ivu_blkno,
+					 -(int)ivus[i].ivu_buflen,
+					 ivus[i].ivu_buf);
+		if (err && !ret)
+			ret = err;
+	}
+
+	return ret;
+}
+
+/*
+ * Borrow a pointer to count blocks at blkno (-count bytes) straight
+ * from the mapping of a CMFS_FLAG_MMAP channel.  The pointer is good
+ * until io_close() and must not be written through.  The bytes are
+ * raw disk bytes; nothing is byte swapped or checked.
+ */
+errcode_t io_map_block(io_channel *channel, int64_t blkno, int count,
+		       const char **ptr)
+{
+	uint64_t size;
+
+	if (!channel->io_map)
+		return CMFS_ET_INVALID_ARGUMENT;
+	if (mmap_io_range(channel, blkno, count, &size) != size)
+		return CMFS_ET_SHORT_READ;
+
+	*ptr = channel->io_map + blkno * channel->io_blksize;
+	io_stat_add(channel->io_bytes_read, size);
+	return 0;
+}
+
+/*
+ * Tell the kernel how count blocks at blkno (-count bytes, or 0 for
+ * the rest of the device) are going to be read.  A mapped channel
+ * gets madvise(), any other one posix_fadvise(), which does nothing
+ * for O_DIRECT reads.  Only a hint; the errors are not worth returning.
+ */
+void io_advise(io_channel *channel, int64_t blkno, int count, int advice)
+{
+	static const int madv[] = {
+		[CMFS_IO_ADVISE_NORMAL]		= MADV_NORMAL,
+		[CMFS_IO_ADVISE_SEQUENTIAL]	= MADV_SEQUENTIAL,
+		[CMFS_IO_ADVISE_RANDOM]		= MADV_RANDOM,
+		[CMFS_IO_ADVISE_WILLNEED]	= MADV_WILLNEED,
+		[CMFS_IO_ADVISE_DONTNEED]	= MADV_DONTNEED,
+	};
+	static const int fadv[] = {
+		[CMFS_IO_ADVISE_NORMAL]		= POSIX_FADV_NORMAL,
+		[CMFS_IO_ADVISE_SEQUENTIAL]	= POSIX_FADV_SEQUENTIAL,
+		[CMFS_IO_ADVISE_RANDOM]		= POSIX_FADV_RANDOM,
+		[CMFS_IO_ADVISE_WILLNEED]	= POSIX_FADV_WILLNEED,
+		[CMFS_IO_ADVISE_DONTNEED]	= POSIX_FADV_DONTNEED,
+	};
+	uint64_t location, size, page_mask = getpagesize() - 1;
+
+	if ((advice < CMFS_IO_ADVISE_NORMAL) ||
+	    (advice > CMFS_IO_ADVISE_DONTNEED) || (blkno < 0) ||
+	    channel->io_image)
+		return;
+
+	location = blkno * channel->io_blksize;
+	size = (count < 0) ? -count : (uint64_t)count * channel->io_blksize;
+
+	if (!channel->io_map) {
+		posix_fadvise(channel->io_fd, location, size, fadv[advice]);
+		return;
+	}
+
+	if (location >= channel->io_map_len)
+		return;
+	if (!count || (size > channel->io_map_len - location))
+		size = channel->io_map_len - location;
+
+	/* madvise() wants a page aligned start */
+	size += location & page_mask;
+	location &= ~page_mask;
+	madvise(channel->io_map + location, size, madv[advice]);
+}
+
 /*
  * See if the rbtree has a block for the given block number.
  *
  * The rb_node garbage lets insertion share the search.  Trivial callers
  * pass NULL.
  */
-static struct io_cache_block *io_cache_lookup(struct io_cache *ic,
+static struct io_cache_block *io_cache_lookup(struct io_cache_shard *ics,
 					      uint64_t blkno)
 {
-	struct rb_node *p = ic->ic_lookup.rb_node;
+	struct rb_node *p = ics->ics_lookup.rb_node;
 	struct io_cache_block *icb;
 
 	while (p) {
@@ -291,9 +753,10 @@ static struct io_cache_block *io_cache_lookup(struct io_cache *ic,
 }
 
 static void io_cache_insert(struct io_cache *ic,
+			    struct io_cache_shard *ics,
 			    struct io_cache_block *insert_icb)
 {
-	struct rb_node **p = &ic->ic_lookup.rb_node;
+	struct rb_node **p = &ics->ics_lookup.rb_node;
 	struct rb_node *parent = NULL;
 	struct io_cache_block *icb = NULL;
 
@@ -311,18 +774,20 @@ static void io_cache_insert(struct io_cache *ic,
 	}
 
 	rb_link_node(&insert_icb->icb_node, parent, p);
-	rb_insert_color(&insert_icb->icb_node, &ic->ic_lookup);
-	ic->ic_inserts++;
+	rb_insert_color(&insert_icb->icb_node, &ics->ics_lookup);
+	io_stat_add(ic->ic_inserts, 1);
 }
 
-static void io_cache_seen(struct io_cache *ic, struct io_cache_block *icb)
+static void io_cache_seen(struct io_cache_shard *ics,
+			  struct io_cache_block *icb)
 {
 	/* Move to the front of the LRU */
 	list_del(&icb->icb_list);
-	list_add_tail(&icb->icb_list, &ic->ic_lru);
+	list_add_tail(&icb->icb_list, &ics->ics_lru);
 }
 
-static void io_cache_unsee(struct io_cache *ic, struct io_cache_block *icb)
+static void io_cache_unsee(struct io_cache_shard *ics,
+			   struct io_cache_block *icb)
 {
 	/*
 	 * Move to the end of the LRU.  There's no point in removing an
@@ -330,10 +795,10 @@ static void io_cache_unsee(struct io_cache *ic, struct io_cache_block *icb)
 	 * next I/O to steal it.
 	 */
 	list_del(&icb->icb_list);
-	list_add(&icb->icb_list, &ic->ic_lru);
+	list_add(&icb->icb_list, &ics->ics_lru);
 }
 
-static void io_cache_disconnect(struct io_cache *ic,
+static void io_cache_disconnect(struct io_cache_shard *ics,
 				struct io_cache_block *icb)
 {
 	/*
@@ -341,19 +806,22 @@ static void io_cache_disconnect(struct io_cache *ic,
 	 * If icb->icb_blkno is UINT64_MAX, it's already disconnected.
 	 */
 	if (icb->icb_blkno != UINT64_MAX) {
-		rb_erase(&icb->icb_node, &ic->ic_lookup);
+		rb_erase(&icb->icb_node, &ics->ics_lookup);
 		memset(&icb->icb_node, 0, sizeof(struct rb_node));
 		icb->icb_blkno = UINT64_MAX;
 	}
 }
 
-static struct io_cache_block *io_cache_pop_lru(struct io_cache *ic)
+static struct io_cache_block *io_cache_pop_lru(struct io_cache *ic,
+					       struct io_cache_shard *ics)
 {
 	struct io_cache_block *icb;
 
-	icb = list_entry(ic->ic_lru.next, struct io_cache_block, icb_list);
-	io_cache_disconnect(ic, icb);
-	ic->ic_removes++;
+	icb = list_entry(ics->ics_lru.next, struct io_cache_block, icb_list);
+	if (icb->icb_blkno != UINT64_MAX)
+		io_stat_add(ic->ic_evictions, 1);
+	io_cache_disconnect(ics, icb);
+	io_stat_add(ic->ic_removes, 1);
 
 	return icb;
 }
@@ -366,47 +834,93 @@ static errcode_t io_cache_vec_read_blocks(io_channel *channel,
 					  int count, int nocache)
 {
 	struct io_cache *ic = channel->io_cache;
+	struct io_cache_shard *ics;
 	struct io_cache_block *icb;
+	struct io_vec_unit *todo = NULL;
 	errcode_t ret = 0;
-	int i, j, blksize = channel->io_blksize;
-	uint64_t blkno;
+	int i, j, nr_todo = 0, blksize = channel->io_blksize;
+	uint64_t blkno, hits = 0, misses = 0;
 	uint32_t numblks;
 	char *buf;
 
-	/*
-	 * Read all blocks. We could extend this to not issue ios for already
-	 * cached blocks. But is it worth the effort?
-	 */
-	ret = unix_vec_read_blocks(channel, ivus, count);
+	ret = cmfs_malloc(sizeof(struct io_vec_unit) * count, &todo);
 	if (ret)
-		goto out;
+		return ret;
 
-	/* refresh cache */
+	/*
+	 * Units that are wholly in the cache are copied out and need no
+	 * I/O, the rest are read whole, as io_cache_read_blocks() would.
+	 */
 	for (i = 0; i < count; i++) {
 		blkno = ivus[i].ivu_blkno;
 		numblks = ivus[i].ivu_buflen / blksize;
 		buf = ivus[i].ivu_buf;
 
 		for (j = 0; j < numblks; ++j, ++blkno, buf += blksize) {
-			icb = io_cache_lookup(ic, blkno);
-			if (!icb) {
+			ics = io_cache_lock(ic, blkno);
+			icb = io_cache_lookup(ics, blkno);
+			if (icb) {
+				memcpy(buf, icb->icb_buf, blksize);
 				if (nocache)
+					io_cache_unsee(ics, icb);
+				else
+					io_cache_seen(ics, icb);
+			}
+			io_cache_unlock(ic, ics);
+			if (!icb)
+				break;
+		}
+
+		if (j == numblks)
+			hits += numblks;
+		else {
+			misses += numblks;
+			todo[nr_todo++] = ivus[i];
+		}
+	}
+	if (hits) {
+		io_stat_add(ic->ic_hits, hits);
+		io_thread_hits += hits;
+	}
+	if (!nr_todo)
+		goto out;
+
+	io_stat_add(ic->ic_misses, misses);
+	ret = unix_vec_read_blocks(channel, todo, nr_todo);
+	if (ret)
+		goto out;
+
+	/* refresh cache */
+	for (i = 0; i < nr_todo; i++) {
+		blkno = todo[i].ivu_blkno;
+		numblks = todo[i].ivu_buflen / blksize;
+		buf = todo[i].ivu_buf;
+
+		for (j = 0; j < numblks; ++j, ++blkno, buf += blksize) {
+			ics = io_cache_lock(ic, blkno);
+			icb = io_cache_lookup(ics, blkno);
+			if (!icb) {
+				if (nocache) {
+					io_cache_unlock(ic, ics);
 					continue;
-				icb = io_cache_pop_lru(ic);
+				}
+				icb = io_cache_pop_lru(ic, ics);
 				icb->icb_blkno = blkno;
-				io_cache_insert(ic, icb);
+				io_cache_insert(ic, ics, icb);
 			}
 
 			memcpy(icb->icb_buf, buf, blksize);
 
 			if (nocache)
-				io_cache_unsee(ic, icb);
+				io_cache_unsee(ics, icb);
 			else
-				io_cache_seen(ic, icb);
+				io_cache_seen(ics, icb);
+			io_cache_unlock(ic, ics);
 		}
 	}
 
 out:
+	cmfs_free(&todo);
 	return ret;
 }
 
@@ -427,6 +941,7 @@ static errcode_t io_cache_read_blocks(io_channel *channel, int64_t blkno,
 	int i, good_blocks;
 	errcode_t ret = 0;
 	struct io_cache *ic = channel->io_cache;
+	struct io_cache_shard *ics;
 	struct io_cache_block *icb;
 
 	/*
@@ -435,43 +950,56 @@ static errcode_t io_cache_read_blocks(io_channel *channel, int64_t blkno,
 	 * 1) Are all the blocks cached?  If so, we can skip I/O.
 	 * 2) If they are not all cached, we want to start our read at the
 	 *    first uncached blkno.
+	 *
+	 * Cached blocks are copied out to the data buffer right away,
+	 * while we hold their shard.
 	 */
 	for (good_blocks = 0; good_blocks < count; good_blocks++) {
-		icb = io_cache_lookup(ic, blkno + good_blocks);
+		ics = io_cache_lock(ic, blkno + good_blocks);
+		icb = io_cache_lookup(ics, blkno + good_blocks);
+		if (icb) {
+			memcpy(data + (channel->io_blksize * good_blocks),
+			       icb->icb_buf, channel->io_blksize);
+			if (nocache)
+				io_cache_unsee(ics, icb);
+			else
+				io_cache_seen(ics, icb);
+		}
+		io_cache_unlock(ic, ics);
 		if (!icb)
 			break;
-		ic->ic_hits++;
+	}
+	if (good_blocks) {
+		io_stat_add(ic->ic_hits, good_blocks);
+		io_thread_hits += good_blocks;
 	}
 
+	if (good_blocks == count)
+		goto out;
+
 	/* Read any blocks not in the cache */
-	if (good_blocks < count) {
-		ic->ic_misses += (count - good_blocks);
-		ret = unix_io_read_block(channel, blkno + good_blocks,
-					 count - good_blocks,
-					 data + (channel->io_blksize *
-						 good_blocks));
-		if (ret)
-			goto out;
-	}
+	io_stat_add(ic->ic_misses, count - good_blocks);
+	ret = unix_io_read_block(channel, blkno + good_blocks,
+				 count - good_blocks,
+				 data + (channel->io_blksize * good_blocks));
+	if (ret)
+		goto out;
 
 	/* Now we sync up the cache with the data buffer */
-	for (i = 0; i < count; i++, data += channel->io_blksize) {
-		icb = io_cache_lookup(ic, blkno + i);
-		if (i < good_blocks) {
-			/*
-			 * We skipped reading this because it was in the
-			 * cache.  Copy it to the data buffer.
-			 */
-			assert(icb);
-			memcpy(data, icb->icb_buf, channel->io_blksize);
-		} else if (!icb) {
-			if (nocache)
+	data += channel->io_blksize * good_blocks;
+	for (i = good_blocks; i < count; i++, data += channel->io_blksize) {
+		ics = io_cache_lock(ic, blkno + i);
+		icb = io_cache_lookup(ics, blkno + i);
+		if (!icb) {
+			if (nocache) {
+				io_cache_unlock(ic, ics);
 				continue;
+			}
 
 			/* Steal the LRU buffer */
-			icb = io_cache_pop_lru(ic);
+			icb = io_cache_pop_lru(ic, ics);
 			icb->icb_blkno = blkno + i;
-			io_cache_insert(ic, icb);
+			io_cache_insert(ic, ics, icb);
 
 			/*
 			 * We did I/O into the data buffer, now update
@@ -480,23 +1008,25 @@ static errcode_t io_cache_read_blocks(io_channel *channel, int64_t blkno,
 			memcpy(icb->icb_buf, data, channel->io_blksize);
 		}
 		/*
-		 * What about if ((i >= good_blocks) && icb)?  That means
-		 * we had the buffer in the cache, but we read it anyway
-		 * to get a single I/O.  Our cache guarantees that the
-		 * contents will match, so we just skip to marking the
-		 * buffer seen.
+		 * What about if icb was found here?  That means we had
+		 * the buffer in the cache, but we read it anyway to get
+		 * a single I/O.  Our cache guarantees that the contents
+		 * will match, so we just skip to marking the buffer seen.
 		 */
 
 		if (nocache)
-			io_cache_unsee(ic, icb);
+			io_cache_unsee(ics, icb);
 		else
-			io_cache_seen(ic, icb);
+			io_cache_seen(ics, icb);
+		io_cache_unlock(ic, ics);
 	}
 
 out:
 	return ret;
 }
 
+static void io_cache_autotune(io_channel *channel);
+
 static errcode_t io_cache_read_block(io_channel *channel, int64_t blkno,
 				     int count, char *data, int nocache)
 
@@ -504,6 +1034,9 @@ static errcode_t io_cache_read_block(io_channel *channel, int64_t blkno,
 	int todo = one_meg_of_blocks(channel);
 	errcode_t ret = 0;
 
+	if (channel->io_cache->ic_tune_max)
+		io_cache_autotune(channel);
+
 	/*
 	 * We do this in one meg hunks so that each hunk has an
 	 * opportunity to be in cache, but we get a good throughput.
@@ -516,95 +1049,573 @@ static errcode_t io_cache_read_block(io_channel *channel, int64_t blkno,
 		if (ret)
 			break;
 
-		blkno += todo;
-		count -= todo;
-		data += (channel->io_blksize * todo);
+		blkno += todo;
+		count -= todo;
+		data += (channel->io_blksize * todo);
+	}
+
+	return ret;
+}
+
+/*
+ * This relies on the fact that our cache is always up to date.  If a
+ * block is in the cache, the same thing is on disk.  So here we'll write
+ * a whole stream and update the cache as needed.
+ */
+static errcode_t io_cache_write_blocks(io_channel *channel, int64_t blkno,
+				       int count, const char *data,
+				       int nocache)
+{
+	int i, completed = 0;
+	errcode_t ret;
+	struct io_cache *ic = channel->io_cache;
+	struct io_cache_shard *ics;
+	struct io_cache_block *icb;
+
+	/* Get the write out of the way */
+	ret = unix_io_write_block_full(channel, blkno, count, data,
+				       &completed);
+
+	/*
+	 * Now we sync up the cache with the data buffer.  We have
+	 * to sync up I/O that completed, even if the entire I/O did not.
+	 *
+	 * In the nocache case, we want to skip blocks that weren't in the
+	 * cache, but we want to update blocks that where.  Even though
+	 * the caller specified "don't cache this", it's already in the
+	 * cache.  We don't want stale data.
+	 */
+	for (i = 0; i < completed; i++, data += channel->io_blksize) {
+		ics = io_cache_lock(ic, blkno + i);
+		icb = io_cache_lookup(ics, blkno + i);
+		if (!icb) {
+			if (nocache) {
+				io_cache_unlock(ic, ics);
+				continue;
+			}
+
+			/*
+			 * Steal the LRU buffer.  We can't error here, so
+			 * we can safely insert it before we copy the data.
+			 */
+			icb = io_cache_pop_lru(ic, ics);
+			icb->icb_blkno = blkno + i;
+			io_cache_insert(ic, ics, icb);
+		}
+
+		memcpy(icb->icb_buf, data, channel->io_blksize);
+		if (nocache)
+			io_cache_unsee(ics, icb);
+		else
+			io_cache_seen(ics, icb);
+		io_cache_unlock(ic, ics);
+	}
+
+	return ret;
+}
+
+static errcode_t io_cache_write_block(io_channel *channel, int64_t blkno,
+				      int count, const char *data,
+				      int nocache)
+{
+	/*
+	 * Unlike io_read_cache_block(), we're going to do all of the
+	 * I/O no matter what.  We keep the separation of
+	 * io_cache_write_block() and io_cache_write_blocks() for
+	 * consistency.
+	 */
+	return io_cache_write_blocks(channel, blkno, count, data,
+				     nocache);
+}
+
+/* The huge page size of the MAP_HUGETLB pool, from /proc/meminfo */
+static unsigned long io_hugetlb_size(void)
+{
+	unsigned long kb = 0;
+	char line[128];
+	FILE *fp;
+
+	fp = fopen("/proc/meminfo", "r");
+	if (!fp)
+		return 0;
+	while (fgets(line, sizeof(line), fp))
+		if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1)
+			break;
+	fclose(fp);
+
+	return kb * 1024;
+}
+
+/* Set the bits of a node list like "0-3,8" in mask */
+static int io_parse_nodes(const char *list, unsigned long *mask)
+{
+	unsigned long bits = 8 * sizeof(unsigned long);
+	unsigned int first, last, n;
+	int found = 0;
+	char *end;
+
+	while (*list && (*list != '\n')) {
+		first = last = strtoul(list, &end, 10);
+		if (end == list)
+			break;
+		if (*end == '-') {
+			list = end + 1;
+			last = strtoul(list, &end, 10);
+		}
+		for (n = first; (n <= last) && (n < IO_CACHE_MAX_NODES); n++) {
+			mask[n / bits] |= 1UL << (n % bits);
+			found = 1;
+		}
+		list = (*end == ',') ? end + 1 : end;
+	}
+
+	return found;
+}
+
+/*
+ * Apply the NUMA policy the cache asked for to a fresh mapping, before
+ * any of it is touched.  Interleaving goes over every online node,
+ * binding to ic_node, or to the node we are running on if that is -1.
+ * Returns the policy flag that took, or 0.
+ */
+static int io_cache_numa(struct io_cache *ic, char *buf, unsigned long len)
+{
+	unsigned long mask[IO_CACHE_MAX_NODES / (8 * sizeof(unsigned long))];
+	unsigned long bits = 8 * sizeof(unsigned long);
+	unsigned int cpu, node;
+	char list[256];
+	FILE *fp;
+	int mode;
+
+	memset(mask, 0, sizeof(mask));
+	if (ic->ic_want_backing & CMFS_IO_CACHE_INTERLEAVE) {
+		fp = fopen("/sys/devices/system/node/online", "r");
+		if (!fp)
+			return 0;
+		if (!fgets(list, sizeof(list), fp) ||
+		    !io_parse_nodes(list, mask)) {
+			fclose(fp);
+			return 0;
+		}
+		fclose(fp);
+		mode = MPOL_INTERLEAVE;
+	} else if (ic->ic_want_backing & CMFS_IO_CACHE_BIND) {
+		if (ic->ic_node >= 0)
+			node = ic->ic_node;
+		else if (syscall(SYS_getcpu, &cpu, &node, NULL))
+			return 0;
+		if (node >= IO_CACHE_MAX_NODES)
+			return 0;
+		mask[node / bits] |= 1UL << (node % bits);
+		mode = MPOL_BIND;
+	} else
+		return 0;
+
+	if (syscall(SYS_mbind, buf, len, mode, mask, IO_CACHE_MAX_NODES, 0))
+		return 0;
+	return (mode == MPOL_INTERLEAVE) ? CMFS_IO_CACHE_INTERLEAVE :
+					   CMFS_IO_CACHE_BIND;
+}
+
+/*
+ * An anonymous mapping for the blocks of a slab, of huge pages when
+ * the cache asks for them.  MAP_HUGETLB needs pages reserved in the
+ * pool, so without them we ask for transparent huge pages on a mapping
+ * aligned to take them.
+ */
+static errcode_t io_cache_map_data(struct io_cache *ic,
+				   struct io_cache_slab *sl)
+{
+	int backing = ic->ic_want_backing;
+	unsigned long len = sl->icsl_data_len;
+	unsigned long map_len, hsize, head;
+	char *map = MAP_FAILED;
+
+	if (backing & CMFS_IO_CACHE_HUGETLB) {
+		hsize = io_hugetlb_size();
+		if (hsize) {
+			map_len = (len + hsize - 1) & ~(hsize - 1);
+			map = mmap(NULL, map_len, PROT_READ | PROT_WRITE,
+				   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+				   -1, 0);
+		}
+		if (map != MAP_FAILED)
+			sl->icsl_backing = CMFS_IO_CACHE_HUGETLB;
+		else
+			backing |= CMFS_IO_CACHE_THP;
+	}
+
+	if (map == MAP_FAILED) {
+		/* Over-map so an aligned piece can be cut out */
+		map_len = (len + IO_CACHE_THP_SIZE - 1) &
+			  ~((unsigned long)IO_CACHE_THP_SIZE - 1);
+		map = mmap(NULL, map_len + IO_CACHE_THP_SIZE,
+			   PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (map == MAP_FAILED)
+			return CMFS_ET_NO_MEMORY;
+
+		head = ((unsigned long)map + IO_CACHE_THP_SIZE - 1) &
+		       ~((unsigned long)IO_CACHE_THP_SIZE - 1);
+		head -= (unsigned long)map;
+		if (head)
+			munmap(map, head);
+		munmap(map + head + map_len, IO_CACHE_THP_SIZE - head);
+		map += head;
+
+		if ((backing & CMFS_IO_CACHE_THP) &&
+		    !madvise(map, map_len, MADV_HUGEPAGE))
+			sl->icsl_backing = CMFS_IO_CACHE_THP;
+	}
+
+	sl->icsl_backing |= io_cache_numa(ic, map, map_len);
+	sl->icsl_data = map;
+	sl->icsl_map_len = map_len;
+	return 0;
+}
+
+/*
+ * A mapping is locked whole.  Faulting it in here puts the pages where
+ * its NUMA policy says, and in huge pages if it got them.
+ */
+static int io_cache_mlock_slab(struct io_cache_slab *sl)
+{
+	unsigned long len = sl->icsl_map_len ? sl->icsl_map_len :
+					       sl->icsl_data_len;
+
+	if (mlock(sl->icsl_data, len))
+		return -1;
+	if (mlock(sl->icsl_blocks,
+		  sl->icsl_nr_blocks * sizeof(struct io_cache_block))) {
+		munlock(sl->icsl_data, len);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void io_cache_munlock_slab(struct io_cache_slab *sl)
+{
+	munlock(sl->icsl_data, sl->icsl_map_len ? sl->icsl_map_len :
+						  sl->icsl_data_len);
+	munlock(sl->icsl_blocks,
+		sl->icsl_nr_blocks * sizeof(struct io_cache_block));
+}
+
+static void io_cache_free_slab(struct io_cache_slab *sl, int locked)
+{
+	if (locked)
+		io_cache_munlock_slab(sl);
+	if (sl->icsl_map_len)
+		munmap(sl->icsl_data, sl->icsl_map_len);
+	else if (sl->icsl_data)
+		cmfs_free(&sl->icsl_data);
+	if (sl->icsl_blocks)
+		cmfs_free(&sl->icsl_blocks);
+	cmfs_free(&sl);
+}
+
+static errcode_t io_cache_alloc_slab(io_channel *channel,
+				     struct io_cache *ic, size_t nr_blocks,
+				     struct io_cache_slab **ret_sl)
+{
+	size_t i;
+	char *dbuf;
+	struct io_cache_slab *sl;
+	errcode_t ret;
+
+	ret = cmfs_malloc0(sizeof(struct io_cache_slab), &sl);
+	if (ret)
+		return ret;
+
+	sl->icsl_first = ic->ic_nr_blocks;
+	sl->icsl_nr_blocks = nr_blocks;
+	sl->icsl_data_len = (unsigned long)nr_blocks * channel->io_blksize;
+	if (ic->ic_want_backing)
+		ret = io_cache_map_data(ic, sl);
+	else
+		ret = cmfs_malloc_blocks(channel, nr_blocks, &sl->icsl_data);
+	if (ret)
+		goto out;
+
+	ret = cmfs_malloc0(sizeof(struct io_cache_block) * nr_blocks,
+			   &sl->icsl_blocks);
+	if (ret)
+		goto out;
+
+	dbuf = sl->icsl_data;
+	for (i = 0; i < nr_blocks; i++) {
+		sl->icsl_blocks[i].icb_blkno = UINT64_MAX;
+		sl->icsl_blocks[i].icb_buf = dbuf;
+		dbuf += channel->io_blksize;
+	}
+
+	/* A locked cache stays locked as it grows */
+	if (ic->ic_locked && io_cache_mlock_slab(sl))
+		ret = CMFS_ET_NO_MEMORY;
+
+out:
+	if (ret)
+		io_cache_free_slab(sl, 0);
+	else
+		*ret_sl = sl;
+
+	return ret;
+}
+
+/* The new blocks are empty, so they go where they are stolen first */
+static void io_cache_add_slab(struct io_cache *ic, struct io_cache_slab *sl)
+{
+	unsigned int s, nr_shards = ic->ic_shard_mask + 1;
+	struct io_cache_shard *ics;
+	size_t i;
+
+	for (s = 0; s < nr_shards; s++) {
+		ics = io_cache_lock(ic, s);
+		for (i = (s - sl->icsl_first) & ic->ic_shard_mask;
+		     i < sl->icsl_nr_blocks; i += nr_shards)
+			list_add(&sl->icsl_blocks[i].icb_list, &ics->ics_lru);
+		io_cache_unlock(ic, ics);
+	}
+
+	list_add_tail(&sl->icsl_list, &ic->ic_slabs);
+	ic->ic_nr_blocks += sl->icsl_nr_blocks;
+}
+
+static inline int io_cache_in_slab(struct io_cache_slab *sl,
+				   struct io_cache_block *icb)
+{
+	return (icb >= sl->icsl_blocks) &&
+	       (icb < sl->icsl_blocks + sl->icsl_nr_blocks);
+}
+
+/*
+ * Take the blocks of sl out of the cache without dropping more than a
+ * cache that much smaller would hold.  In each shard, if sl has k of
+ * its blocks, the k least recently used blocks are dropped.  Those of
+ * them not in sl then take over the place on the LRU, and the contents
+ * if valid, of the blocks of sl that were not dropped.
+ */
+static void io_cache_remove_slab(io_channel *channel, struct io_cache *ic,
+				 struct io_cache_slab *sl)
+{
+	unsigned int s, nr_shards = ic->ic_shard_mask + 1;
+	struct io_cache_shard *ics;
+	struct io_cache_block *icb, *spare;
+	struct list_head spares;
+	size_t i, k;
+
+	list_del(&sl->icsl_list);
+	ic->ic_nr_blocks -= sl->icsl_nr_blocks;
+
+	for (s = 0; s < nr_shards; s++) {
+		ics = io_cache_lock(ic, s);
+
+		i = (s - sl->icsl_first) & ic->ic_shard_mask;
+		k = (i < sl->icsl_nr_blocks) ?
+			(sl->icsl_nr_blocks - i + nr_shards - 1) / nr_shards :
+			0;
+
+		/* Not io_cache_pop_lru(), these aren't evictions for a miss */
+		INIT_LIST_HEAD(&spares);
+		while (k--) {
+			icb = list_entry(ics->ics_lru.next,
+					 struct io_cache_block, icb_list);
+			io_cache_disconnect(ics, icb);
+			io_stat_add(ic->ic_removes, 1);
+			list_del(&icb->icb_list);
+			INIT_LIST_HEAD(&icb->icb_list);
+			if (!io_cache_in_slab(sl, icb))
+				list_add_tail(&icb->icb_list, &spares);
+		}
+
+		for (; i < sl->icsl_nr_blocks; i += nr_shards) {
+			icb = &sl->icsl_blocks[i];
+			if (list_empty(&icb->icb_list))
+				continue;	/* dropped above */
+
+			spare = list_entry(spares.next, struct io_cache_block,
+					   icb_list);
+			list_del(&spare->icb_list);
+			if (icb->icb_blkno != UINT64_MAX) {
+				memcpy(spare->icb_buf, icb->icb_buf,
+				       channel->io_blksize);
+				spare->icb_blkno = icb->icb_blkno;
+				rb_replace_node(&icb->icb_node,
+						&spare->icb_node,
+						&ics->ics_lookup);
+			}
+			list_add(&spare->icb_list, &icb->icb_list);
+			list_del(&icb->icb_list);
+		}
+
+		io_cache_unlock(ic, ics);
+	}
+}
+
+/*
+ * Grow the cache to nr_blocks, or shrink it as close to nr_blocks as
+ * whole slabs allow.  Called with ic_resize_lock held.
+ */
+static errcode_t __io_resize_cache(io_channel *channel, size_t nr_blocks)
+{
+	struct io_cache *ic = channel->io_cache;
+	struct io_cache_slab *sl;
+	size_t slab_blocks, todo;
+	errcode_t ret;
+
+	slab_blocks = IO_CACHE_SLAB_BYTES / channel->io_blksize;
+	while (ic->ic_nr_blocks < nr_blocks) {
+		todo = nr_blocks - ic->ic_nr_blocks;
+		if (todo > slab_blocks)
+			todo = slab_blocks;
+		ret = io_cache_alloc_slab(channel, ic, todo, &sl);
+		if (ret)
+			return ret;
+		io_cache_add_slab(ic, sl);
+	}
+
+	while (ic->ic_slabs.next != ic->ic_slabs.prev) {
+		sl = list_entry(ic->ic_slabs.prev, struct io_cache_slab,
+				icsl_list);
+		if (ic->ic_nr_blocks - sl->icsl_nr_blocks < nr_blocks)
+			break;
+		io_cache_remove_slab(channel, ic, sl);
+		io_cache_free_slab(sl, ic->ic_locked);
 	}
 
-	return ret;
+	return 0;
 }
 
 /*
- * This relies on the fact that our cache is always up to date.  If a
- * block is in the cache, the same thing is on disk.  So here we'll write
- * a whole stream and update the cache as needed.
+ * Change the size of the cache while it is in use.  Growing adds
+ * empty blocks; shrinking only drops the least recently used blocks.
+ * The cache shrinks by whole slabs, so it may stay a little larger
+ * than asked, and never shrinks below the size io_init_cache() gave
+ * it or IO_CACHE_SLAB_BYTES, whichever is smaller.
  */
-static errcode_t io_cache_write_blocks(io_channel *channel, int64_t blkno,
-				       int count, const char *data,
-				       int nocache)
+errcode_t io_resize_cache(io_channel *channel, size_t nr_blocks)
 {
-	int i, completed = 0;
-	errcode_t ret;
 	struct io_cache *ic = channel->io_cache;
-	struct io_cache_block *icb;
+	errcode_t ret;
 
-	/* Get the write out of the way */
-	ret = unix_io_write_block_full(channel, blkno, count, data,
-				       &completed);
+	if (!ic || !nr_blocks)
+		return CMFS_ET_INVALID_ARGUMENT;
 
-	/*
-	 * Now we sync up the cache with the data buffer.  We have
-	 * to sync up I/O that completed, even if the entire I/O did not.
-	 *
-	 * In the nocache case, we want to skip blocks that weren't in the
-	 * cache, but we want to update blocks that where.  Even though
-	 * the caller specified "don't cache this", it's already in the
-	 * cache.  We don't want stale data.
-	 */
-	for (i = 0; i < completed; i++, data += channel->io_blksize) {
-		icb = io_cache_lookup(ic, blkno + i);
-		if (!icb) {
-			if (nocache)
-				continue;
+	pthread_mutex_lock(&ic->ic_resize_lock);
+	ret = __io_resize_cache(channel, nr_blocks);
+	pthread_mutex_unlock(&ic->ic_resize_lock);
 
-			/*
-			 * Steal the LRU buffer.  We can't error here, so
-			 * we can safely insert it before we copy the data.
-			 */
-			icb = io_cache_pop_lru(ic);
-			icb->icb_blkno = blkno + i;
-			io_cache_insert(ic, icb);
-		}
+	return ret;
+}
 
-		memcpy(icb->icb_buf, data, channel->io_blksize);
-		if (nocache)
-			io_cache_unsee(ic, icb);
-		else
-			io_cache_seen(ic, icb);
+/*
+ * Let the cache size itself between its current size and max_bytes,
+ * by the miss rate.  A max_bytes of 0 turns auto-tuning off and leaves
+ * the cache the size it has.
+ */
+errcode_t io_set_cache_autotune(io_channel *channel, size_t max_bytes)
+{
+	struct io_cache *ic = channel->io_cache;
+	size_t max_blocks = max_bytes / channel->io_blksize;
+
+	if (!ic)
+		return CMFS_ET_INVALID_ARGUMENT;
+
+	pthread_mutex_lock(&ic->ic_resize_lock);
+	if (max_blocks && (max_blocks < ic->ic_nr_blocks)) {
+		pthread_mutex_unlock(&ic->ic_resize_lock);
+		return CMFS_ET_INVALID_ARGUMENT;
 	}
+	ic->ic_tune_min = ic->ic_nr_blocks;
+	ic->ic_tune_max = max_blocks;
+	ic->ic_tune_hits = ic->ic_hits;
+	ic->ic_tune_misses = ic->ic_misses;
+	ic->ic_tune_evictions = ic->ic_evictions;
+	ic->ic_tune_quiet = 0;
+	pthread_mutex_unlock(&ic->ic_resize_lock);
 
-	return ret;
+	return 0;
 }
 
-static errcode_t io_cache_write_block(io_channel *channel, int64_t blkno,
-				      int count, const char *data,
-				      int nocache)
+/*
+ * Called on each cached read without any shard held.  Only the reader
+ * that finds an interval gone by and gets ic_resize_lock does the
+ * work, the others go on with the cache as it is.
+ */
+static void io_cache_autotune(io_channel *channel)
 {
-	/*
-	 * Unlike io_read_cache_block(), we're going to do all of the
-	 * I/O no matter what.  We keep the separation of
-	 * io_cache_write_block() and io_cache_write_blocks() for
-	 * consistency.
-	 */
-	return io_cache_write_blocks(channel, blkno, count, data,
-				     nocache);
+	struct io_cache *ic = channel->io_cache;
+	struct io_cache_slab *sl;
+	uint32_t accesses, misses, evictions;
+	size_t want, slab_blocks;
+
+	accesses = ic->ic_hits + ic->ic_misses -
+		   ic->ic_tune_hits - ic->ic_tune_misses;
+	if (accesses < IO_CACHE_TUNE_INTERVAL)
+		return;
+	if (pthread_mutex_trylock(&ic->ic_resize_lock))
+		return;
+
+	/* Someone may have had a look while we got here */
+	accesses = ic->ic_hits + ic->ic_misses -
+		   ic->ic_tune_hits - ic->ic_tune_misses;
+	if (!ic->ic_tune_max || (accesses < IO_CACHE_TUNE_INTERVAL))
+		goto out;
+
+	misses = ic->ic_misses - ic->ic_tune_misses;
+	evictions = ic->ic_evictions - ic->ic_tune_evictions;
+	ic->ic_tune_hits = ic->ic_hits;
+	ic->ic_tune_misses = ic->ic_misses;
+	ic->ic_tune_evictions = ic->ic_evictions;
+
+	want = ic->ic_nr_blocks;
+	if (evictions > accesses / IO_CACHE_TUNE_GROW) {
+		ic->ic_tune_quiet = 0;
+		slab_blocks = IO_CACHE_SLAB_BYTES / channel->io_blksize;
+		want += slab_blocks;
+		if (want > ic->ic_tune_max)
+			want = ic->ic_tune_max;
+	} else if (misses < accesses / IO_CACHE_TUNE_SHRINK) {
+		if (++ic->ic_tune_quiet >= IO_CACHE_TUNE_QUIET) {
+			ic->ic_tune_quiet = 0;
+			sl = list_entry(ic->ic_slabs.prev,
+					struct io_cache_slab, icsl_list);
+			if (ic->ic_nr_blocks - sl->icsl_nr_blocks >=
+			    ic->ic_tune_min)
+				want -= sl->icsl_nr_blocks;
+		}
+	} else
+		ic->ic_tune_quiet = 0;
+
+	/* Running out of memory just leaves the cache as it is */
+	if (want != ic->ic_nr_blocks)
+		__io_resize_cache(channel, want);
+
+out:
+	pthread_mutex_unlock(&ic->ic_resize_lock);
 }
 
 static void io_free_cache(struct io_cache *ic)
 {
+	struct io_cache_slab *sl;
+	int i;
+
 	if (ic) {
-		if (ic->ic_data_buffer) {
-			if (ic->ic_locked)
-				munlock(ic->ic_data_buffer,
-					ic->ic_data_buffer_len);
-			cmfs_free(&ic->ic_data_buffer);
+		if (ic->ic_shards) {
+			if (ic->ic_threaded)
+				for (i = 0; i <= ic->ic_shard_mask; i++)
+					pthread_mutex_destroy(
+						&ic->ic_shards[i].ics_lock);
+			cmfs_free(&ic->ic_shards);
 		}
-		if (ic->ic_metadata_buffer) {
-			if (ic->ic_locked)
-				munlock(ic->ic_metadata_buffer,
-					ic->ic_metadata_buffer_len);
-			cmfs_free(&ic->ic_metadata_buffer);
+		while (!list_empty(&ic->ic_slabs)) {
+			sl = list_entry(ic->ic_slabs.next,
+					struct io_cache_slab, icsl_list);
+			list_del(&sl->icsl_list);
+			io_cache_free_slab(sl, ic->ic_locked);
 		}
+		pthread_mutex_destroy(&ic->ic_resize_lock);
 		cmfs_free(&ic);
 	}
 }
@@ -626,78 +1637,106 @@ void io_destroy_cache(io_channel *channel)
  */
 errcode_t io_mlock_cache(io_channel *channel)
 {
-	int rc;
 	struct io_cache *ic = channel->io_cache;
-	long pages_wanted, avpages;
+	struct io_cache_slab *sl, *done;
+	struct list_head *p, *q;
+	long pages_wanted = 0, avpages;
+	errcode_t ret = 0;
 
 	if (!ic)
 		return CMFS_ET_INVALID_ARGUMENT;
 
+	pthread_mutex_lock(&ic->ic_resize_lock);
 	if (ic->ic_locked)
-		return 0;
+		goto out;
 
 	/*
 	 * We're going to lock our cache pages.  We don't want to
-	 * request more memory than the system has, though.
+	 * request more memory than the system has, though.  Pool huge
+	 * pages are already set aside and can't be swapped anyway.
 	 */
-	pages_wanted = channel->io_blksize * ic->ic_nr_blocks / getpagesize();
+	list_for_each(p, &ic->ic_slabs) {
+		sl = list_entry(p, struct io_cache_slab, icsl_list);
+		if (!(sl->icsl_backing & CMFS_IO_CACHE_HUGETLB))
+			pages_wanted += sl->icsl_data_len / getpagesize();
+	}
 	avpages = sysconf(_SC_AVPHYS_PAGES);
-	if (pages_wanted > avpages)
-		return CMFS_ET_NO_MEMORY;
-
-	rc = mlock(ic->ic_data_buffer, ic->ic_data_buffer_len);
-	if (!rc) {
-		rc = mlock(ic->ic_metadata_buffer, ic->ic_metadata_buffer_len);
-		if (rc)
-			munlock(ic->ic_data_buffer, ic->ic_data_buffer_len);
+	if (pages_wanted > avpages) {
+		ret = CMFS_ET_NO_MEMORY;
+		goto out;
 	}
 
-	if (rc)
-		return CMFS_ET_NO_MEMORY;
+	list_for_each(p, &ic->ic_slabs) {
+		sl = list_entry(p, struct io_cache_slab, icsl_list);
+		if (!io_cache_mlock_slab(sl))
+			continue;
+		list_for_each(q, &ic->ic_slabs) {
+			if (q == p)
+				break;
+			done = list_entry(q, struct io_cache_slab, icsl_list);
+			io_cache_munlock_slab(done);
+		}
+		ret = CMFS_ET_NO_MEMORY;
+		goto out;
+	}
 
 	ic->ic_locked = 1;
-	return 0;
+
+out:
+	pthread_mutex_unlock(&ic->ic_resize_lock);
+	return ret;
 }
 
 errcode_t io_init_cache(io_channel *channel, size_t nr_blocks)
 {
 	int i;
+	unsigned int nr_shards = 1;
 	struct io_cache *ic;
-	char *dbuf;
-	struct io_cache_block *icb_list;
+	struct io_cache_shard *ics;
 	errcode_t ret;
 
+	/* The page cache behind the mapping or image is the cache */
+	if (channel->io_map || channel->io_image)
+		return 0;
+
 	ret = cmfs_malloc0(sizeof(struct io_cache), &ic);
 	if (ret)
 		goto out;
 
-	ic->ic_nr_blocks = nr_blocks;
-	ic->ic_lookup = RB_ROOT;
-	INIT_LIST_HEAD(&ic->ic_lru);
+	INIT_LIST_HEAD(&ic->ic_slabs);
+	pthread_mutex_init(&ic->ic_resize_lock, NULL);
+	ic->ic_want_backing = channel->io_cache_backing;
+	ic->ic_node = channel->io_cache_node;
 
-	ret = cmfs_malloc_blocks(channel, nr_blocks, &ic->ic_data_buffer);
-	if (ret)
-		goto out;
-	ic->ic_data_buffer_len = (unsigned long)nr_blocks * channel->io_blksize;
+	/* Every shard needs at least one block to steal */
+	if (channel->io_threaded) {
+		nr_shards = IO_CACHE_THREADED_SHARDS;
+		while (nr_shards > nr_blocks)
+			nr_shards >>= 1;
+	}
 
-	ret = cmfs_malloc0(sizeof(struct io_cache_block) * nr_blocks,
-			    &ic->ic_metadata_buffer);
+	ret = cmfs_malloc0(sizeof(struct io_cache_shard) * nr_shards,
+			   &ic->ic_shards);
 	if (ret)
 		goto out;
-	ic->ic_metadata_buffer_len =
-		(unsigned long)nr_blocks * sizeof(struct io_cache_block);
+	ic->ic_shard_mask = nr_shards - 1;
+	for (i = 0; i < nr_shards; i++) {
+		ics = &ic->ic_shards[i];
+		ics->ics_lookup = RB_ROOT;
+		INIT_LIST_HEAD(&ics->ics_lru);
+		if (channel->io_threaded)
+			pthread_mutex_init(&ics->ics_lock, NULL);
+	}
+	ic->ic_threaded = channel->io_threaded;
 
-	icb_list = ic->ic_metadata_buffer;
-	dbuf = ic->ic_data_buffer;
-	for (i = 0; i < nr_blocks; i++) {
-		icb_list[i].icb_blkno = UINT64_MAX;
-		icb_list[i].icb_buf = dbuf;
-		dbuf += channel->io_blksize;
-		list_add_tail(&icb_list[i].icb_list, &ic->ic_lru);
+	channel->io_cache = ic;
+	ret = __io_resize_cache(channel, nr_blocks);
+	if (ret) {
+		channel->io_cache = NULL;
+		goto out;
 	}
 
 	ic->ic_use_count = 1;
-	channel->io_cache = ic;
 
 out:
 	if (ret)
@@ -706,6 +1745,41 @@ out:
 	return ret;
 }
 
+/*
+ * Ask for huge pages or a NUMA policy, CMFS_IO_CACHE_*, for the next
+ * io_init_cache() on channel.  node is for CMFS_IO_CACHE_BIND, -1
+ * meaning the node the caller runs on.
+ */
+void io_set_cache_backing(io_channel *channel, int backing, int node)
+{
+	channel->io_cache_backing = backing;
+	channel->io_cache_node = node;
+}
+
+/*
+ * The CMFS_IO_CACHE_* all of the cache got, which may be less than
+ * asked
+ */
+int io_get_cache_backing(io_channel *channel)
+{
+	struct io_cache *ic = channel->io_cache;
+	struct io_cache_slab *sl;
+	struct list_head *p;
+	int backing = ~0;
+
+	if (!ic)
+		return 0;
+
+	pthread_mutex_lock(&ic->ic_resize_lock);
+	list_for_each(p, &ic->ic_slabs) {
+		sl = list_entry(p, struct io_cache_slab, icsl_list);
+		backing &= sl->icsl_backing;
+	}
+	pthread_mutex_unlock(&ic->ic_resize_lock);
+
+	return backing;
+}
+
 errcode_t io_init_cache_size(io_channel *channel, size_t bytes)
 {
 	size_t blocks;
@@ -718,7 +1792,7 @@ errcode_t io_init_cache_size(io_channel *channel, size_t bytes)
 size_t io_get_cache_size(io_channel *channel)
 {
 	if (channel->io_cache)
-		return channel->io_cache->ic_data_buffer_len;
+		return channel->io_cache->ic_nr_blocks * channel->io_blksize;
 	return 0;
 }
 
@@ -756,6 +1830,11 @@ static errcode_t io_validate_o_direct(io_channel *channel)
 	return ret;
 }
 
+int io_is_image(io_channel *channel)
+{
+	return !!channel->io_image;
+}
+
 int io_is_device_readonly(io_channel *channel)
 {
 	errcode_t ret;
@@ -767,12 +1846,64 @@ int io_is_device_readonly(io_channel *channel)
 	return 0;
 }
 
+static errcode_t io_open_device(io_channel *chan, int flags)
+{
+	errcode_t ret = 0;
+
+	chan->io_fd = open64(chan->io_name, chan->io_flags);
+	if (chan->io_fd < 0) {
+		/* chan will be freed, don't bother with chan->io_error */
+		if (errno == ENOENT)
+			return CMFS_ET_NAMED_DEVICE_NOT_FOUND;
+		return CMFS_ET_IO;
+	}
+
+	if (flags & CMFS_FLAG_MMAP)
+		ret = mmap_io_open(chan);
+	else if (!(flags & CMFS_FLAG_BUFFERED))
+		ret = io_validate_o_direct(chan);  /* FIXME: bindraw here */
+
+	/* Ignore the return, leave the original error */
+	if (ret)
+		close(chan->io_fd);
+	return ret;
+}
+
+/*
+ * Log every call on the channel to a trace in path, keeping the last
+ * ring_records of them, 0 for the default.  Start and stop tracing
+ * while no other thread uses the channel.  Setting CMFS_IO_TRACE in
+ * the environment traces every channel io_open() opens to that file.
+ */
+errcode_t io_trace_start(io_channel *channel, const char *path,
+			 uint64_t ring_records)
+{
+	if (channel->io_trace)
+		return CMFS_ET_INVALID_ARGUMENT;
+
+	return cmfs_open_trace_writer(path, channel->io_blksize,
+				      ring_records, &channel->io_trace);
+}
+
+errcode_t io_trace_stop(io_channel *channel)
+{
+	errcode_t ret = 0;
+
+	if (channel->io_trace) {
+		ret = cmfs_close_trace_writer(channel->io_trace,
+					      io_get_cache_size(channel));
+		channel->io_trace = NULL;
+	}
+	return ret;
+}
+
 errcode_t io_open(const char *name, int flags, io_channel **channel)
 {
 	errcode_t ret;
 	io_channel *chan = NULL;
 	struct stat stat_buf;
 	struct utsname ut;
+	char *trace;
 
 	if (!name || !*name)
 		return CMFS_ET_BAD_DEVICE_NAME;
@@ -788,24 +1919,32 @@ errcode_t io_open(const char *name, int flags, io_channel **channel)
 	chan->io_blksize = CMFS_MIN_BLOCKSIZE;
 	chan->io_flags = (flags & CMFS_FLAG_RW) ? O_RDWR : O_RDONLY;
 	chan->io_nocache = 0;
-	if (!(flags & CMFS_FLAG_BUFFERED))
+	chan->io_threaded = !!(flags & CMFS_FLAG_THREADED);
+	if (!(flags & (CMFS_FLAG_BUFFERED | CMFS_FLAG_MMAP)))
 		chan->io_flags |= O_DIRECT;
 	chan->io_error = 0;
 
-	chan->io_fd = open64(name, chan->io_flags);
-	if (chan->io_fd < 0) {
-		/* chan will be freed, don't bother with chan->io_error */
-		if (errno == ENOENT)
-			ret = CMFS_ET_NAMED_DEVICE_NOT_FOUND;
-		else
-			ret = CMFS_ET_IO;
+	/* A mapping is only ever read */
+	if ((flags & CMFS_FLAG_MMAP) && (flags & CMFS_FLAG_RW)) {
+		ret = CMFS_ET_INVALID_ARGUMENT;
 		goto out_name;
 	}
 
-	if (!(flags & CMFS_FLAG_BUFFERED)) {
-		ret = io_validate_o_direct(chan);
-		if (ret)
-			goto out_close;  /* FIXME: bindraw here */
+	/* An image stands in for the whole device */
+	ret = image_io_probe(chan, flags);
+	if (ret == CMFS_ET_BAD_MAGIC)
+		ret = io_open_device(chan, flags);
+	if (ret)
+		goto out_name;
+
+	trace = getenv("CMFS_IO_TRACE");
+	if (trace && *trace) {
+		ret = io_trace_start(chan, trace, 0);
+		if (ret) {
+			io_close(chan);
+			*channel = NULL;
+			return ret;
+		}
 	}
 
 	/* Workaround from e2fsprogs */
@@ -847,10 +1986,6 @@ errcode_t io_open(const char *name, int flags, io_channel **channel)
 	*channel = chan;
 	return 0;
 
-out_close:
-	/* Ignore the return, leave the original error */
-	close(chan->io_fd);
-
 out_name:
 	cmfs_free(&chan->io_name);
 
@@ -865,8 +2000,14 @@ errcode_t io_close(io_channel *channel)
 {
 	errcode_t ret = 0;
 
+	/* A trace that can't be finished is not worth failing the close */
+	io_trace_stop(channel);
 	io_destroy_cache(channel);
 
+	if (channel->io_map)
+		munmap(channel->io_map, channel->io_map_len);
+	cmfs_close_image(channel->io_image);
+
 	if (close(channel->io_fd) < 0)
 		ret = errno;
 
@@ -900,8 +2041,11 @@ int io_get_blksize(io_channel *channel)
 	return channel->io_blksize;
 }
 
+/* -1 for an image, its file doesn't hold the blocks where they belong */
 int io_get_fd(io_channel *channel)
 {
+	if (channel->io_image)
+		return -1;
 	return channel->io_fd;
 }
 
@@ -917,6 +2061,63 @@ void io_get_stats(io_channel *channel, struct cmfs_io_stats *stats)
 		stats->is_cache_misses = ioc->ic_misses;
 		stats->is_cache_inserts = ioc->ic_inserts;
 		stats->is_cache_removes = ioc->ic_removes;
+		stats->is_cache_evictions = ioc->ic_evictions;
+	}
+
+	stats->is_reads = channel->io_reads;
+	stats->is_writes = channel->io_writes;
+	stats->is_read_ns = channel->io_read_ns;
+	stats->is_write_ns = channel->io_write_ns;
+	memcpy(stats->is_read_lat, channel->io_read_lat,
+	       sizeof(stats->is_read_lat));
+	memcpy(stats->is_write_lat, channel->io_write_lat,
+	       sizeof(stats->is_write_lat));
+	memcpy(stats->is_read_size, channel->io_read_size,
+	       sizeof(stats->is_read_size));
+	memcpy(stats->is_write_size, channel->io_write_size,
+	       sizeof(stats->is_write_size));
+	memcpy(stats->is_seek, channel->io_seek, sizeof(stats->is_seek));
+	memcpy(stats->is_type_read, channel->io_type_read,
+	       sizeof(stats->is_type_read));
+	memcpy(stats->is_type_disk, channel->io_type_disk,
+	       sizeof(stats->is_type_disk));
+	memcpy(stats->is_type_written, channel->io_type_written,
+	       sizeof(stats->is_type_written));
+}
+
+/*
+ * Start the counters of the channel and its cache over.  I/O in
+ * flight may land on either side of the reset.
+ */
+void io_reset_stats(io_channel *channel)
+{
+	struct io_cache *ioc = channel->io_cache;
+
+	channel->io_bytes_read = 0;
+	channel->io_bytes_written = 0;
+	channel->io_reads = 0;
+	channel->io_writes = 0;
+	channel->io_read_ns = 0;
+	channel->io_write_ns = 0;
+	memset(channel->io_read_lat, 0, sizeof(channel->io_read_lat));
+	memset(channel->io_write_lat, 0, sizeof(channel->io_write_lat));
+	memset(channel->io_read_size, 0, sizeof(channel->io_read_size));
+	memset(channel->io_write_size, 0, sizeof(channel->io_write_size));
+	memset(channel->io_seek, 0, sizeof(channel->io_seek));
+	memset(channel->io_type_read, 0, sizeof(channel->io_type_read));
+	memset(channel->io_type_disk, 0, sizeof(channel->io_type_disk));
+	memset(channel->io_type_written, 0,
+	       sizeof(channel->io_type_written));
+
+	if (ioc) {
+		/* Auto-tuning works on differences, keep it in step */
+		pthread_mutex_lock(&ioc->ic_resize_lock);
+		ioc->ic_hits = ioc->ic_tune_hits = 0;
+		ioc->ic_misses = ioc->ic_tune_misses = 0;
+		ioc->ic_evictions = ioc->ic_tune_evictions = 0;
+		ioc->ic_inserts = 0;
+		ioc->ic_removes = 0;
+		pthread_mutex_unlock(&ioc->ic_resize_lock);
 	}
 }
 
@@ -932,54 +2133,175 @@ void io_set_nocache(io_channel *channel, int nocache)
 	channel->io_nocache = nocache;
 }
 
+/*
+ * Say what the next read or write of the calling thread is for, so
+ * io_get_stats() can count it by block type.  Untagged I/O counts as
+ * CMFS_BLOCK_UNKNOW.
+ */
+void io_set_block_type(enum cmfs_block_type type)
+{
+	if ((type >= 0) && (type < CMFS_NR_BLOCK_TYPES))
+		io_block_type = type;
+}
+
+static inline void io_stat_blocks(uint64_t *stat, int count,
+				  io_channel *channel)
+{
+	io_stat_add(stat[io_block_type], (count < 0) ?
+		    (-count + channel->io_blksize - 1) / channel->io_blksize :
+		    count);
+}
+
+static inline uint64_t io_trace_begin(io_channel *channel)
+{
+	if (!channel->io_trace)
+		return 0;
+	io_thread_hits = 0;
+	return io_now_ns();
+}
+
+/*
+ * Log a call to the channel's trace.  count is the blocks of a plain
+ * read or write, or the number of ivus of a vec read.
+ */
+static void io_trace_end(io_channel *channel, int op, int flags,
+			 int64_t blkno, int count, struct io_vec_unit *ivus,
+			 uint64_t start, errcode_t ret)
+{
+	struct cmfs_trace_event ev;
+	uint64_t ns;
+
+	if (!channel->io_trace || !start)
+		return;
+
+	ns = io_now_ns() - start;
+	memset(&ev, 0, sizeof(ev));
+	ev.te_time = start;
+	ev.te_blkno = blkno;
+	ev.te_count = count;
+	ev.te_latency = (ns > UINT32_MAX) ? UINT32_MAX : ns;
+	ev.te_hits = io_thread_hits;
+	ev.te_op = op;
+	ev.te_flags = flags;
+	if (ret)
+		ev.te_flags |= CMFS_TRACE_FL_ERROR;
+	ev.te_type = io_block_type;
+	cmfs_trace_log(channel->io_trace, channel->io_blksize, &ev, ivus,
+		       count);
+}
+
 errcode_t io_vec_read_blocks(io_channel *channel, struct io_vec_unit *ivus,
 			     int count)
 {
-	if (channel->io_cache)
-		return io_cache_vec_read_blocks(channel, ivus, count,
-						channel->io_nocache);
+	errcode_t ret;
+	uint64_t blocks = 0, start = io_trace_begin(channel);
+	int i;
+
+	for (i = 0; i < count; i++)
+		blocks += ivus[i].ivu_buflen / channel->io_blksize;
+	io_stat_add(channel->io_type_read[io_block_type], blocks);
+
+	if (channel->io_map)
+		ret = mmap_vec_read_blocks(channel, ivus, count);
+	else if (channel->io_image)
+		ret = image_vec_read_blocks(channel, ivus, count);
+	else if (channel->io_cache)
+		ret = io_cache_vec_read_blocks(channel, ivus, count,
+					       channel->io_nocache);
 	else
-		return unix_vec_read_blocks(channel, ivus, count);
+		ret = unix_vec_read_blocks(channel, ivus, count);
+
+	io_trace_end(channel, CMFS_TRACE_VEC_READ,
+		     channel->io_nocache ? CMFS_TRACE_FL_NOCACHE : 0, 0, count,
+		     ivus, start, ret);
+	io_block_type = CMFS_BLOCK_UNKNOW;
+	return ret;
 }
 
 errcode_t io_read_block(io_channel *channel, int64_t blkno, int count,
 			char *data)
 {
-	if (channel->io_cache)
-		return io_cache_read_block(channel, blkno, count, data,
-					   channel->io_nocache);
+	errcode_t ret;
+	uint64_t start = io_trace_begin(channel);
+
+	io_stat_blocks(channel->io_type_read, count, channel);
+	if (channel->io_map)
+		ret = mmap_io_read_block(channel, blkno, count, data);
+	else if (channel->io_image)
+		ret = image_io_read_block(channel, blkno, count, data);
+	else if (channel->io_cache)
+		ret = io_cache_read_block(channel, blkno, count, data,
+					  channel->io_nocache);
 	else
-		return unix_io_read_block(channel, blkno, count, data);
+		ret = unix_io_read_block(channel, blkno, count, data);
+
+	io_trace_end(channel, CMFS_TRACE_READ,
+		     channel->io_nocache ? CMFS_TRACE_FL_NOCACHE : 0, blkno,
+		     count, NULL, start, ret);
+	io_block_type = CMFS_BLOCK_UNKNOW;
+	return ret;
 }
 
 errcode_t io_read_block_nocache(io_channel *channel, int64_t blkno, int count,
 				char *data)
 {
-	if (channel->io_cache)
-		return io_cache_read_block(channel, blkno, count, data,
-					   1);
+	errcode_t ret;
+	uint64_t start = io_trace_begin(channel);
+
+	io_stat_blocks(channel->io_type_read, count, channel);
+	if (channel->io_map)
+		ret = mmap_io_read_block(channel, blkno, count, data);
+	else if (channel->io_image)
+		ret = image_io_read_block(channel, blkno, count, data);
+	else if (channel->io_cache)
+		ret = io_cache_read_block(channel, blkno, count, data,
+					  1);
 	else
-		return unix_io_read_block(channel, blkno, count, data);
+		ret = unix_io_read_block(channel, blkno, count, data);
+
+	io_trace_end(channel, CMFS_TRACE_READ, CMFS_TRACE_FL_NOCACHE, blkno,
+		     count, NULL, start, ret);
+	io_block_type = CMFS_BLOCK_UNKNOW;
+	return ret;
 }
 
 errcode_t io_write_block(io_channel *channel, int64_t blkno, int count,
 			 const char *data)
 {
+	errcode_t ret;
+	uint64_t start = io_trace_begin(channel);
+
+	io_stat_blocks(channel->io_type_written, count, channel);
 	if (channel->io_cache)
-		return io_cache_write_block(channel, blkno, count, data,
-					    channel->io_nocache);
+		ret = io_cache_write_block(channel, blkno, count, data,
+					   channel->io_nocache);
 	else
-		return unix_io_write_block(channel, blkno, count, data);
+		ret = unix_io_write_block(channel, blkno, count, data);
+
+	io_trace_end(channel, CMFS_TRACE_WRITE,
+		     channel->io_nocache ? CMFS_TRACE_FL_NOCACHE : 0, blkno,
+		     count, NULL, start, ret);
+	io_block_type = CMFS_BLOCK_UNKNOW;
+	return ret;
 }
 
 errcode_t io_write_block_nocache(io_channel *channel, int64_t blkno, int count,
 				 const char *data)
 {
+	errcode_t ret;
+	uint64_t start = io_trace_begin(channel);
+
+	io_stat_blocks(channel->io_type_written, count, channel);
 	if (channel->io_cache)
-		return io_cache_write_block(channel, blkno, count, data,
-					    1);
+		ret = io_cache_write_block(channel, blkno, count, data,
+					   1);
 	else
-		return unix_io_write_block(channel, blkno, count, data);
+		ret = unix_io_write_block(channel, blkno, count, data);
+
+	io_trace_end(channel, CMFS_TRACE_WRITE, CMFS_TRACE_FL_NOCACHE, blkno,
+		     count, NULL, start, ret);
+	io_block_type = CMFS_BLOCK_UNKNOW;
+	return ret;
 }
 
 
@@ -988,6 +2310,7 @@ errcode_t io_write_block_nocache(io_channel *channel, int64_t blkno, int count,
 #include <stdlib.h>
 #include <getopt.h>
 #include <limits.h>
+#include <inttypes.h>
 
 static int64_t read_number(const char *num)
 {
@@ -1030,11 +2353,59 @@ static void dump_block(int64_t blkno, int blksize, char *buf)
 	fprintf(stdout, "\n");
 }
 
+/*
+ * Read the first block that isn't wholly in the file, plainly and
+ * vectored.  Both have to fail, returns non-zero if either doesn't.
+ */
+static int check_eof(io_channel *channel, int blksize)
+{
+	struct io_vec_unit ivu;
+	int64_t blkno;
+	off64_t size;
+	char *buf;
+	errcode_t ret;
+	int rc = 0;
+
+	size = lseek64(io_get_fd(channel), 0, SEEK_END);
+	if (size < 0) {
+		fprintf(stderr, "Unable to size the file: %s\n",
+			strerror(errno));
+		return 1;
+	}
+	blkno = size / blksize;
+
+	ret = cmfs_malloc_block(channel, &buf);
+	if (ret) {
+		com_err("unix_io", ret, "while allocating a block");
+		return 1;
+	}
+
+	ret = io_read_block(channel, blkno, 1, buf);
+	fprintf(stdout, "io_read_block() at block %"PRId64": %s\n", blkno,
+		ret ? error_message(ret) : "no error");
+	if (!ret)
+		rc = 1;
+
+	ivu.ivu_blkno = blkno;
+	ivu.ivu_buf = buf;
+	ivu.ivu_buflen = blksize;
+	ret = io_vec_read_blocks(channel, &ivu, 1);
+	fprintf(stdout, "io_vec_read_blocks() at block %"PRId64": %s\n",
+		blkno, ret ? error_message(ret) : "no error");
+	if (!ret)
+		rc = 1;
+
+	cmfs_free(&buf);
+	return rc;
+}
+
 static void print_usage(void)
 {
 	fprintf(stderr,
 		"Usage: unix_io [-b <blkno>] [-c <count>] [-B <blksize>]\n"
-	       	"               <filename>\n");
+	       	"               <filename>\n"
+		"       unix_io -e [-B <blksize>] <filename>\n"
+		"  -e  check that reading past the end of the file fails\n");
 }
 
 extern int opterr, optind;
@@ -1045,6 +2416,7 @@ int main(int argc, char *argv[])
 	errcode_t ret;
 	int c;
 	int64_t blkno, count, blksize;
+	int eof = 0, rc = 0;
 	char *filename;
 	io_channel *channel;
 	char *blks;
@@ -1054,10 +2426,14 @@ int main(int argc, char *argv[])
 	blkno = 0;
 	count = 1;
 
-	initialize_ocfs_error_table();
+	initialize_cmfs_error_table();
 
-	while((c = getopt(argc, argv, "b:c:B:")) != EOF) {
+	while((c = getopt(argc, argv, "b:c:B:e")) != EOF) {
 		switch (c) {
+			case 'e':
+				eof = 1;
+				break;
+
 			case 'b':
 				blkno = read_number(optarg);
 				if (blkno < 0) {
@@ -1135,6 +2511,18 @@ int main(int argc, char *argv[])
 		goto out;
 	}
 
+	ret = io_set_blksize(channel, (int)blksize);
+	if (ret) {
+		com_err(argv[0], ret,
+			"while setting the block size to %"PRId64, blksize);
+		goto out_channel;
+	}
+
+	if (eof) {
+		rc = check_eof(channel, (int)blksize);
+		goto out_channel;
+	}
+
 	ret = cmfs_malloc_blocks(channel, (int)count, &blks);
 	if (ret) {
 		com_err(argv[0], ret,
@@ -1165,6 +2553,6 @@ out_channel:
 	}
 
 out:
-	return 0;
+	return rc;
 }
 #endif  /* DEBUG_EXE */
@@ -0,0 +1,609 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * unwritten.c
+ *
+ * Preallocate unwritten extents and convert them once data is in
+ * place.  For the CMFS userspace library.
+ *
+ * Copyright (C) 2012, Coly Li <i@coly.li>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#define _XOPEN_SOURCE 600  /* Triggers XOPEN2K in features.h */
+#define _LARGEFILE64_SOURCE
+
+#include <string.h>
+
+#include <cmfs/cmfs.h>
+#include "cmfs_err.h"
+
+/*
+ * An unwritten extent owns its clusters but reads back as zeros
+ * (cmfs_file_read() already does so), which lets a writer reserve the
+ * space of a stream up front without paying for a zero-fill.
+ *
+ * Record boundaries are cluster aligned, so both calls work on whole
+ * clusters.  cmfs_allocate_unwritten() reserves every cluster the range
+ * touches, cmfs_mark_extents_written() only converts the clusters the
+ * range covers completely, so blocks nobody wrote never expose what was
+ * on the disk before.  A writer that lands less than a cluster at a
+ * time converts each cluster once it is complete.
+ */
+
+static int unwritten_supported(cmfs_filesys *fs)
+{
+	return CMFS_HAS_COMPAT_FEATURE(CMFS_RAW_SB(fs->fs_super),
+				       CMFS_FEATURE_COMPAT_UNWRITTEN);
+}
+
+/*
+ * Reserve the clusters holding [offset, offset + len) of the file as
+ * unwritten extents.  The range has to lie past the last extent of the
+ * file.  Each piece is the best fitting free run, so the reservation is
+ * contiguous whenever the volume has such a run; otherwise the pieces
+ * follow each other as closely as the free space allows.  i_size is
+ * not changed, cmfs_mark_extents_written() moves it as data lands.
+ */
+errcode_t cmfs_allocate_unwritten(cmfs_cached_inode *ci, uint64_t offset,
+				  uint64_t len, cmfs_allocator *eb_ca,
+				  cmfs_allocator *cluster_ca)
+{
+	cmfs_filesys *fs = ci->ci_fs;
+	struct cmfs_dinode *di = ci->ci_inode;
+	int bits = CMFS_RAW_SB(fs->fs_super)->s_clustersize_bits;
+	uint64_t cpos, end, bpc = cmfs_clusters_to_blocks(fs, 1);
+	uint32_t max_len, want, p_cpos, got, goal;
+	int inserted = 0;
+	errcode_t ret = 0, ret2;
+
+	if (!(fs->fs_flags & CMFS_FLAG_RW))
+		return CMFS_ET_RO_FILESYS;
+	if (!unwritten_supported(fs))
+		return CMFS_ET_UNSUPP_FEATURE;
+	if (!S_ISREG(di->i_mode) || !len)
+		return CMFS_ET_INVALID_ARGUMENT;
+
+	cpos = offset >> bits;
+	end = (offset + len + fs->fs_clustersize - 1) >> bits;
+	max_len = UINT32_MAX / bpc;
+	goal = cmfs_blocks_to_clusters(fs, ci->ci_blkno);
+
+	while (cpos < end) {
+		want = (end - cpos) > max_len ? max_len : (end - cpos);
+		ret = cmfs_alloc_clusters_fit(cluster_ca, want, &p_cpos);
+		if (!ret)
+			got = want;
+		else if (ret == CMFS_ET_NO_SPACE)
+			ret = cmfs_alloc_clusters(cluster_ca, goal, 1, want,
+						  &p_cpos, &got);
+		if (ret)
+			break;
+
+		ret = cmfs_insert_extent(fs, (char *)di,
+					 cmfs_clusters_to_blocks(fs, cpos),
+					 cmfs_clusters_to_blocks(fs, p_cpos),
+					 got * bpc, CMFS_EXT_UNWRITTEN,
+					 eb_ca, cluster_ca);
+		if (ret) {
+			cmfs_free_clusters(cluster_ca, p_cpos, got);
+			break;
+		}
+		inserted++;
+
+		goal = p_cpos + got;
+		cpos += got;
+	}
+
+	/* What was inserted stays, the tree already points at it */
+	if (inserted) {
+		ret2 = cmfs_write_inode(fs, ci->ci_blkno, (char *)di);
+		if (!ret)
+			ret = ret2;
+	}
+
+	return ret;
+}
+
+/*
+ * Find the leaf holding cpos, or the leaf before it if cpos is in a
+ * hole.  An extent block leaf is read into eb_buf and its block number
+ * returned in *leaf_blkno, the in-inode list leaves it 0.  *next_cpos
+ * is where the next leaf starts, or UINT64_MAX after the last one.
+ */
+static errcode_t find_leaf(cmfs_filesys *fs, struct cmfs_dinode *di,
+			   uint64_t cpos, char *eb_buf,
+			   struct cmfs_extent_list **ret_el,
+			   uint64_t *leaf_blkno, uint64_t *next_cpos)
+{
+	struct cmfs_extent_list *el = &di->id2.i_list;
+	struct cmfs_extent_block *eb;
+	uint64_t blkno;
+	errcode_t ret;
+	int i, depth;
+
+	*leaf_blkno = 0;
+	*next_cpos = UINT64_MAX;
+
+	while (el->l_tree_depth) {
+		if (!el->l_next_free_rec)
+			return CMFS_ET_CORRUPT_EXTENT_BLOCK;
+
+		for (i = el->l_next_free_rec - 1; i > 0; i--)
+			if (el->l_recs[i].e_cpos <= cpos)
+				break;
+		if (i + 1 < el->l_next_free_rec)
+			*next_cpos = el->l_recs[i + 1].e_cpos;
+
+		/* el may live in eb_buf, which the read overwrites */
+		blkno = el->l_recs[i].e_blkno;
+		depth = el->l_tree_depth;
+		ret = cmfs_read_extent_block(fs, blkno, eb_buf);
+		if (ret)
+			return ret;
+
+		eb = (struct cmfs_extent_block *)eb_buf;
+		if ((eb->h_list.l_tree_depth != depth - 1) ||
+		    (eb->h_blkno != blkno))
+			return CMFS_ET_CORRUPT_EXTENT_BLOCK;
+
+		el = &eb->h_list;
+		*leaf_blkno = blkno;
+	}
+
+	*ret_el = el;
+	return 0;
+}
+
+/* Whether b can be folded into a, which comes right before it */
+static int can_merge(cmfs_filesys *fs, struct cmfs_extent_rec *a,
+		     struct cmfs_extent_rec *b)
+{
+	return (a->e_flags == b->e_flags) &&
+	       (cmfs_clusters_to_blocks(fs, a->e_cpos) + a->e_leaf_blocks ==
+		cmfs_clusters_to_blocks(fs, b->e_cpos)) &&
+	       (a->e_blkno + a->e_leaf_blocks == b->e_blkno) &&
+	       ((uint64_t)a->e_leaf_blocks + b->e_leaf_blocks <= UINT32_MAX);
+}
+
+/*
+ * Mark clusters [s, e) of the unwritten record i in the leaf el as
+ * written.  The record splits into at most three, and the written part
+ * merges into written neighbours where it can, so a stream converted
+ * front to back keeps the record count flat.
+ */
+static errcode_t split_rec(cmfs_filesys *fs, struct cmfs_extent_list *el,
+			   int i, uint64_t s, uint64_t e, uint64_t rec_end)
+{
+	struct cmfs_extent_rec *rec = &el->l_recs[i];
+	struct cmfs_extent_rec pieces[3], *mid;
+	uint64_t bpc = cmfs_clusters_to_blocks(fs, 1);
+	uint64_t s_off, e_off;
+	int nr = 0, merged_prev = 0, merged_next = 0, new_nr, src;
+
+	s_off = (s - rec->e_cpos) * bpc;
+	e_off = (e == rec_end) ? rec->e_leaf_blocks : (e - rec->e_cpos) * bpc;
+
+	memset(pieces, 0, sizeof(pieces));
+	if (s_off) {
+		pieces[nr] = *rec;
+		pieces[nr].e_leaf_blocks = s_off;
+		nr++;
+	}
+
+	mid = &pieces[nr++];
+	mid->e_cpos = s;
+	mid->e_blkno = rec->e_blkno + s_off;
+	mid->e_leaf_blocks = e_off - s_off;
+	mid->e_flags = rec->e_flags & ~CMFS_EXT_UNWRITTEN;
+
+	if (e_off < rec->e_leaf_blocks) {
+		pieces[nr] = *rec;
+		pieces[nr].e_cpos = e;
+		pieces[nr].e_blkno = rec->e_blkno + e_off;
+		pieces[nr].e_leaf_blocks = rec->e_leaf_blocks - e_off;
+		nr++;
+	}
+
+	/* Fold the written part into the neighbours */
+	if (!s_off && i && can_merge(fs, &el->l_recs[i - 1], mid))
+		merged_prev = 1;
+	if ((e_off == rec->e_leaf_blocks) &&
+	    (i + 1 < el->l_next_free_rec) &&
+	    can_merge(fs, mid, &el->l_recs[i + 1]) &&
+	    (!merged_prev ||
+	     ((uint64_t)el->l_recs[i - 1].e_leaf_blocks + mid->e_leaf_blocks +
+	      el->l_recs[i + 1].e_leaf_blocks <= UINT32_MAX)))
+		merged_next = 1;
+
+	new_nr = el->l_next_free_rec - 1 + nr - merged_prev - merged_next;
+	if (new_nr > el->l_count)
+		return CMFS_ET_NO_SPACE;
+
+	if (merged_prev) {
+		el->l_recs[i - 1].e_leaf_blocks += mid->e_leaf_blocks;
+		mid = &el->l_recs[i - 1];
+		/* pieces[] only keeps what replaces record i */
+		nr--;
+		memmove(&pieces[0], &pieces[1], nr * sizeof(pieces[0]));
+	}
+	if (merged_next)
+		mid->e_leaf_blocks += el->l_recs[i + 1].e_leaf_blocks;
+
+	src = i + 1 + merged_next;
+	memmove(&el->l_recs[i + nr], &el->l_recs[src],
+		(el->l_next_free_rec - src) * sizeof(struct cmfs_extent_rec));
+	memcpy(&el->l_recs[i], pieces, nr * sizeof(pieces[0]));
+	if (new_nr < el->l_next_free_rec)
+		memset(&el->l_recs[new_nr], 0,
+		       (el->l_next_free_rec - new_nr) *
+		       sizeof(struct cmfs_extent_rec));
+	el->l_next_free_rec = new_nr;
+
+	return 0;
+}
+
+/*
+ * Mark the unwritten clusters wholly inside [offset, offset + len) as
+ * written, after the data has been written to their blocks, and move
+ * i_size up to offset + len if it was below.  Holes and written
+ * extents in the range are left alone.  Ranges may come in any order;
+ * when a leaf has no room for the records a split needs, the tree
+ * grows with cmfs_extent_make_room(), taking extent blocks from eb_ca.
+ */
+errcode_t cmfs_mark_extents_written(cmfs_cached_inode *ci, uint64_t offset,
+				    uint64_t len, cmfs_allocator *eb_ca,
+				    cmfs_allocator *cluster_ca)
+{
+	cmfs_filesys *fs = ci->ci_fs;
+	struct cmfs_dinode *di = ci->ci_inode;
+	struct cmfs_extent_list *el;
+	struct cmfs_extent_rec *rec;
+	int bits = CMFS_RAW_SB(fs->fs_super)->s_clustersize_bits;
+	uint64_t cpos, end, rec_end, e, leaf_blkno, next_cpos;
+	uint64_t bpc = cmfs_clusters_to_blocks(fs, 1);
+	uint64_t grown_at = UINT64_MAX;
+	char *eb_buf = NULL;
+	errcode_t ret, ret2;
+	int i;
+
+	if (!(fs->fs_flags & CMFS_FLAG_RW))
+		return CMFS_ET_RO_FILESYS;
+	if (!S_ISREG(di->i_mode) || !len)
+		return CMFS_ET_INVALID_ARGUMENT;
+	if (di->i_dyn_features & CMFS_INLINE_DATA_FL)
+		return CMFS_ET_INODE_CANNOT_BE_ITERATED;
+
+	ret = cmfs_malloc_block(fs->fs_io, &eb_buf);
+	if (ret)
+		return ret;
+
+	cpos = (offset + fs->fs_clustersize - 1) >> bits;
+	end = (offset + len) >> bits;
+
+	while (cpos < end) {
+		ret = find_leaf(fs, di, cpos, eb_buf, &el, &leaf_blkno,
+				&next_cpos);
+		if (ret)
+			break;
+
+		rec = NULL;
+		rec_end = 0;
+		for (i = 0; i < el->l_next_free_rec; i++) {
+			rec = &el->l_recs[i];
+			rec_end = rec->e_cpos +
+				  (rec->e_leaf_blocks + bpc - 1) / bpc;
+			if (rec_end > cpos)
+				break;
+		}
+		if (i == el->l_next_free_rec) {
+			/* Nothing left in this leaf */
+			cpos = next_cpos;
+			continue;
+		}
+		if (rec->e_cpos >= end)
+			break;
+		if (rec->e_cpos > cpos)
+			cpos = rec->e_cpos;
+		if (!(rec->e_flags & CMFS_EXT_UNWRITTEN)) {
+			cpos = rec_end;
+			continue;
+		}
+
+		e = end < rec_end ? end : rec_end;
+		ret = split_rec(fs, el, i, cpos, e, rec_end);
+		if ((ret == CMFS_ET_NO_SPACE) && (grown_at != cpos)) {
+			/* Look the leaf up again once it has room */
+			ret = cmfs_extent_make_room(fs, (char *)di, cpos,
+						    eb_ca, cluster_ca);
+			if (ret)
+				break;
+			grown_at = cpos;
+			continue;
+		}
+		if (ret)
+			break;
+		if (leaf_blkno) {
+			ret = cmfs_write_extent_block(fs, leaf_blkno, eb_buf);
+			if (ret)
+				break;
+		}
+		cpos = e;
+	}
+
+	if (!ret && (offset + len > di->i_size))
+		di->i_size = offset + len;
+
+	/* The in-inode list may have changed even if we failed later */
+	ret2 = cmfs_write_inode(fs, ci->ci_blkno, (char *)di);
+	if (!ret)
+		ret = ret2;
+
+	cmfs_free(&eb_buf);
+	return ret;
+}
+
+#ifdef DEBUG_EXE
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <inttypes.h>
+
+/*
+ * Preallocate a file of -s MB as unwritten, check that it reads as
+ * zeros, write it -p KB (whole clusters) at a time in a scrambled
+ * order, marking each piece written as it lands, and read it all back.
+ * Run fsck.cmfs on the volume afterwards.
+ */
+
+static void fill_piece(char *buf, uint64_t offset, uint64_t len)
+{
+	uint64_t *vals = (uint64_t *)buf;
+	uint64_t i;
+
+	for (i = 0; i < len / sizeof(uint64_t); i++)
+		vals[i] = offset + i * sizeof(uint64_t);
+}
+
+static errcode_t write_piece(cmfs_cached_inode *ci, char *buf,
+			     uint64_t offset, uint64_t len)
+{
+	cmfs_filesys *fs = ci->ci_fs;
+	uint64_t v_blkno, p_blkno, count, left;
+	uint16_t flags;
+	errcode_t ret;
+
+	v_blkno = offset / fs->fs_blocksize;
+	left = len / fs->fs_blocksize;
+	while (left) {
+		ret = cmfs_extent_map_get_blocks(ci, v_blkno, left, &p_blkno,
+						 &count, &flags);
+		if (ret)
+			return ret;
+		if (!p_blkno)
+			return CMFS_ET_INVALID_ARGUMENT;
+		if (count > left)
+			count = left;
+		ret = io_write_block(fs->fs_io, p_blkno, count, buf);
+		if (ret)
+			return ret;
+		buf += count * fs->fs_blocksize;
+		v_blkno += count;
+		left -= count;
+	}
+
+	return 0;
+}
+
+static int count_rec(cmfs_filesys *fs, struct cmfs_extent_rec *rec,
+		     int tree_depth, uint32_t ccount, uint64_t ref_blkno,
+		     int ref_recno, void *priv_data)
+{
+	uint64_t *counts = priv_data;
+
+	counts[0]++;
+	if (rec->e_flags & CMFS_EXT_UNWRITTEN)
+		counts[1]++;
+	return 0;
+}
+
+static void print_usage(void)
+{
+	fprintf(stderr,
+		"Usage: unwritten [-s size_MB] [-p piece_KB] <device> <name>\n"
+		"  creates <name> in the root directory of <device>\n");
+}
+
+int main(int argc, char *argv[])
+{
+	cmfs_filesys *fs;
+	cmfs_allocator *cluster_ca = NULL, *inode_ca = NULL, *eb_ca = NULL;
+	cmfs_cached_inode *ci = NULL;
+	uint64_t size = 200, piece = 4, ino, i, j, tmp, nr, *order = NULL;
+	uint64_t counts[2] = { 0, 0 }, bad = 0;
+	uint32_t got;
+	char *buf = NULL, *check = NULL;
+	errcode_t ret;
+	int c, rc = 1;
+
+	initialize_cmfs_error_table();
+
+	while ((c = getopt(argc, argv, "s:p:")) != EOF) {
+		switch (c) {
+		case 's':
+			size = strtoull(optarg, NULL, 0);
+			break;
+		case 'p':
+			piece = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			print_usage();
+			return 1;
+		}
+	}
+	if ((optind != argc - 2) || !size || !piece) {
+		print_usage();
+		return 1;
+	}
+	size <<= 20;
+	piece <<= 10;
+
+	ret = cmfs_open(argv[optind], CMFS_FLAG_RW, 0, CMFS_MAX_BLOCKSIZE,
+			&fs);
+	if (ret) {
+		com_err(argv[0], ret, "while opening \"%s\"", argv[optind]);
+		return 1;
+	}
+	if ((piece % fs->fs_clustersize) || (size % piece)) {
+		fprintf(stderr, "The piece has to be whole clusters and "
+			"divide the size\n");
+		goto out;
+	}
+
+	ret = cmfs_open_allocator(fs, GLOBAL_BITMAP_SYSTEM_INODE, &cluster_ca);
+	if (!ret)
+		ret = cmfs_open_allocator(fs, INODE_ALLOC_SYSTEM_INODE,
+					  &inode_ca);
+	if (!ret)
+		ret = cmfs_open_allocator(fs, EXTENT_ALLOC_SYSTEM_INODE,
+					  &eb_ca);
+	if (!ret)
+		ret = cmfs_malloc_blocks(fs->fs_io, piece / fs->fs_blocksize,
+					 &buf);
+	if (!ret)
+		ret = cmfs_malloc_blocks(fs->fs_io, piece / fs->fs_blocksize,
+					 &check);
+	if (ret) {
+		com_err(argv[0], ret, "while setting up");
+		goto out;
+	}
+
+	ret = cmfs_new_inode(inode_ca, cluster_ca, S_IFREG | 0644, buf, &ino);
+	if (!ret)
+		ret = cmfs_write_inode(fs, ino, buf);
+	if (!ret)
+		ret = cmfs_link(fs, fs->fs_root_blkno, argv[optind + 1], ino,
+				CMFS_FT_REG_FILE, eb_ca, cluster_ca);
+	if (!ret)
+		ret = cmfs_read_cached_inode(fs, ino, &ci);
+	if (ret) {
+		com_err(argv[0], ret, "while creating \"%s\"",
+			argv[optind + 1]);
+		goto out;
+	}
+
+	ret = cmfs_allocate_unwritten(ci, 0, size, eb_ca, cluster_ca);
+	if (ret) {
+		com_err(argv[0], ret, "while preallocating");
+		goto out;
+	}
+
+	/* Nothing is written yet, so the whole file has to read as zeros */
+	ci->ci_inode->i_size = size;
+	ret = cmfs_write_inode(fs, ci->ci_blkno, (char *)ci->ci_inode);
+	if (ret) {
+		com_err(argv[0], ret, "while setting the size");
+		goto out;
+	}
+	memset(buf, 0, piece);
+	ret = cmfs_file_read(ci, check, piece, size - piece, &got);
+	if (ret) {
+		com_err(argv[0], ret, "while reading back");
+		goto out;
+	}
+	if ((got != piece) || memcmp(buf, check, piece)) {
+		fprintf(stderr, "Preallocated space does not read as zeros\n");
+		goto out;
+	}
+
+	/* The same scrambled order on every run */
+	nr = size / piece;
+	order = malloc(nr * sizeof(uint64_t));
+	if (!order) {
+		com_err(argv[0], CMFS_ET_NO_MEMORY, "while setting up");
+		goto out;
+	}
+	for (i = 0; i < nr; i++)
+		order[i] = i;
+	srandom(1);
+	for (i = nr - 1; i > 0; i--) {
+		j = random() % (i + 1);
+		tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+
+	for (i = 0; i < nr; i++) {
+		fill_piece(buf, order[i] * piece, piece);
+		ret = write_piece(ci, buf, order[i] * piece, piece);
+		if (!ret)
+			ret = cmfs_mark_extents_written(ci, order[i] * piece,
+							piece, eb_ca,
+							cluster_ca);
+		if (ret) {
+			com_err(argv[0], ret, "while writing piece %"PRIu64
+				" (%"PRIu64" of %"PRIu64")", order[i], i, nr);
+			goto out;
+		}
+	}
+
+	for (i = 0; i < nr; i++) {
+		fill_piece(buf, i * piece, piece);
+		ret = cmfs_file_read(ci, check, piece, i * piece, &got);
+		if (ret) {
+			com_err(argv[0], ret, "while reading back");
+			goto out;
+		}
+		if ((got != piece) || memcmp(buf, check, piece))
+			bad++;
+	}
+
+	ret = cmfs_extent_iterate_leaves(fs, ci->ci_inode,
+					 CMFS_EXTENT_FLAG_DATA_ONLY, 0,
+					 count_rec, counts);
+	if (!ret)
+		ret = cmfs_allocator_flush(eb_ca);
+	if (!ret)
+		ret = cmfs_allocator_flush(inode_ca);
+	if (!ret)
+		ret = cmfs_allocator_flush(cluster_ca);
+	if (ret) {
+		com_err(argv[0], ret, "while finishing");
+		goto out;
+	}
+
+	fprintf(stdout, "%"PRIu64" pieces: tree depth %d, %"PRIu64" records, "
+		"%"PRIu64" unwritten, %"PRIu64" pieces read back wrong\n", nr,
+		ci->ci_inode->id2.i_list.l_tree_depth, counts[0], counts[1],
+		bad);
+	if (!bad)
+		rc = 0;
+
+out:
+	free(order);
+	if (check)
+		cmfs_free(&check);
+	if (buf)
+		cmfs_free(&buf);
+	if (ci)
+		cmfs_free_cached_inode(fs, ci);
+	cmfs_close_allocator(eb_ca);
+	cmfs_close_allocator(inode_ca);
+	cmfs_close_allocator(cluster_ca);
+	cmfs_close(fs);
+	return rc;
+}
+#endif  /* DEBUG_EXE */
@@ -0,0 +1,384 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * probe.c
+ *
+ * Probe the devices scan_for_dev() found for CMFS volumes, many at a
+ * time.
+ *
+ * Copyright (C) 2012, Coly Li <i@coly.li>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * A probe is a single read of the first CMFS_PROBE_BYTES of the
+ * device: the volume header and label in sectors 0 and 1 and the
+ * superblock in block CMFS_SUPER_BLOCK_BLKNO.  On a node with hundreds
+ * of LUNs most of the time is waiting for those reads, so they are
+ * issued from a pool of threads.
+ *
+ * A device that doesn't answer must not hold the caller up, so the
+ * caller waits at most timeout_ms and then abandons the pool: the
+ * threads stop taking work and the last one out frees the pool.  A
+ * thread stuck in open() or pread() on a dead path thus only costs
+ * its stack until the I/O errors out.
+ */
+
+#define _XOPEN_SOURCE 600
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <endian.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include <tools-internal/probe.h>
+
+#define CMFS_PROBE_BYTES	((CMFS_SUPER_BLOCK_BLKNO + 1) * \
+				 CMFS_MAX_BLOCKSIZE)
+
+struct probe_pool {
+	pthread_mutex_t pp_lock;
+	pthread_cond_t pp_cond;
+	int pp_refs;			/* the caller and each thread */
+	int pp_abandoned;
+	int pp_nr;
+	int pp_next;			/* next job to take */
+	int pp_done;
+	struct devprobe *pp_jobs;	/* results, copied out when done */
+	int *pp_state;
+};
+
+/* pp_state */
+enum {
+	PROBE_QUEUED = 0,
+	PROBE_RUNNING,
+	PROBE_DONE,
+};
+
+static void put_pool(struct probe_pool *pp)
+{
+	int last;
+
+	pthread_mutex_lock(&pp->pp_lock);
+	last = !--pp->pp_refs;
+	pthread_mutex_unlock(&pp->pp_lock);
+	if (!last)
+		return;
+
+	pthread_cond_destroy(&pp->pp_cond);
+	pthread_mutex_destroy(&pp->pp_lock);
+	free(pp->pp_jobs);
+	free(pp->pp_state);
+	free(pp);
+}
+
+static void parse_super(struct devprobe *dp, char *buf)
+{
+	struct cmfs_dinode *di;
+	struct cmfs_super_block *sb;
+	int bits;
+
+	di = (struct cmfs_dinode *)(buf + CMFS_SUPER_BLOCK_BLKNO *
+				    CMFS_MAX_BLOCKSIZE);
+	if (memcmp(di->i_signature, CMFS_SUPER_BLOCK_SIGNATURE,
+		   strlen(CMFS_SUPER_BLOCK_SIGNATURE)))
+		return;
+
+	sb = CMFS_RAW_SB(di);
+	dp->dp_status = DEVPROBE_CMFS;
+	memcpy(dp->dp_label, sb->s_label, CMFS_MAX_VOL_LABEL_LEN);
+	dp->dp_label[CMFS_MAX_VOL_LABEL_LEN] = '\0';
+	memcpy(dp->dp_uuid, sb->s_uuid, CMFS_VOL_UUID_LEN);
+
+	bits = le32toh(sb->s_blocksize_bits);
+	if (bits > 0 && bits < 32)
+		dp->dp_blocksize = 1U << bits;
+	bits = le32toh(sb->s_clustersize_bits);
+	if (bits > 0 && bits < 32)
+		dp->dp_clustersize = 1U << bits;
+}
+
+static void probe_one(struct devprobe *dp)
+{
+	char *buf = NULL;
+	ssize_t got;
+	int fd;
+
+	/* O_DIRECT so that a stale page cache can't answer for the disk */
+	fd = open(dp->dp_path, O_RDONLY | O_DIRECT);
+	if (fd < 0 && errno == EINVAL)
+		fd = open(dp->dp_path, O_RDONLY);
+	if (fd < 0) {
+		dp->dp_status = DEVPROBE_ERROR;
+		dp->dp_error = errno;
+		return;
+	}
+
+	errno = posix_memalign((void **)&buf, CMFS_MAX_BLOCKSIZE,
+			       CMFS_PROBE_BYTES);
+	if (errno) {
+		dp->dp_status = DEVPROBE_ERROR;
+		dp->dp_error = errno;
+		goto out;
+	}
+
+	got = pread(fd, buf, CMFS_PROBE_BYTES, 0);
+	if (got < 0) {
+		dp->dp_status = DEVPROBE_ERROR;
+		dp->dp_error = errno;
+	} else if (got == CMFS_PROBE_BYTES)
+		parse_super(dp, buf);
+
+out:
+	free(buf);
+	close(fd);
+}
+
+static void *probe_thread(void *arg)
+{
+	struct probe_pool *pp = arg;
+	struct devprobe dp;
+	int i;
+
+	pthread_mutex_lock(&pp->pp_lock);
+	while (!pp->pp_abandoned && pp->pp_next < pp->pp_nr) {
+		i = pp->pp_next++;
+		pp->pp_state[i] = PROBE_RUNNING;
+		dp = pp->pp_jobs[i];
+		pthread_mutex_unlock(&pp->pp_lock);
+
+		probe_one(&dp);
+
+		pthread_mutex_lock(&pp->pp_lock);
+		pp->pp_jobs[i] = dp;
+		pp->pp_state[i] = PROBE_DONE;
+		pp->pp_done++;
+		pthread_cond_signal(&pp->pp_cond);
+	}
+	pthread_mutex_unlock(&pp->pp_lock);
+
+	put_pool(pp);
+	return NULL;
+}
+
+/*
+ * sysfs has the size without opening the device, so a cached result
+ * costs no I/O at all.  0 if there is no size, no media say.
+ */
+static uint64_t sysfs_dev_size(int maj, int min)
+{
+	char path[MAXPATHLEN];
+	unsigned long long sectors;
+	FILE *f;
+	int err;
+
+	snprintf(path, sizeof(path), SYSFSPATH "/dev/block/%d:%d/size",
+		 maj, min);
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	err = fscanf(f, "%llu", &sectors);
+	fclose(f);
+	if (err != 1)
+		return 0;
+
+	return sectors << 9;
+}
+
+/* prefer the /proc/partitions name, else the first path in /dev */
+static const char *probe_path(struct devnode *node)
+{
+	struct devpath *path;
+	int len = strlen(DEVPATH "/");
+
+	if (node->procpart)
+		for (path = node->devpath; path; path = path->next)
+			if (!strncmp(path->path, DEVPATH "/", len) &&
+			    !strcmp(path->path + len, node->procname))
+				return path->path;
+
+	return node->devpath ? node->devpath->path : NULL;
+}
+
+static struct devprobe *find_probe(struct devlisthead *devlisthead,
+				   int maj, int min)
+{
+	struct devprobe *dp;
+
+	for (dp = devlisthead->probecache; dp; dp = dp->next)
+		if (dp->dp_maj == maj && dp->dp_min == min)
+			return dp;
+
+	return NULL;
+}
+
+static int run_pool(struct probe_pool *pp, int threads, int timeout_ms)
+{
+	struct timeval now;
+	struct timespec deadline;
+	pthread_attr_t attr;
+	pthread_t tid;
+	int i, started = 0;
+
+	gettimeofday(&now, NULL);
+	deadline.tv_sec = now.tv_sec + timeout_ms / 1000;
+	deadline.tv_nsec = now.tv_usec * 1000 + (timeout_ms % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_attr_setstacksize(&attr, 64 * 1024);
+
+	pthread_mutex_lock(&pp->pp_lock);
+	for (i = 0; i < threads && i < pp->pp_nr; i++) {
+		pp->pp_refs++;
+		if (pthread_create(&tid, &attr, probe_thread, pp)) {
+			pp->pp_refs--;
+			break;
+		}
+		started++;
+	}
+	pthread_attr_destroy(&attr);
+
+	if (!started) {
+		pthread_mutex_unlock(&pp->pp_lock);
+		return -1;
+	}
+
+	while (pp->pp_done < pp->pp_nr)
+		if (pthread_cond_timedwait(&pp->pp_cond, &pp->pp_lock,
+					   &deadline) == ETIMEDOUT)
+			break;
+
+	pp->pp_abandoned = 1;
+	pthread_mutex_unlock(&pp->pp_lock);
+
+	return 0;
+}
+
+int probe_cmfs_devices(struct devlisthead *devlisthead, int threads,
+		       int timeout_ms)
+{
+	struct probe_pool *pp;
+	struct devnode *node;
+	struct devprobe *dp, **slots = NULL;
+	const char *path;
+	uint64_t size;
+	time_t now;
+	int i, nr = 0, found = 0;
+
+	if (threads <= 0)
+		threads = DEVPROBE_THREADS;
+	if (timeout_ms <= 0)
+		timeout_ms = DEVPROBE_TIMEOUT_MS;
+
+	pp = calloc(1, sizeof(struct probe_pool));
+	if (!pp)
+		return -1;
+	pthread_mutex_init(&pp->pp_lock, NULL);
+	pthread_cond_init(&pp->pp_cond, NULL);
+	pp->pp_refs = 1;
+
+	for (node = devlisthead->devnode; node; node = node->next)
+		nr++;
+	pp->pp_jobs = calloc(nr ? nr : 1, sizeof(struct devprobe));
+	pp->pp_state = calloc(nr ? nr : 1, sizeof(int));
+	slots = calloc(nr ? nr : 1, sizeof(struct devprobe *));
+	if (!pp->pp_jobs || !pp->pp_state || !slots)
+		goto nomem;
+
+	/* queue what the cache can't answer */
+	time(&now);
+	for (node = devlisthead->devnode; node; node = node->next) {
+		node->probe = NULL;
+		if (node->sysfsattrs.holders)
+			continue;
+		path = probe_path(node);
+		if (!path)
+			continue;
+		size = sysfs_dev_size(node->maj, node->min);
+		if (!size)
+			continue;
+
+		dp = find_probe(devlisthead, node->maj, node->min);
+		if (dp && dp->dp_size == size &&
+		    (dp->dp_status == DEVPROBE_CMFS ||
+		     dp->dp_status == DEVPROBE_NOT_CMFS) &&
+		    (devlisthead->cache_timeout <= 0 ||
+		     now - dp->dp_time < devlisthead->cache_timeout)) {
+			node->probe = dp;
+			continue;
+		}
+
+		if (!dp) {
+			dp = calloc(1, sizeof(struct devprobe));
+			if (!dp)
+				goto nomem;
+			dp->dp_maj = node->maj;
+			dp->dp_min = node->min;
+			dp->next = devlisthead->probecache;
+			devlisthead->probecache = dp;
+		}
+		node->probe = dp;
+
+		memset(&pp->pp_jobs[pp->pp_nr], 0, sizeof(struct devprobe));
+		pp->pp_jobs[pp->pp_nr].dp_maj = node->maj;
+		pp->pp_jobs[pp->pp_nr].dp_min = node->min;
+		pp->pp_jobs[pp->pp_nr].dp_size = size;
+		strcpy(pp->pp_jobs[pp->pp_nr].dp_path, path);
+		slots[pp->pp_nr++] = dp;
+	}
+
+	if (pp->pp_nr && run_pool(pp, threads, timeout_ms))
+		goto nomem;
+
+	/* the threads may still be running, so copy out under the lock */
+	time(&now);
+	pthread_mutex_lock(&pp->pp_lock);
+	for (i = 0; i < pp->pp_nr; i++) {
+		dp = slots[i];
+		if (pp->pp_state[i] == PROBE_DONE) {
+			struct devprobe *next = dp->next;
+
+			*dp = pp->pp_jobs[i];
+			dp->next = next;
+		} else {
+			dp->dp_size = pp->pp_jobs[i].dp_size;
+			strcpy(dp->dp_path, pp->pp_jobs[i].dp_path);
+			dp->dp_status = DEVPROBE_TIMEDOUT;
+			dp->dp_error = ETIMEDOUT;
+		}
+		dp->dp_time = now;
+	}
+	pthread_mutex_unlock(&pp->pp_lock);
+
+	for (node = devlisthead->devnode; node; node = node->next)
+		if (node->probe && node->probe->dp_status == DEVPROBE_CMFS)
+			found++;
+
+	free(slots);
+	put_pool(pp);
+	return found;
+
+nomem:
+	free(slots);
+	put_pool(pp);
+	return -1;
+}
@@ -27,6 +27,7 @@
 #include <sys/stat.h>
 
 #include <tools-internal/scandisk.h>
+#include <tools-internal/probe.h>
 
 /** search in cache helpers **/
 
@@ -103,6 +104,10 @@ static void flush_dev_cache(struct devlisthead *devlisthead)
 		startnode = nextnode;
 	}
 
+	/* a rescan reuses the head */
+	devlisthead->devnode = NULL;
+	devlisthead->tail = NULL;
+
 	return;
 }
 
@@ -793,8 +798,15 @@ struct devlisthead *scan_for_dev(struct devlisthead *devlisthead,
 
 void free_dev_list(struct devlisthead *devlisthead)
 {
+	struct devprobe *nextprobe;
+
 	if (devlisthead) {
 		flush_dev_cache(devlisthead);
+		while (devlisthead->probecache) {
+			nextprobe = devlisthead->probecache->next;
+			free(devlisthead->probecache);
+			devlisthead->probecache = nextprobe;
+		}
 		free(devlisthead);
 	}
 	return;
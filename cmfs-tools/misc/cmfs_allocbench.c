@@ -0,0 +1,445 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * cmfs_allocbench.c
+ *
+ * Compare cluster allocation through the libcmfs free extent index with
+ * a linear scan of the bitmap, on a fragmented volume.
+ *
+ * Copyright (C) 2012, Coly Li <i@coly.li>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * A bitmap of -n clusters is fragmented into short used and free runs
+ * (about -p percent used, runs up to 2 * -f clusters long), with a
+ * rare long free run so large requests can still succeed.  Each method
+ * then performs the same -o operations: allocate a random length of
+ * up to -a clusters, and once -k extents are held, free a random one
+ * first.  The "near" methods ask for space at the end of the previous
+ * allocation, the way a streaming writer does.
+ *
+ * The linear methods scan the bitmap like mkfs.cmfs alloc_from_bitmap()
+ * does.  The index methods use cmfs_free_index and keep the bitmap in
+ * step only so that both sides can be checked against each other.
+ */
+
+#define _XOPEN_SOURCE 600
+#define _LARGEFILE64_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/time.h>
+
+#include <cmfs/cmfs.h>
+#include <cmfs/bitops.h>
+#include "../libcmfs/cmfs_err.h"
+
+enum allocbench_method {
+	ALLOCBENCH_LINEAR_FIRST,
+	ALLOCBENCH_LINEAR_NEAR,
+	ALLOCBENCH_INDEX_BEST,
+	ALLOCBENCH_INDEX_NEAR,
+	ALLOCBENCH_METHODS,
+};
+
+static const char *method_names[ALLOCBENCH_METHODS] = {
+	"linear first-fit",
+	"linear near",
+	"index best-fit",
+	"index near",
+};
+
+struct allocbench_extent {
+	uint32_t ae_cpos;
+	uint32_t ae_len;
+};
+
+struct allocbench_ctxt {
+	uint32_t ac_clusters;
+	int ac_used_pct;
+	int ac_frag;
+	uint32_t ac_alloc_max;
+	int ac_keep;
+	unsigned long ac_ops;
+	uint32_t ac_seed;
+
+	uint8_t *ac_template;	/* the fragmented bitmap every run starts from */
+	uint8_t *ac_bitmap;
+	cmfs_filesys ac_fs;	/* the index only looks at fs_clusters */
+	cmfs_free_index *ac_fi;
+
+	struct allocbench_extent *ac_held;
+	int ac_nr_held;
+};
+
+static char *progname = "cmfs_allocbench";
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-n clusters] [-p used_pct] [-f frag_len]\n"
+		"       [-a alloc_max] [-k keep] [-o ops] [-s seed]\n",
+		progname);
+	exit(1);
+}
+
+static uint32_t allocbench_rand(uint32_t *seed)
+{
+	/* xorshift32, as cmfs_mtbench */
+	uint32_t x = *seed;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*seed = x;
+	return x;
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void set_range(uint8_t *bitmap, uint32_t cpos, uint32_t len)
+{
+	while (len--)
+		cmfs_set_bit(cpos++, bitmap);
+}
+
+static void clear_range(uint8_t *bitmap, uint32_t cpos, uint32_t len)
+{
+	while (len--)
+		cmfs_clear_bit(cpos++, bitmap);
+}
+
+static void fragment(struct allocbench_ctxt *ac)
+{
+	uint32_t seed = ac->ac_seed, cpos = 0, len, used_max;
+
+	used_max = (2 * ac->ac_frag * ac->ac_used_pct) /
+		   (100 - ac->ac_used_pct);
+	if (!used_max)
+		used_max = 1;
+
+	while (cpos < ac->ac_clusters) {
+		len = 1 + allocbench_rand(&seed) % used_max;
+		if (len > ac->ac_clusters - cpos)
+			len = ac->ac_clusters - cpos;
+		set_range(ac->ac_template, cpos, len);
+		cpos += len;
+
+		/* One free run in a thousand is long */
+		if (!(allocbench_rand(&seed) % 1000))
+			len = 4 * ac->ac_alloc_max;
+		else
+			len = 1 + allocbench_rand(&seed) % (2 * ac->ac_frag);
+		cpos += len;
+	}
+}
+
+/* The clear run starting at or after start holding len, as mkfs does */
+static int linear_find(struct allocbench_ctxt *ac, uint32_t start,
+		       uint32_t end, uint32_t len, uint32_t *cpos)
+{
+	int bit = start, next;
+
+	for (;;) {
+		bit = cmfs_find_next_bit_clear(ac->ac_bitmap, end, bit);
+		if (bit >= (int)end)
+			return 0;
+		next = cmfs_find_next_bit_set(ac->ac_bitmap, end, bit);
+		if (next > (int)end)
+			next = end;
+		if (next - bit >= len) {
+			*cpos = bit;
+			return 1;
+		}
+		bit = next;
+	}
+}
+
+static errcode_t do_alloc(struct allocbench_ctxt *ac,
+			  enum allocbench_method method, uint32_t goal,
+			  uint32_t len, uint32_t *cpos, uint32_t *got)
+{
+	errcode_t ret = 0;
+
+	*got = len;
+	switch (method) {
+	case ALLOCBENCH_LINEAR_FIRST:
+		if (!linear_find(ac, 0, ac->ac_clusters, len, cpos))
+			ret = CMFS_ET_NO_SPACE;
+		break;
+	case ALLOCBENCH_LINEAR_NEAR:
+		if (!linear_find(ac, goal, ac->ac_clusters, len, cpos) &&
+		    !linear_find(ac, 0, goal, len, cpos))
+			ret = CMFS_ET_NO_SPACE;
+		break;
+	case ALLOCBENCH_INDEX_BEST:
+		ret = cmfs_free_index_best_fit(ac->ac_fi, len, cpos);
+		break;
+	case ALLOCBENCH_INDEX_NEAR:
+		ret = cmfs_free_index_near(ac->ac_fi, goal, len, len, cpos,
+					   got);
+		break;
+	default:
+		ret = CMFS_ET_INVALID_ARGUMENT;
+	}
+
+	if (!ret)
+		set_range(ac->ac_bitmap, *cpos, *got);
+	return ret;
+}
+
+static errcode_t do_free(struct allocbench_ctxt *ac,
+			 enum allocbench_method method,
+			 struct allocbench_extent *ae)
+{
+	clear_range(ac->ac_bitmap, ae->ae_cpos, ae->ae_len);
+	if (method >= ALLOCBENCH_INDEX_BEST)
+		return cmfs_free_index_insert(ac->ac_fi, ae->ae_cpos,
+					      ae->ae_len);
+	return 0;
+}
+
+static errcode_t build_index(struct allocbench_ctxt *ac)
+{
+	int bit = 0, end;
+	errcode_t ret;
+
+	ret = cmfs_new_free_index(&ac->ac_fs, &ac->ac_fi);
+	if (ret)
+		return ret;
+
+	for (;;) {
+		bit = cmfs_find_next_bit_clear(ac->ac_bitmap, ac->ac_clusters,
+					       bit);
+		if (bit >= (int)ac->ac_clusters)
+			break;
+		end = cmfs_find_next_bit_set(ac->ac_bitmap, ac->ac_clusters,
+					     bit);
+		if (end > (int)ac->ac_clusters)
+			end = ac->ac_clusters;
+		ret = cmfs_free_index_insert(ac->ac_fi, bit, end - bit);
+		if (ret)
+			return ret;
+		bit = end;
+	}
+
+	return 0;
+}
+
+/* The index must describe exactly the clear runs of the bitmap */
+static int check_index(struct allocbench_ctxt *ac)
+{
+	uint32_t runs = 0, clear = 0, nr_extents, free_clusters;
+	int bit = 0, end;
+
+	for (;;) {
+		bit = cmfs_find_next_bit_clear(ac->ac_bitmap, ac->ac_clusters,
+					       bit);
+		if (bit >= (int)ac->ac_clusters)
+			break;
+		end = cmfs_find_next_bit_set(ac->ac_bitmap, ac->ac_clusters,
+					     bit);
+		if (end > (int)ac->ac_clusters)
+			end = ac->ac_clusters;
+		runs++;
+		clear += end - bit;
+		if (cmfs_free_index_claim(ac->ac_fi, bit, end - bit))
+			return -1;
+		bit = end;
+	}
+
+	cmfs_free_index_stats(ac->ac_fi, &nr_extents, &free_clusters);
+	if (nr_extents || free_clusters) {
+		fprintf(stderr, "%s: index has %u extents, %u clusters more "
+			"than the bitmap's %u runs, %u clusters\n", progname,
+			nr_extents, free_clusters, runs, clear);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int run_method(struct allocbench_ctxt *ac,
+		      enum allocbench_method method)
+{
+	uint32_t seed = ac->ac_seed, goal = 0, len, cpos, got;
+	unsigned long i, failed = 0;
+	uint64_t allocated = 0;
+	double start, elapsed;
+	int victim, rc = 0;
+	errcode_t ret;
+
+	memcpy(ac->ac_bitmap, ac->ac_template, (ac->ac_clusters + 7) / 8);
+	ac->ac_nr_held = 0;
+
+	if (method >= ALLOCBENCH_INDEX_BEST) {
+		start = now();
+		ret = build_index(ac);
+		if (ret) {
+			com_err(progname, ret, "while building the index");
+			return -1;
+		}
+		fprintf(stdout, "index built in %.3fs\n", now() - start);
+	}
+
+	start = now();
+	for (i = 0; i < ac->ac_ops; i++) {
+		if (ac->ac_nr_held == ac->ac_keep) {
+			victim = allocbench_rand(&seed) % ac->ac_nr_held;
+			ret = do_free(ac, method, &ac->ac_held[victim]);
+			if (ret) {
+				com_err(progname, ret, "while freeing");
+				rc = -1;
+				break;
+			}
+			ac->ac_held[victim] = ac->ac_held[--ac->ac_nr_held];
+		}
+
+		len = 1 + allocbench_rand(&seed) % ac->ac_alloc_max;
+		ret = do_alloc(ac, method, goal, len, &cpos, &got);
+		if (ret == CMFS_ET_NO_SPACE) {
+			failed++;
+			continue;
+		}
+		if (ret) {
+			com_err(progname, ret, "while allocating");
+			rc = -1;
+			break;
+		}
+
+		ac->ac_held[ac->ac_nr_held].ae_cpos = cpos;
+		ac->ac_held[ac->ac_nr_held++].ae_len = got;
+		allocated += got;
+		goal = cpos + got;
+		if (goal >= ac->ac_clusters)
+			goal = 0;
+	}
+	elapsed = now() - start;
+
+	fprintf(stdout, "%-18s %12.0f %10.2f %12"PRIu64" %8lu\n",
+		method_names[method], i / elapsed, elapsed * 1000000.0 / i,
+		allocated, failed);
+
+	if (ac->ac_fi) {
+		if (!rc && check_index(ac)) {
+			fprintf(stderr, "%s: %s left the index and the bitmap "
+				"out of step\n", progname,
+				method_names[method]);
+			rc = -1;
+		}
+		cmfs_close_free_index(ac->ac_fi);
+		ac->ac_fi = NULL;
+	}
+
+	return rc;
+}
+
+int main(int argc, char **argv)
+{
+	struct allocbench_ctxt *ac;
+	int c, rc = 0;
+	enum allocbench_method method;
+
+	initialize_cmfs_error_table();
+
+	ac = calloc(1, sizeof(struct allocbench_ctxt));
+	if (!ac) {
+		com_err(progname, CMFS_ET_NO_MEMORY, "while starting up");
+		return 1;
+	}
+	ac->ac_clusters = 16 * 1024 * 1024;
+	ac->ac_used_pct = 70;
+	ac->ac_frag = 4;
+	ac->ac_alloc_max = 64;
+	ac->ac_keep = 1024;
+	ac->ac_ops = 20000;
+	ac->ac_seed = 2012;
+
+	while ((c = getopt(argc, argv, "n:p:f:a:k:o:s:")) != EOF) {
+		switch (c) {
+		case 'n':
+			ac->ac_clusters = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			ac->ac_used_pct = atoi(optarg);
+			break;
+		case 'f':
+			ac->ac_frag = atoi(optarg);
+			break;
+		case 'a':
+			ac->ac_alloc_max = strtoul(optarg, NULL, 0);
+			break;
+		case 'k':
+			ac->ac_keep = atoi(optarg);
+			break;
+		case 'o':
+			ac->ac_ops = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			ac->ac_seed = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if ((optind != argc) || !ac->ac_clusters ||
+	    (ac->ac_clusters > INT32_MAX) || (ac->ac_used_pct < 0) ||
+	    (ac->ac_used_pct > 99) || (ac->ac_frag <= 0) ||
+	    !ac->ac_alloc_max || (ac->ac_keep <= 0) || !ac->ac_ops ||
+	    !ac->ac_seed)
+		usage();
+
+	ac->ac_fs.fs_clusters = ac->ac_clusters;
+	ac->ac_template = calloc(1, (ac->ac_clusters + 7) / 8);
+	ac->ac_bitmap = malloc((ac->ac_clusters + 7) / 8);
+	ac->ac_held = calloc(ac->ac_keep, sizeof(struct allocbench_extent));
+	if (!ac->ac_template || !ac->ac_bitmap || !ac->ac_held) {
+		com_err(progname, CMFS_ET_NO_MEMORY, "while starting up");
+		rc = 1;
+		goto out;
+	}
+
+	fragment(ac);
+
+	fprintf(stdout, "%u clusters, %d%% used in runs up to %d, "
+		"%lu ops of up to %u clusters, %d held\n",
+		ac->ac_clusters, ac->ac_used_pct, 2 * ac->ac_frag, ac->ac_ops,
+		ac->ac_alloc_max, ac->ac_keep);
+	fprintf(stdout, "%-18s %12s %10s %12s %8s\n", "method", "allocs/s",
+		"us/alloc", "clusters", "failed");
+
+	for (method = 0; method < ALLOCBENCH_METHODS; method++)
+		if (run_method(ac, method))
+			rc = 1;
+
+out:
+	free(ac->ac_held);
+	free(ac->ac_bitmap);
+	free(ac->ac_template);
+	free(ac);
+	return rc;
+}
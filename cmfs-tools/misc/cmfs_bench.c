@@ -0,0 +1,786 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * cmfs_bench.c
+ *
+ * Run the standard libcmfs read scenarios against a volume made by
+ * cmfs_genvol and print the results for regression tracking.
+ *
+ * Copyright (C) 2012, Coly Li <i@coly.li>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Each scenario opens the volume afresh with a -c MB io_cache, so its
+ * cold run starts with nothing cached in libcmfs; the warm run then
+ * repeats the work on the same open volume.  The page cache of the
+ * host is not dropped, run as root with -d to drop it before each
+ * cold run (it is what "cold" means on a real device).
+ *
+ *   inode_scan        every inode by cmfs_get_next_inode()
+ *   namei_deep        cmfs_namei() of the /deep leaf, -n times warm
+ *   bigdir_lookup     -n cmfs_lookup()s of random names in /bigdir
+ *   seq_read          every /library file by cmfs_file_read()
+ *   free_space_scan   cmfs_load_free_index()
+ *   group_summary     cmfs_get_group_summary() of the global bitmap,
+ *                     from its .summary file when the volume has one
+ *   frag_lookup       -n cmfs_extent_map_get_blocks()s at random
+ *                     blocks of the /frag files
+ *   frag_walk         every extent of the /frag files, depth first by
+ *                     cmfs_extent_iterate_inode() and along the leaf
+ *                     chain by cmfs_extent_iterate_leaves(), both cold
+ *
+ * A scenario whose directory is missing from the volume is skipped.
+ * Each result is one JSON object on a line of its own, the device
+ * figures being the cmfs_get_stats() deltas over the run.
+ */
+
+#define _XOPEN_SOURCE 600
+#define _LARGEFILE64_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <time.h>
+
+#include <cmfs/cmfs.h>
+#include "../libcmfs/cmfs_err.h"
+
+#define BENCH_READ_BYTES	(1024 * 1024)
+
+struct bench_inodes {
+	uint64_t *bi_blkno;
+	unsigned long bi_nr;
+	unsigned long bi_alloc;
+};
+
+struct bench_ctxt {
+	char *bc_device;
+	char *bc_tag;
+	struct cmfs_open_params bc_params;
+	unsigned long bc_lookups;
+	uint32_t bc_seed;
+	int bc_drop_caches;
+
+	/* Found on the volume before the runs */
+	char bc_deep_path[PATH_MAX];
+	unsigned long bc_bigdir_files;
+	uint64_t bc_bigdir;
+	struct bench_inodes bc_library;
+	struct bench_inodes bc_frag;
+};
+
+struct bench_run {
+	struct cmfs_io_stats br_stats;
+	uint64_t br_start;
+};
+
+static char *progname = "cmfs_bench";
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-c cache_mb] [-n lookups] [-s seed] [-T tag] [-d] "
+		"<device>\n"
+		"  -d  drop the page cache before each cold run\n",
+		progname);
+	exit(1);
+}
+
+static uint32_t bench_rand(uint32_t *seed)
+{
+	/* xorshift32, as cmfs_mtbench */
+	uint32_t x = *seed;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*seed = x;
+	return x;
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void drop_caches(struct bench_ctxt *bc)
+{
+	int fd;
+
+	if (!bc->bc_drop_caches)
+		return;
+
+	sync();
+	fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+	if (fd < 0 || write(fd, "3\n", 2) != 2) {
+		fprintf(stderr, "%s: cannot drop the page cache, runs are "
+			"not cold\n", progname);
+		bc->bc_drop_caches = 0;
+	}
+	if (fd >= 0)
+		close(fd);
+}
+
+static errcode_t bench_open(struct bench_ctxt *bc, int cold,
+			    cmfs_filesys **ret_fs)
+{
+	errcode_t ret;
+
+	if (cold)
+		drop_caches(bc);
+	ret = cmfs_open_with_params(bc->bc_device, CMFS_FLAG_RO, 0,
+				    CMFS_MAX_BLOCKSIZE, &bc->bc_params, ret_fs);
+	if (ret)
+		com_err(progname, ret, "while opening \"%s\"", bc->bc_device);
+	return ret;
+}
+
+static void bench_begin(cmfs_filesys *fs, struct bench_run *br)
+{
+	cmfs_get_stats(fs, &br->br_stats);
+	br->br_start = now_ns();
+}
+
+static void bench_end(struct bench_ctxt *bc, cmfs_filesys *fs,
+		      struct bench_run *br, const char *scenario,
+		      unsigned long ops, uint64_t bytes)
+{
+	struct cmfs_io_stats after;
+	double secs = (now_ns() - br->br_start) / 1e9;
+	uint64_t reads, read_bytes;
+	uint32_t hits, misses;
+
+	cmfs_get_stats(fs, &after);
+	reads = after.is_reads - br->br_stats.is_reads;
+	read_bytes = after.is_bytes_read - br->br_stats.is_bytes_read;
+	hits = after.is_cache_hits - br->br_stats.is_cache_hits;
+	misses = after.is_cache_misses - br->br_stats.is_cache_misses;
+	if (secs <= 0)
+		secs = 1e-9;
+
+	fprintf(stdout, "{\"scenario\": \"%s\"", scenario);
+	if (bc->bc_tag)
+		fprintf(stdout, ", \"tag\": \"%s\"", bc->bc_tag);
+	fprintf(stdout, ", \"ops\": %lu, \"seconds\": %.6f"
+		", \"ops_per_sec\": %.1f", ops, secs, ops / secs);
+	if (bytes)
+		fprintf(stdout, ", \"bytes\": %"PRIu64", \"mb_per_sec\": %.1f",
+			bytes, bytes / secs / (1024 * 1024));
+	fprintf(stdout, ", \"device_reads\": %"PRIu64
+		", \"device_read_bytes\": %"PRIu64
+		", \"cache_hits\": %u, \"cache_misses\": %u"
+		", \"cache_mb\": %zu}\n",
+		reads, read_bytes, hits, misses,
+		bc->bc_params.op_cache_bytes / (1024 * 1024));
+	fflush(stdout);
+}
+
+static errcode_t add_inode(struct bench_inodes *bi, uint64_t blkno)
+{
+	uint64_t *blknos;
+
+	if (bi->bi_nr == bi->bi_alloc) {
+		bi->bi_alloc = bi->bi_alloc ? bi->bi_alloc * 2 : 256;
+		blknos = realloc(bi->bi_blkno, bi->bi_alloc * sizeof(uint64_t));
+		if (!blknos)
+			return CMFS_ET_NO_MEMORY;
+		bi->bi_blkno = blknos;
+	}
+	bi->bi_blkno[bi->bi_nr++] = blkno;
+	return 0;
+}
+
+struct walk_ctxt {
+	struct bench_inodes *wc_files;
+	struct bench_inodes wc_dirs;
+	char *wc_last_name;		/* of the last entry seen */
+	uint64_t wc_last_ino;
+	unsigned long wc_entries;
+	errcode_t wc_err;
+};
+
+static int walk_proc(struct cmfs_dir_entry *dirent, uint64_t blocknr,
+		     int offset, int blocksize, char *buf, void *priv_data)
+{
+	struct walk_ctxt *wc = priv_data;
+
+	wc->wc_entries++;
+	wc->wc_last_ino = dirent->inode;
+	if (wc->wc_last_name) {
+		memcpy(wc->wc_last_name, dirent->name, dirent->name_len);
+		wc->wc_last_name[dirent->name_len] = '\0';
+	}
+
+	if (dirent->file_type == CMFS_FT_DIR)
+		wc->wc_err = add_inode(&wc->wc_dirs, dirent->inode);
+	else if (dirent->file_type == CMFS_FT_REG_FILE && wc->wc_files)
+		wc->wc_err = add_inode(wc->wc_files, dirent->inode);
+
+	return wc->wc_err ? CMFS_DIRENT_ABORT : 0;
+}
+
+/* All the regular files under dir, breadth first */
+static errcode_t collect_files(cmfs_filesys *fs, uint64_t dir,
+			       struct bench_inodes *files)
+{
+	struct walk_ctxt wc;
+	unsigned long i;
+	errcode_t ret;
+
+	memset(&wc, 0, sizeof(wc));
+	wc.wc_files = files;
+	ret = add_inode(&wc.wc_dirs, dir);
+	for (i = 0; !ret && i < wc.wc_dirs.bi_nr; i++) {
+		ret = cmfs_dir_iterate(fs, wc.wc_dirs.bi_blkno[i],
+				       CMFS_DIRENT_FLAG_EXCLUDE_DOTS, NULL,
+				       walk_proc, &wc);
+		if (!ret)
+			ret = wc.wc_err;
+	}
+
+	if (wc.wc_dirs.bi_blkno)
+		cmfs_free(&wc.wc_dirs.bi_blkno);
+	return ret;
+}
+
+/* /deep is a chain of single directories down to "leaf" */
+static errcode_t find_deep_path(cmfs_filesys *fs, uint64_t dir,
+				char *path, size_t size)
+{
+	struct walk_ctxt wc;
+	char name[CMFS_MAX_FILENAME_LEN + 1];
+	size_t len = strlen(path);
+	errcode_t ret = 0;
+
+	memset(&wc, 0, sizeof(wc));
+	wc.wc_last_name = name;
+	for (;;) {
+		wc.wc_entries = 0;
+		wc.wc_dirs.bi_nr = 0;
+		ret = cmfs_dir_iterate(fs, dir, CMFS_DIRENT_FLAG_EXCLUDE_DOTS,
+				       NULL, walk_proc, &wc);
+		if (!ret)
+			ret = wc.wc_err;
+		if (ret || wc.wc_entries != 1)
+			break;
+
+		len += snprintf(path + len, size - len, "/%s", name);
+		if (len >= size) {
+			ret = CMFS_ET_NO_SPACE;
+			break;
+		}
+		if (!wc.wc_dirs.bi_nr)
+			break;
+		dir = wc.wc_last_ino;
+	}
+
+	if (wc.wc_dirs.bi_blkno)
+		cmfs_free(&wc.wc_dirs.bi_blkno);
+	return ret;
+}
+
+static errcode_t lookup_dir(cmfs_filesys *fs, const char *name,
+			    uint64_t *ino)
+{
+	return cmfs_lookup(fs, fs->fs_root_blkno, name, strlen(name), NULL,
+			   ino);
+}
+
+static int bench_discover(struct bench_ctxt *bc)
+{
+	cmfs_filesys *fs;
+	struct walk_ctxt wc;
+	uint64_t dir;
+	errcode_t ret;
+
+	ret = bench_open(bc, 0, &fs);
+	if (ret)
+		return -1;
+
+	if (!lookup_dir(fs, "library", &dir)) {
+		ret = collect_files(fs, dir, &bc->bc_library);
+		if (ret) {
+			com_err(progname, ret, "while walking /library");
+			goto out;
+		}
+	}
+
+	if (!lookup_dir(fs, "deep", &dir)) {
+		strcpy(bc->bc_deep_path, "/deep");
+		ret = find_deep_path(fs, dir, bc->bc_deep_path,
+				     sizeof(bc->bc_deep_path));
+		if (ret) {
+			com_err(progname, ret, "while walking /deep");
+			goto out;
+		}
+	}
+
+	if (!lookup_dir(fs, "bigdir", &bc->bc_bigdir)) {
+		memset(&wc, 0, sizeof(wc));
+		ret = cmfs_dir_iterate(fs, bc->bc_bigdir,
+				       CMFS_DIRENT_FLAG_EXCLUDE_DOTS, NULL,
+				       walk_proc, &wc);
+		if (ret) {
+			com_err(progname, ret, "while walking /bigdir");
+			goto out;
+		}
+		bc->bc_bigdir_files = wc.wc_entries;
+	}
+
+	if (!lookup_dir(fs, "frag", &dir)) {
+		ret = collect_files(fs, dir, &bc->bc_frag);
+		if (ret) {
+			com_err(progname, ret, "while walking /frag");
+			goto out;
+		}
+	}
+
+out:
+	cmfs_close(fs);
+	return ret ? -1 : 0;
+}
+
+static int bench_inode_scan(struct bench_ctxt *bc)
+{
+	cmfs_filesys *fs;
+	cmfs_inode_scan *scan = NULL;
+	struct bench_run br;
+	uint64_t blkno;
+	unsigned long nr;
+	char *buf = NULL;
+	int pass;
+	errcode_t ret;
+
+	ret = bench_open(bc, 1, &fs);
+	if (ret)
+		return -1;
+
+	ret = cmfs_malloc_block(fs->fs_io, &buf);
+	if (ret)
+		goto out;
+
+	for (pass = 0; pass < 2; pass++) {
+		bench_begin(fs, &br);
+		ret = cmfs_open_inode_scan(fs, &scan);
+		if (ret)
+			goto out;
+		for (nr = 0; ; nr++) {
+			ret = cmfs_get_next_inode(scan, &blkno, buf);
+			if (ret || !blkno)
+				break;
+		}
+		cmfs_close_inode_scan(scan);
+		if (ret)
+			goto out;
+		bench_end(bc, fs, &br, pass ? "inode_scan_warm" :
+			  "inode_scan_cold", nr, 0);
+	}
+
+out:
+	if (ret)
+		com_err(progname, ret, "while scanning inodes");
+	if (buf)
+		cmfs_free(&buf);
+	cmfs_close(fs);
+	return ret ? -1 : 0;
+}
+
+static int bench_namei_deep(struct bench_ctxt *bc)
+{
+	cmfs_filesys *fs;
+	struct bench_run br;
+	uint64_t ino;
+	unsigned long i;
+	errcode_t ret;
+
+	if (!bc->bc_deep_path[0])
+		return 0;
+
+	ret = bench_open(bc, 1, &fs);
+	if (ret)
+		return -1;
+
+	bench_begin(fs, &br);
+	ret = cmfs_namei(fs, fs->fs_root_blkno, fs->fs_root_blkno,
+			 bc->bc_deep_path, &ino);
+	if (ret)
+		goto out;
+	bench_end(bc, fs, &br, "namei_deep_cold", 1, 0);
+
+	bench_begin(fs, &br);
+	for (i = 0; i < bc->bc_lookups && !ret; i++)
+		ret = cmfs_namei(fs, fs->fs_root_blkno, fs->fs_root_blkno,
+				 bc->bc_deep_path, &ino);
+	if (!ret)
+		bench_end(bc, fs, &br, "namei_deep_warm", i, 0);
+
+out:
+	if (ret)
+		com_err(progname, ret, "while looking up %s",
+			bc->bc_deep_path);
+	cmfs_close(fs);
+	return ret ? -1 : 0;
+}
+
+static int bench_bigdir_lookup(struct bench_ctxt *bc)
+{
+	cmfs_filesys *fs;
+	struct bench_run br;
+	uint32_t seed = bc->bc_seed;
+	uint64_t ino;
+	unsigned long i;
+	char name[16];
+	char *buf = NULL;
+	errcode_t ret;
+
+	if (!bc->bc_bigdir_files)
+		return 0;
+
+	ret = bench_open(bc, 1, &fs);
+	if (ret)
+		return -1;
+
+	ret = cmfs_malloc_block(fs->fs_io, &buf);
+	if (ret)
+		goto out;
+
+	/* cmfs_genvol names them e0000000 onwards */
+	bench_begin(fs, &br);
+	for (i = 0; i < bc->bc_lookups; i++) {
+		snprintf(name, sizeof(name), "e%07lu",
+			 bench_rand(&seed) % bc->bc_bigdir_files);
+		ret = cmfs_lookup(fs, bc->bc_bigdir, name, strlen(name), buf,
+				  &ino);
+		if (ret)
+			goto out;
+	}
+	bench_end(bc, fs, &br, "bigdir_lookup", i, 0);
+
+out:
+	if (ret)
+		com_err(progname, ret, "while looking up in /bigdir");
+	if (buf)
+		cmfs_free(&buf);
+	cmfs_close(fs);
+	return ret ? -1 : 0;
+}
+
+static int bench_seq_read(struct bench_ctxt *bc)
+{
+	cmfs_filesys *fs;
+	cmfs_cached_inode *ci;
+	struct bench_run br;
+	uint64_t offset, bytes = 0;
+	unsigned long i;
+	uint32_t got;
+	char *buf = NULL;
+	errcode_t ret;
+
+	if (!bc->bc_library.bi_nr)
+		return 0;
+
+	ret = bench_open(bc, 1, &fs);
+	if (ret)
+		return -1;
+
+	ret = cmfs_malloc_blocks(fs->fs_io,
+				 BENCH_READ_BYTES / fs->fs_blocksize, &buf);
+	if (ret)
+		goto out;
+
+	bench_begin(fs, &br);
+	for (i = 0; i < bc->bc_library.bi_nr; i++) {
+		ret = cmfs_read_cached_inode(fs, bc->bc_library.bi_blkno[i],
+					     &ci);
+		if (ret)
+			goto out;
+		/* The read at the end of the file comes back short */
+		for (offset = 0; ; offset += got) {
+			ret = cmfs_file_read(ci, buf, BENCH_READ_BYTES, offset,
+					     &got);
+			if (ret)
+				break;
+			bytes += got;
+			if (got < BENCH_READ_BYTES)
+				break;
+		}
+		cmfs_free_cached_inode(fs, ci);
+		if (ret)
+			goto out;
+	}
+	bench_end(bc, fs, &br, "seq_read", i, bytes);
+
+out:
+	if (ret)
+		com_err(progname, ret, "while reading /library");
+	if (buf)
+		cmfs_free(&buf);
+	cmfs_close(fs);
+	return ret ? -1 : 0;
+}
+
+static int bench_free_space_scan(struct bench_ctxt *bc)
+{
+	cmfs_filesys *fs;
+	cmfs_free_index *fi;
+	struct bench_run br;
+	uint32_t nr_extents, free_clusters;
+	errcode_t ret;
+
+	ret = bench_open(bc, 1, &fs);
+	if (ret)
+		return -1;
+
+	bench_begin(fs, &br);
+	ret = cmfs_load_free_index(fs, &fi);
+	if (ret) {
+		com_err(progname, ret, "while loading the free space");
+		goto out;
+	}
+	cmfs_free_index_stats(fi, &nr_extents, &free_clusters);
+	bench_end(bc, fs, &br, "free_space_scan", nr_extents, 0);
+	cmfs_close_free_index(fi);
+
+out:
+	cmfs_close(fs);
+	return ret ? -1 : 0;
+}
+
+static int bench_group_summary(struct bench_ctxt *bc)
+{
+	cmfs_filesys *fs;
+	cmfs_group_summary *sm;
+	struct bench_run br;
+	errcode_t ret;
+
+	ret = bench_open(bc, 1, &fs);
+	if (ret)
+		return -1;
+
+	bench_begin(fs, &br);
+	ret = cmfs_get_group_summary(fs, GLOBAL_BITMAP_SYSTEM_INODE, &sm);
+	if (ret) {
+		com_err(progname, ret, "while loading the group summary");
+		goto out;
+	}
+	bench_end(bc, fs, &br, "group_summary", sm->sm_nr_groups, 0);
+
+out:
+	cmfs_close(fs);
+	return ret ? -1 : 0;
+}
+
+static int bench_frag_lookup(struct bench_ctxt *bc)
+{
+	cmfs_filesys *fs;
+	cmfs_cached_inode **cis = NULL;
+	struct bench_run br;
+	unsigned long i, nr = bc->bc_frag.bi_nr;
+	uint64_t blocks, p_blkno, count;
+	uint16_t flags;
+	uint32_t seed;
+	int pass;
+	errcode_t ret;
+
+	if (!nr)
+		return 0;
+
+	ret = bench_open(bc, 1, &fs);
+	if (ret)
+		return -1;
+
+	ret = cmfs_malloc0(nr * sizeof(cmfs_cached_inode *), &cis);
+	if (ret)
+		goto out;
+
+	/* The inodes are read outside the runs, it is the trees we time */
+	for (i = 0; i < nr; i++) {
+		ret = cmfs_read_cached_inode(fs, bc->bc_frag.bi_blkno[i],
+					     &cis[i]);
+		if (ret)
+			goto out;
+	}
+
+	for (pass = 0; pass < 2; pass++) {
+		seed = bc->bc_seed;
+		bench_begin(fs, &br);
+		for (i = 0; i < bc->bc_lookups; i++) {
+			cmfs_cached_inode *ci = cis[bench_rand(&seed) % nr];
+
+			blocks = cmfs_clusters_to_blocks(fs,
+					ci->ci_inode->i_clusters);
+			if (!blocks)
+				continue;
+			ret = cmfs_extent_map_get_blocks(ci,
+					bench_rand(&seed) % blocks, 1,
+					&p_blkno, &count, &flags);
+			if (ret)
+				goto out;
+		}
+		bench_end(bc, fs, &br, pass ? "frag_lookup_warm" :
+			  "frag_lookup_cold", i, 0);
+	}
+
+out:
+	if (ret)
+		com_err(progname, ret, "while mapping /frag");
+	if (cis) {
+		for (i = 0; i < nr; i++)
+			if (cis[i])
+				cmfs_free_cached_inode(fs, cis[i]);
+		cmfs_free(&cis);
+	}
+	cmfs_close(fs);
+	return ret ? -1 : 0;
+}
+
+static int count_extent(cmfs_filesys *fs, struct cmfs_extent_rec *rec,
+			int tree_depth, uint32_t ccount, uint64_t ref_blkno,
+			int ref_recno, void *priv_data)
+{
+	unsigned long *extents = priv_data;
+
+	(*extents)++;
+	return 0;
+}
+
+static int bench_frag_walk(struct bench_ctxt *bc)
+{
+	cmfs_filesys *fs;
+	struct bench_run br;
+	char *buf = NULL;
+	unsigned long i, extents;
+	int leaves;
+	errcode_t ret = 0;
+
+	if (!bc->bc_frag.bi_nr)
+		return 0;
+
+	for (leaves = 0; leaves < 2 && !ret; leaves++) {
+		ret = bench_open(bc, 1, &fs);
+		if (ret)
+			return -1;
+
+		ret = cmfs_malloc_block(fs->fs_io, &buf);
+		if (ret)
+			goto close;
+
+		extents = 0;
+		bench_begin(fs, &br);
+		for (i = 0; i < bc->bc_frag.bi_nr; i++) {
+			ret = cmfs_read_inode(fs, bc->bc_frag.bi_blkno[i], buf);
+			if (ret)
+				break;
+			if (leaves)
+				ret = cmfs_extent_iterate_leaves(fs,
+					(struct cmfs_dinode *)buf,
+					CMFS_EXTENT_FLAG_DATA_ONLY, 0,
+					count_extent, &extents);
+			else
+				ret = cmfs_extent_iterate_inode(fs,
+					(struct cmfs_dinode *)buf,
+					CMFS_EXTENT_FLAG_DATA_ONLY, NULL,
+					count_extent, &extents);
+			if (ret)
+				break;
+		}
+		if (!ret)
+			bench_end(bc, fs, &br, leaves ? "frag_walk_leaves" :
+				  "frag_walk_depth", extents, 0);
+
+		cmfs_free(&buf);
+close:
+		cmfs_close(fs);
+	}
+
+	if (ret)
+		com_err(progname, ret, "while walking /frag");
+	return ret ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_ctxt bc;
+	unsigned long cache_mb = 64;
+	int c, rc = 0;
+
+	initialize_cmfs_error_table();
+
+	memset(&bc, 0, sizeof(bc));
+	bc.bc_lookups = 100000;
+	bc.bc_seed = 2012;
+
+	while ((c = getopt(argc, argv, "c:n:s:T:d")) != EOF) {
+		switch (c) {
+		case 'c':
+			cache_mb = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			bc.bc_lookups = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			bc.bc_seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'T':
+			bc.bc_tag = optarg;
+			break;
+		case 'd':
+			bc.bc_drop_caches = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if ((optind != argc - 1) || !bc.bc_lookups || !bc.bc_seed)
+		usage();
+	bc.bc_device = argv[optind];
+	bc.bc_params.op_cache_bytes = cache_mb * 1024 * 1024;
+
+	if (bench_discover(&bc))
+		return 1;
+
+	if (bench_inode_scan(&bc))
+		rc = 1;
+	if (bench_namei_deep(&bc))
+		rc = 1;
+	if (bench_bigdir_lookup(&bc))
+		rc = 1;
+	if (bench_seq_read(&bc))
+		rc = 1;
+	if (bench_free_space_scan(&bc))
+		rc = 1;
+	if (bench_group_summary(&bc))
+		rc = 1;
+	if (bench_frag_lookup(&bc))
+		rc = 1;
+	if (bench_frag_walk(&bc))
+		rc = 1;
+
+	if (bc.bc_library.bi_blkno)
+		cmfs_free(&bc.bc_library.bi_blkno);
+	if (bc.bc_frag.bi_blkno)
+		cmfs_free(&bc.bc_frag.bi_blkno);
+	return rc;
+}
@@ -0,0 +1,34 @@
+#!/bin/bash
+#
+# Make a volume with cmfs_genvol and run cmfs_bench on it, the results
+# going to $BENCH_RESULTS one JSON object per line.  Run by "make bench".
+#
+#   BENCH_IMAGE    volume to make, a file or a scratch device
+#                  (default bench.img)
+#   BENCH_SIZE_MB  size of a file volume (default 2048).  The full
+#                  tree takes about 1.3 GB; smaller volumes get fewer
+#                  files, and below 96 MB cmfs_genvol stops with
+#                  "volume too small"
+#   BENCH_CACHE_MB io_cache of each run (default 64)
+#   BENCH_TAG      tag of the results, e.g. a git revision
+#   BENCH_RESULTS  (default bench-results.json)
+#
+# An existing $BENCH_IMAGE is reused when BENCH_REUSE is set, the
+# scenarios only read it.  Run from the misc build directory.
+
+set -e
+
+image=${BENCH_IMAGE:-bench.img}
+size_mb=${BENCH_SIZE_MB:-2048}
+cache_mb=${BENCH_CACHE_MB:-64}
+results=${BENCH_RESULTS:-bench-results.json}
+
+if [ -z "$BENCH_REUSE" ] || [ ! -e "$image" ]; then
+	size=
+	[ -b "$image" ] || size="-s $size_mb"
+	./cmfs_genvol $size -C 4096 -M ../mkfs.cmfs/mkfs.cmfs -D "$image" \
+		> "$image.layout"
+fi
+
+./cmfs_bench -c "$cache_mb" ${BENCH_TAG:+-T "$BENCH_TAG"} "$image" \
+	| tee "$results"
@@ -0,0 +1,278 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * cmfs_cachebench.c
+ *
+ * Measure the latency of random reads that hit the io_cache, with the
+ * cache blocks in normal, transparent huge and hugetlb pages.
+ *
+ * Copyright (C) 2012, Coly Li <i@coly.li>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * For each backing a -m MB cache is filled with the first -m MB of the
+ * device, then -n single blocks are read at random from that range,
+ * so every read is a hit and the time is the lookup and the copy out
+ * of the cache, where TLB misses show.  Each read is timed on its own
+ * and the median, 99th percentile and mean reported.  The backing the
+ * cache really got is printed, hugetlb needs pages in the pool
+ * (vm.nr_hugepages) and falls back to THP without them.
+ */
+
+#define _XOPEN_SOURCE 600
+#define _LARGEFILE64_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include <cmfs/cmfs.h>
+#include "../libcmfs/cmfs_err.h"
+
+struct cachebench_backing {
+	const char *cb_name;
+	int cb_backing;
+};
+
+static struct cachebench_backing backings[] = {
+	{ "4K pages",	0 },
+	{ "THP",	CMFS_IO_CACHE_THP },
+	{ "hugetlb",	CMFS_IO_CACHE_HUGETLB },
+};
+
+#define CACHEBENCH_BACKINGS	(sizeof(backings) / sizeof(backings[0]))
+#define CACHEBENCH_FILL_RUN	256
+
+struct cachebench_ctxt {
+	char *cb_device;
+	int cb_blksize;
+	uint64_t cb_blocks;	/* cache size and range read */
+	unsigned long cb_reads;
+	int cb_numa;		/* CMFS_IO_CACHE_INTERLEAVE or _BIND */
+	int cb_node;
+	int cb_mlock;
+	uint32_t cb_seed;
+
+	uint32_t *cb_lat;	/* ns of each read */
+};
+
+static char *progname = "cmfs_cachebench";
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-m mb] [-n reads] [-i | -b node] [-l] [-s seed] "
+		"<device>\n"
+		"  -i  interleave the cache over all nodes\n"
+		"  -b  bind the cache to node, -1 for the local one\n"
+		"  -l  mlock the cache\n",
+		progname);
+	exit(1);
+}
+
+static uint32_t cachebench_rand(uint32_t *seed)
+{
+	/* xorshift32, as cmfs_mtbench */
+	uint32_t x = *seed;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*seed = x;
+	return x;
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_lat(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static const char *backing_name(int backing)
+{
+	static char name[64];
+
+	if (backing & CMFS_IO_CACHE_HUGETLB)
+		strcpy(name, "hugetlb");
+	else if (backing & CMFS_IO_CACHE_THP)
+		strcpy(name, "THP");
+	else
+		strcpy(name, "4K");
+	if (backing & CMFS_IO_CACHE_INTERLEAVE)
+		strcat(name, "+interleave");
+	else if (backing & CMFS_IO_CACHE_BIND)
+		strcat(name, "+bind");
+	return name;
+}
+
+static int run_backing(struct cachebench_ctxt *cb,
+		       struct cachebench_backing *cbb)
+{
+	struct cmfs_io_stats before, after;
+	io_channel *io = NULL;
+	uint32_t seed = cb->cb_seed;
+	uint64_t blkno, start, total = 0;
+	unsigned long i;
+	char *buf = NULL;
+	int count, rc = -1;
+	errcode_t ret;
+
+	ret = io_open(cb->cb_device, CMFS_FLAG_RO, &io);
+	if (ret) {
+		com_err(progname, ret, "while opening \"%s\"", cb->cb_device);
+		return -1;
+	}
+	io_set_blksize(io, cb->cb_blksize);
+
+	io_set_cache_backing(io, cbb->cb_backing | cb->cb_numa, cb->cb_node);
+	ret = io_init_cache(io, cb->cb_blocks);
+	if (ret) {
+		com_err(progname, ret, "while creating the cache");
+		goto out;
+	}
+	if (cb->cb_mlock) {
+		ret = io_mlock_cache(io);
+		if (ret) {
+			com_err(progname, ret, "while locking the cache");
+			goto out;
+		}
+	}
+
+	ret = cmfs_malloc_blocks(io, CACHEBENCH_FILL_RUN, &buf);
+	if (ret) {
+		com_err(progname, ret, "while allocating the read buffer");
+		goto out;
+	}
+
+	for (blkno = 0; blkno < cb->cb_blocks; blkno += count) {
+		count = CACHEBENCH_FILL_RUN;
+		if (count > cb->cb_blocks - blkno)
+			count = cb->cb_blocks - blkno;
+		ret = io_read_block(io, blkno, count, buf);
+		if (ret) {
+			com_err(progname, ret, "while filling the cache");
+			goto out;
+		}
+	}
+
+	io_get_stats(io, &before);
+	for (i = 0; i < cb->cb_reads; i++) {
+		blkno = cachebench_rand(&seed) % cb->cb_blocks;
+		start = now_ns();
+		ret = io_read_block(io, blkno, 1, buf);
+		cb->cb_lat[i] = now_ns() - start;
+		if (ret) {
+			com_err(progname, ret, "while reading block %"PRIu64,
+				blkno);
+			goto out;
+		}
+		total += cb->cb_lat[i];
+	}
+	io_get_stats(io, &after);
+
+	qsort(cb->cb_lat, cb->cb_reads, sizeof(uint32_t), cmp_lat);
+	fprintf(stdout, "%-10s %-18s %10u %10u %10.1f %8u\n", cbb->cb_name,
+		backing_name(io_get_cache_backing(io)),
+		cb->cb_lat[cb->cb_reads / 2],
+		cb->cb_lat[cb->cb_reads * 99 / 100],
+		(double)total / cb->cb_reads,
+		after.is_cache_misses - before.is_cache_misses);
+	rc = 0;
+
+out:
+	if (buf)
+		cmfs_free(&buf);
+	io_close(io);
+	return rc;
+}
+
+int main(int argc, char **argv)
+{
+	struct cachebench_ctxt cb;
+	unsigned long cache_mb = 512;
+	int c, i, rc = 0;
+	errcode_t ret;
+
+	initialize_cmfs_error_table();
+
+	memset(&cb, 0, sizeof(cb));
+	cb.cb_blksize = CMFS_MAX_BLOCKSIZE;
+	cb.cb_reads = 1000000;
+	cb.cb_node = -1;
+	cb.cb_seed = 2012;
+
+	while ((c = getopt(argc, argv, "m:n:ib:ls:")) != EOF) {
+		switch (c) {
+		case 'm':
+			cache_mb = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			cb.cb_reads = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			cb.cb_numa = CMFS_IO_CACHE_INTERLEAVE;
+			break;
+		case 'b':
+			cb.cb_numa = CMFS_IO_CACHE_BIND;
+			cb.cb_node = atoi(optarg);
+			break;
+		case 'l':
+			cb.cb_mlock = 1;
+			break;
+		case 's':
+			cb.cb_seed = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if ((optind != argc - 1) || !cache_mb || !cb.cb_reads || !cb.cb_seed)
+		usage();
+	cb.cb_device = argv[optind];
+	cb.cb_blocks = cache_mb * 1024 * 1024 / cb.cb_blksize;
+
+	ret = cmfs_malloc(cb.cb_reads * sizeof(uint32_t), &cb.cb_lat);
+	if (ret) {
+		com_err(progname, ret, "while allocating the latencies");
+		return 1;
+	}
+
+	fprintf(stdout, "%s: %lu MB cache, %lu random cached reads\n",
+		cb.cb_device, cache_mb, cb.cb_reads);
+	fprintf(stdout, "%-10s %-18s %10s %10s %10s %8s\n", "asked", "got",
+		"p50 ns", "p99 ns", "mean ns", "misses");
+
+	for (i = 0; i < CACHEBENCH_BACKINGS; i++)
+		if (run_backing(&cb, &backings[i]))
+			rc = 1;
+
+	cmfs_free(&cb.cb_lat);
+	return rc;
+}
@@ -0,0 +1,824 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * cmfs_genvol.c
+ *
+ * Build a synthetic CMFS volume, shaped like a media library, for
+ * benchmarks.
+ *
+ * Copyright (C) 2012, Coly Li <i@coly.li>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * With -s the volume is first made -s MB long, if it is a file, and
+ * formatted by running mkfs.cmfs (-M for another one).  The tree is
+ * then written through libcmfs, the way cmfs-import writes, and is
+ * the same for the same options and -S seed:
+ *
+ *   /library/aNNN/bNNN/.../tNNN   -l levels of -f directories each,
+ *                                 -t files in each leaf directory,
+ *                                 sized log-uniformly in [-k, -K] KB
+ *   /bigdir/eNNNNNNN              -B empty files in one directory
+ *   /deep/d00/d01/.../leaf        a chain of -P directories
+ *   /frag/fNNN                    -q files of -x one-cluster extents
+ *                                 scattered over the volume, for deep
+ *                                 extent trees
+ *
+ * -F percent of the library files are also cut into 2 to -p pieces
+ * placed at random, which fragments the free space too.
+ *
+ * The whole tree is planned before anything is written.  With -s the
+ * default -t, -B and -q shrink until the tree fits the new volume;
+ * counts given on the command line are kept.  A tree that still does
+ * not fit stops cmfs_genvol with the size the volume would need.  File data is
+ * only written with -D, a block pattern; without it the files read
+ * back whatever the volume held, which is quicker to make and enough
+ * for metadata benchmarks.
+ *
+ * The layout is printed at the end, one "key value" per line, for
+ * scripts such as cmfs_bench.sh.
+ */
+
+#define _XOPEN_SOURCE 600
+#define _LARGEFILE64_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+
+#include <cmfs/cmfs.h>
+#include "../libcmfs/cmfs_err.h"
+
+/* Data is written this many blocks at a time with -D */
+#define GENVOL_IO_BLOCKS	256
+
+/* Which default counts may shrink to fit the volume */
+#define GENVOL_SCALE_TRACKS	0x01
+#define GENVOL_SCALE_BIG_DIR	0x02
+#define GENVOL_SCALE_FRAG	0x04
+
+struct genvol_ctxt {
+	cmfs_filesys *gv_fs;
+	cmfs_allocator *gv_cluster_ca;
+	cmfs_allocator *gv_inode_ca;
+	cmfs_allocator *gv_eb_ca;
+	uint32_t gv_seed;
+	uint32_t gv_size_seed;		/* file sizes and pieces, see plan() */
+	uint32_t gv_goal;		/* next cluster after the last file */
+	uint32_t gv_max_extent;		/* clusters a leaf record can hold */
+
+	int gv_levels;
+	int gv_fanout;
+	int gv_tracks;
+	uint64_t gv_min_kb;
+	uint64_t gv_max_kb;
+	int gv_frag_pct;
+	int gv_frag_pieces;
+	int gv_big_dir;
+	int gv_deep;
+	int gv_frag_files;
+	int gv_frag_extents;
+	int gv_write_data;
+	int gv_scale;			/* GENVOL_SCALE_* */
+	char *gv_data;
+
+	unsigned long gv_files;
+	unsigned long gv_dirs;
+	uint64_t gv_bytes;
+	uint64_t gv_extents;
+	int gv_max_depth;		/* deepest extent tree made */
+};
+
+static char *progname = "cmfs_genvol";
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-s size_mb [-C cluster_size] [-M mkfs]] [-S seed]\n"
+		"       [-l levels] [-f fanout] [-t files] [-k min_kb] "
+		"[-K max_kb]\n"
+		"       [-F frag_pct] [-p pieces] [-B bigdir_files] "
+		"[-P deep_dirs]\n"
+		"       [-q frag_files] [-x frag_extents] [-D] <device>\n",
+		progname);
+	exit(1);
+}
+
+static uint32_t genvol_rand(uint32_t *seed)
+{
+	/* xorshift32, as cmfs_mtbench */
+	uint32_t x = *seed;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*seed = x;
+	return x;
+}
+
+/* Log-uniform in [min_kb, max_kb], as media files are */
+static uint64_t file_size(struct genvol_ctxt *gv, uint32_t *seed)
+{
+	uint64_t lo = gv->gv_min_kb * 1024, hi = gv->gv_max_kb * 1024;
+	uint64_t size;
+	int lo_bit, hi_bit, bit;
+
+	if (hi <= lo)
+		return lo;
+
+	lo_bit = lo ? 63 - __builtin_clzll(lo) : 0;
+	hi_bit = 63 - __builtin_clzll(hi);
+	bit = lo_bit + genvol_rand(seed) % (hi_bit - lo_bit + 1);
+	size = (1ULL << bit) + (((uint64_t)genvol_rand(seed) << 32 |
+				 genvol_rand(seed)) % (1ULL << bit));
+	if (size < lo)
+		size = lo;
+	if (size > hi)
+		size = hi;
+	return size;
+}
+
+/* Run mkfs.cmfs on the device, making it size_mb long first if a file */
+static int format_volume(const char *mkfs, const char *device,
+			 unsigned long size_mb, const char *cluster_size)
+{
+	struct stat64 st;
+	int fd, status;
+	pid_t pid;
+
+	if (stat64(device, &st) || S_ISREG(st.st_mode)) {
+		fd = open64(device, O_RDWR | O_CREAT, 0644);
+		if ((fd < 0) ||
+		    ftruncate64(fd, (off64_t)size_mb * 1024 * 1024)) {
+			com_err(progname, errno, "while sizing \"%s\"",
+				device);
+			if (fd >= 0)
+				close(fd);
+			return -1;
+		}
+		close(fd);
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		com_err(progname, errno, "while starting %s", mkfs);
+		return -1;
+	}
+	if (!pid) {
+		if (cluster_size)
+			execlp(mkfs, mkfs, "-F", "-q", "-C", cluster_size,
+			       device, (char *)NULL);
+		else
+			execlp(mkfs, mkfs, "-F", "-q", device, (char *)NULL);
+		com_err(progname, errno, "while running %s", mkfs);
+		_exit(127);
+	}
+
+	if ((waitpid(pid, &status, 0) < 0) || !WIFEXITED(status) ||
+	    WEXITSTATUS(status)) {
+		fprintf(stderr, "%s: %s failed on \"%s\"\n", progname, mkfs,
+			device);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Get up to want clusters in one extent.  Scattered extents start at
+ * a random goal, the others right after the last file.  Anything will
+ * do when the volume is short of long free runs.
+ */
+static errcode_t alloc_extent(struct genvol_ctxt *gv, uint32_t want,
+			      int scatter, uint32_t *cpos, uint32_t *len)
+{
+	uint32_t goal = gv->gv_goal;
+	errcode_t ret;
+
+	if (want > gv->gv_max_extent)
+		want = gv->gv_max_extent;
+	if (scatter)
+		goal = genvol_rand(&gv->gv_seed) % gv->gv_fs->fs_clusters;
+
+	ret = cmfs_alloc_clusters(gv->gv_cluster_ca, goal, want, want, cpos,
+				  len);
+	if (ret == CMFS_ET_NO_SPACE)
+		ret = cmfs_alloc_clusters(gv->gv_cluster_ca, goal, 1, want,
+					  cpos, len);
+	if (!ret && !scatter)
+		gv->gv_goal = *cpos + *len;
+	return ret;
+}
+
+static errcode_t write_data(struct genvol_ctxt *gv, uint32_t cpos,
+			    uint32_t len)
+{
+	cmfs_filesys *fs = gv->gv_fs;
+	uint64_t blkno = cmfs_clusters_to_blocks(fs, cpos);
+	uint64_t left = cmfs_clusters_to_blocks(fs, len);
+	int count;
+	errcode_t ret;
+
+	while (left) {
+		count = left > GENVOL_IO_BLOCKS ? GENVOL_IO_BLOCKS : left;
+		ret = io_write_block(fs->fs_io, blkno, count, gv->gv_data);
+		if (ret)
+			return ret;
+		blkno += count;
+		left -= count;
+	}
+	return 0;
+}
+
+/*
+ * Make a regular file of size bytes called name in parent, in pieces
+ * placed at random when pieces > 1, else next to the previous file.
+ */
+static errcode_t make_file(struct genvol_ctxt *gv, uint64_t parent,
+			   const char *name, uint64_t size, int pieces)
+{
+	cmfs_filesys *fs = gv->gv_fs;
+	struct cmfs_dinode *di;
+	uint32_t clusters, part, cpos, len;
+	uint64_t ino, v_blkno = 0;
+	char *buf = NULL;
+	int i, depth;
+	errcode_t ret;
+
+	ret = cmfs_malloc_block(fs->fs_io, &buf);
+	if (ret)
+		return ret;
+
+	ret = cmfs_new_inode(gv->gv_inode_ca, gv->gv_cluster_ca,
+			     S_IFREG | 0644, buf, &ino);
+	if (ret)
+		goto out;
+	di = (struct cmfs_dinode *)buf;
+	di->i_size = size;
+
+	clusters = cmfs_clusters_in_bytes(fs, size);
+	if (pieces > clusters)
+		pieces = clusters;
+	for (i = 0; clusters; i++) {
+		part = clusters;
+		if (pieces > 1)
+			part = clusters / (pieces - i) ?
+				clusters / (pieces - i) : 1;
+		ret = alloc_extent(gv, part, pieces > 1, &cpos, &len);
+		if (ret)
+			goto out;
+
+		if (gv->gv_write_data) {
+			ret = write_data(gv, cpos, len);
+			if (ret)
+				goto out;
+		}
+
+		ret = cmfs_insert_extent(fs, buf, v_blkno,
+					 cmfs_clusters_to_blocks(fs, cpos),
+					 cmfs_clusters_to_blocks(fs, len), 0,
+					 gv->gv_eb_ca, gv->gv_cluster_ca);
+		if (ret)
+			goto out;
+		v_blkno += cmfs_clusters_to_blocks(fs, len);
+		clusters -= len;
+		gv->gv_extents++;
+		if (i + 1 >= pieces)
+			pieces = 1;
+	}
+
+	depth = di->id2.i_list.l_tree_depth;
+	if (depth > gv->gv_max_depth)
+		gv->gv_max_depth = depth;
+
+	ret = cmfs_write_inode(fs, ino, buf);
+	if (ret)
+		goto out;
+	ret = cmfs_link(fs, parent, name, ino, CMFS_FT_REG_FILE,
+			gv->gv_eb_ca, gv->gv_cluster_ca);
+	if (ret)
+		goto out;
+
+	gv->gv_files++;
+	gv->gv_bytes += size;
+
+out:
+	cmfs_free(&buf);
+	return ret;
+}
+
+static errcode_t make_dir(struct genvol_ctxt *gv, uint64_t parent,
+			  const char *name, uint64_t *ino)
+{
+	errcode_t ret;
+
+	ret = cmfs_mkdir(gv->gv_fs, parent, name, 0755, gv->gv_inode_ca,
+			 gv->gv_eb_ca, gv->gv_cluster_ca, ino);
+	if (!ret)
+		gv->gv_dirs++;
+	return ret;
+}
+
+/* How many pieces the next library file is cut into */
+static int track_pieces(struct genvol_ctxt *gv, uint32_t *seed)
+{
+	if ((genvol_rand(seed) % 100) >= gv->gv_frag_pct)
+		return 1;
+	return 2 + genvol_rand(seed) % (gv->gv_frag_pieces - 1);
+}
+
+static errcode_t build_level(struct genvol_ctxt *gv, uint64_t parent,
+			     int level)
+{
+	char name[CMFS_MAX_FILENAME_LEN + 1];
+	uint64_t ino;
+	int i, pieces;
+	errcode_t ret;
+
+	if (level == gv->gv_levels) {
+		for (i = 0; i < gv->gv_tracks; i++) {
+			pieces = track_pieces(gv, &gv->gv_size_seed);
+			snprintf(name, sizeof(name), "t%03d", i);
+			ret = make_file(gv, parent, name,
+					file_size(gv, &gv->gv_size_seed),
+					pieces);
+			if (ret)
+				return ret;
+		}
+		return 0;
+	}
+
+	for (i = 0; i < gv->gv_fanout; i++) {
+		snprintf(name, sizeof(name), "%c%03d", 'a' + level, i);
+		ret = make_dir(gv, parent, name, &ino);
+		if (!ret)
+			ret = build_level(gv, ino, level + 1);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static errcode_t build_tree(struct genvol_ctxt *gv)
+{
+	cmfs_filesys *fs = gv->gv_fs;
+	char name[CMFS_MAX_FILENAME_LEN + 1];
+	uint64_t ino;
+	int i;
+	errcode_t ret;
+
+	ret = make_dir(gv, fs->fs_root_blkno, "library", &ino);
+	if (!ret)
+		ret = build_level(gv, ino, 0);
+	if (ret)
+		return ret;
+
+	if (gv->gv_big_dir) {
+		ret = make_dir(gv, fs->fs_root_blkno, "bigdir", &ino);
+		for (i = 0; !ret && (i < gv->gv_big_dir); i++) {
+			snprintf(name, sizeof(name), "e%07d", i);
+			ret = make_file(gv, ino, name, 0, 1);
+		}
+		if (ret)
+			return ret;
+	}
+
+	if (gv->gv_deep) {
+		ret = make_dir(gv, fs->fs_root_blkno, "deep", &ino);
+		for (i = 0; !ret && (i < gv->gv_deep); i++) {
+			snprintf(name, sizeof(name), "d%02d", i);
+			ret = make_dir(gv, ino, name, &ino);
+		}
+		if (!ret)
+			ret = make_file(gv, ino, "leaf", fs->fs_clustersize, 1);
+		if (ret)
+			return ret;
+	}
+
+	if (gv->gv_frag_files) {
+		ret = make_dir(gv, fs->fs_root_blkno, "frag", &ino);
+		for (i = 0; !ret && (i < gv->gv_frag_files); i++) {
+			snprintf(name, sizeof(name), "f%03d", i);
+			ret = make_file(gv, ino, name,
+					(uint64_t)gv->gv_frag_extents *
+					fs->fs_clustersize,
+					gv->gv_frag_extents);
+		}
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Planning.
+ *
+ * File sizes and pieces come from gv_size_seed, a stream of their own,
+ * so plan() can replay them and count the data clusters exactly before
+ * anything is written.  Inodes, directory blocks and extent blocks are
+ * estimated, and the allocator groups they need are added on top.
+ */
+
+/* Extent blocks for a file of extents records, appends fill them */
+static uint64_t plan_ebs(cmfs_filesys *fs, uint64_t extents)
+{
+	uint64_t per_eb = cmfs_extent_recs_per_eb(fs->fs_blocksize);
+	uint64_t ebs = 0;
+
+	while (extents > cmfs_extent_recs_per_inode(fs->fs_blocksize)) {
+		extents = (extents + per_eb - 1) / per_eb;
+		ebs += extents;
+	}
+	return ebs;
+}
+
+/* Clusters for a directory of entries names name_len long */
+static uint64_t plan_dir(cmfs_filesys *fs, uint64_t entries, int name_len)
+{
+	uint64_t per_block, blocks;
+
+	/* Leave room for the block trailer, and "." and ".." */
+	per_block = (fs->fs_blocksize - 64) / CMFS_DIR_REC_LEN(name_len);
+	blocks = (entries + 2) / per_block + 1;
+	return cmfs_clusters_in_bytes(fs, blocks * fs->fs_blocksize);
+}
+
+/* Clusters a sub allocator of type takes to hand out bits more bits */
+static errcode_t plan_sub_alloc(cmfs_filesys *fs, int type, uint64_t bits,
+				uint64_t *clusters)
+{
+	cmfs_group_summary *sm;
+	struct cmfs_chain_list *cl;
+	char *buf = NULL;
+	errcode_t ret;
+
+	*clusters = 0;
+	ret = cmfs_build_group_summary(fs, type, &sm);
+	if (ret)
+		return ret;
+	ret = cmfs_malloc_block(fs->fs_io, &buf);
+	if (!ret)
+		ret = cmfs_read_inode(fs, sm->sm_blkno, buf);
+	if (!ret && (bits > sm->sm_free_bits)) {
+		cl = &((struct cmfs_dinode *)buf)->id2.i_chain;
+		/* And a spare group, the free bits are spread over groups */
+		*clusters = ((bits - sm->sm_free_bits) /
+			     ((uint64_t)cl->cl_cpg * cl->cl_bpc) + 2) *
+			    cl->cl_cpg;
+	}
+
+	if (buf)
+		cmfs_free(&buf);
+	cmfs_close_group_summary(sm);
+	return ret;
+}
+
+/* Clusters the tree build_tree() would make takes */
+static errcode_t plan(struct genvol_ctxt *gv, uint64_t *need)
+{
+	cmfs_filesys *fs = gv->gv_fs;
+	uint32_t seed = gv->gv_size_seed;
+	uint64_t clusters = 0, inodes, ebs = 0, leaves = 1, dirs = 1;
+	uint64_t files, i, c, sub;
+	int pieces;
+	errcode_t ret;
+
+	/* /library, every directory taken as big as the largest */
+	for (i = 0; i < gv->gv_levels; i++) {
+		leaves *= gv->gv_fanout;
+		dirs += leaves;
+	}
+	c = plan_dir(fs, gv->gv_fanout > gv->gv_tracks ?
+		     gv->gv_fanout : gv->gv_tracks, 4);
+	clusters += dirs * c;
+	ebs += dirs * plan_ebs(fs, c);
+
+	files = leaves * gv->gv_tracks;
+	for (i = 0; i < files; i++) {
+		pieces = track_pieces(gv, &seed);
+		c = cmfs_clusters_in_bytes(fs, file_size(gv, &seed));
+		clusters += c;
+		ebs += plan_ebs(fs, pieces < c ? pieces : c);
+	}
+	inodes = files + dirs;
+
+	if (gv->gv_big_dir) {
+		c = plan_dir(fs, gv->gv_big_dir, 8);
+		clusters += c;
+		ebs += plan_ebs(fs, c);
+		inodes += gv->gv_big_dir + 1;
+	}
+
+	if (gv->gv_deep) {
+		clusters += (gv->gv_deep + 1) * plan_dir(fs, 1, 4) + 1;
+		inodes += gv->gv_deep + 2;
+	}
+
+	if (gv->gv_frag_files) {
+		c = plan_dir(fs, gv->gv_frag_files, 4);
+		clusters += c + (uint64_t)gv->gv_frag_files *
+				gv->gv_frag_extents;
+		ebs += plan_ebs(fs, c) + gv->gv_frag_files *
+					 plan_ebs(fs, gv->gv_frag_extents);
+		inodes += gv->gv_frag_files + 1;
+	}
+
+	ret = plan_sub_alloc(fs, INODE_ALLOC_SYSTEM_INODE, inodes, &sub);
+	if (ret)
+		return ret;
+	clusters += sub;
+	ret = plan_sub_alloc(fs, EXTENT_ALLOC_SYSTEM_INODE, ebs, &sub);
+	if (ret)
+		return ret;
+	clusters += sub;
+
+	/* Slack for what the estimates miss */
+	*need = clusters + clusters / 50 + 16;
+	return 0;
+}
+
+/* Cut count by a quarter, down to min; 0 when it is there already */
+static int shrink(int *count, int min)
+{
+	if (*count <= min)
+		return 0;
+	*count = *count * 3 / 4;
+	if (*count < min)
+		*count = min;
+	return 1;
+}
+
+/*
+ * Shrink the counts gv_scale allows until the tree fits the free
+ * clusters of the volume.  *need is what the final tree takes and
+ * *avail what the volume has.
+ */
+static errcode_t fit_tree(struct genvol_ctxt *gv, uint64_t *need,
+			  uint64_t *avail)
+{
+	cmfs_group_summary *sm;
+	int shrunk;
+	errcode_t ret;
+
+	ret = cmfs_build_group_summary(gv->gv_fs, GLOBAL_BITMAP_SYSTEM_INODE,
+				       &sm);
+	if (ret)
+		return ret;
+	*avail = sm->sm_free_bits;
+	cmfs_close_group_summary(sm);
+
+	for (;;) {
+		ret = plan(gv, need);
+		if (ret || (*need <= *avail))
+			return ret;
+
+		shrunk = 0;
+		if (gv->gv_scale & GENVOL_SCALE_TRACKS)
+			shrunk |= shrink(&gv->gv_tracks, 1);
+		if (gv->gv_scale & GENVOL_SCALE_BIG_DIR)
+			shrunk |= shrink(&gv->gv_big_dir, 1);
+		if (gv->gv_scale & GENVOL_SCALE_FRAG)
+			shrunk |= shrink(&gv->gv_frag_files, 1);
+		if (!shrunk)
+			return 0;
+	}
+}
+
+static void print_layout(struct genvol_ctxt *gv, const char *device,
+			 double secs)
+{
+	int i;
+
+	fprintf(stdout, "device %s\n", device);
+	fprintf(stdout, "clustersize %u\n", gv->gv_fs->fs_clustersize);
+	fprintf(stdout, "files %lu\n", gv->gv_files);
+	fprintf(stdout, "dirs %lu\n", gv->gv_dirs);
+	fprintf(stdout, "bytes %"PRIu64"\n", gv->gv_bytes);
+	fprintf(stdout, "extents %"PRIu64"\n", gv->gv_extents);
+	fprintf(stdout, "max_tree_depth %d\n", gv->gv_max_depth);
+	fprintf(stdout, "data %s\n", gv->gv_write_data ? "pattern" : "none");
+
+	fprintf(stdout, "library /library");
+	for (i = 0; i < gv->gv_levels; i++)
+		fprintf(stdout, " %d", gv->gv_fanout);
+	fprintf(stdout, " %d\n", gv->gv_tracks);
+	if (gv->gv_big_dir)
+		fprintf(stdout, "bigdir /bigdir %d\n", gv->gv_big_dir);
+	if (gv->gv_deep) {
+		fprintf(stdout, "deep /deep");
+		for (i = 0; i < gv->gv_deep; i++)
+			fprintf(stdout, "/d%02d", i);
+		fprintf(stdout, "/leaf\n");
+	}
+	if (gv->gv_frag_files)
+		fprintf(stdout, "frag /frag %d %d\n", gv->gv_frag_files,
+			gv->gv_frag_extents);
+	fprintf(stdout, "seconds %.1f\n", secs);
+}
+
+int main(int argc, char **argv)
+{
+	struct genvol_ctxt gv;
+	struct timeval start, end;
+	char *device, *mkfs = "mkfs.cmfs", *cluster_size = NULL;
+	unsigned long size_mb = 0;
+	uint64_t need, avail;
+	int c, i, rc = 0;
+	errcode_t ret, ret2;
+
+	initialize_cmfs_error_table();
+
+	memset(&gv, 0, sizeof(gv));
+	gv.gv_seed = 2012;
+	gv.gv_levels = 2;
+	gv.gv_fanout = 8;
+	gv.gv_tracks = 12;
+	gv.gv_min_kb = 64;
+	gv.gv_max_kb = 4096;
+	gv.gv_frag_pct = 10;
+	gv.gv_frag_pieces = 8;
+	gv.gv_big_dir = 10000;
+	gv.gv_deep = 32;
+	gv.gv_frag_files = 16;
+	gv.gv_frag_extents = 2048;
+	gv.gv_scale = GENVOL_SCALE_TRACKS | GENVOL_SCALE_BIG_DIR |
+		      GENVOL_SCALE_FRAG;
+
+	while ((c = getopt(argc, argv, "s:C:M:S:l:f:t:k:K:F:p:B:P:q:x:D")) !=
+	       EOF) {
+		switch (c) {
+		case 's':
+			size_mb = strtoul(optarg, NULL, 0);
+			break;
+		case 'C':
+			cluster_size = optarg;
+			break;
+		case 'M':
+			mkfs = optarg;
+			break;
+		case 'S':
+			gv.gv_seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			gv.gv_levels = atoi(optarg);
+			break;
+		case 'f':
+			gv.gv_fanout = atoi(optarg);
+			break;
+		case 't':
+			gv.gv_tracks = atoi(optarg);
+			gv.gv_scale &= ~GENVOL_SCALE_TRACKS;
+			break;
+		case 'k':
+			gv.gv_min_kb = strtoull(optarg, NULL, 0);
+			break;
+		case 'K':
+			gv.gv_max_kb = strtoull(optarg, NULL, 0);
+			break;
+		case 'F':
+			gv.gv_frag_pct = atoi(optarg);
+			break;
+		case 'p':
+			gv.gv_frag_pieces = atoi(optarg);
+			break;
+		case 'B':
+			gv.gv_big_dir = atoi(optarg);
+			gv.gv_scale &= ~GENVOL_SCALE_BIG_DIR;
+			break;
+		case 'P':
+			gv.gv_deep = atoi(optarg);
+			break;
+		case 'q':
+			gv.gv_frag_files = atoi(optarg);
+			gv.gv_scale &= ~GENVOL_SCALE_FRAG;
+			break;
+		case 'x':
+			gv.gv_frag_extents = atoi(optarg);
+			break;
+		case 'D':
+			gv.gv_write_data = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if ((optind != argc - 1) || !gv.gv_seed || (gv.gv_levels < 0) ||
+	    (gv.gv_levels > 26) || (gv.gv_fanout <= 0) ||
+	    (gv.gv_tracks < 0) || (gv.gv_min_kb > gv.gv_max_kb) ||
+	    (gv.gv_frag_pct < 0) || (gv.gv_frag_pct > 100) ||
+	    (gv.gv_frag_pieces < 2) || (gv.gv_big_dir < 0) ||
+	    (gv.gv_deep < 0) || (gv.gv_deep > 100) ||
+	    (gv.gv_frag_files < 0) || (gv.gv_frag_extents <= 0))
+		usage();
+	device = argv[optind];
+	/* Only a volume made here is fitted, an existing one is checked */
+	if (!size_mb)
+		gv.gv_scale = 0;
+	gv.gv_size_seed = gv.gv_seed * 2654435761U;
+
+	if (size_mb && format_volume(mkfs, device, size_mb, cluster_size))
+		return 1;
+
+	ret = cmfs_open(device, CMFS_FLAG_RW, 0, CMFS_MAX_BLOCKSIZE,
+			&gv.gv_fs);
+	if (ret) {
+		com_err(progname, ret, "while opening \"%s\"", device);
+		return 1;
+	}
+	gv.gv_max_extent = UINT32_MAX / cmfs_clusters_to_blocks(gv.gv_fs, 1);
+
+	ret = cmfs_open_allocator(gv.gv_fs, GLOBAL_BITMAP_SYSTEM_INODE,
+				  &gv.gv_cluster_ca);
+	if (!ret)
+		ret = cmfs_open_allocator(gv.gv_fs, INODE_ALLOC_SYSTEM_INODE,
+					  &gv.gv_inode_ca);
+	if (!ret)
+		ret = cmfs_open_allocator(gv.gv_fs, EXTENT_ALLOC_SYSTEM_INODE,
+					  &gv.gv_eb_ca);
+	if (ret) {
+		com_err(progname, ret, "while loading the allocators");
+		rc = 1;
+		goto out;
+	}
+
+	ret = fit_tree(&gv, &need, &avail);
+	if (ret) {
+		com_err(progname, ret, "while planning the volume");
+		rc = 1;
+		goto out;
+	}
+	if (need > avail) {
+		fprintf(stderr, "%s: volume too small, need %"PRIu64" MB\n",
+			progname, ((gv.gv_fs->fs_clusters - avail + need) *
+				   gv.gv_fs->fs_clustersize + (1 << 20) - 1) >>
+				  20);
+		rc = 1;
+		goto out;
+	}
+
+	if (gv.gv_write_data) {
+		ret = cmfs_malloc_blocks(gv.gv_fs->fs_io, GENVOL_IO_BLOCKS,
+					 &gv.gv_data);
+		if (ret) {
+			com_err(progname, ret, "while allocating the data");
+			rc = 1;
+			goto out;
+		}
+		for (i = 0; i < GENVOL_IO_BLOCKS * gv.gv_fs->fs_blocksize; i++)
+			gv.gv_data[i] = i * 31 + (i >> 12);
+	}
+
+	gettimeofday(&start, NULL);
+	ret = build_tree(&gv);
+	ret2 = cmfs_allocator_flush(gv.gv_eb_ca);
+	if (!ret2)
+		ret2 = cmfs_allocator_flush(gv.gv_inode_ca);
+	if (!ret2)
+		ret2 = cmfs_allocator_flush(gv.gv_cluster_ca);
+	if (!ret)
+		ret = ret2;
+	gettimeofday(&end, NULL);
+	if (ret) {
+		com_err(progname, ret, "while building the volume, after %lu "
+			"files", gv.gv_files);
+		rc = 1;
+	}
+
+	print_layout(&gv, device, (end.tv_sec - start.tv_sec) +
+		     (end.tv_usec - start.tv_usec) / 1000000.0);
+
+out:
+	if (gv.gv_data)
+		cmfs_free(&gv.gv_data);
+	cmfs_close_allocator(gv.gv_eb_ca);
+	cmfs_close_allocator(gv.gv_inode_ca);
+	cmfs_close_allocator(gv.gv_cluster_ca);
+	ret = cmfs_close(gv.gv_fs);
+	if (ret) {
+		com_err(progname, ret, "while closing \"%s\"", device);
+		rc = 1;
+	}
+	return rc;
+}
@@ -0,0 +1,355 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * cmfs_mmapbench.c
+ *
+ * Compare block reads through the pread + io_cache channel with the
+ * CMFS_FLAG_MMAP channel, on a volume image.
+ *
+ * Copyright (C) 2012, Coly Li <i@coly.li>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Every method reads the same blocks twice, the second pass showing
+ * what a warm cache gives.  The sequential pattern reads the first -m
+ * MB in runs of -b blocks, the random one reads -n single blocks at
+ * random over the same range, the way metadata is read.  The methods:
+ *
+ *   pread+cache  io_read_block() on an O_DIRECT channel with a -c MB
+ *                io_cache, what the tools use today
+ *   mmap copy    io_read_block() on a CMFS_FLAG_MMAP channel
+ *   mmap borrow  io_map_block() on the same channel, no copy
+ *
+ * Each block read is folded into a checksum, so a borrowed pointer is
+ * really read too, and all methods must agree on it.
+ */
+
+#define _XOPEN_SOURCE 600
+#define _LARGEFILE64_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+
+#include <cmfs/cmfs.h>
+#include "../libcmfs/cmfs_err.h"
+
+enum mmapbench_method {
+	MMAPBENCH_PREAD,
+	MMAPBENCH_MMAP_COPY,
+	MMAPBENCH_MMAP_BORROW,
+	MMAPBENCH_METHODS,
+};
+
+static const char *method_names[MMAPBENCH_METHODS] = {
+	"pread+cache",
+	"mmap copy",
+	"mmap borrow",
+};
+
+enum mmapbench_pattern {
+	MMAPBENCH_SEQUENTIAL,
+	MMAPBENCH_RANDOM,
+	MMAPBENCH_PATTERNS,
+};
+
+static const char *pattern_names[MMAPBENCH_PATTERNS] = {
+	"sequential",
+	"random",
+};
+
+struct mmapbench_ctxt {
+	char *mb_device;
+	int mb_blksize;
+	uint64_t mb_blocks;	/* the range read, in blocks */
+	int mb_run;		/* blocks per sequential read */
+	unsigned long mb_random;
+	unsigned long mb_cache_mb;
+	uint32_t mb_seed;
+
+	uint64_t mb_sums[MMAPBENCH_PATTERNS];
+	int mb_have_sums[MMAPBENCH_PATTERNS];
+};
+
+static char *progname = "cmfs_mmapbench";
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-m mb] [-b run_blocks] [-n random_reads]\n"
+		"       [-c cache_mb] [-s seed] <image>\n",
+		progname);
+	exit(1);
+}
+
+static uint32_t mmapbench_rand(uint32_t *seed)
+{
+	/* xorshift32, as cmfs_mtbench */
+	uint32_t x = *seed;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*seed = x;
+	return x;
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* One word from every 512 bytes, enough to touch each page */
+static uint64_t fold(const char *buf, int len, uint64_t sum)
+{
+	int i;
+
+	for (i = 0; i < len; i += 512)
+		sum = (sum << 1 | sum >> 63) ^ *(const uint64_t *)(buf + i);
+	return sum;
+}
+
+static errcode_t read_run(io_channel *io, enum mmapbench_method method,
+			  uint64_t blkno, int count, char *buf, uint64_t *sum)
+{
+	const char *data = buf;
+	errcode_t ret;
+
+	if (method == MMAPBENCH_MMAP_BORROW)
+		ret = io_map_block(io, blkno, count, &data);
+	else
+		ret = io_read_block(io, blkno, count, buf);
+	if (!ret)
+		*sum = fold(data, count * io_get_blksize(io), *sum);
+	return ret;
+}
+
+static errcode_t run_pass(struct mmapbench_ctxt *mb, io_channel *io,
+			  enum mmapbench_method method,
+			  enum mmapbench_pattern pattern, char *buf,
+			  uint64_t *sum, unsigned long *reads)
+{
+	uint32_t seed = mb->mb_seed;
+	uint64_t blkno;
+	unsigned long i;
+	int count;
+	errcode_t ret = 0;
+
+	*sum = 0;
+	*reads = 0;
+	if (pattern == MMAPBENCH_SEQUENTIAL) {
+		for (blkno = 0; blkno < mb->mb_blocks; blkno += count) {
+			count = mb->mb_run;
+			if (count > mb->mb_blocks - blkno)
+				count = mb->mb_blocks - blkno;
+			ret = read_run(io, method, blkno, count, buf, sum);
+			if (ret)
+				break;
+			(*reads)++;
+		}
+	} else {
+		for (i = 0; i < mb->mb_random; i++) {
+			blkno = mmapbench_rand(&seed) % mb->mb_blocks;
+			ret = read_run(io, method, blkno, 1, buf, sum);
+			if (ret)
+				break;
+			(*reads)++;
+		}
+	}
+
+	return ret;
+}
+
+static int run_method(struct mmapbench_ctxt *mb,
+		      enum mmapbench_method method)
+{
+	int flags = CMFS_FLAG_RO, pass, rc = 0;
+	enum mmapbench_pattern pattern;
+	io_channel *io = NULL;
+	char *buf = NULL;
+	unsigned long reads;
+	double start, elapsed, mbs[2], us;
+	uint64_t sum, bytes;
+	errcode_t ret;
+
+	if (method != MMAPBENCH_PREAD)
+		flags |= CMFS_FLAG_MMAP;
+
+	ret = io_open(mb->mb_device, flags, &io);
+	if (ret) {
+		com_err(progname, ret, "while opening \"%s\" for %s",
+			mb->mb_device, method_names[method]);
+		return -1;
+	}
+	io_set_blksize(io, mb->mb_blksize);
+
+	if (method == MMAPBENCH_PREAD) {
+		ret = io_init_cache_size(io, mb->mb_cache_mb * 1024 * 1024);
+		if (ret) {
+			com_err(progname, ret, "while creating a %luMB cache",
+				mb->mb_cache_mb);
+			rc = -1;
+			goto out;
+		}
+	}
+
+	ret = cmfs_malloc_blocks(io, mb->mb_run, &buf);
+	if (ret) {
+		com_err(progname, ret, "while allocating the read buffer");
+		rc = -1;
+		goto out;
+	}
+
+	for (pattern = 0; pattern < MMAPBENCH_PATTERNS; pattern++) {
+		io_advise(io, 0, 0, pattern == MMAPBENCH_SEQUENTIAL ?
+			  CMFS_IO_ADVISE_SEQUENTIAL : CMFS_IO_ADVISE_RANDOM);
+
+		for (pass = 0; pass < 2; pass++) {
+			start = now();
+			ret = run_pass(mb, io, method, pattern, buf, &sum,
+				       &reads);
+			elapsed = now() - start;
+			if (ret) {
+				com_err(progname, ret, "while reading for "
+					"%s %s", method_names[method],
+					pattern_names[pattern]);
+				rc = -1;
+				goto out;
+			}
+
+			bytes = (pattern == MMAPBENCH_SEQUENTIAL) ?
+				mb->mb_blocks : reads;
+			bytes *= mb->mb_blksize;
+			mbs[pass] = bytes / elapsed / (1024 * 1024);
+		}
+		us = elapsed * 1000000.0 / reads;
+
+		fprintf(stdout, "%-12s %-10s %12.1f %12.1f %10.2f\n",
+			method_names[method], pattern_names[pattern], mbs[0],
+			mbs[1], us);
+
+		if (!mb->mb_have_sums[pattern]) {
+			mb->mb_sums[pattern] = sum;
+			mb->mb_have_sums[pattern] = 1;
+		} else if (mb->mb_sums[pattern] != sum) {
+			fprintf(stderr, "%s: %s %s read different data\n",
+				progname, method_names[method],
+				pattern_names[pattern]);
+			rc = -1;
+		}
+	}
+
+out:
+	if (buf)
+		cmfs_free(&buf);
+	io_close(io);
+	return rc;
+}
+
+int main(int argc, char **argv)
+{
+	struct mmapbench_ctxt mb;
+	enum mmapbench_method method;
+	unsigned long range_mb = 0;
+	uint64_t dev_blocks;
+	struct stat st;
+	int c, rc = 0;
+	errcode_t ret;
+
+	initialize_cmfs_error_table();
+
+	memset(&mb, 0, sizeof(mb));
+	mb.mb_blksize = CMFS_MAX_BLOCKSIZE;
+	mb.mb_run = 256;
+	mb.mb_random = 200000;
+	mb.mb_cache_mb = 64;
+	mb.mb_seed = 2012;
+
+	while ((c = getopt(argc, argv, "m:b:n:c:s:")) != EOF) {
+		switch (c) {
+		case 'm':
+			range_mb = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			mb.mb_run = atoi(optarg);
+			break;
+		case 'n':
+			mb.mb_random = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			mb.mb_cache_mb = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			mb.mb_seed = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if ((optind != argc - 1) || (mb.mb_run <= 0) || !mb.mb_random ||
+	    !mb.mb_cache_mb || !mb.mb_seed)
+		usage();
+	mb.mb_device = argv[optind];
+
+	/* cmfs_get_device_size() only knows block devices */
+	if (stat(mb.mb_device, &st)) {
+		com_err(progname, errno, "while opening \"%s\"", mb.mb_device);
+		return 1;
+	}
+	if (S_ISREG(st.st_mode))
+		dev_blocks = st.st_size / mb.mb_blksize;
+	else {
+		ret = cmfs_get_device_size(mb.mb_device, mb.mb_blksize,
+					   &dev_blocks);
+		if (ret) {
+			com_err(progname, ret, "while getting the size of "
+				"\"%s\"", mb.mb_device);
+			return 1;
+		}
+	}
+	mb.mb_blocks = dev_blocks;
+	if (range_mb &&
+	    (range_mb * 1024 * 1024 / mb.mb_blksize < mb.mb_blocks))
+		mb.mb_blocks = range_mb * 1024 * 1024 / mb.mb_blksize;
+	if (!mb.mb_blocks) {
+		fprintf(stderr, "%s: \"%s\" is empty\n", progname,
+			mb.mb_device);
+		return 1;
+	}
+
+	fprintf(stdout, "%s: %"PRIu64" MB read in runs of %d blocks, "
+		"%lu random blocks, %lu MB cache\n", mb.mb_device,
+		mb.mb_blocks * mb.mb_blksize / (1024 * 1024), mb.mb_run,
+		mb.mb_random, mb.mb_cache_mb);
+	fprintf(stdout, "%-12s %-10s %12s %12s %10s\n", "method", "pattern",
+		"MB/s first", "MB/s again", "us/read");
+
+	for (method = 0; method < MMAPBENCH_METHODS; method++)
+		if (run_method(&mb, method))
+			rc = 1;
+
+	return rc;
+}
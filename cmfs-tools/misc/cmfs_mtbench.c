@@ -0,0 +1,420 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * cmfs_mtbench.c
+ *
+ * Multi-threaded stress and throughput benchmark for libcmfs opened
+ * with CMFS_FLAG_THREADED.
+ *
+ * Copyright (C) 2012, Coly Li <i@coly.li>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * The benchmark collects the inodes of the root and system directories,
+ * then runs 1, 2, 4 ... max threads against the same cmfs_filesys for a
+ * fixed time each.  Every thread either reads random inodes with
+ * cmfs_read_inode() (and checks i_blkno, which catches a torn cache
+ * block), or reads random chunks of random files with cmfs_file_read().
+ * Throughput and the speedup over one thread are printed per round.
+ */
+
+#define _XOPEN_SOURCE 600
+#define _LARGEFILE64_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+
+#include <cmfs/cmfs.h>
+#include "../libcmfs/cmfs_err.h"
+
+#define MTBENCH_MAX_INODES	4096
+
+enum mtbench_mode {
+	MTBENCH_INODE,
+	MTBENCH_FILE,
+};
+
+struct mtbench_inode {
+	uint64_t mi_blkno;
+	uint64_t mi_size;
+};
+
+struct mtbench_ctxt {
+	cmfs_filesys *mc_fs;
+	enum mtbench_mode mc_mode;
+	uint32_t mc_chunk;
+	struct mtbench_inode mc_inodes[MTBENCH_MAX_INODES];
+	int mc_nr_inodes;
+	int mc_nr_files;	/* inodes with data, sorted first */
+	volatile int mc_stop;
+};
+
+struct mtbench_thread {
+	pthread_t mt_thread;
+	struct mtbench_ctxt *mt_ctxt;
+	uint32_t mt_seed;
+	uint64_t mt_ops;
+	uint64_t mt_bytes;
+	uint64_t mt_errors;
+};
+
+static char *progname = "cmfs_mtbench";
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-m inode|file] [-t max_threads] [-s seconds]\n"
+		"       [-c cache_mb] [-b chunk_kb] [-u] <device>\n"
+		"  -u  open without CMFS_FLAG_THREADED (single thread only)\n",
+		progname);
+	exit(1);
+}
+
+static uint32_t mtbench_rand(uint32_t *seed)
+{
+	/* xorshift32, good enough to pick blocks */
+	uint32_t x = *seed;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*seed = x;
+	return x;
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static int collect_inode(struct cmfs_dir_entry *dirent,
+			 uint64_t blocknr,
+			 int offset,
+			 int blocksize,
+			 char *buf,
+			 void *priv_data)
+{
+	struct mtbench_ctxt *ctxt = priv_data;
+	int i;
+
+	if (ctxt->mc_nr_inodes == MTBENCH_MAX_INODES)
+		return CMFS_DIRENT_ABORT;
+
+	for (i = 0; i < ctxt->mc_nr_inodes; i++)
+		if (ctxt->mc_inodes[i].mi_blkno == dirent->inode)
+			return 0;
+
+	ctxt->mc_inodes[ctxt->mc_nr_inodes++].mi_blkno = dirent->inode;
+	return 0;
+}
+
+static errcode_t collect_inodes(struct mtbench_ctxt *ctxt)
+{
+	errcode_t ret;
+	int i;
+	char *buf = NULL;
+	struct cmfs_dinode *di;
+	struct mtbench_inode tmp;
+	cmfs_filesys *fs = ctxt->mc_fs;
+
+	ret = cmfs_dir_iterate(fs, fs->fs_root_blkno, 0, NULL,
+			       collect_inode, ctxt);
+	if (ret)
+		goto out;
+	ret = cmfs_dir_iterate(fs, fs->fs_sysdir_blkno, 0, NULL,
+			       collect_inode, ctxt);
+	if (ret)
+		goto out;
+
+	ret = cmfs_malloc_block(fs->fs_io, &buf);
+	if (ret)
+		goto out;
+
+	/*
+	 * Move extent mapped inodes with data to the front.  Chain and
+	 * local allocators keep other things in id2.
+	 */
+	for (i = 0; i < ctxt->mc_nr_inodes; i++) {
+		ret = cmfs_read_inode(fs, ctxt->mc_inodes[i].mi_blkno, buf);
+		if (ret)
+			goto out;
+		di = (struct cmfs_dinode *)buf;
+		if ((!S_ISREG(di->i_mode) && !S_ISDIR(di->i_mode)) ||
+		    !di->i_size)
+			continue;
+		if (di->i_flags & (CMFS_SUPER_BLOCK_FL | CMFS_LOCAL_ALLOC_FL |
+				   CMFS_CHAIN_FL | CMFS_DEALLOC_FL))
+			continue;
+
+		ctxt->mc_inodes[i].mi_size = di->i_size;
+		tmp = ctxt->mc_inodes[ctxt->mc_nr_files];
+		ctxt->mc_inodes[ctxt->mc_nr_files++] = ctxt->mc_inodes[i];
+		ctxt->mc_inodes[i] = tmp;
+	}
+
+out:
+	if (buf)
+		cmfs_free(&buf);
+	return ret;
+}
+
+static void bench_inode(struct mtbench_thread *mt, char *buf)
+{
+	errcode_t ret;
+	struct mtbench_ctxt *ctxt = mt->mt_ctxt;
+	struct mtbench_inode *mi;
+	struct cmfs_dinode *di = (struct cmfs_dinode *)buf;
+
+	mi = &ctxt->mc_inodes[mtbench_rand(&mt->mt_seed) %
+			      ctxt->mc_nr_inodes];
+	ret = cmfs_read_inode(ctxt->mc_fs, mi->mi_blkno, buf);
+	if (ret || (di->i_blkno != mi->mi_blkno))
+		mt->mt_errors++;
+	mt->mt_ops++;
+	mt->mt_bytes += ctxt->mc_fs->fs_blocksize;
+}
+
+static void bench_file(struct mtbench_thread *mt, char *buf)
+{
+	errcode_t ret;
+	uint32_t got = 0;
+	uint64_t chunks, offset;
+	cmfs_cached_inode *ci = NULL;
+	struct mtbench_ctxt *ctxt = mt->mt_ctxt;
+	struct mtbench_inode *mi;
+
+	mi = &ctxt->mc_inodes[mtbench_rand(&mt->mt_seed) %
+			      ctxt->mc_nr_files];
+	chunks = (mi->mi_size + ctxt->mc_chunk - 1) / ctxt->mc_chunk;
+	offset = (mtbench_rand(&mt->mt_seed) % chunks) * ctxt->mc_chunk;
+
+	ret = cmfs_read_cached_inode(ctxt->mc_fs, mi->mi_blkno, &ci);
+	if (!ret)
+		ret = cmfs_file_read(ci, buf, ctxt->mc_chunk, offset, &got);
+	if (ret)
+		mt->mt_errors++;
+	if (ci)
+		cmfs_free_cached_inode(ctxt->mc_fs, ci);
+	mt->mt_ops++;
+	mt->mt_bytes += got;
+}
+
+static void *bench_thread(void *arg)
+{
+	struct mtbench_thread *mt = arg;
+	struct mtbench_ctxt *ctxt = mt->mt_ctxt;
+	char *buf;
+	int blocks;
+
+	blocks = ctxt->mc_chunk / ctxt->mc_fs->fs_blocksize;
+	if (cmfs_malloc_blocks(ctxt->mc_fs->fs_io, blocks, &buf)) {
+		mt->mt_errors++;
+		return NULL;
+	}
+
+	while (!ctxt->mc_stop) {
+		if (ctxt->mc_mode == MTBENCH_INODE)
+			bench_inode(mt, buf);
+		else
+			bench_file(mt, buf);
+	}
+
+	cmfs_free(&buf);
+	return NULL;
+}
+
+static int run_round(struct mtbench_ctxt *ctxt, int nr_threads,
+		     int seconds, double base, double *rate)
+{
+	int i, rc = 0;
+	double start, elapsed;
+	uint64_t ops = 0, bytes = 0, errors = 0;
+	struct mtbench_thread *mts;
+
+	mts = calloc(nr_threads, sizeof(struct mtbench_thread));
+	if (!mts)
+		return -1;
+
+	ctxt->mc_stop = 0;
+	start = now();
+	for (i = 0; i < nr_threads; i++) {
+		mts[i].mt_ctxt = ctxt;
+		mts[i].mt_seed = 2463534242U + i * 7919;
+		if (pthread_create(&mts[i].mt_thread, NULL, bench_thread,
+				   &mts[i])) {
+			nr_threads = i;
+			rc = -1;
+			break;
+		}
+	}
+
+	sleep(seconds);
+	ctxt->mc_stop = 1;
+
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(mts[i].mt_thread, NULL);
+		ops += mts[i].mt_ops;
+		bytes += mts[i].mt_bytes;
+		errors += mts[i].mt_errors;
+	}
+	elapsed = now() - start;
+
+	*rate = ops / elapsed;
+	fprintf(stdout, "%7d %12.0f %10.1f %8.2f %8"PRIu64"\n",
+		nr_threads, *rate, bytes / elapsed / (1024 * 1024),
+		base ? *rate / base : 1.0, errors);
+
+	if (errors)
+		rc = -1;
+	free(mts);
+	return rc;
+}
+
+int main(int argc, char **argv)
+{
+	errcode_t ret;
+	int c, rc = 0, threads, max_threads = 0, seconds = 5;
+	int flags = CMFS_FLAG_RO | CMFS_FLAG_THREADED;
+	unsigned long cache_mb = 64;
+	double rate = 0, base = 0;
+	char *device;
+	struct mtbench_ctxt *ctxt;
+	struct cmfs_io_stats stats;
+
+	initialize_cmfs_error_table();
+
+	ctxt = calloc(1, sizeof(struct mtbench_ctxt));
+	if (!ctxt) {
+		com_err(progname, CMFS_ET_NO_MEMORY, "while starting up");
+		return 1;
+	}
+	ctxt->mc_mode = MTBENCH_INODE;
+	ctxt->mc_chunk = 64 * 1024;
+
+	while ((c = getopt(argc, argv, "m:t:s:c:b:u")) != EOF) {
+		switch (c) {
+		case 'm':
+			if (!strcmp(optarg, "inode"))
+				ctxt->mc_mode = MTBENCH_INODE;
+			else if (!strcmp(optarg, "file"))
+				ctxt->mc_mode = MTBENCH_FILE;
+			else
+				usage();
+			break;
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 'c':
+			cache_mb = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			ctxt->mc_chunk = strtoul(optarg, NULL, 0) * 1024;
+			break;
+		case 'u':
+			flags &= ~CMFS_FLAG_THREADED;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind != argc - 1 || seconds <= 0)
+		usage();
+	device = argv[optind];
+
+	if (max_threads <= 0)
+		max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (!(flags & CMFS_FLAG_THREADED))
+		max_threads = 1;
+
+	ret = cmfs_open(device, flags, 0, CMFS_MAX_BLOCKSIZE, &ctxt->mc_fs);
+	if (ret) {
+		com_err(progname, ret, "while opening \"%s\"", device);
+		return 1;
+	}
+
+	if (!ctxt->mc_chunk || (ctxt->mc_chunk % ctxt->mc_fs->fs_blocksize)) {
+		fprintf(stderr, "%s: chunk must be a multiple of %u bytes\n",
+			progname, ctxt->mc_fs->fs_blocksize);
+		rc = 1;
+		goto out;
+	}
+
+	if (cache_mb) {
+		ret = io_init_cache_size(ctxt->mc_fs->fs_io,
+					 cache_mb * 1024 * 1024);
+		if (ret) {
+			com_err(progname, ret, "while creating a %luMB cache",
+				cache_mb);
+			rc = 1;
+			goto out;
+		}
+	}
+
+	ret = collect_inodes(ctxt);
+	if (ret) {
+		com_err(progname, ret, "while collecting inodes");
+		rc = 1;
+		goto out;
+	}
+	if (!ctxt->mc_nr_inodes ||
+	    ((ctxt->mc_mode == MTBENCH_FILE) && !ctxt->mc_nr_files)) {
+		fprintf(stderr, "%s: no inodes to read\n", progname);
+		rc = 1;
+		goto out;
+	}
+
+	fprintf(stdout, "%s: %s mode, %d inodes (%d with data), "
+		"%lu MB cache, %s\n", device,
+		ctxt->mc_mode == MTBENCH_INODE ? "inode" : "file",
+		ctxt->mc_nr_inodes, ctxt->mc_nr_files, cache_mb,
+		(flags & CMFS_FLAG_THREADED) ? "threaded" : "unthreaded");
+	fprintf(stdout, "%7s %12s %10s %8s %8s\n",
+		"threads", "ops/s", "MB/s", "speedup", "errors");
+
+	for (threads = 1; threads <= max_threads; threads <<= 1) {
+		if (run_round(ctxt, threads, seconds, base, &rate))
+			rc = 1;
+		if (!base)
+			base = rate;
+		if ((threads < max_threads) && ((threads << 1) > max_threads))
+			threads = max_threads >> 1;
+	}
+
+	cmfs_get_stats(ctxt->mc_fs, &stats);
+	fprintf(stdout, "cache: %u hits, %u misses; "
+		"inode cache: %u hits, %u misses\n",
+		stats.is_cache_hits, stats.is_cache_misses,
+		stats.is_icache_hits, stats.is_icache_misses);
+
+out:
+	cmfs_close(ctxt->mc_fs);
+	free(ctxt);
+	return rc;
+}
@@ -0,0 +1,156 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * cmfs_probe.c
+ *
+ * List the CMFS volumes on the block devices of this node.
+ *
+ * Copyright (C) 2012, Coly Li <i@coly.li>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * The devices come from scan_for_dev() and are probed -t at a time by
+ * probe_cmfs_devices(), giving up on those that take more than -T ms.
+ * With -r the scan is repeated on the same device list, results for
+ * unchanged devices then come from its cache, as a daemon would see.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/time.h>
+#include <sys/param.h>
+
+#include <tools-internal/scandisk.h>
+#include <tools-internal/probe.h>
+
+static char *progname = "cmfs_probe";
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-a] [-t threads] [-T timeout_ms] [-r rounds] "
+		"[-v]\n"
+		"  -a  list every device probed, not only CMFS ones\n"
+		"  -v  print how long each round took\n",
+		progname);
+	exit(1);
+}
+
+static const char *status_name(struct devprobe *dp)
+{
+	switch (dp->dp_status) {
+	case DEVPROBE_CMFS:
+		return "cmfs";
+	case DEVPROBE_NOT_CMFS:
+		return "-";
+	case DEVPROBE_TIMEDOUT:
+		return "timedout";
+	default:
+		return strerror(dp->dp_error);
+	}
+}
+
+static void print_devices(struct devlisthead *devlisthead, int all)
+{
+	struct devnode *node;
+	struct devprobe *dp;
+	char uuid[CMFS_VOL_UUID_LEN * 2 + 1];
+	int i;
+
+	fprintf(stdout, "%-24s %-9s %10s %-8s %-32s %s\n", "Device",
+		"Maj:Min", "Size MB", "Status", "UUID", "Label");
+
+	for (node = devlisthead->devnode; node; node = node->next) {
+		dp = node->probe;
+		if (!dp || (!all && dp->dp_status != DEVPROBE_CMFS))
+			continue;
+
+		uuid[0] = '\0';
+		if (dp->dp_status == DEVPROBE_CMFS)
+			for (i = 0; i < CMFS_VOL_UUID_LEN; i++)
+				sprintf(uuid + i * 2, "%02X", dp->dp_uuid[i]);
+
+		fprintf(stdout, "%-24s %4d:%-4d %10"PRIu64" %-8s %-32s %s\n",
+			dp->dp_path, dp->dp_maj, dp->dp_min,
+			dp->dp_size >> 20, status_name(dp), uuid,
+			dp->dp_label);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct devlisthead *devlisthead = NULL;
+	struct timeval start, end;
+	int threads = DEVPROBE_THREADS, timeout_ms = DEVPROBE_TIMEOUT_MS;
+	int rounds = 1, all = 0, verbose = 0;
+	int c, round, found;
+
+	while ((c = getopt(argc, argv, "at:T:r:v")) != EOF) {
+		switch (c) {
+		case 'a':
+			all = 1;
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'T':
+			timeout_ms = atoi(optarg);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind != argc || threads <= 0 || timeout_ms <= 0 || rounds <= 0)
+		usage();
+
+	for (round = 0; round < rounds; round++) {
+		gettimeofday(&start, NULL);
+
+		/* 0 keeps the default cache timeout */
+		devlisthead = scan_for_dev(devlisthead, 0, NULL, NULL);
+		if (!devlisthead) {
+			fprintf(stderr, "%s: unable to scan the devices\n",
+				progname);
+			return 1;
+		}
+
+		found = probe_cmfs_devices(devlisthead, threads, timeout_ms);
+		if (found < 0) {
+			fprintf(stderr, "%s: unable to probe the devices\n",
+				progname);
+			free_dev_list(devlisthead);
+			return 1;
+		}
+
+		gettimeofday(&end, NULL);
+		if (round == rounds - 1)
+			print_devices(devlisthead, all);
+		if (verbose)
+			fprintf(stderr, "round %d: %d CMFS volumes in %.3f ms\n",
+				round, found,
+				(end.tv_sec - start.tv_sec) * 1000.0 +
+				(end.tv_usec - start.tv_usec) / 1000.0);
+	}
+
+	free_dev_list(devlisthead);
+	return 0;
+}
@@ -0,0 +1,614 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * cmfs_replay.c
+ *
+ * Replay an io_channel trace against a device or image, with any
+ * backend and cache setup, and report how it did.
+ *
+ * Copyright (C) 2012, Coly Li <i@coly.li>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Traces are taken by running any tool with CMFS_IO_TRACE=<file> in
+ * the environment, or with io_trace_start().  The calls in the trace
+ * are issued again, in order, as fast as they go or with -p at the
+ * pace they were recorded.  Calls are in the channel blocksize of
+ * their time; they are replayed in the last one, so the few reads made
+ * while probing for the superblock are rounded out to whole blocks.
+ *
+ * With -t threads the calls of recorded thread n go to replay thread
+ * n % threads.  Writes are only replayed with -w, and then write
+ * whatever the buffer holds, so -w is for scratch copies only.
+ *
+ * The trace is replayed -l times on the same channel; the first pass
+ * starts with a cold io_cache.  Each pass reports the rate, latency
+ * percentiles of the calls and the io_cache hit rate, next to the same
+ * figures from the trace.
+ */
+
+#define _XOPEN_SOURCE 600
+#define _LARGEFILE64_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <cmfs/cmfs.h>
+#include <cmfs/trace.h>
+#include "../libcmfs/cmfs_err.h"
+
+/* A call, in the replay blocksize */
+struct replay_call {
+	uint64_t rc_time;		/* ns after the first call */
+	uint64_t rc_blkno;
+	uint32_t rc_count;		/* blocks, or units of a vec read */
+	uint32_t rc_first;		/* vec read: its first unit */
+	uint32_t rc_latency;		/* recorded ns */
+	uint32_t rc_hits;		/* recorded */
+	uint8_t rc_op;
+	uint8_t rc_flags;
+	uint8_t rc_thread;
+};
+
+struct replay_unit {
+	uint64_t ru_blkno;
+	uint32_t ru_count;
+};
+
+struct replay_ctxt {
+	char *rp_device;
+	io_channel *rp_io;
+	int rp_blksize;
+	int rp_threads;
+	int rp_pace;
+	int rp_writes;
+
+	struct replay_call *rp_calls;
+	uint64_t rp_nr_calls;
+	struct replay_unit *rp_units;
+	uint64_t rp_nr_units;
+	uint32_t rp_max_blocks;		/* most any call reads or writes */
+	uint32_t rp_max_units;
+
+	uint32_t *rp_lat;		/* ns of each call, this pass */
+	uint64_t rp_start;		/* of this pass */
+};
+
+struct replay_thread {
+	pthread_t rt_thread;
+	struct replay_ctxt *rt_ctxt;
+	int rt_index;
+	uint64_t rt_calls;
+	uint64_t rt_blocks;
+	uint64_t rt_errors;
+	uint64_t rt_skipped;
+	errcode_t rt_ret;
+};
+
+static char *progname = "cmfs_replay";
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-c cache_mb] [-a max_cache_mb] [-B thp|hugetlb]\n"
+		"       [-m] [-t threads] [-l loops] [-p] [-w] <trace> <device>\n"
+		"  -c  io_cache size, 0 for none (default 64)\n"
+		"  -a  let the io_cache grow up to max_cache_mb\n"
+		"  -m  read through CMFS_FLAG_MMAP instead\n"
+		"  -p  keep the recorded pace between calls\n"
+		"  -w  replay writes too, over the data on <device>\n",
+		progname);
+	exit(1);
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_lat(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Turn a range in old blocks into whole new ones */
+static void rescale(uint64_t blkno, int32_t count, int old_bs, int new_bs,
+		    uint64_t *ret_blkno, uint32_t *ret_count)
+{
+	uint64_t start, end;
+
+	start = blkno * old_bs;
+	end = start + ((count < 0) ? -(int64_t)count :
+		       (int64_t)count * old_bs);
+	*ret_blkno = start / new_bs;
+	*ret_count = (end + new_bs - 1) / new_bs - *ret_blkno;
+}
+
+/*
+ * Load the trace into calls in the final blocksize.  Leading vec units
+ * whose call fell off the ring are dropped.
+ */
+static errcode_t load_trace(struct replay_ctxt *rp, const char *path,
+			    struct cmfs_trace_info *info)
+{
+	struct cmfs_trace_event *evs = NULL, *ev;
+	struct replay_call *rc = NULL;
+	struct replay_unit *ru;
+	cmfs_trace *trace = NULL;
+	uint64_t i, first_time = 0;
+	uint32_t blocks = 0;
+	int bs = 0, have_first = 0;
+	errcode_t ret;
+
+	ret = cmfs_open_trace(path, &trace);
+	if (ret)
+		return ret;
+	cmfs_trace_get_info(trace, info);
+	rp->rp_blksize = info->ti_blocksize;
+
+	ret = cmfs_malloc0(info->ti_nr_events * sizeof(*evs) + 1, &evs);
+	if (!ret)
+		ret = cmfs_malloc0(info->ti_nr_events * sizeof(*rp->rp_calls) + 1,
+				   &rp->rp_calls);
+	if (!ret)
+		ret = cmfs_malloc0(info->ti_nr_events * sizeof(*rp->rp_units) + 1,
+				   &rp->rp_units);
+	if (ret)
+		goto out;
+	ret = cmfs_trace_read(trace, 0, info->ti_nr_events, evs);
+	if (ret)
+		goto out;
+
+	/* The blocksize of the oldest record */
+	for (i = 0; i < info->ti_nr_events; i++) {
+		if (evs[i].te_op == CMFS_TRACE_BLKSIZE) {
+			bs = evs[i].te_blkno;
+			break;
+		}
+	}
+	if (!bs)
+		bs = rp->rp_blksize;
+
+	for (i = 0, ev = evs; i < info->ti_nr_events; i++, ev++) {
+		if (ev->te_op == CMFS_TRACE_BLKSIZE) {
+			bs = ev->te_count;
+			continue;
+		}
+
+		if (ev->te_flags & CMFS_TRACE_FL_CONT) {
+			if (!rc || (rc->rc_op != CMFS_TRACE_VEC_READ))
+				continue;
+			ru = &rp->rp_units[rp->rp_nr_units++];
+			rescale(ev->te_blkno, ev->te_count, bs, rp->rp_blksize,
+				&ru->ru_blkno, &ru->ru_count);
+			rc->rc_count++;
+			blocks += ru->ru_count;
+			if (blocks > rp->rp_max_blocks)
+				rp->rp_max_blocks = blocks;
+			if (rc->rc_count > rp->rp_max_units)
+				rp->rp_max_units = rc->rc_count;
+			continue;
+		}
+
+		if (!have_first) {
+			first_time = ev->te_time;
+			have_first = 1;
+		}
+		rc = &rp->rp_calls[rp->rp_nr_calls++];
+		rc->rc_time = ev->te_time - first_time;
+		rc->rc_latency = ev->te_latency;
+		rc->rc_hits = ev->te_hits;
+		rc->rc_op = ev->te_op;
+		rc->rc_flags = ev->te_flags;
+		rc->rc_thread = ev->te_thread;
+
+		if (ev->te_op == CMFS_TRACE_VEC_READ) {
+			rc->rc_first = rp->rp_nr_units;
+			rc->rc_count = 1;
+			ru = &rp->rp_units[rp->rp_nr_units++];
+			rescale(ev->te_blkno, ev->te_count, bs, rp->rp_blksize,
+				&ru->ru_blkno, &ru->ru_count);
+			blocks = ru->ru_count;
+		} else {
+			rescale(ev->te_blkno, ev->te_count, bs, rp->rp_blksize,
+				&rc->rc_blkno, &rc->rc_count);
+			blocks = rc->rc_count;
+		}
+		if (blocks > rp->rp_max_blocks)
+			rp->rp_max_blocks = blocks;
+		if (rc->rc_count > rp->rp_max_units)
+			rp->rp_max_units = rc->rc_count;
+	}
+
+out:
+	if (evs)
+		cmfs_free(&evs);
+	cmfs_close_trace(trace);
+	return ret;
+}
+
+static errcode_t replay_call(struct replay_ctxt *rp, struct replay_call *rc,
+			     char *buf, struct io_vec_unit *ivus,
+			     uint64_t *blocks)
+{
+	struct replay_unit *ru;
+	char *p = buf;
+	uint32_t i;
+
+	*blocks = 0;
+	switch (rc->rc_op) {
+	case CMFS_TRACE_READ:
+		*blocks = rc->rc_count;
+		if (rc->rc_flags & CMFS_TRACE_FL_NOCACHE)
+			return io_read_block_nocache(rp->rp_io, rc->rc_blkno,
+						     rc->rc_count, buf);
+		return io_read_block(rp->rp_io, rc->rc_blkno, rc->rc_count,
+				     buf);
+
+	case CMFS_TRACE_WRITE:
+		*blocks = rc->rc_count;
+		if (rc->rc_flags & CMFS_TRACE_FL_NOCACHE)
+			return io_write_block_nocache(rp->rp_io, rc->rc_blkno,
+						      rc->rc_count, buf);
+		return io_write_block(rp->rp_io, rc->rc_blkno, rc->rc_count,
+				      buf);
+
+	case CMFS_TRACE_VEC_READ:
+		for (i = 0; i < rc->rc_count; i++) {
+			ru = &rp->rp_units[rc->rc_first + i];
+			ivus[i].ivu_blkno = ru->ru_blkno;
+			ivus[i].ivu_buf = p;
+			ivus[i].ivu_buflen = ru->ru_count * rp->rp_blksize;
+			p += ivus[i].ivu_buflen;
+			*blocks += ru->ru_count;
+		}
+		return io_vec_read_blocks(rp->rp_io, ivus, rc->rc_count);
+	}
+
+	return CMFS_ET_INVALID_ARGUMENT;
+}
+
+static void *replay_thread(void *arg)
+{
+	struct replay_thread *rt = arg;
+	struct replay_ctxt *rp = rt->rt_ctxt;
+	struct replay_call *rc;
+	struct io_vec_unit *ivus = NULL;
+	struct timespec ts;
+	char *buf = NULL;
+	uint64_t i, start, blocks, ahead;
+	errcode_t ret;
+
+	ret = cmfs_malloc_blocks(rp->rp_io, rp->rp_max_blocks, &buf);
+	if (!ret)
+		ret = cmfs_malloc0(rp->rp_max_units *
+				   sizeof(struct io_vec_unit), &ivus);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < rp->rp_nr_calls; i++) {
+		rc = &rp->rp_calls[i];
+		if ((rc->rc_thread % rp->rp_threads) != rt->rt_index)
+			continue;
+		if ((rc->rc_op == CMFS_TRACE_WRITE) && !rp->rp_writes) {
+			rt->rt_skipped++;
+			continue;
+		}
+
+		if (rp->rp_pace) {
+			ahead = rp->rp_start + rc->rc_time;
+			start = now_ns();
+			if (ahead > start) {
+				ts.tv_sec = (ahead - start) / 1000000000ULL;
+				ts.tv_nsec = (ahead - start) % 1000000000ULL;
+				nanosleep(&ts, NULL);
+			}
+		}
+
+		start = now_ns();
+		ret = replay_call(rp, rc, buf, ivus, &blocks);
+		rp->rp_lat[i] = now_ns() - start;
+		if (ret)
+			rt->rt_errors++;
+		rt->rt_calls++;
+		rt->rt_blocks += blocks;
+	}
+	ret = 0;
+
+out:
+	if (ivus)
+		cmfs_free(&ivus);
+	if (buf)
+		cmfs_free(&buf);
+	rt->rt_ret = ret;
+	return NULL;
+}
+
+/* Sort lat and print p50 p90 p99 p99.9 and the max in us */
+static void print_percentiles(uint32_t *lat, uint64_t nr)
+{
+	if (!nr) {
+		fprintf(stdout, " %9s %9s %9s %9s %9s", "-", "-", "-", "-",
+			"-");
+		return;
+	}
+
+	qsort(lat, nr, sizeof(uint32_t), cmp_lat);
+	fprintf(stdout, " %9.1f %9.1f %9.1f %9.1f %9.1f",
+		lat[nr / 2] / 1000.0, lat[nr * 90 / 100] / 1000.0,
+		lat[nr * 99 / 100] / 1000.0, lat[nr * 999 / 1000] / 1000.0,
+		lat[nr - 1] / 1000.0);
+}
+
+static void print_hits(uint64_t hits, uint64_t lookups)
+{
+	if (lookups)
+		fprintf(stdout, " %6.1f%%\n", hits * 100.0 / lookups);
+	else
+		fprintf(stdout, " %7s\n", "-");
+}
+
+/* The figures the trace itself holds, of the calls we replay */
+static errcode_t print_recorded(struct replay_ctxt *rp)
+{
+	struct replay_call *rc;
+	uint32_t *lat = NULL;
+	uint64_t i, nr = 0, hits = 0, lookups = 0;
+	errcode_t ret;
+
+	ret = cmfs_malloc(rp->rp_nr_calls * sizeof(uint32_t) + 1, &lat);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < rp->rp_nr_calls; i++) {
+		rc = &rp->rp_calls[i];
+		if ((rc->rc_op == CMFS_TRACE_WRITE) && !rp->rp_writes)
+			continue;
+		lat[nr++] = rc->rc_latency;
+		hits += rc->rc_hits;
+		/* Only plain reads look blocks up in the io_cache */
+		if (rc->rc_op == CMFS_TRACE_READ)
+			lookups += rc->rc_count;
+	}
+
+	fprintf(stdout, "%-9s %10s %9s", "recorded", "-", "-");
+	print_percentiles(lat, nr);
+	print_hits(hits, lookups);
+	cmfs_free(&lat);
+	return 0;
+}
+
+static int run_pass(struct replay_ctxt *rp, int pass)
+{
+	struct replay_thread *rts = NULL;
+	struct cmfs_io_stats before, after;
+	uint64_t calls = 0, blocks = 0, errors = 0, skipped = 0, i, nr = 0;
+	uint32_t *lat = NULL;
+	double elapsed;
+	int t, started = 0, rc = 0;
+	errcode_t ret;
+
+	ret = cmfs_malloc0(rp->rp_threads * sizeof(struct replay_thread),
+			   &rts);
+	if (!ret)
+		ret = cmfs_malloc(rp->rp_nr_calls * sizeof(uint32_t) + 1, &lat);
+	if (ret) {
+		com_err(progname, ret, "while allocating pass %d", pass);
+		rc = -1;
+		goto out;
+	}
+
+	memset(rp->rp_lat, 0xff, rp->rp_nr_calls * sizeof(uint32_t));
+	io_get_stats(rp->rp_io, &before);
+	rp->rp_start = now_ns();
+	for (t = 0; t < rp->rp_threads; t++) {
+		rts[t].rt_ctxt = rp;
+		rts[t].rt_index = t;
+		if (pthread_create(&rts[t].rt_thread, NULL, replay_thread,
+				   &rts[t])) {
+			fprintf(stderr, "%s: can't start thread %d\n",
+				progname, t);
+			rc = -1;
+			break;
+		}
+		started++;
+	}
+	for (t = 0; t < started; t++) {
+		pthread_join(rts[t].rt_thread, NULL);
+		if (rts[t].rt_ret) {
+			com_err(progname, rts[t].rt_ret,
+				"while setting up thread %d", t);
+			rc = -1;
+		}
+		calls += rts[t].rt_calls;
+		blocks += rts[t].rt_blocks;
+		errors += rts[t].rt_errors;
+		skipped += rts[t].rt_skipped;
+	}
+	elapsed = (now_ns() - rp->rp_start) / 1000000000.0;
+	io_get_stats(rp->rp_io, &after);
+	if (rc)
+		goto out;
+
+	/* Calls not replayed were left at ~0 */
+	for (i = 0; i < rp->rp_nr_calls; i++)
+		if (rp->rp_lat[i] != UINT32_MAX)
+			lat[nr++] = rp->rp_lat[i];
+
+	fprintf(stdout, "pass %-4d %10.0f %9.1f", pass,
+		elapsed ? calls / elapsed : 0.0,
+		elapsed ? blocks * (double)rp->rp_blksize / elapsed /
+		(1024 * 1024) : 0.0);
+	print_percentiles(lat, nr);
+	print_hits(after.is_cache_hits - before.is_cache_hits,
+		   (uint64_t)(after.is_cache_hits - before.is_cache_hits) +
+		   (after.is_cache_misses - before.is_cache_misses));
+
+	if (errors)
+		fprintf(stdout, "          %"PRIu64" calls failed\n", errors);
+	if (skipped && (pass == 1))
+		fprintf(stdout, "          %"PRIu64" writes skipped, "
+			"see -w\n", skipped);
+
+out:
+	if (lat)
+		cmfs_free(&lat);
+	if (rts)
+		cmfs_free(&rts);
+	return rc;
+}
+
+int main(int argc, char **argv)
+{
+	struct replay_ctxt rp;
+	struct cmfs_trace_info info;
+	unsigned long cache_mb = 64, max_mb = 0;
+	int c, flags = CMFS_FLAG_RO, backing = 0, use_mmap = 0, loops = 2;
+	int pass, rc = 0;
+	char *trace;
+	errcode_t ret;
+
+	initialize_cmfs_error_table();
+
+	memset(&rp, 0, sizeof(rp));
+	rp.rp_threads = 1;
+
+	while ((c = getopt(argc, argv, "c:a:B:mt:l:pw")) != EOF) {
+		switch (c) {
+		case 'c':
+			cache_mb = strtoul(optarg, NULL, 0);
+			break;
+		case 'a':
+			max_mb = strtoul(optarg, NULL, 0);
+			break;
+		case 'B':
+			if (!strcmp(optarg, "thp"))
+				backing = CMFS_IO_CACHE_THP;
+			else if (!strcmp(optarg, "hugetlb"))
+				backing = CMFS_IO_CACHE_HUGETLB;
+			else
+				usage();
+			break;
+		case 'm':
+			use_mmap = 1;
+			break;
+		case 't':
+			rp.rp_threads = atoi(optarg);
+			break;
+		case 'l':
+			loops = atoi(optarg);
+			break;
+		case 'p':
+			rp.rp_pace = 1;
+			break;
+		case 'w':
+			rp.rp_writes = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if ((optind != argc - 2) || (rp.rp_threads <= 0) || (loops <= 0) ||
+	    (use_mmap && rp.rp_writes) || (max_mb && (max_mb < cache_mb)))
+		usage();
+	trace = argv[optind];
+	rp.rp_device = argv[optind + 1];
+
+	ret = load_trace(&rp, trace, &info);
+	if (ret) {
+		com_err(progname, ret, "while loading the trace \"%s\"",
+			trace);
+		return 1;
+	}
+	if (!rp.rp_nr_calls) {
+		fprintf(stderr, "%s: \"%s\" holds no calls\n", progname,
+			trace);
+		return 1;
+	}
+
+	if (rp.rp_writes)
+		flags = CMFS_FLAG_RW;
+	if (use_mmap)
+		flags |= CMFS_FLAG_MMAP;
+	if (rp.rp_threads > 1)
+		flags |= CMFS_FLAG_THREADED;
+	ret = io_open(rp.rp_device, flags, &rp.rp_io);
+	if (ret) {
+		com_err(progname, ret, "while opening \"%s\"", rp.rp_device);
+		return 1;
+	}
+	io_set_blksize(rp.rp_io, rp.rp_blksize);
+
+	if (!use_mmap && cache_mb) {
+		io_set_cache_backing(rp.rp_io, backing, -1);
+		ret = io_init_cache_size(rp.rp_io, cache_mb * 1024 * 1024);
+		if (!ret && max_mb)
+			ret = io_set_cache_autotune(rp.rp_io,
+						    max_mb * 1024 * 1024);
+		if (ret) {
+			com_err(progname, ret, "while creating the cache");
+			rc = 1;
+			goto out;
+		}
+	}
+
+	ret = cmfs_malloc(rp.rp_nr_calls * sizeof(uint32_t), &rp.rp_lat);
+	if (ret) {
+		com_err(progname, ret, "while allocating the latencies");
+		rc = 1;
+		goto out;
+	}
+
+	fprintf(stdout, "%s: %"PRIu64" calls, %"PRIu64" lost to the ring, "
+		"recorded with a %.1f MB cache\n", trace, rp.rp_nr_calls,
+		info.ti_lost, info.ti_cache_bytes / (1024.0 * 1024));
+	fprintf(stdout, "%s: %s, %lu MB cache, %d thread(s)%s\n",
+		rp.rp_device, use_mmap ? "mmap" : "pread", use_mmap ? 0 : cache_mb,
+		rp.rp_threads, rp.rp_pace ? ", paced" : "");
+	fprintf(stdout, "%-9s %10s %9s %9s %9s %9s %9s %9s %7s\n", "", "calls/s",
+		"MB/s", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us",
+		"hits");
+
+	ret = print_recorded(&rp);
+	if (ret) {
+		com_err(progname, ret, "while summing up the trace");
+		rc = 1;
+		goto out;
+	}
+	for (pass = 1; pass <= loops; pass++)
+		if (run_pass(&rp, pass))
+			rc = 1;
+
+out:
+	if (rp.rp_lat)
+		cmfs_free(&rp.rp_lat);
+	io_close(rp.rp_io);
+	cmfs_free(&rp.rp_units);
+	cmfs_free(&rp.rp_calls);
+	return rc;
+}
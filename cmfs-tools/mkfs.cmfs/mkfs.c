@@ -242,6 +242,7 @@ format_superblock(State *s, SystemFileDiskRecord *rec,
 	di->id2.i_super.s_minor_rev_level = CMFS_MINOR_REV_LEVEL;
 	di->id2.i_super.s_root_blkno = root_rec->fe_off >> s->blocksize_bits;
 	di->id2.i_super.s_system_dir_blkno = sys_rec->fe_off >> s->blocksize_bits;
+	di->id2.i_super.s_first_cluster_group = s->first_cluster_group_blkno;
 	di->id2.i_super.s_mnt_count = 0;
 	di->id2.i_super.s_max_mnt_count = CMFS_DFL_MAX_MNT_COUNT;
 	di->id2.i_super.s_state = 0;
@@ -1078,11 +1079,11 @@ static AllocBitmap *initialize_bitmap(State *s,
 
 		bitmap->groups[chain]->chain_total +=
 			bitmap->groups[i]->gd->bg_bits;
-		bitmap->groups[chain]->chain_free =
+		bitmap->groups[chain]->chain_free +=
 			bitmap->groups[i]->gd->bg_free_bits_count;
 
-		blkno = (uint64_t)(s->global_cpg <<
-				(s->cluster_size_bits - s->blocksize_bits));
+		blkno += (uint64_t)s->global_cpg <<
+				(s->cluster_size_bits - s->blocksize_bits);
 		chain ++;
 		/* XXX: need to understand how chain records work */
 		if (chain >= recs_per_inode) {
@@ -1496,7 +1497,7 @@ static void format_file(State *s, SystemFileDiskRecord *rec)
 
 	clusters = (rec->extent_len + s->cluster_size - 1) >>
 		   s->cluster_size_bits;
-	blocks = (rec->extent_len + s->cluster_size - 1) >>
+	blocks = (rec->extent_len + s->blocksize - 1) >>
 		   s->blocksize_bits;
 
 	di = do_malloc(s, s->blocksize);
@@ -0,0 +1,595 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * scrub.c
+ *
+ * Read every allocated extent of a CMFS volume to find latent sector
+ * errors.
+ *
+ * Copyright (C) 2012, Coly Li <i@coly.li>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * The scrub first walks every inode (cmfs_open_inode_scan()) and
+ * collects the physical runs of its data extents and extent blocks,
+ * reading the leaves along their chain (cmfs_extent_iterate_leaves()).
+ * The runs are sorted by block number and read front to back with
+ * large O_DIRECT reads on a descriptor of its own, -q of them in
+ * flight through libaio, so neither the page cache nor the libcmfs
+ * block cache gets involved.  Adjacent runs share reads.  -r caps the
+ * bandwidth so a scrub can run beside production load.
+ *
+ * A read that fails is retried one block at a time, and every bad
+ * block is reported with the inode and file offset it belongs to.
+ */
+
+#define _XOPEN_SOURCE 600
+#define _LARGEFILE64_SOURCE
+#define _GNU_SOURCE /* O_DIRECT */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <libaio.h>
+#include <sys/time.h>
+
+#include <cmfs/cmfs.h>
+#include "../libcmfs/cmfs_err.h"
+
+/* Exit codes, as fsck.cmfs */
+#define SCRUB_OK		0
+#define SCRUB_BAD_BLOCKS	4
+#define SCRUB_ERROR		8
+#define SCRUB_USAGE		16
+
+#define SCRUB_IO_KB		1024
+#define SCRUB_DEPTH		16
+
+/* sr_lblk of a run which is an extent block rather than file data */
+#define SCRUB_EXTENT_BLOCK	UINT64_MAX
+
+struct scrub_run {
+	uint64_t sr_blkno;	/* first physical block */
+	uint64_t sr_lblk;	/* first logical block in the inode */
+	uint64_t sr_ino;
+	uint32_t sr_count;
+};
+
+struct scrub_io {
+	struct iocb si_iocb;
+	char *si_buf;
+	uint64_t si_blkno;
+	uint32_t si_count;
+	size_t si_run;		/* first run the read touches */
+};
+
+struct scrub_ctxt {
+	cmfs_filesys *sc_fs;
+	const char *sc_devname;
+	int sc_fd;
+	int sc_verbose;
+
+	struct scrub_run *sc_runs;
+	size_t sc_nr_runs;
+	size_t sc_alloc_runs;
+	uint64_t sc_cur_ino;	/* while collecting */
+	errcode_t sc_err;
+
+	uint32_t sc_io_blocks;
+	int sc_depth;
+	uint64_t sc_rate;	/* bytes per second, 0 for no limit */
+
+	/* read cursor over sc_runs */
+	size_t sc_next_run;
+	uint64_t sc_next_blkno;
+
+	struct timeval sc_start;
+	uint64_t sc_bytes_total;
+	uint64_t sc_bytes_submitted;
+	uint64_t sc_bytes_read;
+	uint64_t sc_bad_blocks;
+	unsigned long sc_bad_ranges;
+};
+
+static char *progname = "scrub.cmfs";
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-v] [-b io_kb] [-q depth] [-r MB/s] device\n"
+		"  -b  size of one read in KB (default %d)\n"
+		"  -q  reads in flight (default %d)\n"
+		"  -r  bandwidth limit in MB/s (default: none)\n"
+		"  -v  verbose\n",
+		progname, SCRUB_IO_KB, SCRUB_DEPTH);
+	exit(SCRUB_USAGE);
+}
+
+static double elapsed(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) +
+	       (now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+static errcode_t add_run(struct scrub_ctxt *sc, uint64_t blkno,
+			 uint32_t count, uint64_t lblk)
+{
+	struct scrub_run *sr;
+	size_t alloc;
+
+	if (sc->sc_nr_runs == sc->sc_alloc_runs) {
+		alloc = sc->sc_alloc_runs ? sc->sc_alloc_runs * 2 : 1024;
+		sr = realloc(sc->sc_runs, alloc * sizeof(struct scrub_run));
+		if (!sr)
+			return CMFS_ET_NO_MEMORY;
+		sc->sc_runs = sr;
+		sc->sc_alloc_runs = alloc;
+	}
+
+	sr = &sc->sc_runs[sc->sc_nr_runs++];
+	sr->sr_blkno = blkno;
+	sr->sr_count = count;
+	sr->sr_ino = sc->sc_cur_ino;
+	sr->sr_lblk = lblk;
+	sc->sc_bytes_total += (uint64_t)count * sc->sc_fs->fs_blocksize;
+
+	return 0;
+}
+
+static int collect_extent(cmfs_filesys *fs,
+			  struct cmfs_extent_rec *rec,
+			  int tree_depth,
+			  uint32_t ccount,
+			  uint64_t ref_blkno,
+			  int ref_recno,
+			  void *priv_data)
+{
+	struct scrub_ctxt *sc = priv_data;
+	errcode_t ret;
+
+	if (tree_depth)
+		ret = add_run(sc, rec->e_blkno, 1, SCRUB_EXTENT_BLOCK);
+	else if (rec->e_leaf_blocks)
+		ret = add_run(sc, rec->e_blkno, rec->e_leaf_blocks,
+			      cmfs_clusters_to_blocks(fs, rec->e_cpos));
+	else
+		ret = 0;
+
+	if (ret) {
+		sc->sc_err = ret;
+		return CMFS_EXTENT_ABORT | CMFS_EXTENT_ERROR;
+	}
+
+	return 0;
+}
+
+static int run_cmp(const void *a, const void *b)
+{
+	const struct scrub_run *ra = a, *rb = b;
+
+	if (ra->sr_blkno < rb->sr_blkno)
+		return -1;
+	if (ra->sr_blkno > rb->sr_blkno)
+		return 1;
+	return 0;
+}
+
+static errcode_t collect_runs(struct scrub_ctxt *sc)
+{
+	cmfs_filesys *fs = sc->sc_fs;
+	cmfs_inode_scan *scan = NULL;
+	struct cmfs_dinode *di;
+	char *buf = NULL;
+	uint64_t blkno;
+	errcode_t ret;
+
+	ret = cmfs_malloc_block(fs->fs_io, &buf);
+	if (ret)
+		goto out;
+
+	ret = cmfs_open_inode_scan(fs, &scan);
+	if (ret)
+		goto out;
+
+	di = (struct cmfs_dinode *)buf;
+	for (;;) {
+		ret = cmfs_get_next_inode(scan, &blkno, buf);
+		if (ret || !blkno)
+			break;
+
+		if (di->i_flags & (CMFS_SUPER_BLOCK_FL | CMFS_LOCAL_ALLOC_FL |
+				   CMFS_CHAIN_FL | CMFS_DEALLOC_FL))
+			continue;
+		if (di->i_dyn_features & CMFS_INLINE_DATA_FL)
+			continue;
+
+		sc->sc_cur_ino = blkno;
+		ret = cmfs_extent_iterate_leaves(fs, di, 0, 0,
+						 collect_extent, sc);
+		if (sc->sc_err) {
+			ret = sc->sc_err;
+			break;
+		}
+		if (ret) {
+			/* Keep going, a damaged tree is fsck's business */
+			fprintf(stderr, "%s: %s while walking the extents of "
+				"inode %"PRIu64"\n", progname,
+				error_message(ret), blkno);
+			ret = 0;
+		}
+	}
+
+	if (!ret)
+		qsort(sc->sc_runs, sc->sc_nr_runs, sizeof(struct scrub_run),
+		      run_cmp);
+
+out:
+	if (scan)
+		cmfs_close_inode_scan(scan);
+	if (buf)
+		cmfs_free(&buf);
+	return ret;
+}
+
+/*
+ * Fill si with the next read: up to sc_io_blocks blocks, stopping at
+ * the first gap between runs.  Blocks claimed by more than one run are
+ * read once.  Returns 0 when every run has been read.
+ */
+static int next_io(struct scrub_ctxt *sc, struct scrub_io *si)
+{
+	struct scrub_run *sr;
+	uint64_t end, take;
+
+	si->si_count = 0;
+	while (sc->sc_next_run < sc->sc_nr_runs) {
+		sr = &sc->sc_runs[sc->sc_next_run];
+		end = sr->sr_blkno + sr->sr_count;
+
+		if (sc->sc_next_blkno < sr->sr_blkno)
+			sc->sc_next_blkno = sr->sr_blkno;
+		if (sc->sc_next_blkno >= end) {
+			sc->sc_next_run++;
+			continue;
+		}
+
+		if (!si->si_count) {
+			si->si_blkno = sc->sc_next_blkno;
+			si->si_run = sc->sc_next_run;
+		} else if (sc->sc_next_blkno != si->si_blkno + si->si_count)
+			break;
+
+		take = end - sc->sc_next_blkno;
+		if (take > sc->sc_io_blocks - si->si_count)
+			take = sc->sc_io_blocks - si->si_count;
+		si->si_count += take;
+		sc->sc_next_blkno += take;
+		if (sc->sc_next_blkno >= end)
+			sc->sc_next_run++;
+		if (si->si_count == sc->sc_io_blocks)
+			break;
+	}
+
+	return si->si_count != 0;
+}
+
+/* Report bad blocks [first, last] against every run they fall in */
+static void report_bad(struct scrub_ctxt *sc, size_t run, uint64_t first,
+		       uint64_t last)
+{
+	cmfs_filesys *fs = sc->sc_fs;
+	struct scrub_run *sr;
+	uint64_t s, e;
+
+	sc->sc_bad_ranges++;
+	sc->sc_bad_blocks += last - first + 1;
+
+	fprintf(stdout, "Blocks %"PRIu64"-%"PRIu64" are unreadable\n",
+		first, last);
+
+	/* Runs are sorted by start, a long earlier run may still cover */
+	for (; run > 0; run--)
+		if (sc->sc_runs[run - 1].sr_blkno +
+		    sc->sc_runs[run - 1].sr_count <= first)
+			break;
+
+	for (; run < sc->sc_nr_runs; run++) {
+		sr = &sc->sc_runs[run];
+		if (sr->sr_blkno > last)
+			break;
+		if (sr->sr_blkno + sr->sr_count <= first)
+			continue;
+
+		s = first > sr->sr_blkno ? first : sr->sr_blkno;
+		e = last < sr->sr_blkno + sr->sr_count - 1 ?
+			last : sr->sr_blkno + sr->sr_count - 1;
+
+		if (sr->sr_lblk == SCRUB_EXTENT_BLOCK)
+			fprintf(stdout, "\textent block of inode %"PRIu64"\n",
+				sr->sr_ino);
+		else
+			fprintf(stdout, "\tinode %"PRIu64" bytes %"PRIu64
+				"-%"PRIu64"\n", sr->sr_ino,
+				(sr->sr_lblk + s - sr->sr_blkno) *
+				fs->fs_blocksize,
+				(sr->sr_lblk + e - sr->sr_blkno + 1) *
+				fs->fs_blocksize - 1);
+	}
+}
+
+/* A large read failed, find out which of its blocks are bad */
+static void retry_blocks(struct scrub_ctxt *sc, struct scrub_io *si)
+{
+	unsigned int bs = sc->sc_fs->fs_blocksize;
+	uint64_t blkno, bad_start = 0;
+	int in_bad = 0;
+	ssize_t got;
+	uint32_t i;
+
+	for (i = 0; i < si->si_count; i++) {
+		blkno = si->si_blkno + i;
+		got = pread64(sc->sc_fd, si->si_buf, bs, blkno * bs);
+		if (got == bs) {
+			sc->sc_bytes_read += bs;
+			if (in_bad)
+				report_bad(sc, si->si_run, bad_start,
+					   blkno - 1);
+			in_bad = 0;
+			continue;
+		}
+		if (!in_bad)
+			bad_start = blkno;
+		in_bad = 1;
+	}
+	if (in_bad)
+		report_bad(sc, si->si_run, bad_start,
+			   si->si_blkno + si->si_count - 1);
+}
+
+static void throttle(struct scrub_ctxt *sc)
+{
+	double ahead;
+
+	if (!sc->sc_rate)
+		return;
+
+	ahead = (double)sc->sc_bytes_submitted / sc->sc_rate -
+		elapsed(&sc->sc_start);
+	if (ahead > 0)
+		usleep(ahead * 1000000);
+}
+
+static errcode_t scrub_runs(struct scrub_ctxt *sc)
+{
+	cmfs_filesys *fs = sc->sc_fs;
+	io_context_t ctx = NULL;
+	struct scrub_io *ios = NULL, **idle = NULL, *si;
+	struct iocb *iocb;
+	struct io_event *events = NULL;
+	int i, nr_idle = 0, inflight = 0, more = 1, n;
+	long res;
+	errcode_t ret;
+
+	ret = cmfs_malloc0(sc->sc_depth * sizeof(struct scrub_io), &ios);
+	if (ret)
+		goto out;
+	ret = cmfs_malloc0(sc->sc_depth * sizeof(struct scrub_io *), &idle);
+	if (ret)
+		goto out;
+	ret = cmfs_malloc0(sc->sc_depth * sizeof(struct io_event), &events);
+	if (ret)
+		goto out;
+	for (i = 0; i < sc->sc_depth; i++) {
+		ret = cmfs_malloc_blocks(fs->fs_io, sc->sc_io_blocks,
+					 &ios[i].si_buf);
+		if (ret)
+			goto out;
+		idle[nr_idle++] = &ios[i];
+	}
+
+	ret = CMFS_ET_IO;
+	if (io_queue_init(sc->sc_depth, &ctx))
+		goto out;
+	ret = 0;
+
+	while (more || inflight) {
+		while (more && nr_idle) {
+			si = idle[nr_idle - 1];
+			more = next_io(sc, si);
+			if (!more)
+				break;
+			nr_idle--;
+
+			throttle(sc);
+			io_prep_pread(&si->si_iocb, sc->sc_fd, si->si_buf,
+				      (size_t)si->si_count * fs->fs_blocksize,
+				      si->si_blkno * fs->fs_blocksize);
+			si->si_iocb.data = si;
+			iocb = &si->si_iocb;
+			if (io_submit(ctx, 1, &iocb) != 1) {
+				ret = CMFS_ET_IO;
+				goto out;
+			}
+			sc->sc_bytes_submitted +=
+				(uint64_t)si->si_count * fs->fs_blocksize;
+			inflight++;
+		}
+
+		if (!inflight)
+			break;
+
+		n = io_getevents(ctx, 1, inflight, events, NULL);
+		if (n < 0) {
+			if (n == -EINTR)
+				continue;
+			ret = CMFS_ET_IO;
+			goto out;
+		}
+
+		for (i = 0; i < n; i++) {
+			si = events[i].data;
+			res = (long)events[i].res;
+			if (res == (long)si->si_count * fs->fs_blocksize)
+				sc->sc_bytes_read += res;
+			else
+				retry_blocks(sc, si);
+			idle[nr_idle++] = si;
+			inflight--;
+		}
+	}
+
+out:
+	/* Reap what is still in flight before the buffers go away */
+	while (ctx && inflight > 0) {
+		n = io_getevents(ctx, 1, inflight, events, NULL);
+		if (n <= 0)
+			break;
+		inflight -= n;
+	}
+	if (ctx)
+		io_queue_release(ctx);
+	if (ios) {
+		for (i = 0; i < sc->sc_depth; i++)
+			if (ios[i].si_buf)
+				cmfs_free(&ios[i].si_buf);
+		cmfs_free(&ios);
+	}
+	if (idle)
+		cmfs_free(&idle);
+	if (events)
+		cmfs_free(&events);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct scrub_ctxt *sc;
+	int c, io_kb = SCRUB_IO_KB, rc = SCRUB_OK;
+	unsigned long rate_mb = 0;
+	double secs;
+	errcode_t ret;
+
+	initialize_cmfs_error_table();
+
+	if (argc && *argv)
+		progname = basename(argv[0]);
+
+	sc = calloc(1, sizeof(struct scrub_ctxt));
+	if (!sc) {
+		com_err(progname, CMFS_ET_NO_MEMORY,
+			"while allocating scrub state");
+		return SCRUB_ERROR;
+	}
+	sc->sc_depth = SCRUB_DEPTH;
+	sc->sc_fd = -1;
+
+	while ((c = getopt(argc, argv, "vb:q:r:")) != EOF) {
+		switch (c) {
+		case 'v':
+			sc->sc_verbose = 1;
+			break;
+		case 'b':
+			io_kb = atoi(optarg);
+			break;
+		case 'q':
+			sc->sc_depth = atoi(optarg);
+			break;
+		case 'r':
+			rate_mb = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if ((optind != argc - 1) || (io_kb <= 0) || (sc->sc_depth <= 0))
+		usage();
+	sc->sc_devname = argv[optind];
+	sc->sc_rate = (uint64_t)rate_mb * 1024 * 1024;
+
+	ret = cmfs_open(sc->sc_devname, CMFS_FLAG_RO, 0, CMFS_MAX_BLOCKSIZE,
+			&sc->sc_fs);
+	if (ret) {
+		com_err(progname, ret, "while opening \"%s\"", sc->sc_devname);
+		free(sc);
+		return SCRUB_ERROR;
+	}
+
+	sc->sc_io_blocks = (io_kb * 1024) / sc->sc_fs->fs_blocksize;
+	if (!sc->sc_io_blocks)
+		sc->sc_io_blocks = 1;
+
+	sc->sc_fd = open64(sc->sc_devname, O_RDONLY | O_DIRECT);
+	if ((sc->sc_fd < 0) && (errno == EINVAL)) {
+		/* Some image files can't do O_DIRECT, read them buffered */
+		fprintf(stderr, "%s: O_DIRECT not supported on %s, reading "
+			"through the page cache\n", progname, sc->sc_devname);
+		sc->sc_fd = open64(sc->sc_devname, O_RDONLY);
+	}
+	if (sc->sc_fd < 0) {
+		com_err(progname, errno, "while opening \"%s\"",
+			sc->sc_devname);
+		rc = SCRUB_ERROR;
+		goto out;
+	}
+
+	gettimeofday(&sc->sc_start, NULL);
+	ret = collect_runs(sc);
+	if (ret) {
+		com_err(progname, ret, "while collecting extents");
+		rc = SCRUB_ERROR;
+		goto out;
+	}
+	if (sc->sc_verbose)
+		fprintf(stdout, "%zu runs, %"PRIu64" MB allocated, collected "
+			"in %.2fs\n", sc->sc_nr_runs,
+			sc->sc_bytes_total >> 20, elapsed(&sc->sc_start));
+
+	gettimeofday(&sc->sc_start, NULL);
+	ret = scrub_runs(sc);
+	if (ret) {
+		com_err(progname, ret, "while reading \"%s\"", sc->sc_devname);
+		rc = SCRUB_ERROR;
+		goto out;
+	}
+	secs = elapsed(&sc->sc_start);
+
+	fprintf(stdout, "%s: read %"PRIu64" MB in %.2fs (%.1f MB/s), "
+		"%"PRIu64" bad blocks in %lu ranges\n", sc->sc_devname,
+		sc->sc_bytes_read >> 20, secs,
+		secs > 0 ? (sc->sc_bytes_read / 1048576.0) / secs : 0,
+		sc->sc_bad_blocks, sc->sc_bad_ranges);
+	if (sc->sc_bad_ranges)
+		rc = SCRUB_BAD_BLOCKS;
+
+out:
+	if (sc->sc_fd >= 0)
+		close(sc->sc_fd);
+	free(sc->sc_runs);
+	cmfs_close(sc->sc_fs);
+	free(sc);
+	return rc;
+}